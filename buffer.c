@@ -2,11 +2,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include "buffer.h"
+#include "slab.h"
 
 static size_t next_power_of_2(size_t number)
 {
 	size_t power_of_2 = 128;
-	while (number < power_of_2)
+	while (power_of_2 < number)
 		power_of_2 *= 2;
 	return power_of_2;
 }
@@ -18,11 +19,23 @@ void buffer_init(struct buffer *buf, size_t capacity)
 	assert(buf->data);
 	buf->capacity = capacity;
 	buf->space = buf->data;
+	buf->slab = false;
+}
+
+void buffer_init_slab(struct buffer *buf, size_t capacity)
+{
+	buf->data = slab_alloc(capacity);
+	buf->capacity = slab_capacity(buf->data);
+	buf->space = buf->data;
+	buf->slab = true;
 }
 
 void buffer_term(struct buffer *buf)
 {
-	free(buf->data);
+	if (buf->slab)
+		slab_free(buf->data);
+	else
+		free(buf->data);
 	memset(buf, 0, sizeof(*buf));
 }
 
@@ -32,8 +45,16 @@ void buffer_grow(struct buffer *buf, size_t min_grow_size)
 	size_t old_capacity = buf->capacity;
 	size_t new_capacity = next_power_of_2(old_capacity + min_grow_size);
 	size_t data_len = buffer_data_len(buf);
-	buf->data = realloc(buf->data, new_capacity);
-	assert(buf->data);
+	if (buf->slab) {
+		char *data = slab_alloc(new_capacity);
+		memcpy(data, buf->data, data_len);
+		slab_free(buf->data);
+		buf->data = data;
+		new_capacity = slab_capacity(data);
+	} else {
+		buf->data = realloc(buf->data, new_capacity);
+		assert(buf->data);
+	}
 	buf->capacity = new_capacity;
 	buf->space = buf->data + data_len;
 }
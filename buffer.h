@@ -1,13 +1,18 @@
 #pragma once
+#include <stdbool.h>
 #include <stddef.h>
+#include <string.h>
 
 struct buffer {
 	size_t	capacity;
 	char	*data;
 	char	*space;
+	bool	slab;	/* data is from the pool of slab.h */
 };
 
 void buffer_init(struct buffer *buf, size_t capacity);
+/* The data comes from the pool and goes back to it, see slab.h */
+void buffer_init_slab(struct buffer *buf, size_t capacity);
 void buffer_term(struct buffer *buf);
 
 static inline void *buffer_data(struct buffer *buf)
@@ -32,3 +37,11 @@ static inline void buffer_reserve(struct buffer *buf, size_t size)
 	if (buf->space + size > buf->data + buf->capacity)
 		buffer_grow(buf, (buf->space + size) - (buf->data + buf->capacity));
 }
+
+/* The caller reserves the space in advance to append many pieces without checks */
+static inline void buffer_append(struct buffer *buf, const void *data, size_t size)
+{
+	buffer_reserve(buf, size);
+	memcpy(buf->space, data, size);
+	buf->space += size;
+}
@@ -0,0 +1,244 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "connect.h"
+#include "http.h"
+#include "log.h"
+
+static unsigned int attempt_delay_ms = CONNECT_DEFAULT_ATTEMPT_DELAY_MS;
+static unsigned int timeout_ms = CONNECT_DEFAULT_TIMEOUT_MS;
+
+void connect_set_timeouts(unsigned int delay_ms, unsigned int limit_ms)
+{
+	attempt_delay_ms = delay_ms;
+	timeout_ms = limit_ms;
+}
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Orders the addresses so that families alternate starting from the first one
+   getaddrinfo() prefers, see https://tools.ietf.org/html/rfc8305#section-4 */
+static size_t interleave(const struct addrinfo *addrinfo, const struct addrinfo ***result)
+{
+	size_t nr = 0, nr_first = 0;
+	for (const struct addrinfo *cur = addrinfo; cur; cur = cur->ai_next) {
+		nr++;
+		if (cur->ai_family == addrinfo->ai_family)
+			nr_first++;
+	}
+	size_t nr_other = nr - nr_first;
+	const struct addrinfo **order = calloc(nr ? nr : 1, sizeof(*order));
+	assert(order);
+
+	/* The first family takes even positions while the other family has addresses left */
+	size_t first = 0, other = 0;
+	for (const struct addrinfo *cur = addrinfo; cur; cur = cur->ai_next) {
+		if (cur->ai_family == addrinfo->ai_family) {
+			order[first < nr_other ? 2 * first : nr_other + first] = cur;
+			first++;
+		} else {
+			order[other < nr_first ? 2 * other + 1 : nr_first + other] = cur;
+			other++;
+		}
+	}
+	*result = order;
+	return nr;
+}
+
+static int set_blocking(int socket, int blocking)
+{
+	int flags = fcntl(socket, F_GETFL);
+	if (flags == -1)
+		return -1;
+	return fcntl(socket, F_SETFL, blocking ? flags & ~O_NONBLOCK : flags | O_NONBLOCK);
+}
+
+/* Returns -1 if the attempt has failed immediately, 1 if it is in progress, 0 if connected */
+static int attempt_start(const struct addrinfo *addr, int *socket_fd)
+{
+	int s = socket(addr->ai_family, addr->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, addr->ai_protocol);
+	if (s == -1) {
+		error("socket() failed: %s, err=%d", strerror(errno), errno);
+		return -1;
+	}
+	if (connect(s, addr->ai_addr, addr->ai_addrlen)) {
+		if (errno != EINPROGRESS) {
+			error("connect() failed: %s, err=%d", strerror(errno), errno);
+			close(s);
+			return -1;
+		}
+		*socket_fd = s;
+		return 1;
+	}
+	*socket_fd = s;
+	return 0;
+}
+
+int connect_race(const struct addrinfo *addrinfo, int *result)
+{
+	const struct addrinfo **order = NULL;
+	size_t nr = interleave(addrinfo, &order);
+	struct pollfd *fds = calloc(nr ? nr : 1, sizeof(*fds));
+	uint64_t *deadlines = calloc(nr ? nr : 1, sizeof(*deadlines));
+	assert(fds && deadlines);
+
+	int s = -1;
+	size_t next = 0, nr_pending = 0;
+	uint64_t next_start = 0;
+	while (s == -1) {
+		uint64_t now = now_ms();
+		if (next < nr && (nr_pending == 0 || now >= next_start)) {
+			int fd = -1;
+			int started = attempt_start(order[next++], &fd);
+			if (started == 0) {
+				s = fd;
+			} else if (started == 1) {
+				fds[nr_pending].fd = fd;
+				fds[nr_pending].events = POLLOUT;
+				deadlines[nr_pending] = now + timeout_ms;
+				nr_pending++;
+				next_start = now + attempt_delay_ms;
+			}
+			continue;
+		}
+		if (nr_pending == 0)
+			break;
+
+		uint64_t wake = next < nr ? next_start : UINT64_MAX;
+		for (size_t i = 0; i < nr_pending; i++)
+			wake = deadlines[i] < wake ? deadlines[i] : wake;
+		int ready = poll(fds, nr_pending, wake > now ? (int)(wake - now) : 0);
+		if (ready < 0 && errno != EINTR) {
+			error("poll() failed: %s errno=%d", strerror(errno), errno);
+			break;
+		}
+
+		now = now_ms();
+		for (size_t i = nr_pending; i-- > 0; ) {
+			int so_error = ETIMEDOUT;
+			if (ready > 0 && fds[i].revents) {
+				socklen_t len = sizeof(so_error);
+				if (getsockopt(fds[i].fd, SOL_SOCKET, SO_ERROR, &so_error, &len))
+					so_error = errno;
+				if (so_error == 0)
+					s = fds[i].fd;
+			} else if (now < deadlines[i]) {
+				continue;
+			}
+			if (s != fds[i].fd) {
+				error("connect() failed: %s, err=%d", strerror(so_error), so_error);
+				close(fds[i].fd);
+				/* Do not wait for the delay if the previous attempt has failed */
+				next_start = now;
+			}
+			fds[i] = fds[--nr_pending];
+			deadlines[i] = deadlines[nr_pending];
+			if (s != -1)
+				break;
+		}
+	}
+
+	/* Losers */
+	for (size_t i = 0; i < nr_pending; i++)
+		close(fds[i].fd);
+	free(deadlines);
+	free(fds);
+	free(order);
+
+	if (s == -1)
+		return ERR_HTTP_CONNECT_FAILED;
+	if (set_blocking(s, 1)) {
+		error("fcntl() failed: %s errno=%d", strerror(errno), errno);
+		close(s);
+		return ERR_HTTP_CONNECT_FAILED;
+	}
+	info("connect successfull");
+	*result = s;
+	return 0;
+}
+
+#ifdef UNIT_TEST
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+static void test_interleave(void)
+{
+	struct addrinfo a[5];
+	memset(a, 0, sizeof(a));
+	int families[] = { AF_INET6, AF_INET6, AF_INET6, AF_INET, AF_INET };
+	for (int i = 0; i < 5; i++) {
+		a[i].ai_family = families[i];
+		a[i].ai_next = i < 4 ? &a[i + 1] : NULL;
+	}
+	const struct addrinfo **order = NULL;
+	assert(interleave(a, &order) == 5);
+	assert(order[0] == &a[0]);
+	assert(order[1] == &a[3]);
+	assert(order[2] == &a[1]);
+	assert(order[3] == &a[4]);
+	assert(order[4] == &a[2]);
+	free(order);
+}
+
+static int test_listen(struct sockaddr_in *addr)
+{
+	int s = socket(AF_INET, SOCK_STREAM, 0);
+	assert(s != -1);
+	addr->sin_family = AF_INET;
+	addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr->sin_port = 0;
+	socklen_t len = sizeof(*addr);
+	assert(!bind(s, (struct sockaddr*)addr, len));
+	assert(!listen(s, 1));
+	assert(!getsockname(s, (struct sockaddr*)addr, &len));
+	return s;
+}
+
+static void test_race(void)
+{
+	struct sockaddr_in listening, refused;
+	int server = test_listen(&listening);
+	/* Nobody accepts on a port which is closed right after it was bound */
+	close(test_listen(&refused));
+
+	struct addrinfo a[2];
+	memset(a, 0, sizeof(a));
+	for (int i = 0; i < 2; i++) {
+		a[i].ai_family = AF_INET;
+		a[i].ai_socktype = SOCK_STREAM;
+		a[i].ai_addrlen = sizeof(struct sockaddr_in);
+	}
+	a[0].ai_addr = (struct sockaddr*)&refused;
+	a[0].ai_next = &a[1];
+	a[1].ai_addr = (struct sockaddr*)&listening;
+
+	int s = -1;
+	assert(!connect_race(a, &s));
+	assert(s != -1);
+	assert(!(fcntl(s, F_GETFL) & O_NONBLOCK));
+	close(s);
+
+	a[0].ai_next = NULL;
+	assert(connect_race(a, &s) == ERR_HTTP_CONNECT_FAILED);
+	close(server);
+}
+
+void test_connect(void)
+{
+	test_interleave();
+	test_race();
+}
+#endif
@@ -0,0 +1,20 @@
+#pragma once
+#include <netdb.h>
+
+/* Happy Eyeballs, see https://tools.ietf.org/html/rfc8305
+   Connection attempts to the addresses of a host alternate between address
+   families and start one after another with a short delay without waiting
+   for the previous ones to fail. The first established connection wins. */
+
+#define CONNECT_DEFAULT_ATTEMPT_DELAY_MS	250
+#define CONNECT_DEFAULT_TIMEOUT_MS			10000
+
+/* Returns ERR_HTTP_CONNECT_FAILED if no address could be connected */
+int connect_race(const struct addrinfo *addrinfo, int *socket);
+
+/* attempt_delay_ms: delay before the next attempt, timeout_ms: limit for every attempt */
+void connect_set_timeouts(unsigned int attempt_delay_ms, unsigned int timeout_ms);
+
+#ifdef UNIT_TEST
+void test_connect(void);
+#endif
@@ -0,0 +1,297 @@
+#include <assert.h>
+#include <ctype.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include "dns.h"
+#include "log.h"
+#include "punycode.h"
+
+#define DNS_NR_BUCKETS	256
+#define DNS_MAX_ENTRIES	4096
+
+static struct {
+	/* Lookups take the lock for reading, only misses take it for writing */
+	pthread_rwlock_t	lock;
+	struct dns_entry	*buckets[DNS_NR_BUCKETS];
+	size_t				nr_entries;
+	unsigned int		ttl_ms;
+	unsigned int		negative_ttl_ms;
+	struct dns_stats	stats;
+} dns = {
+	.lock = PTHREAD_RWLOCK_INITIALIZER,
+	.ttl_ms = DNS_DEFAULT_TTL_MS,
+	.negative_ttl_ms = DNS_DEFAULT_NEGATIVE_TTL_MS,
+};
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void counter_add(uint64_t *counter, uint64_t value)
+{
+	__atomic_add_fetch(counter, value, __ATOMIC_RELAXED);
+}
+
+/* FNV-1a */
+static size_t dns_hash(const char *key)
+{
+	uint32_t hash = 2166136261u;
+	for (; *key; key++)
+		hash = (hash ^ (unsigned char)*key) * 16777619u;
+	return hash % DNS_NR_BUCKETS;
+}
+
+static struct dns_entry *dns_get(struct dns_entry *entry)
+{
+	__atomic_add_fetch(&entry->refcount, 1, __ATOMIC_RELAXED);
+	return entry;
+}
+
+void dns_release(struct dns_entry *entry)
+{
+	if (__atomic_sub_fetch(&entry->refcount, 1, __ATOMIC_ACQ_REL))
+		return;
+	if (entry->addrinfo)
+		freeaddrinfo(entry->addrinfo);
+	free(entry->key);
+	free(entry);
+}
+
+/* Called under the read lock */
+static struct dns_entry *dns_lookup(const char *key, uint64_t now)
+{
+	for (struct dns_entry *entry = dns.buckets[dns_hash(key)]; entry; entry = entry->next) {
+		if (!strcmp(entry->key, key))
+			return now < entry->expires ? dns_get(entry) : NULL;
+	}
+	return NULL;
+}
+
+/* Called under the write lock */
+static void dns_remove(struct dns_entry **link)
+{
+	struct dns_entry *entry = *link;
+	*link = entry->next;
+	dns.nr_entries--;
+	dns_release(entry);
+}
+
+/* Makes room for a new entry, called under the write lock */
+static void dns_evict(uint64_t now)
+{
+	for (size_t i = 0; i < DNS_NR_BUCKETS; i++) {
+		struct dns_entry **link = &dns.buckets[i];
+		while (*link) {
+			if ((*link)->expires <= now)
+				dns_remove(link);
+			else
+				link = &(*link)->next;
+		}
+	}
+	/* Still full of live entries: drop whole buckets starting from a pseudo-random one */
+	for (size_t i = now % DNS_NR_BUCKETS; dns.nr_entries >= DNS_MAX_ENTRIES; i = (i + 1) % DNS_NR_BUCKETS) {
+		while (dns.buckets[i])
+			dns_remove(&dns.buckets[i]);
+	}
+}
+
+/* Replaces the expired entry if any. Called under the write lock. */
+static void dns_insert(struct dns_entry *entry, uint64_t now)
+{
+	struct dns_entry **link = &dns.buckets[dns_hash(entry->key)];
+	for (struct dns_entry **cur = link; *cur; cur = &(*cur)->next) {
+		if (!strcmp((*cur)->key, entry->key)) {
+			dns_remove(cur);
+			break;
+		}
+	}
+	if (dns.nr_entries >= DNS_MAX_ENTRIES)
+		dns_evict(now);
+	entry->next = *link;
+	*link = dns_get(entry);
+	dns.nr_entries++;
+}
+
+static struct dns_entry *dns_getaddrinfo(const char *host, const char *port)
+{
+	struct addrinfo hints = {
+		.ai_flags = AI_ALL | AI_ADDRCONFIG,
+		//.ai_flags = AI_ALL,
+		.ai_family = AF_UNSPEC, /* support both IPv4 and IPv6 */
+		.ai_socktype = SOCK_STREAM
+	};
+
+	struct dns_entry *entry = calloc(1, sizeof(*entry));
+	assert(entry);
+	entry->refcount = 1;
+	/* An internationalized name is converted before the lookup, the entry is cached
+	   under the original one */
+	char *ascii = NULL;
+	if (punycode_host(host, strlen(host), &ascii)) {
+		entry->err = EAI_NONAME;
+		return entry;
+	}
+	entry->err = getaddrinfo(ascii ? ascii : host, port, &hints, &entry->addrinfo);
+	free(ascii);
+	if (entry->err) {
+		error("getaddrinfo(host='%s') failed: %s err=%d", host, gai_strerror(entry->err), entry->err);
+		entry->addrinfo = NULL;
+	}
+	return entry;
+}
+
+int dns_resolve(const char *host, size_t host_len, const char *port, size_t port_len,
+				struct dns_entry **result)
+{
+	/* "host:port" with the host in lower case */
+	char *key = malloc(host_len + port_len + 2);
+	assert(key);
+	for (size_t i = 0; i < host_len; i++)
+		key[i] = tolower((unsigned char)host[i]);
+	key[host_len] = ':';
+	memcpy(key + host_len + 1, port, port_len);
+	key[host_len + 1 + port_len] = 0;
+
+	pthread_rwlock_rdlock(&dns.lock);
+	struct dns_entry *entry = dns.ttl_ms ? dns_lookup(key, now_us() / 1000) : NULL;
+	pthread_rwlock_unlock(&dns.lock);
+	if (entry) {
+		counter_add(entry->err ? &dns.stats.negative_hits : &dns.stats.hits, 1);
+		free(key);
+		*result = entry;
+		return entry->err;
+	}
+
+	/* Concurrent misses for the same host resolve it independently, the last one wins */
+	key[host_len] = 0;
+	uint64_t start = now_us();
+	entry = dns_getaddrinfo(key, key + host_len + 1);
+	uint64_t end = now_us();
+	key[host_len] = ':';
+	entry->key = key;
+	counter_add(&dns.stats.misses, 1);
+	counter_add(&dns.stats.miss_time_us, end - start);
+
+	pthread_rwlock_wrlock(&dns.lock);
+	unsigned int ttl_ms = entry->err ? dns.negative_ttl_ms : dns.ttl_ms;
+	entry->expires = end / 1000 + ttl_ms;
+	if (dns.ttl_ms && ttl_ms)
+		dns_insert(entry, end / 1000);
+	pthread_rwlock_unlock(&dns.lock);
+
+	*result = entry;
+	return entry->err;
+}
+
+void dns_set_ttl(unsigned int ttl_ms, unsigned int negative_ttl_ms)
+{
+	pthread_rwlock_wrlock(&dns.lock);
+	dns.ttl_ms = ttl_ms;
+	dns.negative_ttl_ms = negative_ttl_ms;
+	pthread_rwlock_unlock(&dns.lock);
+}
+
+void dns_get_stats(struct dns_stats *stats)
+{
+	stats->hits = __atomic_load_n(&dns.stats.hits, __ATOMIC_RELAXED);
+	stats->negative_hits = __atomic_load_n(&dns.stats.negative_hits, __ATOMIC_RELAXED);
+	stats->misses = __atomic_load_n(&dns.stats.misses, __ATOMIC_RELAXED);
+	stats->miss_time_us = __atomic_load_n(&dns.stats.miss_time_us, __ATOMIC_RELAXED);
+}
+
+void dns_clear(void)
+{
+	pthread_rwlock_wrlock(&dns.lock);
+	for (size_t i = 0; i < DNS_NR_BUCKETS; i++) {
+		while (dns.buckets[i])
+			dns_remove(&dns.buckets[i]);
+	}
+	pthread_rwlock_unlock(&dns.lock);
+}
+
+#ifdef UNIT_TEST
+static void test_cache(void)
+{
+	struct dns_stats before, after;
+	dns_get_stats(&before);
+
+	struct dns_entry *first = NULL, *second = NULL;
+	assert(!dns_resolve("127.0.0.1", 9, "80", 2, &first));
+	assert(first->addrinfo);
+	assert(!dns_resolve("127.0.0.1", 9, "80", 2, &second));
+	assert(first == second);
+	dns_release(second);
+
+	/* A different port is a different entry */
+	assert(!dns_resolve("127.0.0.1", 9, "8080", 4, &second));
+	assert(first != second);
+	dns_release(second);
+
+	/* The entry outlives the cache while it is referenced */
+	dns_clear();
+	assert(first->addrinfo->ai_family == AF_INET);
+	dns_release(first);
+
+	dns_get_stats(&after);
+	assert(after.hits == before.hits + 1);
+	assert(after.misses == before.misses + 2);
+}
+
+static void test_negative(void)
+{
+	struct dns_stats before, after;
+	dns_get_stats(&before);
+
+	/* The .invalid top level domain never resolves, see RFC 2606 */
+	struct dns_entry *entry = NULL;
+	int err = dns_resolve("host.invalid", 12, "80", 2, &entry);
+	assert(err && entry->addrinfo == NULL);
+	dns_release(entry);
+	assert(dns_resolve("host.invalid", 12, "80", 2, &entry) == err);
+	dns_release(entry);
+
+	dns_get_stats(&after);
+	assert(after.negative_hits == before.negative_hits + 1);
+	assert(after.misses == before.misses + 1);
+	dns_clear();
+}
+
+static void test_idn(void)
+{
+	/* A host that is not UTF-8 fails without a lookup */
+	struct dns_entry *entry = NULL;
+	assert(dns_resolve("b\xfc" "cher.de", 9, "80", 2, &entry) == EAI_NONAME);
+	assert(entry->addrinfo == NULL);
+	dns_release(entry);
+	dns_clear();
+}
+
+static void test_disabled(void)
+{
+	dns_set_ttl(0, 0);
+	struct dns_entry *first = NULL, *second = NULL;
+	assert(!dns_resolve("127.0.0.1", 9, "80", 2, &first));
+	assert(!dns_resolve("127.0.0.1", 9, "80", 2, &second));
+	assert(first != second);
+	dns_release(first);
+	dns_release(second);
+	dns_set_ttl(DNS_DEFAULT_TTL_MS, DNS_DEFAULT_NEGATIVE_TTL_MS);
+}
+
+void test_dns(void)
+{
+	test_cache();
+	test_negative();
+	test_idn();
+	test_disabled();
+}
+#endif
@@ -0,0 +1,47 @@
+#pragma once
+#include <netdb.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Cache of getaddrinfo() results shared by all threads. Failures are cached
+   for a shorter time so that a missing host does not cost a lookup per request. */
+
+#define DNS_DEFAULT_TTL_MS			60000
+#define DNS_DEFAULT_NEGATIVE_TTL_MS	5000
+
+struct dns_entry {
+	struct addrinfo	*addrinfo;	/* NULL if the lookup has failed */
+	int				err;		/* getaddrinfo() error */
+
+	/* Internally used fields */
+	struct dns_entry	*next;
+	char				*key;
+	uint64_t			expires;	/* ms */
+	unsigned int		refcount;
+};
+
+struct dns_stats {
+	uint64_t	hits;
+	uint64_t	negative_hits;
+	uint64_t	misses;
+	uint64_t	miss_time_us;	/* total time spent in getaddrinfo() */
+};
+
+/* Resolves the host. The port is a number or a service name. On success the caller
+   owns a reference to the entry and must pass it to dns_release() when done with
+   the addresses. Returns getaddrinfo() error on failure. */
+int dns_resolve(const char *host, size_t host_len, const char *port, size_t port_len,
+				struct dns_entry **entry);
+
+void dns_release(struct dns_entry *entry);
+
+/* ttl_ms = 0 disables the cache */
+void dns_set_ttl(unsigned int ttl_ms, unsigned int negative_ttl_ms);
+
+void dns_get_stats(struct dns_stats *stats);
+
+void dns_clear(void);
+
+#ifdef UNIT_TEST
+void test_dns(void);
+#endif
@@ -0,0 +1,1109 @@
+#define _GNU_SOURCE /* sync_file_range() */
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "download.h"
+#include "http.h"
+#include "http_internal.h"
+#include "log.h"
+#include "progress.h"
+#include "server.h"
+#include "slab.h"
+#include "uring.h"
+#include "url.h"
+
+/* Smaller files are not worth additional connections */
+#define MIN_SEGMENT_SIZE	(1 << 20)
+/* Bytes written between progress updates. A slow segment is never split
+   closer than this to its current position. */
+#define STEP_SIZE			(1 << 20)
+/* Consecutive failures after which a connection gives up */
+#define MAX_ATTEMPTS		3
+/* Bytes of the file mapped at once by DOWNLOAD_WRITER_MMAP. The page cache of a stream keeps
+   about two of them, the older data is written back and dropped. */
+#define MAP_WINDOW			(16 << 20)
+
+/* Buffers of DOWNLOAD_WRITER_URING, each one is received and written by a linked pair
+   of requests */
+#define URING_SLOTS			4
+#define URING_SLOT_SIZE		(1 << 20)
+/* Seconds between the saves of the progress of a resumable download, each one waits
+   for the data written to reach the disk */
+#define CHECKPOINT_INTERVAL	5
+
+static int download_writer = DOWNLOAD_WRITER_SPLICE;
+static bool download_resume;
+
+void download_set_writer(int writer)
+{
+	download_writer = writer;
+}
+
+void download_set_resume(bool resume)
+{
+	download_resume = resume;
+}
+
+/* The file is truncated unless a download is resumed */
+static int download_open(const char *path, bool truncate, int *fd)
+{
+	if (!strcmp(path, "-")) {
+		*fd = STDOUT_FILENO;
+		return 0;
+	}
+	/* A shared mapping needs the file open for reading as well */
+	*fd = open(path, O_RDWR | O_CREAT | (truncate ? O_TRUNC : 0), 0644);
+	if (*fd == -1) {
+		error("open(path='%s') failed: %s errno=%d", path, strerror(errno), errno);
+		return ERR_DOWNLOAD_OPEN_FAILED;
+	}
+	return 0;
+}
+
+static int download_close(const char *path, int fd)
+{
+	if (fd == STDOUT_FILENO)
+		return 0;
+	if (close(fd)) {
+		error("close(path='%s') failed: %s errno=%d", path, strerror(errno), errno);
+		return ERR_HTTP_WRITE_FAILED;
+	}
+	return 0;
+}
+
+/* Allocates the blocks of the file at once, so it is not fragmented by many small writes */
+static int download_allocate(const char *path, int fd, off_t length)
+{
+	int err = posix_fallocate(fd, 0, length);
+	if (err && ftruncate(fd, length)) {
+		error("Could not allocate %lld bytes for '%s': %s err=%d",
+			(long long)length, path, strerror(err), err);
+		return ERR_HTTP_WRITE_FAILED;
+	}
+	return 0;
+}
+
+/* Progress of a resumable download, saved every CHECKPOINT_INTERVAL seconds */
+struct checkpoint {
+	const char	*path;	/* of the file */
+	int			fd;
+	struct progress	progress;	/* as of the next save */
+	double		saved;	/* when it was saved last */
+	bool		saving;	/* by a connection of a parallel download */
+};
+
+static double checkpoint_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Returns nonzero if the download can not be resumed: its length is not known in advance or
+   the server gives no validator to check the file has not changed since */
+static int checkpoint_init(struct checkpoint *cp, const char *path, int fd, const char *validator,
+						   off_t start, off_t length)
+{
+	memset(cp, 0, sizeof(*cp));
+	if (validator == NULL || length <= 0) {
+		info("The download of '%s' can not be resumed: the server gives no %s", path,
+			validator ? "Content-Length" : "ETag or Last-Modified");
+		return -1;
+	}
+	cp->path = path;
+	cp->fd = fd;
+	cp->progress.length = length;
+	cp->progress.validator = strdup(validator);
+	cp->progress.ranges = malloc(sizeof(*cp->progress.ranges));
+	assert(cp->progress.validator && cp->progress.ranges);
+	cp->progress.ranges[0].start = start;
+	cp->progress.ranges[0].end = length;
+	cp->progress.nr_ranges = 1;
+	cp->saved = checkpoint_now();
+	return 0;
+}
+
+static void checkpoint_term(struct checkpoint *cp)
+{
+	progress_term(&cp->progress);
+}
+
+static bool checkpoint_due(const struct checkpoint *cp)
+{
+	return checkpoint_now() - cp->saved >= CHECKPOINT_INTERVAL;
+}
+
+/* The progress is saved only once the data it counts is on the disk */
+static void checkpoint_save(struct checkpoint *cp)
+{
+	cp->saved = checkpoint_now();
+	if (fdatasync(cp->fd)) {
+		error("fdatasync(path='%s') failed: %s errno=%d", cp->path, strerror(errno), errno);
+		return;
+	}
+	progress_save(cp->path, &cp->progress);
+}
+
+/* A stream of data written to the file through mappings */
+struct file_map {
+	int		fd;
+	off_t	clean;		/* the data before is written back and out of the page cache */
+	off_t	queued;		/* the writeback of the data before has started */
+};
+
+/* Starts the writeback of the data up to end. The data more than a window behind is waited
+   for and dropped from the page cache, which would otherwise fill up with the file. */
+static void file_map_written(struct file_map *map, off_t end)
+{
+	if (end > map->queued) {
+		sync_file_range(map->fd, map->queued, end - map->queued, SYNC_FILE_RANGE_WRITE);
+		map->queued = end;
+	}
+	off_t old = end - MAP_WINDOW;
+	if (old > map->clean) {
+		sync_file_range(map->fd, map->clean, old - map->clean,
+			SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+		posix_fadvise(map->fd, map->clean, old - map->clean, POSIX_FADV_DONTNEED);
+		map->clean = old;
+	}
+}
+
+/* Receives up to size bytes of the body right into the mapped pages of the file at *offset,
+   which is advanced. The file must be as long already. *written < size means the end of
+   the body. */
+static int file_map_recv(struct file_map *map, struct http_response *response, off_t *offset,
+						 size_t size, size_t *written)
+{
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	size_t total = 0;
+	int err = 0;
+	while (total < size) {
+		off_t base = *offset - *offset % MAP_WINDOW;
+		size_t skip = *offset - base;
+		size_t len = MAP_WINDOW - skip < size - total ? MAP_WINDOW - skip : size - total;
+		/* The mapping starts at a page boundary */
+		size_t map_skip = skip % page_size;
+		char *addr = mmap(NULL, map_skip + len, PROT_READ | PROT_WRITE, MAP_SHARED, map->fd,
+						  *offset - map_skip);
+		if (addr == MAP_FAILED) {
+			error("mmap() failed: %s errno=%d", strerror(errno), errno);
+			err = ERR_HTTP_WRITE_FAILED;
+			break;
+		}
+		size_t received = 0;
+		err = http_response_read(response, addr + map_skip, len, &received);
+		munmap(addr, map_skip + len);
+		*offset += received;
+		total += received;
+		file_map_written(map, *offset);
+		if (err || received < len)
+			break;
+	}
+	*written = total;
+	return err;
+}
+
+/* A stream of data received to the file through io_uring */
+struct file_uring {
+	struct uring	uring;
+	char			*bufs[URING_SLOTS];	/* registered */
+};
+
+static int file_uring_init(struct file_uring *fu)
+{
+	int err = uring_init(&fu->uring, 2 * URING_SLOTS);
+	if (err)
+		return err;
+	struct iovec iov[URING_SLOTS];
+	for (size_t i = 0; i < URING_SLOTS; i++) {
+		fu->bufs[i] = slab_alloc(URING_SLOT_SIZE);
+		iov[i].iov_base = fu->bufs[i];
+		iov[i].iov_len = URING_SLOT_SIZE;
+	}
+	if ((err = uring_register_buffers(&fu->uring, iov, URING_SLOTS))) {
+		for (size_t i = 0; i < URING_SLOTS; i++)
+			slab_free(fu->bufs[i]);
+		uring_term(&fu->uring);
+	}
+	return err;
+}
+
+static void file_uring_term(struct file_uring *fu)
+{
+	/* Closing the ring unregisters the buffers */
+	uring_term(&fu->uring);
+	for (size_t i = 0; i < URING_SLOTS; i++)
+		slab_free(fu->bufs[i]);
+}
+
+/* Receives up to size bytes of a body of a known length to the file at *offset, which is
+   advanced. Every receive into a buffer is linked to the write of the buffer and to the next
+   receive, so a chain of URING_SLOTS of them streams the data with one io_uring_enter().
+   *written < size means the end of the body. */
+static int file_uring_recv(struct file_uring *fu, struct http_response *response, int fd,
+						   off_t *offset, size_t size, size_t *written)
+{
+	/* The data received with the header goes first */
+	size_t total = 0;
+	int err = 0;
+	if (response->data_size) {
+		size_t buffered = response->data_size < size ? response->data_size : size;
+		if ((err = http_response_splice(response, fd, offset, buffered, &total)))
+			goto out;
+	}
+	while (total < size) {
+		uint64_t left = parser_body_available(response);
+		if (left > size - total)
+			left = size - total;
+		if (left == 0)
+			break;
+		size_t lens[URING_SLOTS];
+		size_t nr = 0;
+		for (size_t queued = 0; nr < URING_SLOTS && queued < left; nr++) {
+			lens[nr] = left - queued < URING_SLOT_SIZE ? left - queued : URING_SLOT_SIZE;
+			struct io_uring_sqe *sqe = uring_sqe(&fu->uring);
+			sqe->opcode = IORING_OP_RECV;
+			sqe->fd = response->socket;
+			sqe->addr = (uintptr_t)fu->bufs[nr];
+			sqe->len = lens[nr];
+			sqe->msg_flags = MSG_WAITALL;	/* a short receive would break the chain */
+			sqe->flags = IOSQE_IO_LINK;
+			sqe->user_data = 2 * nr;
+			sqe = uring_sqe(&fu->uring);
+			sqe->opcode = IORING_OP_WRITE_FIXED;
+			sqe->fd = fd;
+			sqe->addr = (uintptr_t)fu->bufs[nr];
+			sqe->len = lens[nr];
+			sqe->off = *offset + queued;
+			sqe->buf_index = nr;
+			sqe->flags = IOSQE_IO_LINK;
+			sqe->user_data = 2 * nr + 1;
+			queued += lens[nr];
+		}
+		fu->uring.sqes[(fu->uring.sq_local_tail - 1) & fu->uring.sq_mask].flags = 0;
+
+		/* A failed request completes the rest of the chain with -ECANCELED */
+		int results[2 * URING_SLOTS];
+		for (size_t done = 0; done < 2 * nr; ) {
+			if ((err = uring_submit(&fu->uring, 2 * nr - done)) < 0)
+				goto out;
+			struct io_uring_cqe *cqe;
+			for (; (cqe = uring_cqe(&fu->uring)); done++) {
+				results[cqe->user_data] = cqe->res;
+				uring_cqe_seen(&fu->uring);
+			}
+		}
+		err = 0;
+		for (size_t i = 0; i < nr && !err; i++) {
+			int received = results[2 * i], result = results[2 * i + 1];
+			if (received < 0) {
+				response->recv_errno = -received;
+				error("recv() failed: %s errno=%d", strerror(-received), -received);
+				err = ERR_HTTP_RECV_FAILED;
+				break;
+			}
+			/* The write is cancelled after a short receive, the end of the stream */
+			if (result == -ECANCELED)
+				result = 0;
+			if (result < 0) {
+				error("write() failed: %s errno=%d", strerror(-result), -result);
+				err = ERR_HTTP_WRITE_FAILED;
+				break;
+			}
+			off_t at = *offset + result;
+			err = write_all(fd, &at, fu->bufs[i] + result, received - result);
+			parser_body_consumed(response, received);
+			*offset += received;
+			total += received;
+			if (!err && (size_t)received < lens[i])
+				err = parser_eof(response);	/* the server closed the connection */
+		}
+		if (err || response->parser.state == PARSER_DONE)
+			break;
+	}
+out:
+	*written = total;
+	return err;
+}
+
+/* Returns the strong ETag or the Last-Modified of the response, which names the version of
+   the file in If-Range */
+static const char *response_validator(struct http_response *response)
+{
+	const char *etag = http_response_header(response, HTTP_HDR_ETAG);
+	/* Weak entity tags can not be used in If-Range */
+	if (etag && strncmp(etag, "W/", 2))
+		return etag;
+	return http_response_header(response, HTTP_HDR_LAST_MODIFIED);
+}
+
+/* Writes the rest of the body of the response to the file from start on. The file is
+   truncated if start is 0, otherwise the download of the version named by validator is
+   resumed. A body of a known length is written to the file allocated in advance, and with
+   DOWNLOAD_WRITER_MMAP is received right into it. DOWNLOAD_WRITER_URING falls back to
+   splice() if io_uring is not available. A resumable download saves its progress between
+   the steps of STEP_SIZE bytes and removes it once the file is complete. */
+static int download_response(struct http_response *response, const char *path, off_t start,
+							 const char *validator)
+{
+	int fd = -1;
+	int err = download_open(path, start == 0, &fd);
+	if (err)
+		return err;
+
+	off_t length = 0;
+	if (fd != STDOUT_FILENO && response->body_type == HTTP_BODY_LENGTH &&
+		response->coding == HTTP_CODING_IDENTITY)
+		length = start + response->body_left;
+	if (length && (err = download_allocate(path, fd, length))) {
+		download_close(path, fd);
+		return err;
+	}
+	struct checkpoint cp;
+	bool resumable = download_resume && fd != STDOUT_FILENO &&
+		!checkpoint_init(&cp, path, fd, validator ? validator : response_validator(response),
+						 start, length);
+
+	off_t offset = start;
+	struct file_map map = { .fd = fd, .clean = start, .queued = start };
+	struct file_uring fu;
+	bool mapped = length && download_writer == DOWNLOAD_WRITER_MMAP;
+	bool uring = length && download_writer == DOWNLOAD_WRITER_URING && !file_uring_init(&fu);
+	size_t step = resumable ? STEP_SIZE : SIZE_MAX;
+	while (1) {
+		size_t written = 0;
+		if (mapped)
+			err = file_map_recv(&map, response, &offset, step, &written);
+		else if (uring)
+			err = file_uring_recv(&fu, response, fd, &offset, step, &written);
+		else	/* Pipes and terminals do not support positional writes */
+			err = http_response_splice(response, fd, fd == STDOUT_FILENO ? NULL : &offset,
+				step, &written);
+		if (resumable) {
+			cp.progress.ranges[0].start = offset;
+			if (!err && written == step && checkpoint_due(&cp))
+				checkpoint_save(&cp);
+		}
+		if (err || written < step)
+			break;
+	}
+	if (uring)
+		file_uring_term(&fu);
+
+	if (resumable) {
+		/* The file keeps its length, which tells that it belongs to the progress */
+		if (!err && offset == length)
+			progress_remove(path);
+		else
+			checkpoint_save(&cp);
+		checkpoint_term(&cp);
+	} else if (length && offset < length && ftruncate(fd, offset) && !err) {
+		/* The file ends where the body has, if it is shorter than allocated */
+		error("ftruncate(path='%s') failed: %s errno=%d", path, strerror(errno), errno);
+		err = ERR_HTTP_WRITE_FAILED;
+	}
+	int close_err = download_close(path, fd);
+	return err ? err : close_err;
+}
+
+/* Parses "bytes first-last/length", see https://tools.ietf.org/html/rfc7233#section-4.2
+   The length is -1 if it is unknown ('*'). */
+static int parse_content_range(const char *value, off_t *first, off_t *last, off_t *length);
+
+/* With the progress of one range left to the end of the file, asks for the rest of it if it
+   has not changed. The server returns the whole file otherwise. */
+static int download_single(const char *url, const char *path, const struct progress *resume)
+{
+	char range[64] = "";
+	char *if_range = NULL;
+	const char *headers[] = { range, NULL, NULL };
+	if (resume) {
+		snprintf(range, sizeof(range), "Range: bytes=%lld-", (long long)resume->ranges[0].start);
+		if_range = aprintf("If-Range: %s", resume->validator);
+		headers[1] = if_range;
+	}
+	struct http_response response;
+	off_t start = 0;
+	int err = http_get(url, resume ? headers : NULL, &response);
+	if (err)
+		goto out;
+	if (resume && response.status_code == 206) {
+		off_t first = 0, last = 0, length = 0;
+		if ((err = parse_content_range(http_response_header(&response, HTTP_HDR_CONTENT_RANGE),
+										&first, &last, &length)))
+			goto out;
+		if (first != resume->ranges[0].start || length != resume->length) {
+			error("%s: Content-Range '%s' does not continue the download", url,
+				http_response_header(&response, HTTP_HDR_CONTENT_RANGE));
+			err = ERR_HTTP_INVALID_RESPONSE;
+			goto out;
+		}
+		info("Resuming the download of '%s' at byte %lld", path, (long long)first);
+		start = first;
+	} else if (response.status_code != 200) {
+		error("%s: %s", url, response.status_line);
+		err = ERR_DOWNLOAD_HTTP_STATUS;
+		goto out;
+	} else if (resume) {
+		info("%s: The file has changed, downloading it again", url);
+	}
+	err = download_response(&response, path, start, start ? resume->validator : NULL);
+out:
+	http_response_close(&response);
+	free(if_range);
+	return err;
+}
+
+static int parse_content_range(const char *value, off_t *first, off_t *last, off_t *length)
+{
+	long long f = 0, l = 0, len = -1;
+	int pos = 0;
+	if (value == NULL || sscanf(value, "bytes %lld-%lld/%n", &f, &l, &pos) != 2 || pos == 0)
+		goto invalid;
+	if (!strcmp(value + pos, "*"))
+		len = -1;
+	else if (sscanf(value + pos, "%lld", &len) != 1 || len <= l)
+		goto invalid;
+	if (f < 0 || l < f)
+		goto invalid;
+	*first = f;
+	*last = l;
+	*length = len;
+	return 0;
+invalid:
+	error("Invalid Content-Range: '%s'", value ? value : "");
+	return ERR_HTTP_INVALID_RESPONSE;
+}
+
+struct segment {
+	off_t	start;	/* next byte to download */
+	off_t	end;	/* end of the segment, exclusive */
+	bool	active;	/* a connection is downloading the segment */
+};
+
+struct parallel {
+	const char		*url;
+	char			*validator;	/* ETag or Last-Modified of the file or NULL */
+	char			*if_range;	/* "If-Range: <validator>" or NULL */
+	struct http_template	template;	/* of the segment requests */
+	int				fd;
+
+	pthread_mutex_t	lock;
+	struct segment	*segments;
+	size_t			nr_segments;
+	size_t			capacity;
+	int				err;		/* fatal error which stops all connections */
+	struct checkpoint	*checkpoint;	/* NULL if the download is not resumable */
+};
+
+static size_t segment_add(struct parallel *p, off_t start, off_t end, bool active)
+{
+	if (p->nr_segments == p->capacity) {
+		p->capacity = p->capacity ? p->capacity * 2 : 16;
+		p->segments = realloc(p->segments, p->capacity * sizeof(*p->segments));
+		assert(p->segments);
+	}
+	struct segment *segment = &p->segments[p->nr_segments];
+	segment->start = start;
+	segment->end = end;
+	segment->active = active;
+	return p->nr_segments++;
+}
+
+/* Takes a segment nobody downloads. If there is none, splits the segment with
+   the most bytes left in two and takes the second half. Returns -1 if every
+   segment is too small to split. Called under the lock. */
+static ssize_t segment_take(struct parallel *p)
+{
+	ssize_t largest = -1;
+	off_t largest_left = 0;
+	for (size_t i = 0; i < p->nr_segments; i++) {
+		struct segment *segment = &p->segments[i];
+		off_t left = segment->end - segment->start;
+		if (left == 0)
+			continue;
+		if (!segment->active) {
+			segment->active = true;
+			return i;
+		}
+		if (left > largest_left) {
+			largest = i;
+			largest_left = left;
+		}
+	}
+
+	/* The owner may be writing the next STEP_SIZE bytes right now */
+	if (largest == -1 || largest_left - STEP_SIZE < 2 * MIN_SEGMENT_SIZE)
+		return -1;
+	struct segment *victim = &p->segments[largest];
+	off_t split = victim->start + STEP_SIZE + (largest_left - STEP_SIZE) / 2;
+	off_t end = victim->end;
+	victim->end = split;
+	return segment_add(p, split, end, true);
+}
+
+/* Saves the segments left if CHECKPOINT_INTERVAL has passed since the last save. Only one
+   connection saves at a time, the others go on downloading. */
+static void parallel_checkpoint(struct parallel *p, bool force)
+{
+	struct checkpoint *cp = p->checkpoint;
+	if (cp == NULL)
+		return;
+	pthread_mutex_lock(&p->lock);
+	if (cp->saving || (!force && !checkpoint_due(cp))) {
+		pthread_mutex_unlock(&p->lock);
+		return;
+	}
+	cp->saving = true;
+	struct progress *progress = &cp->progress;
+	progress->ranges = realloc(progress->ranges, p->nr_segments * sizeof(*progress->ranges));
+	assert(progress->ranges);
+	progress->nr_ranges = 0;
+	for (size_t i = 0; i < p->nr_segments; i++) {
+		if (p->segments[i].start == p->segments[i].end)
+			continue;
+		progress->ranges[progress->nr_ranges].start = p->segments[i].start;
+		progress->ranges[progress->nr_ranges].end = p->segments[i].end;
+		progress->nr_ranges++;
+	}
+	pthread_mutex_unlock(&p->lock);
+
+	/* The segments advance after their data is written, so the sync covers the data counted */
+	checkpoint_save(cp);
+	pthread_mutex_lock(&p->lock);
+	cp->saving = false;
+	pthread_mutex_unlock(&p->lock);
+}
+
+static bool is_fatal(int err)
+{
+	return err == ERR_HTTP_WRITE_FAILED || err == ERR_DOWNLOAD_RANGE_IGNORED;
+}
+
+static int segment_download(struct parallel *p, size_t i)
+{
+	pthread_mutex_lock(&p->lock);
+	off_t start = p->segments[i].start;
+	off_t end = p->segments[i].end;
+	pthread_mutex_unlock(&p->lock);
+
+	char range[64];
+	snprintf(range, sizeof(range), "Range: bytes=%lld-%lld", (long long)start, (long long)end - 1);
+	const char *headers[] = { range, NULL };
+
+	struct http_response response;
+	int err = http_template_request(&p->template, NULL, headers, NULL, &response);
+	if (err)
+		goto out;
+	if (response.status_code != 206) {
+		/* The file has changed since the first request or the server stopped honoring ranges */
+		error("%s: %s in response to '%s'", p->url, response.status_line, range);
+		err = response.status_code == 200 ? ERR_DOWNLOAD_RANGE_IGNORED : ERR_DOWNLOAD_HTTP_STATUS;
+		goto out;
+	}
+	off_t first = 0, last = 0, length = 0;
+	if ((err = parse_content_range(http_response_header(&response, HTTP_HDR_CONTENT_RANGE),
+									&first, &last, &length)))
+		goto out;
+	if (first != start) {
+		error("Content-Range starts at %lld instead of %lld", (long long)first, (long long)start);
+		err = ERR_HTTP_INVALID_RESPONSE;
+		goto out;
+	}
+
+	off_t offset = start;
+	struct file_map map = { .fd = p->fd, .clean = start, .queued = start };
+	struct file_uring fu;
+	/* The io_uring and mmap writers receive a body of a known length only */
+	bool known_length = response.body_type == HTTP_BODY_LENGTH &&
+		response.coding == HTTP_CODING_IDENTITY;
+	bool uring = known_length && download_writer == DOWNLOAD_WRITER_URING && !file_uring_init(&fu);
+	while (1) {
+		pthread_mutex_lock(&p->lock);
+		off_t left = p->segments[i].end - p->segments[i].start;
+		bool stop = p->err != 0;
+		pthread_mutex_unlock(&p->lock);
+		if (left == 0 || stop)
+			break;
+
+		size_t step = left < STEP_SIZE ? left : STEP_SIZE;
+		size_t written = 0;
+		if (known_length && download_writer == DOWNLOAD_WRITER_MMAP)
+			err = file_map_recv(&map, &response, &offset, step, &written);
+		else if (uring)
+			err = file_uring_recv(&fu, &response, p->fd, &offset, step, &written);
+		else
+			err = http_response_splice(&response, p->fd, &offset, step, &written);
+
+		pthread_mutex_lock(&p->lock);
+		p->segments[i].start += written;
+		pthread_mutex_unlock(&p->lock);
+		parallel_checkpoint(p, false);
+		if (err)
+			break;
+		if (written < step) {
+			error("Segment ended %lld bytes early", (long long)(left - written));
+			err = ERR_HTTP_BODY_TRUNCATED;
+			break;
+		}
+	}
+	if (uring)
+		file_uring_term(&fu);
+out:
+	http_response_close(&response);
+	return err;
+}
+
+static void *parallel_connection(void *arg)
+{
+	struct parallel *p = arg;
+	int attempts = 0;
+	while (1) {
+		pthread_mutex_lock(&p->lock);
+		ssize_t i = p->err ? -1 : segment_take(p);
+		pthread_mutex_unlock(&p->lock);
+		if (i == -1)
+			break;
+
+		int err = segment_download(p, i);
+
+		pthread_mutex_lock(&p->lock);
+		p->segments[i].active = false;
+		if (is_fatal(err) && !p->err)
+			p->err = err;
+		pthread_mutex_unlock(&p->lock);
+
+		attempts = err ? attempts + 1 : 0;
+		if (attempts == MAX_ATTEMPTS)
+			break;
+	}
+	return NULL;
+}
+
+static int parallel_run(struct parallel *p, off_t length, unsigned int connections)
+{
+	if (connections > length / MIN_SEGMENT_SIZE)
+		connections = length / MIN_SEGMENT_SIZE;
+	if (connections == 0)
+		connections = 1;
+	/* A resumed download has its segments already */
+	if (p->nr_segments == 0) {
+		off_t segment_size = length / connections;
+		for (unsigned int i = 0; i < connections; i++)
+			segment_add(p, i * segment_size, i + 1 == connections ? length : (i + 1) * segment_size, false);
+	}
+
+	pthread_t *threads = calloc(connections, sizeof(*threads));
+	assert(threads);
+	unsigned int started = 0;
+	for (; started < connections; started++) {
+		int err = pthread_create(&threads[started], NULL, parallel_connection, p);
+		if (err) {
+			error("pthread_create() failed: %s err=%d", strerror(err), err);
+			break;
+		}
+	}
+	/* Remaining connections finish the segments of the threads which failed to start */
+	if (started == 0)
+		parallel_connection(p);
+	for (unsigned int i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+
+	if (p->err)
+		return p->err;
+	for (size_t i = 0; i < p->nr_segments; i++) {
+		if (p->segments[i].start != p->segments[i].end) {
+			error("Could not download %lld bytes at offset %lld",
+				(long long)(p->segments[i].end - p->segments[i].start),
+				(long long)p->segments[i].start);
+			return ERR_DOWNLOAD_INCOMPLETE;
+		}
+	}
+	return 0;
+}
+
+/* A resumed download asks for the segments left in the progress. The probe returns the whole
+   file instead if it has changed, which is downloaded with it. */
+static int download_parallel(const char *url, const char *path, unsigned int connections,
+							 const struct progress *resume)
+{
+	struct parallel p;
+	memset(&p, 0, sizeof(p));
+	p.url = url;
+	p.fd = -1;
+	pthread_mutex_init(&p.lock, NULL);
+	struct checkpoint cp;
+	memset(&cp, 0, sizeof(cp));
+
+	/* If-Range makes every segment come from the same version of the file */
+	const char *probe_headers[] = { "Range: bytes=0-0", NULL, NULL };
+	if (resume) {
+		p.validator = strdup(resume->validator);
+		assert(p.validator);
+		p.if_range = aprintf("If-Range: %s", p.validator);
+		probe_headers[1] = p.if_range;
+	}
+	struct http_response response;
+	int err = http_get(url, probe_headers, &response);
+	if (err)
+		goto out;
+	if (response.status_code == 200) {
+		if (resume)
+			info("%s: The file has changed, downloading it again", url);
+		else
+			info("%s: The server does not support ranges, downloading with a single connection", url);
+		err = download_response(&response, path, 0, NULL);
+		goto out;
+	}
+	if (response.status_code != 206) {
+		error("%s: %s", url, response.status_line);
+		err = ERR_DOWNLOAD_HTTP_STATUS;
+		goto out;
+	}
+	off_t first = 0, last = 0, length = 0;
+	if ((err = parse_content_range(http_response_header(&response, HTTP_HDR_CONTENT_RANGE),
+									&first, &last, &length)))
+		goto out;
+	if (resume && length != resume->length) {
+		error("%s: The file is of %lld bytes instead of %lld", url, (long long)length,
+			(long long)resume->length);
+		err = ERR_HTTP_INVALID_RESPONSE;
+		goto out;
+	}
+	if (resume == NULL && response_validator(&response)) {
+		p.validator = strdup(response_validator(&response));
+		assert(p.validator);
+		p.if_range = aprintf("If-Range: %s", p.validator);
+	}
+	http_response_close(&response);
+	if (length == -1) {
+		info("%s: The file size is unknown, downloading with a single connection", url);
+		err = download_single(url, path, NULL);
+		goto out;
+	}
+
+	const char *fixed_headers[] = { p.if_range, NULL };
+	if ((err = http_template_init(&p.template, "GET", url, fixed_headers)))
+		goto out;
+	if ((err = download_open(path, resume == NULL, &p.fd)))
+		goto out;
+	if ((err = download_allocate(path, p.fd, length)))
+		goto out;
+	if (download_resume && !checkpoint_init(&cp, path, p.fd, p.validator, 0, length))
+		p.checkpoint = &cp;
+	for (size_t i = 0; resume && i < resume->nr_ranges; i++)
+		segment_add(&p, resume->ranges[i].start, resume->ranges[i].end, false);
+	if (resume)
+		info("Resuming the download of '%s' with %lld bytes left", path,
+			(long long)(length - progress_written(resume)));
+	err = parallel_run(&p, length, connections);
+	if (p.checkpoint) {
+		if (err)
+			parallel_checkpoint(&p, true);
+		else
+			progress_remove(path);
+	}
+out:
+	http_response_close(&response);
+	if (p.fd != -1) {
+		int close_err = download_close(path, p.fd);
+		if (!err)
+			err = close_err;
+	}
+	http_template_term(&p.template);
+	checkpoint_term(&cp);
+	free(p.validator);
+	free(p.if_range);
+	free(p.segments);
+	pthread_mutex_destroy(&p.lock);
+	return err;
+}
+
+/* Loads the progress of the file, which has the length of the download until it is complete */
+static int download_load_progress(const char *path, struct progress *progress)
+{
+	int err = progress_load(path, progress);
+	if (err)
+		return err;
+	struct stat st;
+	if (stat(path, &st) || st.st_size != progress->length) {
+		info("'%s' does not match its progress, downloading it again", path);
+		progress_term(progress);
+		return ERR_PROGRESS_INVALID;
+	}
+	return 0;
+}
+
+int download(const char *url, const char *path, unsigned int connections)
+{
+	bool to_stdout = !strcmp(path, "-");
+	struct progress progress;
+	bool resume = download_resume && !to_stdout && !download_load_progress(path, &progress);
+	/* One connection continues with a single range, more segments are downloaded one by one */
+	bool single = !resume || (progress.nr_ranges == 1 && progress.ranges[0].end == progress.length);
+	int err;
+	/* Segments are written at their offsets, which the standard output can not do */
+	if (to_stdout || (connections <= 1 && single))
+		err = download_single(url, path, resume ? &progress : NULL);
+	else
+		err = download_parallel(url, path, connections, resume ? &progress : NULL);
+	if (resume)
+		progress_term(&progress);
+	return err;
+}
+
+char *download_file_name(const char *url)
+{
+	struct url parsed;
+	if (url_parse(url, &parsed) || parsed.path == NULL)
+		return strdup("index.html");
+
+	const char *end = parsed.path + parsed.path_len;
+	const char *name = end;
+	while (name > parsed.path && name[-1] != '/')
+		name--;
+	if (name == end)
+		return strdup("index.html");
+	return strndup(name, end - name);
+}
+
+#ifdef UNIT_TEST
+static void test_file_name_one(const char *url, const char *name)
+{
+	char *file_name = download_file_name(url);
+	assert(!strcmp(file_name, name));
+	free(file_name);
+}
+
+static void test_file_name(void)
+{
+	test_file_name_one("http://en.wikipedia.org/wiki/URL#Syntax", "URL");
+	test_file_name_one("http://example.com/dir/file.tar.gz?x=1", "file.tar.gz");
+	test_file_name_one("http://example.com/dir/", "index.html");
+	test_file_name_one("http://example.com", "index.html");
+	test_file_name_one("example.com", "index.html");
+}
+
+static void test_content_range(void)
+{
+	off_t first = 0, last = 0, length = 0;
+	assert(!parse_content_range("bytes 0-0/1234", &first, &last, &length));
+	assert(first == 0 && last == 0 && length == 1234);
+	assert(!parse_content_range("bytes 100-199/*", &first, &last, &length));
+	assert(first == 100 && last == 199 && length == -1);
+	assert(parse_content_range("bytes 100-99/1234", &first, &last, &length));
+	assert(parse_content_range("bytes 0-1234/1234", &first, &last, &length));
+	assert(parse_content_range("bytes */1234", &first, &last, &length));
+	assert(parse_content_range(NULL, &first, &last, &length));
+}
+
+static void test_segment_take(void)
+{
+	struct parallel p;
+	memset(&p, 0, sizeof(p));
+	const off_t size = 16 * MIN_SEGMENT_SIZE;
+	segment_add(&p, 0, size / 2, false);
+	segment_add(&p, size / 2, size, false);
+
+	assert(segment_take(&p) == 0);
+	assert(segment_take(&p) == 1);
+
+	/* The first connection is done, the second one is at the beginning of its segment */
+	p.segments[0].start = p.segments[0].end;
+	p.segments[0].active = false;
+	assert(segment_take(&p) == 2);
+	assert(p.segments[1].end == p.segments[2].start);
+	assert(p.segments[1].end - p.segments[1].start > STEP_SIZE);
+	assert(p.segments[2].end == size);
+
+	/* Nothing worth splitting */
+	p.segments[1].start = p.segments[1].end - STEP_SIZE;
+	p.segments[2].start = p.segments[2].end - STEP_SIZE;
+	assert(segment_take(&p) == -1);
+	free(p.segments);
+}
+
+/* Downloads the path of the local server and checks the file */
+static void test_writer_one(struct server *server, int writer, const char *path, size_t size,
+							unsigned int connections)
+{
+	char url[128];
+	snprintf(url, sizeof(url), "http://127.0.0.1:%d%s", server->port, path);
+	char file_path[] = "/tmp/http_client_test_XXXXXX";
+	int fd = mkstemp(file_path);
+	assert(fd != -1);
+	close(fd);
+	download_set_writer(writer);
+	assert(!download(url, file_path, connections));
+	download_set_writer(DOWNLOAD_WRITER_SPLICE);
+
+	FILE *file = fopen(file_path, "rb");
+	assert(file);
+	size_t offset = 0;
+	int ch;
+	while ((ch = fgetc(file)) != EOF)
+		assert(ch == server_body_byte(offset++));
+	assert(offset == size);
+	fclose(file);
+	unlink(file_path);
+}
+
+static void test_writer(void)
+{
+	struct server server;
+	assert(!server_start(&server));
+	static const size_t sizes[] = {0, 100, 1 << 20, MAP_WINDOW + 12345};
+	for (int writer = DOWNLOAD_WRITER_SPLICE; writer <= DOWNLOAD_WRITER_URING; writer++) {
+		for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+			char path[64];
+			snprintf(path, sizeof(path), "/length/%zu", sizes[i]);
+			test_writer_one(&server, writer, path, sizes[i], 1);
+		}
+		/* The length is not known in advance */
+		test_writer_one(&server, writer, "/chunked/100000", 100000, 1);
+		test_writer_one(&server, writer, "/close/100000", 100000, 1);
+		/* Segments of a known length and chunked ones */
+		char path[64];
+		snprintf(path, sizeof(path), "/length/%d", 4 * MIN_SEGMENT_SIZE + 12345);
+		test_writer_one(&server, writer, path, 4 * MIN_SEGMENT_SIZE + 12345, 4);
+		snprintf(path, sizeof(path), "/chunked/%d", 4 * MIN_SEGMENT_SIZE + 12345);
+		test_writer_one(&server, writer, path, 4 * MIN_SEGMENT_SIZE + 12345, 4);
+	}
+	server_stop(&server);
+}
+
+/* Returns the first byte of the file, which must have the body of the local server after it */
+static char test_check_file(const char *path, size_t size)
+{
+	FILE *file = fopen(path, "rb");
+	assert(file);
+	int first = fgetc(file);
+	size_t offset = first == EOF ? 0 : 1;
+	int ch;
+	while ((ch = fgetc(file)) != EOF)
+		assert(ch == server_body_byte(offset++));
+	assert(offset == size);
+	fclose(file);
+	return first;
+}
+
+/* Breaks the download at the abort offset, marks the first byte of the file and downloads
+   the file again, from the etag of the query on. Returns the first byte, which is kept if
+   the download has been resumed. */
+static char test_resume_one(struct server *server, unsigned int connections, size_t size,
+							size_t abort, const char *etag)
+{
+	char path[] = "/tmp/http_client_test_XXXXXX";
+	int fd = mkstemp(path);
+	assert(fd != -1);
+	close(fd);
+	char url[128];
+	snprintf(url, sizeof(url), "http://127.0.0.1:%d/length/%zu?etag=1&abort=%zu",
+		server->port, size, abort);
+	assert(download(url, path, connections));
+
+	struct progress progress;
+	assert(!progress_load(path, &progress));
+	assert(progress.length == (off_t)size && !strcmp(progress.validator, "\"1\""));
+	assert(progress_written(&progress) == (off_t)abort);
+	progress_term(&progress);
+	fd = open(path, O_WRONLY);
+	assert(fd != -1 && pwrite(fd, "X", 1, 0) == 1);
+	close(fd);
+
+	snprintf(url, sizeof(url), "http://127.0.0.1:%d/length/%zu?%s", server->port, size, etag);
+	assert(!download(url, path, connections));
+	assert(progress_load(path, &progress) == ERR_PROGRESS_NOT_FOUND);
+	char first = test_check_file(path, size);
+	unlink(path);
+	return first;
+}
+
+static void test_resume(void)
+{
+	struct server server;
+	assert(!server_start(&server));
+	download_set_resume(true);
+	/* 206 continues the file, 200 is a new version */
+	assert(test_resume_one(&server, 1, 100000, 12345, "etag=1") == 'X');
+	assert(test_resume_one(&server, 1, 100000, 12345, "etag=2") == server_body_byte(0));
+	/* The connections fail at the segment of the abort offset, every segment is saved */
+	size_t size = 4 * MIN_SEGMENT_SIZE;
+	assert(test_resume_one(&server, 4, size, size - 12345, "etag=1") == 'X');
+	assert(test_resume_one(&server, 4, size, size / 2 + 1, "etag=1") == 'X');
+	assert(test_resume_one(&server, 1, size, size / 2 + 1, "etag=1") == 'X');
+	assert(test_resume_one(&server, 2, size, size / 2 + 1, "etag=3") == server_body_byte(0));
+
+	/* Without a validator nothing is saved */
+	char path[] = "/tmp/http_client_test_XXXXXX";
+	int fd = mkstemp(path);
+	assert(fd != -1);
+	close(fd);
+	char url[128];
+	snprintf(url, sizeof(url), "http://127.0.0.1:%d/length/100000?abort=12345", server.port);
+	assert(download(url, path, 1));
+	struct progress progress;
+	assert(progress_load(path, &progress) == ERR_PROGRESS_NOT_FOUND);
+	unlink(path);
+
+	download_set_resume(false);
+	server_stop(&server);
+}
+
+void test_download(void)
+{
+	test_file_name();
+	test_content_range();
+	test_segment_take();
+	test_writer();
+	test_resume();
+}
+#endif
+
+#ifdef BENCH
+/* Downloads from the local server to a file in /tmp with every writer */
+void bench_download(void)
+{
+	struct server server;
+	int err = server_start(&server);
+	assert(!err);
+	(void)err;
+
+	static const char *writers[] = {"splice", "mmap", "io_uring"};
+	static const size_t sizes[] = {64 << 20, 256 << 20};
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		for (int writer = DOWNLOAD_WRITER_SPLICE; writer <= DOWNLOAD_WRITER_URING; writer++) {
+			char url[128];
+			snprintf(url, sizeof(url), "http://127.0.0.1:%d/length/%zu", server.port, sizes[i]);
+			char path[] = "/tmp/http_client_bench_XXXXXX";
+			int fd = mkstemp(path);
+			assert(fd != -1);
+			close(fd);
+			download_set_writer(writer);
+			size_t iterations = (size_t)(1 << 30) / sizes[i];
+			double start = bench_now();
+			for (size_t n = 0; n < iterations; n++) {
+				err = download(url, path, 1);
+				assert(!err);
+			}
+			double seconds = bench_now() - start;
+			unlink(path);
+			printf("download writer=%s size=%zu GB/s=%.2f\n", writers[writer], sizes[i],
+				iterations * sizes[i] / seconds / 1e9);
+		}
+	}
+	download_set_writer(DOWNLOAD_WRITER_SPLICE);
+	server_stop(&server);
+}
+#endif
@@ -0,0 +1,44 @@
+#pragma once
+#include <stdbool.h>
+
+#define ERR_DOWNLOAD_HTTP_STATUS	-21	/* the server did not return 200 OK */
+#define ERR_DOWNLOAD_OPEN_FAILED	-22
+#define ERR_DOWNLOAD_RANGE_IGNORED	-23	/* the server returned the whole file instead of a range */
+#define ERR_DOWNLOAD_INCOMPLETE		-24	/* some segments could not be downloaded */
+
+/* Downloads the url to the file. "-" means the standard output.
+   With several connections the file is split into segments downloaded in parallel
+   with Range requests. A connection which has finished its segment takes over
+   the second half of the largest segment left. */
+int download(const char *url, const char *path, unsigned int connections);
+
+/* How the body gets to the file. A body of a known length is received right into the
+   mapped pages of the file with DOWNLOAD_WRITER_MMAP, which spares the system call per
+   buffer and the copy through the receive buffer. The data written is flushed to the disk
+   and dropped from the page cache as the download goes.
+   DOWNLOAD_WRITER_URING receives such a body with chains of linked io_uring requests,
+   a receive into a registered buffer followed by the write of it, four MiB per system call.
+   Without io_uring the default writer is used. */
+#define DOWNLOAD_WRITER_SPLICE	0	/* splice() or write(), the default */
+#define DOWNLOAD_WRITER_MMAP	1
+#define DOWNLOAD_WRITER_URING	2
+
+void download_set_writer(int writer);
+
+/* A resumable download saves its progress next to the file (see progress.h) every few
+   seconds and when it fails. The next download to the path asks only for the bytes left,
+   with If-Range so the server returns the whole file if it has changed since. Files of
+   an unknown length and files without ETag or Last-Modified are downloaded from the start. */
+void download_set_resume(bool resume);
+
+/* Returns the last segment of the url path or "index.html" if it is empty.
+   The caller must free() the result. */
+char *download_file_name(const char *url);
+
+#ifdef UNIT_TEST
+void test_download(void);
+#endif
+
+#ifdef BENCH
+void bench_download(void);
+#endif
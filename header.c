@@ -0,0 +1,291 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include "header.h"
+
+static const char *const header_names[HTTP_HDR_COUNT] = {
+	"Accept-Ranges",
+	"Age",
+	"Alt-Svc",
+	"Cache-Control",
+	"Connection",
+	"Content-Disposition",
+	"Content-Encoding",
+	"Content-Language",
+	"Content-Length",
+	"Content-Location",
+	"Content-Range",
+	"Content-Type",
+	"Date",
+	"ETag",
+	"Expires",
+	"Keep-Alive",
+	"Last-Modified",
+	"Link",
+	"Location",
+	"Pragma",
+	"Proxy-Authenticate",
+	"Retry-After",
+	"Server",
+	"Set-Cookie",
+	"Strict-Transport-Security",
+	"Trailer",
+	"Transfer-Encoding",
+	"Upgrade",
+	"Vary",
+	"Via",
+	"WWW-Authenticate",
+	"X-Content-Type-Options",
+};
+
+#define HEADER_PERFECT_HASH_SIZE	64
+
+/* The coefficients are found by a search for the names above to have no collisions.
+   Setting 0x20 lower cases letters and keeps '-' as is, other characters are caught
+   by the name comparison. */
+static inline size_t header_perfect_hash(const char *name, size_t name_len)
+{
+	size_t middle = name_len > 8 ? 8 : name_len - 1;
+	return (name_len + 28 * (name[0] | 0x20) + 26 * (name[name_len - 1] | 0x20) +
+		(name[middle] | 0x20)) % HEADER_PERFECT_HASH_SIZE;
+}
+
+/* Maps the perfect hash to id + 1 */
+static unsigned char header_ids[HEADER_PERFECT_HASH_SIZE];
+static size_t header_name_lens[HTTP_HDR_COUNT];
+static pthread_once_t header_once = PTHREAD_ONCE_INIT;
+
+static void header_init(void)
+{
+	for (int id = 0; id < HTTP_HDR_COUNT; id++) {
+		header_name_lens[id] = strlen(header_names[id]);
+		size_t hash = header_perfect_hash(header_names[id], header_name_lens[id]);
+		assert(header_ids[hash] == 0);
+		header_ids[hash] = id + 1;
+	}
+}
+
+/* Compares len bytes ignoring the case of ASCII letters. Unlike strncasecmp() it does not
+   stop at a zero byte, which the names of the response may have. */
+static bool header_name_equal(const char *a, const char *b, size_t len)
+{
+	for (size_t i = 0; i < len; i++) {
+		char x = a[i] >= 'A' && a[i] <= 'Z' ? a[i] + 32 : a[i];
+		char y = b[i] >= 'A' && b[i] <= 'Z' ? b[i] + 32 : b[i];
+		if (x != y)
+			return false;
+	}
+	return true;
+}
+
+int header_id(const char *name, size_t name_len)
+{
+	if (name_len == 0)
+		return -1;
+	pthread_once(&header_once, header_init);
+	int id = header_ids[header_perfect_hash(name, name_len)] - 1;
+	if (id < 0 || name_len != header_name_lens[id] || !header_name_equal(name, header_names[id], name_len))
+		return -1;
+	return id;
+}
+
+/* tchar of https://tools.ietf.org/html/rfc7230#section-3.2.6 */
+static bool header_is_tchar(unsigned char c)
+{
+	return (c >= '0' && c <= '9') || ((c | 0x20) >= 'a' && (c | 0x20) <= 'z') ||
+		(c && strchr("!#$%&'*+-.^_`|~", c));
+}
+
+const char *header_name(int id)
+{
+	assert(id >= 0 && id < HTTP_HDR_COUNT);
+	return header_names[id];
+}
+
+/* FNV-1a of the lower cased name */
+uint32_t header_hash(const char *name, size_t name_len)
+{
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < name_len; i++) {
+		hash ^= (unsigned char)(name[i] | 0x20);
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+void header_index_init(struct header_index *index)
+{
+	memset(index, 0, sizeof(*index));
+}
+
+int header_field(const char *block, size_t offset, size_t len, struct header_slot *slot)
+{
+	const char *line = block + offset;
+	const char *colon = memchr(line, ':', len);
+	/* The name is a token, so no whitespace is allowed between it and the colon,
+	   see https://tools.ietf.org/html/rfc7230#section-3.2.4 */
+	if (colon == NULL || colon == line)
+		return -2;
+	for (const char *c = line; c < colon; c++) {
+		if (!header_is_tchar(*c))
+			return -2;
+	}
+
+	const char *value = colon + 1;
+	const char *end = line + len;
+	while (value < end && (*value == ' ' || *value == '\t'))
+		value++;
+	slot->name = offset;
+	slot->name_len = colon - line;
+	slot->value = value - block;
+	slot->value_len = end - value;
+	return header_id(line, slot->name_len);
+}
+
+static bool header_slot_is(const struct header_slot *slot, const char *block,
+						   const char *name, size_t name_len)
+{
+	return slot->name_len == name_len && header_name_equal(block + slot->name, name, name_len);
+}
+
+size_t header_other_capacity(size_t nr_other)
+{
+	if (nr_other == 0)
+		return 0;
+	size_t capacity = 4;
+	while (capacity < 2 * nr_other)
+		capacity *= 2;
+	return capacity;
+}
+
+void header_index_other(struct header_index *index, const char *block, struct header_slot *table,
+						const struct header_slot *other, size_t nr_other)
+{
+	size_t capacity = header_other_capacity(nr_other);
+	index->other = capacity ? table : NULL;
+	index->other_mask = capacity ? capacity - 1 : 0;
+	for (size_t i = 0; i < nr_other; i++) {
+		size_t pos = header_hash(block + other[i].name, other[i].name_len) & index->other_mask;
+		for (; table[pos].name; pos = (pos + 1) & index->other_mask) {
+			if (header_slot_is(&table[pos], block, block + other[i].name, other[i].name_len))
+				break;
+		}
+		if (table[pos].name == 0)
+			table[pos] = other[i];
+	}
+}
+
+const struct header_slot *header_find(const struct header_index *index, const char *block,
+									  const char *name, size_t name_len)
+{
+	int id = header_id(name, name_len);
+	if (id >= 0)
+		return index->known[id].name ? &index->known[id] : NULL;
+	if (index->other == NULL)
+		return NULL;
+	size_t pos = header_hash(name, name_len) & index->other_mask;
+	for (; index->other[pos].name; pos = (pos + 1) & index->other_mask) {
+		if (header_slot_is(&index->other[pos], block, name, name_len))
+			return &index->other[pos];
+	}
+	return NULL;
+}
+
+#ifdef UNIT_TEST
+void test_header(void)
+{
+	for (int id = 0; id < HTTP_HDR_COUNT; id++) {
+		const char *name = header_name(id);
+		assert(header_id(name, strlen(name)) == id);
+		char lower[64];
+		size_t len = strlen(name);
+		for (size_t i = 0; i <= len; i++)
+			lower[i] = name[i] >= 'A' && name[i] <= 'Z' ? name[i] + 32 : name[i];
+		assert(header_id(lower, len) == id);
+	}
+	assert(header_id("Content-Lengths", 15) == -1);
+	assert(header_id("Content-Lengt", 13) == -1);
+	assert(header_id("X-Unknown", 9) == -1);
+	assert(header_id("", 0) == -1);
+	/* Zero bytes do not end the names */
+	assert(header_id("Via\0;", 5) == -1);
+	assert(header_id("Content-Length\0", 15) == -1);
+	assert(header_id("Content\0Length", 14) == -1);
+	assert(header_id("Content-Length\0", 14) == HTTP_HDR_CONTENT_LENGTH);
+	assert(header_hash("X-Request-Id", 12) == header_hash("x-request-ID", 12));
+
+	const char block[] = "HTTP/1.1 200 OK\0X-A: 1\0x-b:\t2\0X-A: 3\0Bad\0 : x\0X-C : y";
+	struct header_slot slots[3];
+	assert(header_field(block, 16, 6, &slots[0]) == -1);
+	assert(slots[0].name == 16 && slots[0].name_len == 3 && slots[0].value == 21 && slots[0].value_len == 1);
+	assert(header_field(block, 23, 6, &slots[1]) == -1);
+	assert(header_field(block, 30, 6, &slots[2]) == -1);
+	assert(header_field(block, 37, 3, &slots[0]) == -2);
+	assert(header_field(block, 41, 4, &slots[0]) == -2);
+	assert(header_field(block, 46, 7, &slots[0]) == -2);
+	const char nul[] = "Via\0;: x";
+	assert(header_field(nul, 0, sizeof(nul) - 1, &slots[0]) == -2);
+	assert(header_field("X(A): b", 0, 7, &slots[0]) == -2);
+
+	assert(header_field(block, 16, 6, &slots[0]) == -1);
+	struct header_index index;
+	header_index_init(&index);
+	struct header_slot table[8] = {{0}};
+	assert(header_other_capacity(3) == 8);
+	header_index_other(&index, block, table, slots, 3);
+	assert(header_find(&index, block, "x-a", 3)->value == 21);	/* the first one */
+	assert(header_find(&index, block, "X-B", 3)->value == 28);
+	assert(header_find(&index, block, "X-C", 3) == NULL);
+	assert(header_find(&index, block, "Server", 6) == NULL);
+}
+#endif
+
+#ifdef FUZZ
+#include <stdlib.h>
+
+/* The lines of the data are header fields. Every field must be found, and the slot found
+   must be the first field with its name. */
+void fuzz_header(const unsigned char *data, size_t size)
+{
+	/* The block starts with an empty line as an empty slot is at the offset 0 */
+	char *block = malloc(size + 1);
+	block[0] = 0;
+	memcpy(block + 1, data, size);
+	struct header_slot fields[256], other[256];
+	size_t nr_fields = 0, nr_other = 0;
+	struct header_index index;
+	header_index_init(&index);
+	for (size_t offset = 1; offset < size + 1 && nr_fields < 256; ) {
+		const char *end = memchr(block + offset, '\n', size + 1 - offset);
+		size_t len = end ? (size_t)(end - block) - offset : size + 1 - offset;
+		struct header_slot slot;
+		int id = header_field(block, offset, len, &slot);
+		offset += len + 1;
+		if (id == -2)
+			continue;
+		assert(slot.name_len > 0 && slot.value + slot.value_len <= size + 1);
+		assert(id == header_id(block + slot.name, slot.name_len));
+		fields[nr_fields++] = slot;
+		if (id >= 0 && index.known[id].name == 0)
+			index.known[id] = slot;
+		else if (id < 0)
+			other[nr_other++] = slot;
+	}
+	struct header_slot *table = calloc(header_other_capacity(nr_other) + 1, sizeof(*table));
+	header_index_other(&index, block, table, other, nr_other);
+	for (size_t i = 0; i < nr_fields; i++) {
+		const char *name = block + fields[i].name;
+		const struct header_slot *found = header_find(&index, block, name, fields[i].name_len);
+		assert(found);
+		size_t first = 0;
+		while (fields[first].name_len != fields[i].name_len ||
+			   strncasecmp(block + fields[first].name, name, fields[i].name_len))
+			first++;
+		assert(found->name == fields[first].name);
+	}
+	free(table);
+	free(block);
+}
+#endif
@@ -0,0 +1,91 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/* Index of the response header built while it is parsed. Well-known fields have fixed
+   slots found by a perfect hash of the name, the other fields are in a small open
+   addressing table keyed by a case-insensitive hash. A lookup costs one hash and one
+   name comparison however many fields the response has. */
+
+/* Ids of the well-known header fields */
+#define HTTP_HDR_ACCEPT_RANGES				0
+#define HTTP_HDR_AGE						1
+#define HTTP_HDR_ALT_SVC					2
+#define HTTP_HDR_CACHE_CONTROL				3
+#define HTTP_HDR_CONNECTION					4
+#define HTTP_HDR_CONTENT_DISPOSITION		5
+#define HTTP_HDR_CONTENT_ENCODING			6
+#define HTTP_HDR_CONTENT_LANGUAGE			7
+#define HTTP_HDR_CONTENT_LENGTH				8
+#define HTTP_HDR_CONTENT_LOCATION			9
+#define HTTP_HDR_CONTENT_RANGE				10
+#define HTTP_HDR_CONTENT_TYPE				11
+#define HTTP_HDR_DATE						12
+#define HTTP_HDR_ETAG						13
+#define HTTP_HDR_EXPIRES					14
+#define HTTP_HDR_KEEP_ALIVE					15
+#define HTTP_HDR_LAST_MODIFIED				16
+#define HTTP_HDR_LINK						17
+#define HTTP_HDR_LOCATION					18
+#define HTTP_HDR_PRAGMA						19
+#define HTTP_HDR_PROXY_AUTHENTICATE			20
+#define HTTP_HDR_RETRY_AFTER				21
+#define HTTP_HDR_SERVER						22
+#define HTTP_HDR_SET_COOKIE					23
+#define HTTP_HDR_STRICT_TRANSPORT_SECURITY	24
+#define HTTP_HDR_TRAILER					25
+#define HTTP_HDR_TRANSFER_ENCODING			26
+#define HTTP_HDR_UPGRADE					27
+#define HTTP_HDR_VARY						28
+#define HTTP_HDR_VIA						29
+#define HTTP_HDR_WWW_AUTHENTICATE			30
+#define HTTP_HDR_X_CONTENT_TYPE_OPTIONS		31
+#define HTTP_HDR_COUNT						32
+
+/* Offsets in the header block. name == 0 means an empty slot,
+   the status line is at the offset 0. */
+struct header_slot {
+	uint32_t	name;
+	uint32_t	name_len;
+	uint32_t	value;
+	uint32_t	value_len;
+};
+
+struct header_index {
+	struct header_slot	known[HTTP_HDR_COUNT];	/* the first field of the name */
+	struct header_slot	*other;		/* in the header block */
+	size_t				other_mask;	/* capacity - 1 */
+};
+
+/* Returns the id of the well-known header name or -1 */
+int header_id(const char *name, size_t name_len);
+
+/* Returns the canonical spelling of the name, e.g. for requests */
+const char *header_name(int id);
+
+/* Case-insensitive hash of the name for the table of the other fields */
+uint32_t header_hash(const char *name, size_t name_len);
+
+void header_index_init(struct header_index *index);
+
+/* Parses "name: value" at the offset of the block into the slot. Returns the id of the
+   well-known name, -1 for another name or -2 if the line is not a header field. */
+int header_field(const char *block, size_t offset, size_t len, struct header_slot *slot);
+
+/* Puts the fields with other names to the table, which has the capacity returned by
+   header_other_capacity() and is zeroed */
+size_t header_other_capacity(size_t nr_other);
+void header_index_other(struct header_index *index, const char *block, struct header_slot *table,
+						const struct header_slot *other, size_t nr_other);
+
+/* Returns the slot of the first field with the name or NULL */
+const struct header_slot *header_find(const struct header_index *index, const char *block,
+									  const char *name, size_t name_len);
+
+#ifdef UNIT_TEST
+void test_header(void);
+#endif
+
+#ifdef FUZZ
+void fuzz_header(const unsigned char *data, size_t size);
+#endif
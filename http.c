@@ -1,169 +1,137 @@
+#define _GNU_SOURCE /* splice() */
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
-#include <stdarg.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 #include "buffer.h"
+#include "connect.h"
+#include "dns.h"
 #include "http.h"
+#include "http_internal.h"
+#include "inflate.h"
 #include "log.h"
+#include "parser.h"
+#include "pool.h"
+#include "punycode.h"
+#include "scan.h"
+#include "server.h"
+#include "slab.h"
 #include "url.h"
 
-static int url_connect(struct url *url, int *sock)
+/* splice() can not be used with the descriptor, internal to http_response_splice() */
+#define ERR_HTTP_SPLICE_UNSUPPORTED	-19
+
+int url_resolve(const struct url *url, struct dns_entry **entry)
 {
 	assert(url->host && url->host_len);
-	char *host = strndup(url->host, url->host_len);
 
 	/* TODO: Add HTTPS support */
 	assert(url->scheme_len == 4);
 	assert(!strncasecmp(url->scheme, "http", 4));
 
-	struct addrinfo hints = {
-		.ai_flags = AI_ALL | AI_ADDRCONFIG,
-		//.ai_flags = AI_ALL,
-		.ai_family = AF_UNSPEC, /* support both IPv4 and IPv6 */
-		.ai_socktype = SOCK_STREAM
-	};
-
-	struct addrinfo *addrinfo = NULL;
-	int err = getaddrinfo(host, "http", &hints, &addrinfo);
-	/*
-	if (err == EAI_NODATA) {
-		err = punycode(&host);
-		assert(!err);
-		err = getaddrinfo(host, "http", &hints, &addrinfo);
-	}
-	*/
-	if (err)
-		error("getaddrinfo(host='%s') failed: %s err=%d", host, gai_strerror(err), err);
-	free(host);
-	if (err)
-		return err;
-
-	for (struct addrinfo *cur = addrinfo; cur != NULL; cur = cur->ai_next) {
-		int s = socket(cur->ai_family, cur->ai_socktype, cur->ai_protocol);
-		if (s == -1) {
-			error("socket() failed: %s, err=%d", strerror(errno), errno);
-			continue;
-		}
-		if (connect(s, cur->ai_addr, cur->ai_addrlen)) {
-			error("connect() failed: %s, err=%d", strerror(errno), errno);
-			close(s);
-			continue;
-		}
-		info("connect successfull");
-		*sock = s;
-		break;
-	}
+	char port[8];
+	int port_len = snprintf(port, sizeof(port), "%u", url->port_number);
+	return dns_resolve(url->host, url->host_len, port, port_len, entry);
+}
 
-	freeaddrinfo(addrinfo);
+static int url_connect(struct url *url, int *sock)
+{
+	struct dns_entry *dns = NULL;
+	int err = url_resolve(url, &dns);
+	if (!err)
+		err = connect_race(dns->addrinfo, sock);
+	dns_release(dns);
 	return err;
 }
 
+/* Header lines of a request, "Name: value\r\n" one after another in the order they are added.
+   The buffer is the arena of the request header: the lines are only appended, they are
+   copied to the request as is and freed all at once. */
 struct http_headers {
-	size_t	capacity;
-	size_t	nr_headers;
-	char	**headers;
+	struct buffer	lines;	/* allocated with the first line */
+	bool			host;	/* Host is among the lines */
+	bool			content_length;
+	bool			accept_encoding;
+	int				err;	/* of the first invalid header passed by the caller */
 };
 
-static void http_headers_init(struct http_headers *headers, size_t capacity)
-{
-	assert(capacity > 0);
-	headers->headers = calloc(capacity, sizeof(char*));
-	assert(headers->headers);
-	headers->capacity = capacity;
-	headers->nr_headers = 0;
-}
-
 static void http_headers_term(struct http_headers *headers)
 {
-	free(headers->headers);
-	memset(headers, 0, sizeof(headers));
+	if (headers->lines.data)
+		buffer_term(&headers->lines);
+	memset(headers, 0, sizeof(*headers));
 }
 
-static void http_headers_grow(struct http_headers *headers)
+static void http_headers_append(struct http_headers *headers, const char *name, size_t name_len,
+								const char *value, size_t value_len)
 {
-	size_t old_capacity = headers->capacity;
-	size_t new_capacity = old_capacity * 2;
-	headers->headers = realloc(headers->headers, new_capacity * sizeof(char*));
-	assert(headers->headers);
-	memset(headers->headers + old_capacity * sizeof(char*), 0,
-		(new_capacity - old_capacity) * sizeof(char*));
-	headers->capacity = new_capacity;
+	if (headers->lines.data == NULL)
+		buffer_init_slab(&headers->lines, 1 << 9);
+	buffer_reserve(&headers->lines, name_len + 2 + value_len + 2);
+	buffer_append(&headers->lines, name, name_len);
+	buffer_append(&headers->lines, ": ", 2);
+	buffer_append(&headers->lines, value, value_len);
+	buffer_append(&headers->lines, "\r\n", 2);
+
+	if (name_len == 4 && !strncasecmp(name, "Host", 4))
+		headers->host = true;
+	else if (name_len == 14 && !strncasecmp(name, "Content-Length", 14))
+		headers->content_length = true;
+	else if (name_len == 15 && !strncasecmp(name, "Accept-Encoding", 15))
+		headers->accept_encoding = true;
 }
 
-static const char *http_header_parse(const char *header, size_t *name_len)
+/* Adds the "Name: value" header. A header without a name or with a line break, which
+   would inject lines into the request, is not added and fails the request. */
+static void http_header_add(struct http_headers *headers, const char *header)
 {
-	assert(!isspace(*header));
-
 	const char *colon = strchr(header, ':');
-	assert(colon);
-	*name_len = colon - header;
-
-	const char *value = colon + 1;
+	size_t name_len = colon ? colon - header : 0;
+	if (name_len == 0 || strcspn(header, " \t\r\n") < name_len || header[strcspn(header, "\r\n")]) {
+		error("Invalid request header: '%s'", header);
+		if (headers->err == 0)
+			headers->err = ERR_HTTP_INVALID_HEADER;
+		return;
+	}
 
 	/* Skip optional leading whitespace according to
 	   https://tools.ietf.org/html/rfc7230#section-3.2 */
-	while (isspace(*value))
+	const char *value = colon + 1;
+	while (*value == ' ' || *value == '\t')
 		value++;
-
-	return value;
-}
-
-static const char *http_header_is(const char *header, const char *name, size_t name_len)
-{
-	size_t name_len_2 = 0;
-	const char *value = http_header_parse(header, &name_len_2);
-	if (name_len != name_len_2)
-		return NULL;
-	if (strncasecmp(header, name, name_len))
-		return NULL;
-	return value;
-}
-
-static const char *http_header_get(struct http_headers *headers, const char *name, size_t name_len)
-{
-	for (size_t i = 0; i < headers->nr_headers; i++) {
-		const char *value = http_header_is(headers->headers[i], name, name_len);
-		if (value)
-			return value;
-	}
-	return NULL;
-}
-
-#ifndef NDEBUG
-static bool http_header_present(struct http_headers *headers, const char *header)
-{
-	size_t name_len = 0;
-	http_header_parse(header, &name_len);
-	return http_header_get(headers, header, name_len) != NULL;
+	http_headers_append(headers, header, name_len, value, strlen(value));
 }
-#endif
 
-static void http_header_add(struct http_headers *headers, const char *header)
+static void http_header_set(struct http_headers *headers, const char *name,
+							const char *value, size_t value_size)
 {
-	if (headers->nr_headers == headers->capacity)
-		http_headers_grow(headers);
-	assert(!http_header_present(headers, header));
-	headers->headers[headers->nr_headers] = strdup(header);
-	headers->nr_headers++;
+	http_headers_append(headers, name, strlen(name), value, value_size);
 }
 
-static void http_header_set(struct http_headers *headers, const char *name,
-							const char *value, size_t value_size)
+/* Adds Host with the ASCII form of an internationalized host name, the brackets of
+   an IPv6 address and the port given in the url */
+static void http_header_set_host(struct http_headers *headers, const struct url *url)
 {
-	if (headers->nr_headers == headers->capacity)
-		http_headers_grow(headers);
-	assert(http_header_get(headers, name, strlen(name)) == NULL);
-	headers->headers[headers->nr_headers] =
-		aprintf("%s: %.*s", name, (unsigned int)value_size, value);
-	headers->nr_headers++;
+	char *ascii = NULL;
+	if (punycode_host(url->host, url->host_len, &ascii))
+		ascii = NULL;
+	char *host = aprintf("%s%.*s%s%s%.*s", url->ipv6 ? "[" : "",
+		ascii ? (int)strlen(ascii) : (int)url->host_len, ascii ? ascii : url->host,
+		url->ipv6 ? "]" : "", url->port_len ? ":" : "", (int)url->port_len, url->port ? url->port : "");
+	http_header_set(headers, "Host", host, strlen(host));
+	free(host);
+	free(ascii);
 }
 
 static void http_headers_set(struct http_headers *h, const char **headers)
@@ -178,8 +146,10 @@ struct http_request {
 	const char			*method;
 	const char			*url;
 	struct url			parsed_url;
+	struct http_template	*template;	/* the fixed part of the header or NULL */
 	struct http_headers	headers;
 	const char			*body;
+	size_t				body_len;
 	int					socket;
 };
 
@@ -187,10 +157,25 @@ static void http_request_init(struct http_request *request, const char *method)
 {
 	memset(request, 0, sizeof(*request));
 	request->method = method;
-	http_headers_init(&request->headers, 100);
 	request->socket = -1;
 }
 
+/* The request goes to the origin of the template, the path replaces its path unless it is NULL */
+static void http_request_init_template(struct http_request *request, struct http_template *template,
+									   const char *path, size_t path_len)
+{
+	http_request_init(request, template->method);
+	request->template = template;
+	request->url = template->url;
+	request->parsed_url = template->parsed_url;
+	if (path) {
+		request->parsed_url.path = path;
+		request->parsed_url.path_len = path_len;
+		request->parsed_url.query = NULL;
+		request->parsed_url.query_len = 0;
+	}
+}
+
 static void http_request_term(struct http_request *request)
 {
 	if (request->socket != -1) {
@@ -200,94 +185,258 @@ static void http_request_term(struct http_request *request)
 	http_headers_term(&request->headers);
 }
 
-static void http_response_init(struct http_response *response)
+void http_response_init(struct http_response *response)
 {
 	memset(response, 0, sizeof(*response));
 	response->socket = -1;
 	response->buf_size = 1 << 20;
+	response->pipe[0] = response->pipe[1] = -1;
+	parser_init(&response->parser, PARSER_DEFAULT_MAX_HEADER_SIZE);
+}
+
+/* Bytes of the receive buffers of all responses, limited by the budget if it is set */
+static struct {
+	pthread_mutex_t	lock;
+	pthread_cond_t	released;
+	size_t	budget;
+	size_t	used;
+} recv_budget = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.released = PTHREAD_COND_INITIALIZER,
+};
+
+void http_set_recv_budget(size_t bytes)
+{
+	pthread_mutex_lock(&recv_budget.lock);
+	recv_budget.budget = bytes;
+	pthread_cond_broadcast(&recv_budget.released);
+	pthread_mutex_unlock(&recv_budget.lock);
+}
+
+size_t http_recv_budget_used(void)
+{
+	pthread_mutex_lock(&recv_budget.lock);
+	size_t used = recv_budget.used;
+	pthread_mutex_unlock(&recv_budget.lock);
+	return used;
+}
+
+/* Takes size bytes of the budget. If they are not available, returns false or, if wait is
+   set, waits for other buffers to be released. The wait is limited, as they may belong to
+   the same thread: the bytes are taken over the budget after HTTP_RECV_BUDGET_WAIT_MS. */
+static bool recv_budget_charge(size_t size, bool wait)
+{
+	pthread_mutex_lock(&recv_budget.lock);
+	bool available = !recv_budget.budget || recv_budget.used + size <= recv_budget.budget;
+	if (!available && wait) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += HTTP_RECV_BUDGET_WAIT_MS / 1000;
+		deadline.tv_nsec += (HTTP_RECV_BUDGET_WAIT_MS % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		while (recv_budget.budget && recv_budget.used + size > recv_budget.budget &&
+			   !pthread_cond_timedwait(&recv_budget.released, &recv_budget.lock, &deadline));
+		available = true;
+	}
+	if (available)
+		recv_budget.used += size;
+	pthread_mutex_unlock(&recv_budget.lock);
+	return available;
+}
+
+static void recv_budget_release(size_t size)
+{
+	pthread_mutex_lock(&recv_budget.lock);
+	assert(recv_budget.used >= size);
+	recv_budget.used -= size;
+	pthread_cond_broadcast(&recv_budget.released);
+	pthread_mutex_unlock(&recv_budget.lock);
+}
+
+void http_recv_budget_take(size_t size)
+{
+	pthread_mutex_lock(&recv_budget.lock);
+	recv_budget.used += size;
+	pthread_mutex_unlock(&recv_budget.lock);
+}
+
+void http_recv_budget_release(size_t size)
+{
+	recv_budget_release(size);
+}
+
+/* Replaces the receive buffer with one of capacity bytes, keeping the unread data */
+static void http_response_resize_buf(struct http_response *response, size_t capacity)
+{
+	assert(response->data_size <= capacity);
+	char *buf = slab_alloc_ring(capacity);
+	bool ring = buf != NULL;
+	if (!buf)
+		buf = slab_alloc(capacity);
+	if (response->data_size)
+		memcpy(buf, response->data, response->data_size);
+	if (response->buf_ring)
+		slab_free_ring(response->buf, response->buf_capacity);
+	else
+		slab_free(response->buf);
+	response->data = response->buf = buf;
+	response->buf_ring = ring;
+	response->buf_capacity = capacity;
+}
+
+/* The buffer starts small, enough for most headers and small bodies, see do_recv() */
+static void http_response_alloc_buf(struct http_response *response)
+{
+	assert(response->buf == NULL);
+	size_t capacity = response->buf_size < HTTP_RECV_BUF_INITIAL ? response->buf_size : HTTP_RECV_BUF_INITIAL;
+	/* The response waits in the socket until the budget allows to receive it */
+	recv_budget_charge(capacity, true);
+	http_response_resize_buf(response, capacity);
+	response->buf_filled = false;
+}
+
+static void http_response_free_buf(struct http_response *response)
+{
+	if (response->buf) {
+		recv_budget_release(response->buf_capacity);
+		if (response->buf_ring)
+			slab_free_ring(response->buf, response->buf_capacity);
+		else
+			slab_free(response->buf);
+	}
+	response->buf_ring = false;
+	response->data = response->buf = NULL;
+	response->buf_capacity = 0;
+}
+
+/* Grows the buffer up to buf_size if the last recv() filled it and the body does not fit it,
+   i.e. the data comes faster than the buffer takes it. Over the budget the buffer stays as
+   it is, the smaller reads let the socket fill up and TCP flow control slow the server down.
+   The buffer grows anyway if it is full of unread data, which can not be consumed without
+   more, e.g. a long line. */
+static void http_response_grow_buf(struct http_response *response)
+{
+	size_t capacity = response->buf_capacity;
+	if (capacity >= response->buf_size)
+		return;
+	bool full = response->data_size == capacity;
+	bool fits = response->body_type == HTTP_BODY_LENGTH && response->body_left <= capacity;
+	if (!full && (!response->buf_filled || fits))
+		return;
+	/* A full socket holds more than the buffer, so it grows by more than twice. The size of
+	   the body or of the current chunk tells how much more is coming. */
+	size_t new_capacity = capacity * 4;
+	if (response->body_type == HTTP_BODY_LENGTH || response->body_type == HTTP_BODY_CHUNKED) {
+		while (new_capacity < response->body_left && new_capacity < response->buf_size)
+			new_capacity *= 2;
+	}
+	if (new_capacity > response->buf_size)
+		new_capacity = response->buf_size;
+	if (!recv_budget_charge(new_capacity - capacity, full))
+		return;
+	http_response_resize_buf(response, new_capacity);
+}
+
+/* Shrinks the buffer grown by the previous response on the connection */
+static void http_response_shrink_buf(struct http_response *response)
+{
+	if (response->buf == NULL || response->buf_capacity <= HTTP_RECV_BUF_INITIAL ||
+		response->data_size > HTTP_RECV_BUF_INITIAL)
+		return;
+	size_t released = response->buf_capacity - HTTP_RECV_BUF_INITIAL;
+	http_response_resize_buf(response, HTTP_RECV_BUF_INITIAL);
+	recv_budget_release(released);
+	response->buf_filled = false;
 }
 
 static int do_recv(struct http_response *response)
 {
+	http_response_grow_buf(response);
 	size_t data_size = response->data_size;
-	if (data_size) {
+	if (data_size == 0) {
+		response->data = response->buf;
+	} else if (response->buf_ring) {
+		/* The unread data stays in place, the free space follows it in the mirror */
+		if (response->data >= response->buf + response->buf_capacity)
+			response->data -= response->buf_capacity;
+	} else if (response->data != response->buf) {
 		memmove(response->buf, response->data, data_size);
 		response->data = response->buf;
-	} else {
-		response->data = NULL;
 	}
-	ssize_t result = recv(response->socket, response->buf + data_size, response->buf_size - data_size, 0);
+	size_t space = response->buf_capacity - data_size;
+	ssize_t result = recv(response->socket, response->data + data_size, space, 0);
 	if (result < 0) {
 		response->recv_errno = errno;
 		error("recv() failed: %s errno=%d", strerror(response->recv_errno), response->recv_errno);
 		return ERR_HTTP_RECV_FAILED;
 	}
-	assert(result <= response->buf_size - data_size);
+	assert(result <= space);
 	response->data_size += result;
-	response->data = response->buf;
+	response->buf_filled = result == space;
 	return 0;
 }
 
 const char *http_response_get_header(struct http_response *response, const char *name)
 {
+	if (response->header_buf == NULL)
+		return NULL;
 	size_t name_len = strlen(name);
-	const char **header = response->headers;
-	for (; *header; header++) {
-		const char *value = http_header_is(*header, name, name_len);
-		if (value)
-			return value;
-	}
-	return NULL;
+	const struct header_slot *slot = header_find(&response->header_index, response->header_buf,
+												 name, name_len);
+	if (slot)
+		return response->header_buf + slot->value;
+	if (response->trailer_buf == NULL)
+		return NULL;
+	slot = header_find(&response->trailer_index, response->trailer_buf, name, name_len);
+	return slot ? response->trailer_buf + slot->value : NULL;
 }
 
-static char *memstr(const char *mem, size_t size, const char *str)
+const char *http_response_header(struct http_response *response, int id)
 {
-	while (1) {
-		char *ptr = memchr(mem, *str, size);
-		if (ptr == NULL)
-			return NULL;
-		size_t str_size = strlen(str);
-		if (mem + size < ptr + str_size)
-			return NULL;
-		if (!memcmp(ptr, str, str_size))
-			return ptr;
-		mem = ptr + 1;
-	}
+	assert(id >= 0 && id < HTTP_HDR_COUNT);
+	const struct header_slot *slot = &response->header_index.known[id];
+	if (response->header_buf && slot->name)
+		return response->header_buf + slot->value;
+	slot = &response->trailer_index.known[id];
+	if (response->trailer_buf && slot->name)
+		return response->trailer_buf + slot->value;
+	return NULL;
 }
 
 int http_response_readline(struct http_response *response, const char **line)
 {
-	for (int attempt = 1; ; attempt++) {
-		char *eol = memstr(response->data, response->data_size, "\r\n");
+	size_t scanned = 0;	/* the bytes without CRLF are not scanned again */
+	while (1) {
+		char *eol = (char*)scan_crlf(response->data + scanned, response->data_size - scanned);
 		if (eol) {
 			*eol = 0;
 			char *prev_data = response->data;
 			response->data = eol + 2;
-			response->data_size -= response->data - prev_data; 
+			response->data_size -= response->data - prev_data;
 			*line = prev_data;
 			return 0;
 		}
-
-		if (attempt == 2) {
-			error("http_response_readline() failed: Could not find CRLF in %u bytes", response->data_size);
-			return ERR_HTTP_INVALID_RESPONSE;
+		if (response->data_size == response->buf_size) {
+			error("http_response_readline() failed: Could not find CRLF in %zu bytes", response->data_size);
+			return ERR_HTTP_BUFFER_TOO_SMALL;
 		}
+		/* The CR of the CRLF may be the last byte */
+		scanned = response->data_size ? response->data_size - 1 : 0;
 
+		size_t data_size = response->data_size;
 		int err = do_recv(response);
 		if (err)
 			return err;
+		if (response->data_size == data_size) {
+			error("http_response_readline() failed: Connection closed before CRLF");
+			return ERR_HTTP_INVALID_RESPONSE;
+		}
 	}
 }
 
-static inline size_t xdigit_to_number(char xdigit)
-{
-	if (xdigit <= '9')
-		return xdigit - '0';
-	if (isupper(xdigit))
-		return xdigit - 'A' + 10;
-	return xdigit - 'a' + 10;
-}
-
 int http_response_get_chunk_size(struct http_response *response, size_t *chunk_size)
 {
 	const char *chunk_header = NULL;
@@ -296,8 +445,18 @@ int http_response_get_chunk_size(struct http_response *response, size_t *chunk_s
 		return err;
 
 	size_t size = 0;
-	for (const char *ch = chunk_header; isxdigit(*ch); ch++)
-		size = (size << 4) | xdigit_to_number(*ch);  
+	const char *ch = chunk_header;
+	for (; isxdigit((unsigned char)*ch); ch++) {
+		if (size >> (sizeof(size) * 8 - 4)) {
+			error("Chunk size is too large: '%s'", chunk_header);
+			return ERR_HTTP_INVALID_RESPONSE;
+		}
+		size = (size << 4) | (isdigit((unsigned char)*ch) ? *ch - '0' : tolower((unsigned char)*ch) - 'a' + 10);
+	}
+	if (ch == chunk_header) {
+		error("Invalid chunk size: '%s'", chunk_header);
+		return ERR_HTTP_INVALID_RESPONSE;
+	}
 
 	/* Ignoring chunk extensions. See https://tools.ietf.org/html/rfc7230#section-4 */
 
@@ -305,249 +464,735 @@ int http_response_get_chunk_size(struct http_response *response, size_t *chunk_s
 	return 0;
 }
 
-int http_response_read(struct http_response *response, void *buf, size_t buf_len, size_t *data_size)
+/* Decodes the chunks received after the current one in place. Their data is moved back over
+   the framing to continue the data before it, so it makes one run of body bytes at data.
+   The parser is given the whole run at once. The bytes after the body, e.g. of the next
+   pipelined response, follow the run. */
+static void http_response_dechunk(struct http_response *response)
 {
-	char *dest = buf;
-	size_t received = 0;
-	int err = 0;
-	while (received < buf_len) {
-		if (response->data == response->buf + response->buf_size && (err = do_recv(response)))
-			break;
-		if (response->data_size == 0)
+	char *run_end = response->data + response->body_run;
+	const char *src = run_end;
+	const char *end = response->data + response->data_size;
+	while (src < end && response->parser.state != PARSER_DONE) {
+		uint64_t available = parser_body_available(response);
+		if (available) {
+			size_t size = available < (uint64_t)(end - src) ? available : (size_t)(end - src);
+			if (run_end != src)
+				memmove(run_end, src, size);
+			parser_body_consumed(response, size);
+			run_end += size;
+			src += size;
+			continue;
+		}
+		size_t consumed = 0;
+		int err = parser_parse(response, src, end - src, &consumed);
+		src += consumed;
+		if (err) {
+			/* Reported after the run is read */
+			response->body_err = err;
 			break;
-		size_t remainder = buf_len - received;
-		size_t block_size = remainder < response->data_size ? remainder : response->data_size;
-		memcpy(dest, response->data, block_size);
-		dest += block_size;
-		received += block_size;
-		response->data += block_size;
-		response->data_size -= block_size;
+		}
 	}
-	*data_size = received;
-	return err;
+	if (run_end != src)
+		memmove(run_end, src, end - src);
+	response->data_size -= src - run_end;
+	response->body_run = run_end - response->data;
 }
 
-void http_response_close(struct http_response *response)
+/* Returns number of body bytes which may be read before the next framing element,
+   feeding the parser with the framing. Zero means the end of the body. */
+static int http_response_body_available(struct http_response *response, uint64_t *available)
 {
-	if (response->socket != -1) {
-		close(response->socket);
-		response->socket = -1;
+	while (1) {
+		if (response->body_run == 0 && response->body_err == 0 && response->data_size &&
+			response->body_type == HTTP_BODY_CHUNKED)
+			http_response_dechunk(response);
+		if (response->body_run) {
+			*available = response->body_run;
+			return 0;
+		}
+		if (response->body_err)
+			return response->body_err;
+		*available = parser_body_available(response);
+		if (*available || response->parser.state == PARSER_DONE)
+			return 0;
+		if (response->data_size == 0) {
+			int err = do_recv(response);
+			if (err)
+				return err;
+			if (response->data_size == 0)
+				return parser_eof(response);
+		}
+		size_t consumed = 0;
+		int err = parser_parse(response, response->data, response->data_size, &consumed);
+		response->data += consumed;
+		response->data_size -= consumed;
+		if (err)
+			return err;
 	}
+}
 
-	free(response->header_buf);
-	response->header_buf = NULL;
-	response->status_line = NULL;
-	response->headers = NULL;
-
-	free(response->buf);
-	response->data = response->buf = NULL;
-	response->data_size = response->buf_size = 0;
+/* Returns a view of the body as received, see http_response_peek() */
+static int http_response_peek_raw(struct http_response *response, const char **data, size_t *size)
+{
+	*data = NULL;
+	*size = 0;
+	uint64_t available = 0;
+	while (1) {
+		int err = http_response_body_available(response, &available);
+		if (err || available == 0)
+			return err;
+		if (response->data_size)
+			break;
+		if ((err = do_recv(response)))
+			return err;
+		if (response->data_size == 0)
+			return parser_eof(response);	/* the server closed the connection */
+	}
+	*data = response->data;
+	*size = available < response->data_size ? available : response->data_size;
+	return 0;
 }
 
-static void http_printf(struct buffer *buf, const char *format, ...)
+static void http_response_consume_raw(struct http_response *response, size_t size)
 {
-	va_list ap;
-	va_start(ap, format);
-	int size = vsnprintf(NULL, 0, format, ap);
-	assert(size >= 0);
-	buffer_reserve(buf, size);
-	size_t space_len = buffer_space_len(buf);
-	size = vsnprintf(buf->space, space_len, format, ap);
-	assert(size >= 0);
-	size_t usize = size;
-	assert(usize < space_len);
-	buf->space += usize;
-	va_end(ap);
+	assert(size <= response->data_size);
+	response->data += size;
+	response->data_size -= size;
+	if (response->body_run) {
+		assert(size <= response->body_run);
+		response->body_run -= size;
+	} else {
+		parser_body_consumed(response, size);
+	}
 }
 
-static int do_send(int s, const void *data, size_t len)
+/* Decodes the received body into the window of the decoder until it has output */
+static int http_response_peek_decoded(struct http_response *response, const char **data, size_t *size)
 {
-	ssize_t sent = send(s, data, len, 0);
-	if (sent == -1) {
-		error("send() failed: %s errno=%d", strerror(errno), errno);
-		return ERR_HTTP_SEND_FAILED;
+	struct inflate *inflate = response->inflate;
+	while ((*size = inflate_peek(inflate, data)) == 0) {
+		const char *raw = NULL;
+		size_t raw_size = 0;
+		int err = http_response_peek_raw(response, &raw, &raw_size);
+		if (err)
+			return err;
+		if (raw_size == 0) {
+			/* An empty body is not encoded, e.g. of a redirect */
+			return inflate->total_in ? inflate_eof(inflate) : 0;
+		}
+		size_t consumed = 0;
+		err = inflate_decode(inflate, raw, raw_size, &consumed);
+		http_response_consume_raw(response, consumed);
+		if (err)
+			return err;
 	}
 	return 0;
 }
 
-static int http_send(struct http_request *request)
+int http_response_peek(struct http_response *response, const char **data, size_t *size)
 {
-	assert(request->socket != -1);
-	struct buffer buf;
-	buffer_init(&buf, 1 << 12);
-
-	http_printf(&buf, "%s %.*s HTTP/1.1\r\n", request->method,
-		(unsigned int)request->parsed_url.path_len, request->parsed_url.path);
-	for (size_t i = 0; i < request->headers.nr_headers; i++)
-		http_printf(&buf, "%s\r\n", request->headers.headers[i]);
-	http_printf(&buf, "\r\n");
+	if (response->coding != HTTP_CODING_IDENTITY)
+		return http_response_peek_decoded(response, data, size);
+	return http_response_peek_raw(response, data, size);
+}
 
-	int err = do_send(request->socket, buf.data, buffer_data_len(&buf));
-	buffer_term(&buf);
-	if (err)
-		return err;
-	if (request->body)
-		err = do_send(request->socket, request->body, strlen(request->body));
-	return err;
+void http_response_consume(struct http_response *response, size_t size)
+{
+	if (response->coding != HTTP_CODING_IDENTITY)
+		inflate_consume(response->inflate, size);
+	else
+		http_response_consume_raw(response, size);
 }
 
-static int parse_status_line(struct http_response *response, char *first_line, const char **next)
+int http_response_on_data(struct http_response *response, http_data_callback callback, void *arg)
 {
-	char *eol = strstr(first_line, "\r\n");
-	if (eol) {
-		*eol = 0;
-		*next = eol + 2;
+	while (1) {
+		const char *data = NULL;
+		size_t size = 0;
+		int err = http_response_peek(response, &data, &size);
+		if (err || size == 0)
+			return err;
+		http_response_consume(response, size);
+		if ((err = callback(arg, data, size)))
+			return err;
 	}
+}
 
-	/* Skip HTTP version */
-	char *space = strchr(first_line, ' ');
-	if (space == NULL) {
-		error("Invalid status line: '%s'", first_line);
-		return ERR_HTTP_INVALID_RESPONSE;
+int http_response_read(struct http_response *response, void *buf, size_t buf_len, size_t *data_size)
+{
+	char *dest = buf;
+	size_t received = 0;
+	int err = 0;
+	while (received < buf_len) {
+		/* A read larger than the receive buffer takes the data right from the socket */
+		if (response->coding == HTTP_CODING_IDENTITY && response->data_size == 0 &&
+			buf_len - received >= response->buf_capacity) {
+			uint64_t available = 0;
+			if ((err = http_response_body_available(response, &available)) || available == 0)
+				break;
+			if (response->data_size == 0) {
+				size_t size = available < buf_len - received ? available : buf_len - received;
+				ssize_t result = recv(response->socket, dest + received, size, 0);
+				if (result < 0) {
+					response->recv_errno = errno;
+					error("recv() failed: %s errno=%d", strerror(errno), errno);
+					err = ERR_HTTP_RECV_FAILED;
+					break;
+				}
+				if (result == 0) {
+					err = parser_eof(response);	/* the server closed the connection */
+					break;
+				}
+				parser_body_consumed(response, result);
+				received += result;
+				continue;
+			}
+		}
+		const char *data = NULL;
+		size_t size = 0;
+		if ((err = http_response_peek(response, &data, &size)) || size == 0)
+			break;
+		if (size > buf_len - received)
+			size = buf_len - received;
+		memcpy(dest + received, data, size);
+		http_response_consume(response, size);
+		received += size;
 	}
-	*space = 0;
-	response->status_line = space + 1;
+	*data_size = received;
+	return err;
+}
 
-	unsigned int http_major = 0;
-	unsigned int http_minor = 0;
-	if (2 != sscanf(first_line, "HTTP/%u.%u", &http_major, &http_minor)) {
-		error("Invalid HTTP version: '%s'", first_line);
-		return ERR_HTTP_INVALID_RESPONSE;
+int write_all(int fd, off_t *offset, const char *data, size_t size)
+{
+	while (size) {
+		ssize_t written = offset ? pwrite(fd, data, size, *offset) : write(fd, data, size);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			error("write() failed: %s errno=%d", strerror(errno), errno);
+			return ERR_HTTP_WRITE_FAILED;
+		}
+		if (offset)
+			*offset += written;
+		data += written;
+		size -= written;
 	}
-	response->http_version_major = http_major;
-	response->http_version_minor = http_minor;
+	return 0;
+}
 
-	if (1 != sscanf(response->status_line, "%u", &response->status_code)) {
-		error("Invalid status code: Status line: '%s'", response->status_line);
-		return ERR_HTTP_INVALID_RESPONSE;
+static int pipe_init(struct http_response *response)
+{
+	if (response->pipe[0] != -1)
+		return 0;
+	if (pipe(response->pipe)) {
+		error("pipe() failed: %s errno=%d", strerror(errno), errno);
+		return -1;
 	}
-
+	/* The default 64 KiB pipe turns every MiB into 16 splice() pairs.
+	   A failure here is harmless, the pipe still works with its default size. */
+	fcntl(response->pipe[1], F_SETPIPE_SZ, 1 << 20);
 	return 0;
 }
 
-static size_t count_headers(const char *response_header)
+static void pipe_term(struct http_response *response)
 {
-	size_t nr_headers = 0;
-	const char *line = response_header;
-	while (1) {
-		char *eol = strstr(line, "\r\n");
-		if (eol == NULL) {
-			/* Last header must not be empty.
-			   The caller must terminate last header with the '\0' character */
-			assert(*line);
-			return nr_headers;
+	for (int i = 0; i < 2; i++) {
+		if (response->pipe[i] != -1) {
+			close(response->pipe[i]);
+			response->pipe[i] = -1;
 		}
-		nr_headers++;
-		line = eol + 2;
 	}
 }
 
-static void remove_trailing_space(const char *header, char *eol)
+/* Moves data left in the pipe after a failed splice() to the file through the receive buffer */
+static int pipe_drain(struct http_response *response, int fd, off_t *offset, size_t size)
 {
-	while (eol > header) {
-		eol--;
-		if (!isspace(*eol))
-			break;
-		*eol = 0;
+	assert(response->data_size == 0);
+	while (size) {
+		size_t block_size = size < response->buf_capacity ? size : response->buf_capacity;
+		ssize_t result = read(response->pipe[0], response->buf, block_size);
+		if (result <= 0) {
+			if (result < 0 && errno == EINTR)
+				continue;
+			error("read() from pipe failed: %s errno=%d", strerror(errno), errno);
+			return ERR_HTTP_WRITE_FAILED;
+		}
+		int err = write_all(fd, offset, response->buf, result);
+		if (err)
+			return err;
+		size -= result;
 	}
+	return 0;
 }
 
-static int parse_headers(struct http_response *response, const char *headers, size_t nr_headers)
+/* Moves up to size bytes from the socket to the file without copying them to user space.
+   Sets *moved to 0 on end of stream. Returns ERR_HTTP_SPLICE_UNSUPPORTED if either
+   descriptor does not support splice() and nothing was moved. */
+static int splice_body(struct http_response *response, int fd, off_t *offset, size_t size, size_t *moved)
 {
-	if (headers == NULL) {
-		assert(nr_headers == 0);
-		response->headers[0] = NULL;
-		return 0;
+	*moved = 0;
+	if (response->splice_unsupported || pipe_init(response))
+		return ERR_HTTP_SPLICE_UNSUPPORTED;
+
+	ssize_t in = 0;
+	do {
+		in = splice(response->socket, NULL, response->pipe[1], NULL, size, SPLICE_F_MOVE | SPLICE_F_MORE);
+	} while (in < 0 && errno == EINTR);
+	if (in < 0) {
+		if (errno == EINVAL) {
+			response->splice_unsupported = true;
+			return ERR_HTTP_SPLICE_UNSUPPORTED;
+		}
+		response->recv_errno = errno;
+		error("splice() from socket failed: %s errno=%d", strerror(errno), errno);
+		return ERR_HTTP_RECV_FAILED;
 	}
 
-	size_t i = 0;
-	const char *header = headers;
-	while (1) {
-		response->headers[i++] = header;
-		char *eol = strstr(header, "\r\n");
-		if (eol == NULL) {
-			remove_trailing_space(header, (char*)header + strlen(header));
+	size_t left = in;
+	while (left) {
+		ssize_t out = splice(response->pipe[0], NULL, fd, offset, left, SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (out < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EINVAL) {
+				error("splice() to file failed: %s errno=%d", strerror(errno), errno);
+				return ERR_HTTP_WRITE_FAILED;
+			}
+			/* E.g. the file is opened with O_APPEND */
+			response->splice_unsupported = true;
+			int err = pipe_drain(response, fd, offset, left);
+			if (err)
+				return err;
 			break;
 		}
-		*eol = 0;
-
-		/* Remove optional trailing whitespace according to
-		   https://tools.ietf.org/html/rfc7230#section-3.2 */
-		remove_trailing_space(header, eol);
-
-		header = eol + 2;
+		left -= out;
 	}
-	assert(i == nr_headers);
-	response->headers[i] = NULL;
+	*moved = in;
 	return 0;
 }
 
-static int parse_header(struct http_response *response)
+/* Writes the decoded body, which is only in user space */
+static int http_response_write_decoded(struct http_response *response, int fd, off_t *offset,
+									   size_t size, size_t *written)
 {
-	const char *empty_line = memstr(response->data, response->data_size, "\r\n\r\n");
-	if (empty_line == NULL)
-		return ERR_HTTP_BUFFER_TOO_SMALL; /* too many HTTP headers */
-
-	size_t header_size = empty_line - response->data;
-	response->data[header_size] = 0;
-
-	size_t nr_headers = count_headers(response->data);
-
-	response->header_buf = malloc((nr_headers + 1) * sizeof(char*) + header_size + 1);
-	response->headers = (const char**)response->header_buf;
-	memset(response->headers, 0, (nr_headers + 1) * sizeof(char*));
-
-	char *header = response->header_buf + (nr_headers + 1) * sizeof(char*);
-	memcpy(header, response->data, header_size);
-	header[header_size] = 0;
-	response->data += header_size + 4;
+	size_t total = 0;
+	int err = 0;
+	while (total < size) {
+		const char *data = NULL;
+		size_t block_size = 0;
+		if ((err = http_response_peek_decoded(response, &data, &block_size)) || block_size == 0)
+			break;
+		if (block_size > size - total)
+			block_size = size - total;
+		if ((err = write_all(fd, offset, data, block_size)))
+			break;
+		inflate_consume(response->inflate, block_size);
+		total += block_size;
+	}
+	*written = total;
+	return err;
+}
 
-	const char *headers = NULL;
-	int err = parse_status_line(response, header, &headers);
-	if (err)
-		return err;
+int http_response_splice(struct http_response *response, int fd, off_t *offset, size_t size, size_t *written)
+{
+	if (response->coding != HTTP_CODING_IDENTITY)
+		return http_response_write_decoded(response, fd, offset, size, written);
+	size_t total = 0;
+	int err = 0;
+	while (total < size) {
+		uint64_t available = 0;
+		if ((err = http_response_body_available(response, &available)) || available == 0)
+			break;
+		size_t block_size = size - total;
+		if (block_size > available)
+			block_size = available;
+
+		if (response->data_size == 0) {
+			size_t moved = 0;
+			err = splice_body(response, fd, offset, block_size, &moved);
+			if (err == ERR_HTTP_SPLICE_UNSUPPORTED)
+				err = do_recv(response);
+			else if (!err && moved == 0)
+				response->data = NULL;
+			if (err)
+				break;
+			if (moved) {
+				parser_body_consumed(response, moved);
+				total += moved;
+				continue;
+			}
+			if (response->data_size == 0) {
+				err = parser_eof(response);	/* the server closed the connection */
+				break;
+			}
+		}
 
-	return parse_headers(response, headers, nr_headers);
+		if (block_size > response->data_size)
+			block_size = response->data_size;
+		if ((err = write_all(fd, offset, response->data, block_size)))
+			break;
+		http_response_consume_raw(response, block_size);
+		total += block_size;
+	}
+	*written = total;
+	return err;
 }
 
-static int http_recv(struct http_response *response)
+/* Checks if the comma separated list contains the token, e.g. "keep-alive, Upgrade" */
+static bool http_header_has_token(const char *value, const char *token)
 {
-	assert(response->socket != -1);
-	assert(response->buf == NULL);
-	assert(response->buf_size > 0);
-	response->buf = malloc(response->buf_size);
-	assert(response->data_size == 0);
-	int err = do_recv(response);
-	if (err)
-		return err;
-	return parse_header(response);
+	size_t token_len = strlen(token);
+	while (*value) {
+		while (*value == ',' || isspace((unsigned char)*value))
+			value++;
+		size_t len = strcspn(value, ", \t");
+		if (len == token_len && !strncasecmp(value, token, len))
+			return true;
+		value += len;
+	}
+	return false;
 }
 
-/* Performs HTTP request-response transaction */
-static int http_request_response(struct http_request *request, struct http_response *response)
+/* Checks if the server keeps the connection open after the response,
+   see https://tools.ietf.org/html/rfc7230#section-6.3 */
+static bool http_response_keep_alive(struct http_response *response)
 {
-	http_response_init(response);
-	int err = url_parse(request->url, &request->parsed_url);
-	if (err)
-		return err;
-	if (request->parsed_url.host_len == 0) {
-		error("Could not connect to the url: '%s'. Host is empty.", request->url);
-		return ERR_HTTP_URL_HAS_NO_HOST;
-	}
-	if (!http_header_get(&request->headers, "Host", 4)) {
-		http_header_set(&request->headers, "Host",
-			request->parsed_url.host, request->parsed_url.host_len);
-	}
-	if ((err = url_connect(&request->parsed_url, &request->socket)))
-		return err;
-	if ((err = http_send(request)))
-		return err;
-	response->socket = request->socket;
-	request->socket = -1;
-	return http_recv(response);
+	if (response->body_type == HTTP_BODY_CLOSE)
+		return false;
+	const char *connection = http_response_header(response, HTTP_HDR_CONNECTION);
+	if (response->http_version_major == 1 && response->http_version_minor == 0)
+		return connection && http_header_has_token(connection, "keep-alive");
+	return connection == NULL || !http_header_has_token(connection, "close");
 }
 
-int http_get(const char *url, const char **headers, struct http_response *response)
+static bool http_response_reusable(struct http_response *response)
+{
+	if (response->origin == NULL || response->data_size || response->recv_errno)
+		return false;
+	if (response->parser.state != PARSER_DONE || response->body_type == HTTP_BODY_CLOSE)
+		return false;
+	return http_response_keep_alive(response);
+}
+
+void http_response_close(struct http_response *response)
+{
+	if (response->socket != -1) {
+		if (http_response_reusable(response))
+			pool_put(response->origin, response->socket);
+		else
+			close(response->socket);
+		response->socket = -1;
+	}
+	pipe_term(response);
+	parser_term(&response->parser);
+	free(response->origin);
+	response->origin = NULL;
+
+	slab_free(response->header_buf);
+	response->header_buf = NULL;
+	header_index_init(&response->header_index);
+	slab_free(response->trailer_buf);
+	response->trailer_buf = NULL;
+	header_index_init(&response->trailer_index);
+	response->status_line = NULL;
+	response->headers = NULL;
+
+	if (response->inflate) {
+		inflate_term(response->inflate);
+		free(response->inflate);
+		response->inflate = NULL;
+	}
+	response->coding = HTTP_CODING_IDENTITY;
+
+	http_response_free_buf(response);
+	response->data_size = response->buf_size = 0;
+}
+
+/* Sends all the pieces resuming after partial writes. A typical request goes out
+   in one system call and, with the data ready at once, in one TCP segment. */
+static int do_sendv(int s, struct iovec *iov, size_t iovcnt)
+{
+	while (iovcnt) {
+		struct msghdr msg = {
+			.msg_iov = iov,
+			.msg_iovlen = iovcnt,
+		};
+		/* A reused connection may have been closed by the server, which must not raise SIGPIPE */
+		ssize_t sent = sendmsg(s, &msg, MSG_NOSIGNAL);
+		if (sent == -1) {
+			if (errno == EINTR)
+				continue;
+			error("send() failed: %s errno=%d", strerror(errno), errno);
+			return ERR_HTTP_SEND_FAILED;
+		}
+		for (; iovcnt && (size_t)sent >= iov->iov_len; iov++, iovcnt--)
+			sent -= iov->iov_len;
+		if (iovcnt) {
+			iov->iov_base = (char*)iov->iov_base + sent;
+			iov->iov_len -= sent;
+		}
+	}
+	return 0;
+}
+
+static int do_send(int s, const void *data, size_t len)
+{
+	struct iovec iov = {
+		.iov_base = (void*)data,
+		.iov_len = len,
+	};
+	return do_sendv(s, &iov, 1);
+}
+
+/* Formats the request line and the header computing the exact size first */
+static void http_request_format_head(struct http_request *request, struct buffer *buf)
+{
+	static const char version[] = " HTTP/1.1\r\n";
+	const char *target;
+	size_t target_len = url_target(&request->parsed_url, &target);
+	/* An empty path is sent as "/" */
+	bool slash = target_len == 0 || target[0] == '?';
+	size_t method_len = strlen(request->method);
+
+	size_t fixed_len = request->template ? buffer_data_len(&request->template->head) : 0;
+	size_t lines_len = buffer_data_len(&request->headers.lines);
+
+	size_t size = method_len + 2 + target_len + sizeof(version) - 1 + fixed_len + lines_len + 2;
+	buffer_reserve(buf, size);
+
+	buffer_append(buf, request->method, method_len);
+	buffer_append(buf, " /", slash ? 2 : 1);
+	if (target_len)
+		buffer_append(buf, target, target_len);
+	buffer_append(buf, version, sizeof(version) - 1);
+	if (fixed_len)
+		buffer_append(buf, request->template->head.data, fixed_len);
+	if (lines_len)
+		buffer_append(buf, request->headers.lines.data, lines_len);
+	buffer_append(buf, "\r\n", 2);
+}
+
+static int http_send(struct http_request *request)
+{
+	assert(request->socket != -1);
+	struct buffer buf;
+	buffer_init_slab(&buf, 1 << 12);
+	http_request_format_head(request, &buf);
+
+	struct iovec iov[2] = {
+		{ .iov_base = buf.data, .iov_len = buffer_data_len(&buf) },
+		{ .iov_base = (void*)request->body, .iov_len = request->body_len },
+	};
+	int err = do_sendv(request->socket, iov, request->body ? 2 : 1);
+	buffer_term(&buf);
+	return err;
+}
+
+/* Sets up decoding of the body if the request has asked for a coding the response has.
+   The decoder and its window are reused by the responses on the connection. */
+static void http_response_set_coding(struct http_response *response)
+{
+	const char *encoding = http_response_header(response, HTTP_HDR_CONTENT_ENCODING);
+	if (!response->accept_encoding || encoding == NULL || response->body_type == HTTP_BODY_NONE)
+		return;
+	int format = 0;
+	if (!strcasecmp(encoding, "gzip") || !strcasecmp(encoding, "x-gzip")) {
+		response->coding = HTTP_CODING_GZIP;
+		format = INFLATE_GZIP;
+	} else if (!strcasecmp(encoding, "deflate")) {
+		response->coding = HTTP_CODING_DEFLATE;
+		format = INFLATE_DEFLATE;
+	} else {
+		return;	/* e.g. br or a list of codings */
+	}
+	if (response->inflate == NULL) {
+		response->inflate = malloc(sizeof(*response->inflate));
+		assert(response->inflate);
+		inflate_init(response->inflate, format);
+	} else {
+		inflate_reset(response->inflate, format);
+	}
+}
+
+/* Receives and parses the header of the response. The buffer may already contain
+   its beginning, e.g. left after the previous response on the connection. */
+static int http_response_recv_header(struct http_response *response)
+{
+	while (!parser_header_received(&response->parser)) {
+		if (response->data_size == 0) {
+			int err = do_recv(response);
+			/* A reset instead of the response means a closed idle connection as well */
+			if (err && !(response->recv_errno == ECONNRESET && parser_empty(&response->parser)))
+				return err;
+			if (response->data_size == 0)
+				return parser_eof(response);
+		}
+		size_t consumed = 0;
+		int err = parser_parse(response, response->data, response->data_size, &consumed);
+		response->data += consumed;
+		response->data_size -= consumed;
+		if (err)
+			return err;
+	}
+	http_response_set_coding(response);
+	return 0;
+}
+
+static int http_recv(struct http_response *response)
+{
+	assert(response->socket != -1);
+	assert(response->buf_size > 0);
+	http_response_alloc_buf(response);
+	assert(response->data_size == 0);
+	return http_response_recv_header(response);
+}
+
+/* Reads the rest of the body, leaving the data after it in the buffer */
+static int http_response_skip_body(struct http_response *response)
+{
+	while (1) {
+		const char *data = NULL;
+		size_t size = 0;
+		int err = http_response_peek_raw(response, &data, &size);
+		if (err || size == 0)
+			return err;
+		http_response_consume_raw(response, size);
+	}
+}
+
+/* Prepares the response for the next one on the same connection */
+static void http_response_reset(struct http_response *response)
+{
+	slab_free(response->header_buf);
+	response->header_buf = NULL;
+	header_index_init(&response->header_index);
+	slab_free(response->trailer_buf);
+	response->trailer_buf = NULL;
+	header_index_init(&response->trailer_index);
+	response->status_line = NULL;
+	response->headers = NULL;
+	response->status_code = 0;
+	response->http_version_major = response->http_version_minor = 0;
+	response->body_type = HTTP_BODY_UNKNOWN;
+	response->body_left = 0;
+	response->body_chunks = 0;
+	response->body_done = false;
+	response->body_run = 0;
+	response->body_err = 0;
+	response->coding = HTTP_CODING_IDENTITY;
+	parser_reset(&response->parser);
+	http_response_shrink_buf(response);
+}
+
+char *http_origin(const struct url *url)
+{
+	char *origin = aprintf(url->ipv6 ? "%.*s://[%.*s]:%u" : "%.*s://%.*s:%u",
+		(unsigned int)url->scheme_len, url->scheme,
+		(unsigned int)url->host_len, url->host, url->port_number);
+	for (char *ch = origin; *ch; ch++)
+		*ch = tolower((unsigned char)*ch);
+	return origin;
+}
+
+static int http_exchange(struct http_request *request, struct http_response *response)
+{
+	int err = http_send(request);
+	if (err)
+		return err;
+	response->socket = request->socket;
+	request->socket = -1;
+	response->accept_encoding = request->headers.accept_encoding ||
+		(request->template && request->template->accept_encoding);
+	return http_recv(response);
+}
+
+static int http_url_parse(const char *url, struct url *parsed_url)
+{
+	int err = url_parse(url, parsed_url);
+	if (err)
+		return err;
+	if (parsed_url->host_len == 0) {
+		error("Could not connect to the url: '%s'. Host is empty.", url);
+		return ERR_HTTP_URL_HAS_NO_HOST;
+	}
+	return 0;
+}
+
+/* Parses the url and adds the headers the request can not go without.
+   The url of a template is parsed and its Host is there already. */
+static int http_request_prepare(struct http_request *request)
+{
+	if (request->headers.err)
+		return request->headers.err;
+	if (request->template == NULL) {
+		int err = http_url_parse(request->url, &request->parsed_url);
+		if (err)
+			return err;
+		if (!request->headers.host)
+			http_header_set_host(&request->headers, &request->parsed_url);
+	}
+	bool content_length = request->headers.content_length ||
+		(request->template && request->template->content_length);
+	request->body_len = request->body ? strlen(request->body) : 0;
+	if (request->body && !content_length) {
+		char length[24];
+		int length_len = snprintf(length, sizeof(length), "%zu", request->body_len);
+		http_header_set(&request->headers, "Content-Length", length, length_len);
+	}
+	return 0;
+}
+
+int http_request_format(const char *method, const char *url, const char **headers,
+						const char *body, struct url *parsed_url, struct buffer *buf)
+{
+	struct http_request request;
+	http_request_init(&request, method);
+	request.url = url;
+	request.body = body;
+	http_headers_set(&request.headers, headers);
+	int err = http_request_prepare(&request);
+	if (!err) {
+		http_request_format_head(&request, buf);
+		*parsed_url = request.parsed_url;
+	}
+	http_request_term(&request);
+	return err;
+}
+
+/* Performs HTTP request-response transaction */
+static int http_request_response(struct http_request *request, struct http_response *response)
+{
+	http_response_init(response);
+	int err = http_request_prepare(request);
+	if (err)
+		return err;
+
+	char *origin = request->template ? strdup(request->template->origin) :
+		http_origin(&request->parsed_url);
+	request->socket = pool_get(origin);
+	if (request->socket != -1) {
+		err = http_exchange(request, response);
+		if (err != ERR_HTTP_SEND_FAILED && err != ERR_HTTP_CONNECTION_CLOSED)
+			goto out;
+		/* The server has closed the idle connection while the request was on its way */
+		info("Retrying the request on a new connection");
+		if (request->socket != -1) {
+			/* http_send() has failed, the socket is not the response's yet */
+			close(request->socket);
+			request->socket = -1;
+		}
+		http_response_close(response);
+		http_response_init(response);
+	}
+	if (!(err = url_connect(&request->parsed_url, &request->socket)))
+		err = http_exchange(request, response);
+out:
+	response->origin = origin;
+	return err;
+}
+
+int http_get(const char *url, const char **headers, struct http_response *response)
 {
 	struct http_request request;
 	http_request_init(&request, "GET");
@@ -558,6 +1203,197 @@ int http_get(const char *url, const char **headers, struct http_response *respon
 	return err;
 }
 
+int http_template_init(struct http_template *template, const char *method, const char *url,
+					   const char **headers)
+{
+	memset(template, 0, sizeof(*template));
+	template->method = strdup(method);
+	template->url = strdup(url);
+	assert(template->method && template->url);
+	int err = http_url_parse(template->url, &template->parsed_url);
+	if (err) {
+		http_template_term(template);
+		return err;
+	}
+	template->origin = http_origin(&template->parsed_url);
+
+	struct http_headers fixed;
+	memset(&fixed, 0, sizeof(fixed));
+	http_headers_set(&fixed, headers);
+	if ((err = fixed.err)) {
+		http_headers_term(&fixed);
+		http_template_term(template);
+		return err;
+	}
+	if (!fixed.host)
+		http_header_set_host(&fixed, &template->parsed_url);
+	template->head = fixed.lines;
+	template->content_length = fixed.content_length;
+	template->accept_encoding = fixed.accept_encoding;
+	return 0;
+}
+
+void http_template_term(struct http_template *template)
+{
+	free(template->method);
+	free(template->url);
+	free(template->origin);
+	if (template->head.data)
+		buffer_term(&template->head);
+	memset(template, 0, sizeof(*template));
+}
+
+int http_template_request(struct http_template *template, const char *path, const char **headers,
+						  const char *body, struct http_response *response)
+{
+	struct http_request request;
+	http_request_init_template(&request, template, path, path ? strlen(path) : 0);
+	request.body = body;
+	http_headers_set(&request.headers, headers);
+	int err = http_request_response(&request, response);
+	http_request_term(&request);
+	return err;
+}
+
+struct http_pipeline {
+	const char				**urls;
+	size_t					nr_urls;
+	struct http_template	*template;	/* of the first url */
+	size_t					depth;
+	http_pipeline_callback	callback;
+	void					*arg;
+	size_t					done;	/* number of answered requests */
+	bool					keep_alive;	/* the last response keeps the connection */
+};
+
+/* Sends the requests not answered yet keeping up to depth of them in flight and reads
+   the responses until the connection can not be used any more */
+static int http_pipeline_connection(struct http_pipeline *p, struct http_response *response)
+{
+	size_t sent = p->done;
+	bool send_failed = false;
+	http_response_alloc_buf(response);
+	while (p->done < p->nr_urls) {
+		if (!send_failed && sent < p->nr_urls && sent - p->done < p->depth) {
+			struct buffer buf;
+			buffer_init_slab(&buf, 1 << 12);
+			size_t batch = sent;
+			int err = 0;
+			for (; !err && batch < p->nr_urls && batch - p->done < p->depth; batch++) {
+				/* The urls differ only in the path, which is checked already */
+				struct url parsed_url;
+				err = url_parse(p->urls[batch], &parsed_url);
+				assert(!err);
+				struct http_request request;
+				const char *target;
+				size_t target_len = url_target(&parsed_url, &target);
+				http_request_init_template(&request, p->template, target ? target : "", target_len);
+				if (!(err = http_request_prepare(&request)))
+					http_request_format_head(&request, &buf);
+				http_request_term(&request);
+			}
+			if (!err)
+				err = do_send(response->socket, buf.data, buffer_data_len(&buf));
+			buffer_term(&buf);
+			if (!err)
+				sent = batch;
+			else if (sent == p->done)
+				return err;
+			else
+				send_failed = true; /* the responses in flight may still arrive */
+		}
+		if (send_failed && sent == p->done)
+			return ERR_HTTP_SEND_FAILED;
+
+		int err = http_response_recv_header(response);
+		if (err)
+			return err;
+		p->callback(p->arg, p->done++, 0, response);
+		if ((err = http_response_skip_body(response)))
+			return err;
+		p->keep_alive = http_response_keep_alive(response);
+		http_response_reset(response);
+		if (!p->keep_alive)
+			return 0;
+	}
+	return 0;
+}
+
+int http_pipeline(const char **urls, size_t nr_urls, const char **headers, size_t depth,
+				  http_pipeline_callback callback, void *arg)
+{
+	assert(depth > 0);
+	if (nr_urls == 0)
+		return 0;
+
+	struct http_template template;
+	int err = http_template_init(&template, "GET", urls[0], headers);
+	if (err)
+		return err;
+	const char *origin = template.origin;
+	for (size_t i = 1; i < nr_urls; i++) {
+		struct url other;
+		char *other_origin = NULL;
+		if ((err = url_parse(urls[i], &other)) || other.host_len == 0 ||
+			strcmp(origin, (other_origin = http_origin(&other)))) {
+			error("Pipelined url '%s' has another origin than '%s'", urls[i], origin);
+			err = ERR_HTTP_NOT_SAME_ORIGIN;
+		}
+		free(other_origin);
+		if (err) {
+			http_template_term(&template);
+			return err;
+		}
+	}
+
+	struct http_pipeline p = {
+		.urls = urls,
+		.nr_urls = nr_urls,
+		.template = &template,
+		.depth = depth,
+		.callback = callback,
+		.arg = arg,
+	};
+	bool fresh = false;	/* do not take the connection from the pool */
+	while (p.done < nr_urls) {
+		size_t done = p.done;
+		p.keep_alive = false;
+		struct http_response response;
+		http_response_init(&response);
+		response.accept_encoding = template.accept_encoding;
+		response.socket = fresh ? -1 : pool_get(origin);
+		bool pooled = response.socket != -1;
+		err = response.socket == -1 ? url_connect(&template.parsed_url, &response.socket) : 0;
+		if (!err)
+			err = http_pipeline_connection(&p, &response);
+		/* Requests in flight make the connection unusable for anyone else */
+		if (!err && p.done == nr_urls && p.keep_alive && response.data_size == 0) {
+			pool_put(origin, response.socket);
+			response.socket = -1;
+		}
+		http_response_close(&response);
+
+		if (p.done > done) {
+			/* GET is idempotent, the requests left unanswered are sent again */
+			fresh = false;
+			continue;
+		}
+		/* The server may have closed the pooled connection while it was idle */
+		bool retry_on_new_connection = pooled &&
+			(err == ERR_HTTP_CONNECTION_CLOSED || err == ERR_HTTP_SEND_FAILED);
+		if (retry_on_new_connection) {
+			fresh = true;
+			continue;
+		}
+		/* A new connection which does not answer the request reports it, another one
+		   would not do better */
+		callback(arg, p.done++, err ? err : ERR_HTTP_CONNECTION_CLOSED, NULL);
+		fresh = false;
+	}
+	http_template_term(&template);
+	return 0;
+}
+
 int http_post(const char *url, const char **headers, const char *body, struct http_response *response)
 {
 	struct http_request request;
@@ -571,6 +1407,9 @@ int http_post(const char *url, const char **headers, const char *body, struct ht
 }
 
 #ifdef UNIT_TEST
+#include <pthread.h>
+#include <time.h>
+
 static void test_strndup(void)
 {
 	const char *null = NULL;
@@ -601,124 +1440,801 @@ static void test_tools(void)
 	test_aprintf();
 }
 
-static void test_count_headers(void)
+/* Receives the response from a socket pair fed with the text */
+static int test_recv_buf(const char *text, size_t len, size_t buf_size, struct http_response *response)
 {
-	static const char response_header1[] = 
-		"HTTP/1.1 200 OK";
-	assert(0 == count_headers(response_header1));
-
-	static const char response_header2[] = 
-		"HTTP/1.1 200 OK\r\n"
-		"Server: nginx";
-	assert(1 == count_headers(response_header2));
+	int sv[2];
+	assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+	assert(write(sv[1], text, len) == len);
+	close(sv[1]);
+	http_response_init(response);
+	response->socket = sv[0];
+	response->buf_size = buf_size;
+	return http_recv(response);
+}
 
-	static const char response_header3[] = 
-		"HTTP/1.1 200 OK\r\n"
-		"Server: nginx\r\n"
-		"Date: Sun, 03 Feb 2019 09:35:44 GMT";
-	assert(2 == count_headers(response_header3));
+static int test_recv(const char *text, struct http_response *response)
+{
+	return test_recv_buf(text, strlen(text), 1 << 20, response);
 }
 
-static int test_parse_status_line_one(const char *first_line, int major_version, int minor_version)
+static void test_splice_one(const char *text, const char *body, int expected_err)
 {
 	struct http_response response;
-	http_response_init(&response);
+	assert(!test_recv(text, &response));
 
-	char *header = strdup(first_line);
-	const char *headers = NULL;
-	int err = parse_status_line(&response, header, &headers);
-	free(header);
+	char path[] = "/tmp/http_client_test_XXXXXX";
+	int fd = mkstemp(path);
+	assert(fd != -1);
+	unlink(path);
+
+	off_t offset = 0;
+	size_t written = 0;
+	int err = http_response_splice(&response, fd, &offset, SIZE_MAX, &written);
+	assert(err == expected_err);
 	if (!err) {
-		assert(response.http_version_major == major_version);
-		assert(response.http_version_minor == minor_version);
+		size_t body_len = strlen(body);
+		assert(written == body_len && offset == body_len);
+		char buf[256];
+		assert(pread(fd, buf, sizeof(buf), 0) == body_len);
+		assert(!memcmp(buf, body, body_len));
 	}
+	close(fd);
 	http_response_close(&response);
-	return err;
 }
 
-static void test_parse_status_line(void)
+static void test_splice(void)
+{
+	test_splice_one("HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nhello, ignored", "hello", 0);
+	test_splice_one("HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+		"5\r\nhello\r\n7;ext=1\r\n, world\r\n0\r\nTrailer: x\r\n\r\n", "hello, world", 0);
+	test_splice_one("HTTP/1.0 200 OK\r\n\r\nuntil close", "until close", 0);
+	test_splice_one("HTTP/1.1 204 No Content\r\n\r\n", "", 0);
+	test_splice_one("HTTP/1.1 200 OK\r\nContent-Length: 10\r\n\r\nshort", NULL, ERR_HTTP_BODY_TRUNCATED);
+}
+
+static int test_append(void *arg, const char *data, size_t size)
+{
+	buffer_append(arg, data, size);
+	return 0;
+}
+
+static void test_body_one(const char *text, const char *body, int expected_err)
+{
+	struct http_response response;
+	assert(!test_recv(text, &response));
+	const char *data = NULL;
+	size_t size = 0;
+	assert(!http_response_peek(&response, &data, &size));
+	/* The view points into the receive buffer */
+	if (size) {
+		assert(data >= response.buf && data + size <= response.buf + response.buf_capacity);
+		assert(*data == *body);
+		http_response_consume(&response, 1);
+	}
+	struct buffer buf;
+	buffer_init(&buf, 16);
+	int err = http_response_on_data(&response, test_append, &buf);
+	assert(err == expected_err);
+	if (!err) {
+		assert(buffer_data_len(&buf) + (size != 0) == strlen(body));
+		assert(!memcmp(buf.data, body + (size != 0), buffer_data_len(&buf)));
+		assert(!http_response_peek(&response, &data, &size) && size == 0);
+	}
+	buffer_term(&buf);
+	http_response_close(&response);
+
+	assert(!test_recv(text, &response));
+	char copy[256];
+	err = http_response_read(&response, copy, sizeof(copy), &size);
+	assert(err == expected_err);
+	if (!err)
+		assert(size == strlen(body) && !memcmp(copy, body, size));
+	http_response_close(&response);
+}
+
+static void test_body(void)
+{
+	test_body_one("HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nhello, ignored", "hello", 0);
+	test_body_one("HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+		"5\r\nhello\r\n7;ext=1\r\n, world\r\n0\r\nTrailer: x\r\n\r\n", "hello, world", 0);
+	test_body_one("HTTP/1.0 200 OK\r\n\r\nuntil close", "until close", 0);
+	test_body_one("HTTP/1.1 204 No Content\r\n\r\n", "", 0);
+	test_body_one("HTTP/1.1 200 OK\r\nContent-Length: 10\r\n\r\nshort", "short", ERR_HTTP_BODY_TRUNCATED);
+}
+
+/* The chunks received together make one view, the trailers are found as headers */
+static void test_dechunk(void)
+{
+	struct http_response response;
+	assert(!test_recv("HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+		"5\r\nhello\r\n7;ext=1\r\n, world\r\n1\r\n!\r\n0\r\nChecksum: abc \r\nETag: \"x\"\r\n\r\n"
+		"HTTP/1.1 204 No Content\r\n\r\n", &response));
+	assert(http_response_get_header(&response, "Checksum") == NULL);
+	const char *data = NULL;
+	size_t size = 0;
+	assert(!http_response_peek(&response, &data, &size));
+	assert(size == 13 && !memcmp(data, "hello, world!", 13));
+	http_response_consume(&response, 6);
+	assert(!http_response_peek(&response, &data, &size));
+	assert(size == 7 && !memcmp(data, " world!", 7));
+	http_response_consume(&response, 7);
+	assert(!http_response_peek(&response, &data, &size) && size == 0);
+	assert(!strcmp(http_response_get_header(&response, "checksum"), "abc"));
+	assert(!strcmp(http_response_header(&response, HTTP_HDR_ETAG), "\"x\""));
+	assert(!strcmp(http_response_header(&response, HTTP_HDR_TRANSFER_ENCODING), "chunked"));
+	/* The next response follows the body */
+	assert(response.data_size == 27 && !memcmp(response.data, "HTTP/1.1 204", 12));
+	http_response_close(&response);
+
+	/* The error in the framing comes after the data before it */
+	assert(!test_recv("HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+		"5\r\nhello\r\nxx\r\n", &response));
+	assert(!http_response_peek(&response, &data, &size));
+	assert(size == 5 && !memcmp(data, "hello", 5));
+	http_response_consume(&response, 5);
+	assert(http_response_peek(&response, &data, &size) == ERR_HTTP_INVALID_RESPONSE);
+	http_response_close(&response);
+}
+
+/* "Hello, world! " 20 times compressed by gzip, zlib and bare deflate */
+#define TEST_DEFLATE	"\xf3\x48\xcd\xc9\xc9\xd7\x51\x28\xcf\x2f\xca\x49\x51\x54\xf0\x18\xe5\x41\x79\x00"
+#define TEST_GZIP		"\x1f\x8b\x08\x00\x00\x00\x00\x00\x02\x03" TEST_DEFLATE "\xbb\x03\xc3\xf5\x18\x01\x00\x00"
+#define TEST_ZLIB		"\x78\xda" TEST_DEFLATE "\x53\xa1\x5d\x35"
+
+/* Receives the response with the encoded body, decoding is asked for unless raw */
+static void test_recv_encoded(const char *header, const char *body, size_t body_len, bool raw,
+							  struct http_response *response)
+{
+	struct buffer text;
+	buffer_init(&text, 1 << 10);
+	test_append(&text, header, strlen(header));
+	test_append(&text, body, body_len);
+	assert(!test_recv_buf(text.data, buffer_data_len(&text), 1 << 20, response));
+	buffer_term(&text);
+	response->accept_encoding = !raw;
+	http_response_set_coding(response);
+}
+
+static void test_decode_one(const char *header, const char *body, size_t body_len, int expected_err)
+{
+	char expected[281] = {0}, copy[512];
+	for (int i = 0; i < 20; i++)
+		memcpy(expected + 14 * i, "Hello, world! ", 14);
+
+	struct http_response response;
+	test_recv_encoded(header, body, body_len, false, &response);
+	size_t size = 0;
+	int err = http_response_read(&response, copy, sizeof(copy), &size);
+	assert(err == expected_err);
+	if (!err)
+		assert(size == 280 && !memcmp(copy, expected, size));
+	http_response_close(&response);
+
+	test_recv_encoded(header, body, body_len, false, &response);
+	char path[] = "/tmp/http_client_test_XXXXXX";
+	int fd = mkstemp(path);
+	assert(fd != -1);
+	unlink(path);
+	off_t offset = 0;
+	err = http_response_splice(&response, fd, &offset, SIZE_MAX, &size);
+	assert(err == expected_err);
+	if (!err)
+		assert(size == 280 && pread(fd, copy, sizeof(copy), 0) == 280 && !memcmp(copy, expected, 280));
+	close(fd);
+	http_response_close(&response);
+}
+
+static void test_decode(void)
+{
+	test_decode_one("HTTP/1.1 200 OK\r\nContent-Encoding: gzip\r\nContent-Length: 38\r\n\r\n",
+		TEST_GZIP, 38, 0);
+	test_decode_one("HTTP/1.1 200 OK\r\nContent-Encoding: deflate\r\nContent-Length: 26\r\n\r\n",
+		TEST_ZLIB, 26, 0);
+	test_decode_one("HTTP/1.1 200 OK\r\nContent-Encoding: Deflate\r\nContent-Length: 20\r\n\r\n",
+		TEST_DEFLATE, 20, 0);
+	test_decode_one("HTTP/1.1 200 OK\r\nContent-Encoding: x-gzip\r\nTransfer-Encoding: chunked\r\n\r\n",
+		"5\r\n\x1f\x8b\x08\x00\x00\r\n21\r\n\x00\x00\x00\x02\x03" TEST_DEFLATE "\xbb\x03\xc3\xf5\x18\x01\x00\x00\r\n"
+		"0\r\n\r\n", 54, 0);
+	test_decode_one("HTTP/1.1 200 OK\r\nContent-Encoding: gzip\r\nContent-Length: 38\r\n\r\n",
+		"\x1f\x8b\x08\x00\x00\x00\x00\x00\x02\x03" TEST_DEFLATE "\xbb\x03\xc3\xf5\x18\x01\x00\x01", 38,
+		ERR_INFLATE_CHECKSUM);
+	test_decode_one("HTTP/1.1 200 OK\r\nContent-Encoding: gzip\r\nContent-Length: 30\r\n\r\n",
+		TEST_GZIP, 30, ERR_INFLATE_TRUNCATED);
+	test_decode_one("HTTP/1.1 200 OK\r\nContent-Encoding: gzip\r\nContent-Length: 39\r\n\r\n",
+		TEST_GZIP "!", 39, ERR_INFLATE_INVALID_DATA);
+
+	/* Passed as received without Accept-Encoding or with an unknown coding */
+	struct http_response response;
+	char copy[64];
+	size_t size = 0;
+	test_recv_encoded("HTTP/1.1 200 OK\r\nContent-Encoding: gzip\r\nContent-Length: 38\r\n\r\n",
+		TEST_GZIP, 38, true, &response);
+	assert(!http_response_read(&response, copy, sizeof(copy), &size));
+	assert(size == 38 && !memcmp(copy, TEST_GZIP, 38));
+	http_response_close(&response);
+	test_recv_encoded("HTTP/1.1 200 OK\r\nContent-Encoding: gzip, br\r\nContent-Length: 38\r\n\r\n",
+		TEST_GZIP, 38, false, &response);
+	assert(!http_response_read(&response, copy, sizeof(copy), &size) && size == 38);
+	http_response_close(&response);
+
+	/* The decoder is reused by the next response on the connection, an empty body is not decoded */
+	test_recv_encoded("HTTP/1.1 200 OK\r\nContent-Encoding: gzip\r\nContent-Length: 38\r\n\r\n",
+		TEST_GZIP "HTTP/1.1 200 OK\r\nContent-Encoding: gzip\r\nContent-Length: 0\r\n\r\n"
+		"HTTP/1.1 200 OK\r\nContent-Encoding: deflate\r\nContent-Length: 26\r\n\r\n" TEST_ZLIB,
+		38 + 62 + 66 + 26, false, &response);
+	struct inflate *inflate = response.inflate;
+	assert(!http_response_read(&response, copy, 14, &size) && !memcmp(copy, "Hello, world! ", 14));
+	assert(!http_response_skip_body(&response));
+	http_response_reset(&response);
+	assert(!http_response_recv_header(&response) && response.coding == HTTP_CODING_GZIP);
+	assert(!http_response_read(&response, copy, sizeof(copy), &size) && size == 0);
+	http_response_reset(&response);
+	assert(!http_response_recv_header(&response) && response.coding == HTTP_CODING_DEFLATE);
+	assert(response.inflate == inflate);
+	assert(!http_response_read(&response, copy, 14, &size) && size == 14);
+	http_response_close(&response);
+}
+
+static void test_request_format(void)
+{
+	const char *headers[] = {"Accept: */*", "Content-Type: text/plain", NULL};
+	const char *expected = "POST /a?b HTTP/1.1\r\nAccept: */*\r\nContent-Type: text/plain\r\n"
+		"Host: example.com\r\nContent-Length: 5\r\n\r\n";
+	struct url parsed_url;
+	struct buffer buf;
+	buffer_init(&buf, 16);
+	assert(!http_request_format("POST", "http://example.com/a?b", headers, "hello", &parsed_url, &buf));
+	assert(buffer_data_len(&buf) == strlen(expected) && !memcmp(buf.data, expected, strlen(expected)));
+	buffer_term(&buf);
+
+	buffer_init(&buf, 16);
+	assert(!http_request_format("GET", "http://example.com", NULL, NULL, &parsed_url, &buf));
+	expected = "GET / HTTP/1.1\r\nHost: example.com\r\n\r\n";
+	assert(buffer_data_len(&buf) == strlen(expected) && !memcmp(buf.data, expected, strlen(expected)));
+	buffer_term(&buf);
+
+	buffer_init(&buf, 16);
+	assert(!http_request_format("GET", "http://example.com/", (const char*[]){"host:  a.b", NULL},
+		NULL, &parsed_url, &buf));
+	expected = "GET / HTTP/1.1\r\nhost: a.b\r\n\r\n";
+	assert(buffer_data_len(&buf) == strlen(expected) && !memcmp(buf.data, expected, strlen(expected)));
+	buffer_term(&buf);
+
+	buffer_init(&buf, 16);
+	assert(!http_request_format("GET", "http://bücher.example/", NULL, NULL, &parsed_url, &buf));
+	expected = "GET / HTTP/1.1\r\nHost: xn--bcher-kva.example\r\n\r\n";
+	assert(buffer_data_len(&buf) == strlen(expected) && !memcmp(buf.data, expected, strlen(expected)));
+	buffer_term(&buf);
+
+	buffer_init(&buf, 16);
+	assert(!http_request_format("GET", "http://[::1]:8080?x=1#top", NULL, NULL, &parsed_url, &buf));
+	expected = "GET /?x=1 HTTP/1.1\r\nHost: [::1]:8080\r\n\r\n";
+	assert(buffer_data_len(&buf) == strlen(expected) && !memcmp(buf.data, expected, strlen(expected)));
+	buffer_term(&buf);
+	char *origin = http_origin(&parsed_url);
+	assert(!strcmp(origin, "http://[::1]:8080"));
+	free(origin);
+	/* The default port is explicit in the origin */
+	assert(!url_parse("HTTP://Example.com/a", &parsed_url));
+	origin = http_origin(&parsed_url);
+	assert(!strcmp(origin, "http://example.com:80"));
+	free(origin);
+
+	/* Header lines must not be split or injected into the request */
+	static const char *invalid[] = {"Bad", "X: a\r\nInjected: b", " : x", "X-A : b", ": b", "X:\n"};
+	for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+		buffer_init(&buf, 16);
+		assert(http_request_format("GET", "http://example.com/", (const char*[]){"Accept: */*", invalid[i], NULL},
+			NULL, &parsed_url, &buf) == ERR_HTTP_INVALID_HEADER);
+		assert(buffer_data_len(&buf) == 0);
+		buffer_term(&buf);
+	}
+}
+
+static void test_template_format(struct http_template *template, const char *path,
+								 const char **headers, const char *body, const char *expected)
+{
+	struct buffer buf;
+	buffer_init(&buf, 16);
+	struct http_request request;
+	http_request_init_template(&request, template, path, path ? strlen(path) : 0);
+	request.body = body;
+	http_headers_set(&request.headers, headers);
+	assert(!http_request_prepare(&request));
+	http_request_format_head(&request, &buf);
+	http_request_term(&request);
+	assert(buffer_data_len(&buf) == strlen(expected) && !memcmp(buf.data, expected, strlen(expected)));
+	buffer_term(&buf);
+}
+
+static void test_template(void)
+{
+	struct http_template template;
+	const char *fixed[] = {"Accept: */*", NULL};
+	assert(!http_template_init(&template, "GET", "http://Example.com:8080/a?b", fixed));
+	assert(!strcmp(template.origin, "http://example.com:8080"));
+	test_template_format(&template, NULL, NULL, NULL,
+		"GET /a?b HTTP/1.1\r\nAccept: */*\r\nHost: Example.com:8080\r\n\r\n");
+	const char *range[] = {"Range: bytes=0-99", NULL};
+	test_template_format(&template, "/c", range, NULL,
+		"GET /c HTTP/1.1\r\nAccept: */*\r\nHost: Example.com:8080\r\nRange: bytes=0-99\r\n\r\n");
+	test_template_format(&template, NULL, NULL, "hello",
+		"GET /a?b HTTP/1.1\r\nAccept: */*\r\nHost: Example.com:8080\r\nContent-Length: 5\r\n\r\n");
+	http_template_term(&template);
+
+	const char *length[] = {"Content-Length: 5", NULL};
+	assert(!http_template_init(&template, "POST", "http://example.com", length));
+	test_template_format(&template, NULL, NULL, "hello",
+		"POST / HTTP/1.1\r\nContent-Length: 5\r\nHost: example.com\r\n\r\n");
+	http_template_term(&template);
+
+	assert(http_template_init(&template, "GET", "http:///a", NULL) == ERR_HTTP_URL_HAS_NO_HOST);
+	http_template_term(&template);
+	assert(http_template_init(&template, "GET", "http://example.com", (const char*[]){"X: a\nY: b", NULL}) ==
+		ERR_HTTP_INVALID_HEADER);
+	http_template_term(&template);
+}
+
+static void *test_send_reader(void *arg)
+{
+	int *sv = arg;
+	struct buffer *received = malloc(sizeof(*received));
+	buffer_init(received, 1 << 16);
+	while (1) {
+		buffer_reserve(received, 1 << 16);
+		ssize_t size = read(sv[1], received->space, buffer_space_len(received));
+		assert(size >= 0);
+		if (size == 0)
+			break;
+		received->space += size;
+	}
+	return received;
+}
+
+/* The body is larger than the socket buffer, so sendmsg() writes it partially */
+static void test_send(void)
+{
+	size_t body_len = 1 << 21;
+	char *body = malloc(body_len + 1);
+	for (size_t i = 0; i < body_len; i++)
+		body[i] = 'a' + i % 26;
+	body[body_len] = 0;
+
+	int sv[2];
+	assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+	int size = 4096;
+	setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	pthread_t reader;
+	assert(!pthread_create(&reader, NULL, test_send_reader, sv));
+
+	struct http_request request;
+	http_request_init(&request, "POST");
+	request.url = "http://example.com/";
+	request.body = body;
+	assert(!http_request_prepare(&request));
+	request.socket = sv[0];
+	assert(!http_send(&request));
+	http_request_term(&request);
+
+	struct buffer *received = NULL;
+	assert(!pthread_join(reader, (void**)&received));
+	close(sv[1]);
+	const char *head = "POST / HTTP/1.1\r\nHost: example.com\r\nContent-Length: 2097152\r\n\r\n";
+	size_t head_len = strlen(head);
+	assert(buffer_data_len(received) == head_len + body_len);
+	assert(!memcmp(received->data, head, head_len));
+	assert(!memcmp(received->data + head_len, body, body_len));
+	buffer_term(received);
+	free(received);
+	free(body);
+}
+
+/* Chunk size lines and data wrap around the end of a small receive buffer many times */
+static void test_wrap(size_t buf_size)
+{
+	struct buffer text, body;
+	buffer_init(&text, 1 << 16);
+	buffer_init(&body, 1 << 16);
+	const char *header = "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n";
+	test_append(&text, header, strlen(header));
+	for (size_t i = 1; i < 200; i++) {
+		char line[32], data[256];
+		memset(data, 'a' + i % 26, i);
+		test_append(&text, line, sprintf(line, "%zx\r\n", i));
+		test_append(&text, data, i);
+		test_append(&text, "\r\n", 2);
+		test_append(&body, data, i);
+	}
+	test_append(&text, "0\r\n\r\n", 6);	/* with the terminating zero */
+
+	struct http_response response;
+	assert(!test_recv_buf(text.data, buffer_data_len(&text), buf_size, &response));
+	char *copy = malloc(buffer_data_len(&body) + 1);
+	size_t size = 0;
+	assert(!http_response_read(&response, copy, buffer_data_len(&body) + 1, &size));
+	assert(size == buffer_data_len(&body) && !memcmp(copy, body.data, size));
+	free(copy);
+	http_response_close(&response);
+	buffer_term(&text);
+	buffer_term(&body);
+}
+
+/* Responses of pipelined requests arrive back to back in one stream */
+static void test_pipeline_responses(void)
+{
+	struct http_response response;
+	assert(!test_recv("HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nhello"
+		"HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n3\r\nabc\r\n0\r\n\r\n"
+		"HTTP/1.1 404 Not Found\r\nConnection: close\r\nContent-Length: 0\r\n\r\n", &response));
+	assert(response.status_code == 200 && response.body_left == 5);
+	assert(!http_response_skip_body(&response));
+	assert(http_response_keep_alive(&response));
+	http_response_reset(&response);
+
+	assert(!http_response_recv_header(&response));
+	assert(response.body_type == HTTP_BODY_CHUNKED);
+	char buf[16];
+	size_t size = 0;
+	assert(!http_response_read(&response, buf, 2, &size) && size == 2 && !memcmp(buf, "ab", 2));
+	assert(!http_response_skip_body(&response));
+	http_response_reset(&response);
+
+	assert(!http_response_recv_header(&response));
+	assert(response.status_code == 404);
+	assert(!http_response_skip_body(&response));
+	assert(!http_response_keep_alive(&response));
+	assert(response.data_size == 0);
+	http_response_reset(&response);
+	assert(http_response_recv_header(&response) == ERR_HTTP_CONNECTION_CLOSED);
+	http_response_close(&response);
+
+	const char *urls[] = {"http://localhost/a", "http://localhost:8080/b"};
+	assert(http_pipeline(urls, 2, NULL, 2, NULL, NULL) == ERR_HTTP_NOT_SAME_ORIGIN);
+}
+
+/* Gets the path from the local server and checks the body */
+static void test_one(struct server *server, const char *path, int status_code, size_t size)
+{
+	char url[128];
+	snprintf(url, sizeof(url), "http://127.0.0.1:%d%s", server->port, path);
+	struct http_response response;
+	assert(!http_get(url, NULL, &response));
+	assert(response.status_code == status_code);
+	char *body = malloc(size + 1);
+	size_t body_size = 0;
+	assert(!http_response_read(&response, body, size + 1, &body_size));
+	assert(body_size == size);
+	for (size_t i = 0; i < size; i++)
+		assert(body[i] == server_body_byte(i));
+	free(body);
+	http_response_close(&response);
+}
+
+static double test_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void test_local_pipeline(void *arg, size_t index, int err, struct http_response *response)
+{
+	size_t *done = arg;
+	assert(!err && response->status_code == 200 && index == *done);
+	char body[16];
+	size_t size = 0;
+	assert(!http_response_read(response, body, sizeof(body), &size) && size == index);
+	(*done)++;
+}
+
+/* Requests to the local server of every kind of body */
+static void test_local(void)
 {
-	assert(!test_parse_status_line_one("HTTP/1.1 200 OK", 1, 1));
+	struct server server;
+	assert(!server_start(&server));
+	test_one(&server, "/length/0", 200, 0);
+	test_one(&server, "/length/100000", 200, 100000);
+	test_one(&server, "/chunked/100000?chunk=1000", 200, 100000);
+	test_one(&server, "/chunked/3000000", 200, 3000000);
+	test_one(&server, "/close/70000", 200, 70000);
+	test_one(&server, "/chunked/10000?drip=999&interval=0", 200, 10000);
+	test_one(&server, "/nothing", 404, 0);
+
+	/* The connection is reused unless the server closes it */
+	size_t accepted = server_accepted(&server);
+	for (int i = 0; i < 3; i++)
+		test_one(&server, "/length/10", 200, 10);
+	assert(server_accepted(&server) == accepted);
+	for (int i = 0; i < 3; i++)
+		test_one(&server, "/length/10?close=1", 200, 10);
+	assert(server_accepted(&server) == accepted + 2);
+
+	double start = test_now();
+	test_one(&server, "/length/10?latency=20", 200, 10);
+	test_one(&server, "/length/100?drip=10&interval=2", 200, 100);
+	assert(test_now() - start >= 0.02 + 9 * 0.002);
+
+	char urls[5][64];
+	const char *url_list[5];
+	for (int i = 0; i < 5; i++) {
+		snprintf(urls[i], sizeof(urls[i]), "http://127.0.0.1:%d/length/%d", server.port, i);
+		url_list[i] = urls[i];
+	}
+	size_t done = 0;
+	size_t requests = server_requests(&server);
+	assert(!http_pipeline(url_list, 5, NULL, 3, test_local_pipeline, &done));
+	assert(done == 5 && server_requests(&server) == requests + 5);
+
+	server_stop(&server);
+	pool_clear();
+}
 
-	static const char response_header2[] = 
-		"HTTP/1.1 200 OK\r\n"
-		"Server: nginx";
-	assert(!test_parse_status_line_one(response_header2, 1, 1));
+static size_t test_nr_fds(void)
+{
+	size_t nr = 0;
+	for (int fd = 0; fd < 1024; fd++)
+		nr += fcntl(fd, F_GETFD) != -1;
+	return nr;
+}
 
-	assert(!test_parse_status_line_one("HTTP/0.9 200 OK", 0, 9));
-	assert(!test_parse_status_line_one("HTTP/1.0 200 OK", 1, 0));
-	assert(ERR_HTTP_INVALID_RESPONSE == test_parse_status_line_one("HTTP/2 200 OK", 2, 0));
-	assert(ERR_HTTP_INVALID_RESPONSE == test_parse_status_line_one("HTTP/xx 200 OK", 0, 0));
+/* A pooled connection the server has stopped reading fails the send, the request is
+   retried on a new connection and the pooled one is closed */
+static void test_pool_retry(void)
+{
+	struct server server;
+	assert(!server_start(&server));
+	size_t nr_fds = test_nr_fds();
+	int sv[2];
+	assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+	assert(!shutdown(sv[1], SHUT_RD));
+	char origin[64];
+	snprintf(origin, sizeof(origin), "http://127.0.0.1:%d", server.port);
+	pool_put(origin, sv[0]);
+	test_one(&server, "/length/10", 200, 10);
+	close(sv[1]);
+	pool_clear();
+	assert(test_nr_fds() == nr_fds);
+
+	/* The pipeline retries the same way */
+	assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+	assert(!shutdown(sv[1], SHUT_RD));
+	pool_put(origin, sv[0]);
+	char urls[3][64];
+	const char *url_list[3];
+	for (int i = 0; i < 3; i++) {
+		snprintf(urls[i], sizeof(urls[i]), "http://127.0.0.1:%d/length/%d", server.port, i);
+		url_list[i] = urls[i];
+	}
+	size_t done = 0;
+	assert(!http_pipeline(url_list, 3, NULL, 2, test_local_pipeline, &done) && done == 3);
+	close(sv[1]);
+	pool_clear();
+	assert(test_nr_fds() == nr_fds);
+	server_stop(&server);
 }
 
-static void test_parse_header_default(void)
+/* The receive buffer grows with the body, within the budget, and shrinks between responses */
+static void test_recv_buf_size(void)
 {
-	static const char response_header[] = 
-		"HTTP/1.1 200 OK\r\n"
-		"Server: nginx\r\n"
-		"Date: Sun, 03 Feb 2019 09:35:44 GMT\r\n"
-		"Header-With-Trailing-Whitespace: \tsome value \t\r\n"
-		"\r\n"
-		"blah blah blah";
+	const char *header = "HTTP/1.1 200 OK\r\nContent-Length: 100000\r\n\r\n";
+	const char *small = "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok";
+	struct buffer text;
+	buffer_init(&text, 1 << 17);
+	test_append(&text, header, strlen(header));
+	for (size_t i = 0; i < 100000; i++)
+		test_append(&text, "0123456789" + i % 10, 1);
+	test_append(&text, small, strlen(small));
+	char *body = malloc(100000);
+
+	for (int budget = 0; budget < 2; budget++) {
+		size_t used = http_recv_budget_used();
+		if (budget)
+			http_set_recv_budget(used + HTTP_RECV_BUF_INITIAL);
+		struct http_response response;
+		assert(!test_recv_buf(text.data, buffer_data_len(&text), 1 << 20, &response));
+		assert(response.buf_capacity == HTTP_RECV_BUF_INITIAL);
+		/* Reads smaller than the buffer go through it */
+		size_t size = 0;
+		for (size_t total = 0; total < 100000; total += size)
+			assert(!http_response_read(&response, body + total, 1000, &size) && size == 1000);
+		for (size_t i = 0; i < 100000; i++)
+			assert(body[i] == '0' + i % 10);
+		/* Sized for the Content-Length at once */
+		assert(response.buf_capacity == (budget ? HTTP_RECV_BUF_INITIAL : 1 << 17));
+		assert(http_recv_budget_used() == used + response.buf_capacity);
+
+		assert(!http_response_skip_body(&response));
+		http_response_reset(&response);
+		assert(response.buf_capacity == HTTP_RECV_BUF_INITIAL);
+		assert(!http_response_recv_header(&response));
+		assert(!http_response_read(&response, body, 3, &size) && size == 2 && !memcmp(body, "ok", 2));
+		http_response_close(&response);
+		assert(http_recv_budget_used() == used);
+		http_set_recv_budget(0);
+	}
+
+	/* A line longer than the initial buffer */
+	buffer_term(&text);
+	buffer_init(&text, 1 << 16);
+	for (size_t i = 0; i < 40000; i++)
+		test_append(&text, "a", 1);
+	test_append(&text, "\r\n", 2);
 	struct http_response response;
 	http_response_init(&response);
+	response.buf_size = 1 << 16;
+	int sv[2];
+	assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+	assert(write(sv[1], text.data, buffer_data_len(&text)) == buffer_data_len(&text));
+	close(sv[1]);
+	response.socket = sv[0];
+	http_response_alloc_buf(&response);
+	const char *line = NULL;
+	assert(!http_response_readline(&response, &line) && strlen(line) == 40000);
+	assert(response.buf_capacity == 1 << 16);
+	http_response_close(&response);
+	buffer_term(&text);
+	free(body);
+}
 
-	response.buf = strdup(response_header);
-	response.data = response.buf;
-	response.data_size = strlen(response_header);
-	assert(!parse_header(&response));
-
-	assert(response.http_version_major == 1);
-	assert(response.http_version_minor == 1);
-	assert(response.status_code == 200);
-	assert(!strcmp(response.status_line, "200 OK"));
-	assert(!strcmp(response.headers[0], "Server: nginx"));
-	assert(!strcmp(response.headers[1], "Date: Sun, 03 Feb 2019 09:35:44 GMT"));
-	assert(!strcmp(response.headers[2], "Header-With-Trailing-Whitespace: \tsome value"));
-	assert(response.headers[3] == NULL);
-
-	assert(!strcmp(http_response_get_header(&response, "Server"), "nginx"));
-	assert(!strcmp(http_response_get_header(&response, "Date"), "Sun, 03 Feb 2019 09:35:44 GMT"));
-	assert(!strcmp(http_response_get_header(&response, "Header-With-Trailing-Whitespace"), "some value"));
-	assert(http_response_get_header(&response, "Unknown-header") == NULL);
+void test_http(void)
+{
+	test_tools();
+	test_request_format();
+	test_template();
+	test_send();
+	test_splice();
+	test_body();
+	test_dechunk();
+	test_decode();
+	test_wrap(4096);	/* a ring */
+	test_wrap(4000);	/* not a multiple of the page size, the buffer is compacted */
+	test_pipeline_responses();
+	test_recv_buf_size();
+	test_local();
+	test_pool_retry();
+}
+#endif
+
+#ifdef FUZZ
+/* The lines of the data are a url and request headers. A request that is formatted has
+   exactly the lines of its headers, the request line, the empty line and maybe Host. */
+static void fuzz_request(const char *data, size_t size)
+{
+	char *text = malloc(size + 1);
+	memcpy(text, data, size);
+	text[size] = 0;
+	const char *lines[64];
+	size_t nr_lines = 0;
+	for (char *line = text; line && nr_lines < 64; nr_lines++) {
+		lines[nr_lines] = line;
+		if ((line = strchr(line, '\n')))
+			*line++ = 0;
+	}
+	lines[nr_lines] = NULL;
 
+	struct url parsed_url;
+	struct buffer buf;
+	buffer_init(&buf, 64);
+	if (nr_lines && !http_request_format("GET", lines[0], lines + 1, NULL, &parsed_url, &buf)) {
+		size_t nr_crlf = 0;
+		for (const char *ch = buf.data; ch < buf.space; ch++) {
+			assert((*ch == '\r') == (ch + 1 < buf.space && ch[1] == '\n'));
+			assert(*ch != '\n' || ch[-1] == '\r');
+			nr_crlf += *ch == '\n';
+		}
+		assert(nr_crlf == nr_lines + 1 || nr_crlf == nr_lines + 2);
+	}
+	buffer_term(&buf);
+	free(text);
+}
+
+/* The data is the chunk framing in the receive buffer */
+static void fuzz_chunk_size(const char *data, size_t size)
+{
+	struct http_response response;
+	http_response_init(&response);
+	if (size >= HTTP_RECV_BUF_INITIAL)
+		size = HTTP_RECV_BUF_INITIAL - 1;
+	response.buf_size = size + 1;
+	http_response_alloc_buf(&response);
+	response.buf_size = size;	/* a line filling it is too long */
+	memcpy(response.buf, data, size);
+	response.data = response.buf;
+	response.data_size = size;
+	size_t chunk_size;
+	while (!http_response_get_chunk_size(&response, &chunk_size))
+		assert(response.data >= response.buf && response.data <= response.buf + size);
 	http_response_close(&response);
 }
 
-static void test_parse_header(void)
+void fuzz_http(const unsigned char *data, size_t size)
 {
-	test_parse_header_default();
+	fuzz_request((const char*)data, size);
+	fuzz_chunk_size((const char*)data, size);
 }
+#endif
 
-static void test_http_headers(void)
+#ifdef BENCH
+static int bench_count(void *arg, const char *data, size_t size)
 {
-	test_count_headers();
-	test_parse_status_line();
-	test_parse_header();
+	*(size_t*)arg += size;
+	(void)data;
+	return 0;
 }
 
-static void test_one(const char *url)
+/* Gets the path and reads the body, returns the seconds it took */
+static double bench_get(struct server *server, const char *path, size_t size)
 {
+	char url[128];
+	snprintf(url, sizeof(url), "http://127.0.0.1:%d%s", server->port, path);
+	double start = bench_now();
 	struct http_response response;
 	int err = http_get(url, NULL, &response);
 	assert(!err);
+	size_t received = 0;
+	err = http_response_on_data(&response, bench_count, &received);
+	assert(!err && received == size);
+	(void)err;
 	http_response_close(&response);
+	return bench_now() - start;
 }
 
-static void test_default(void)
+static int bench_compare(const void *a, const void *b)
 {
-	test_one("http://web-control.ru/");
-	return;
-	test_one("http://xn----dtbofgvdd5ah.xn--p1ai/4950985197/");
-	test_one("http://кто-звонит.рф/4950985197/");
-	test_one("http://en.wikipedia.org/wiki/URL#Syntax");
-	test_one("http://yandex.ru/");
+	double x = *(const double*)a, y = *(const double*)b;
+	return x < y ? -1 : x > y;
 }
 
-void test_http(void)
+/* Requests per second and the latency percentiles of small responses */
+static void bench_requests(struct server *server, const char *name, const char *path, size_t count)
 {
-	test_tools();
-	test_http_headers();
-	test_default();
+	double *seconds = malloc(count * sizeof(*seconds));
+	assert(seconds);
+	struct slab_stats before, after;
+	slab_get_stats(&before);
+	double start = bench_now();
+	for (size_t i = 0; i < count; i++)
+		seconds[i] = bench_get(server, path, 64);
+	double total = bench_now() - start;
+	slab_get_stats(&after);
+	qsort(seconds, count, sizeof(*seconds), bench_compare);
+	printf("http requests=%s req/s=%.0f\n", name, count / total);
+	printf("http requests=%s p50_us=%.1f\n", name, seconds[count / 2] * 1e6);
+	printf("http requests=%s p99_us=%.1f\n", name, seconds[count * 99 / 100] * 1e6);
+	uint64_t hits = after.hits - before.hits;
+	uint64_t allocs = hits + after.misses - before.misses;
+	printf("http requests=%s pool_hit_rate=%.3f\n", name, allocs ? (double)hits / allocs : 0);
+	printf("http requests=%s resident_KiB=%.0f\n", name, after.resident / 1024.0);
+	free(seconds);
+}
+
+/* Runs http_get() against the local server */
+void bench_http(void)
+{
+	struct server server;
+	int err = server_start(&server);
+	assert(!err);
+	(void)err;
+
+	static const char *bodies[] = {"length", "chunked"};
+	static const size_t sizes[] = {1 << 20, 64 << 20};
+	for (size_t i = 0; i < sizeof(bodies) / sizeof(bodies[0]); i++) {
+		for (size_t j = 0; j < sizeof(sizes) / sizeof(sizes[0]); j++) {
+			char path[64];
+			snprintf(path, sizeof(path), "/%s/%zu", bodies[i], sizes[j]);
+			size_t iterations = (size_t)(1 << 30) / sizes[j];
+			double seconds = 0;
+			for (size_t n = 0; n < iterations; n++)
+				seconds += bench_get(&server, path, sizes[j]);
+			printf("http body=%s size=%zu GB/s=%.2f\n", bodies[i], sizes[j],
+				iterations * sizes[j] / seconds / 1e9);
+		}
+	}
+
+	bench_requests(&server, "keep-alive", "/length/64", 20000);
+	bench_requests(&server, "close", "/length/64?close=1", 5000);
+	server_stop(&server);
+	pool_clear();
 }
 #endif
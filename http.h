@@ -1,6 +1,32 @@
 #pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "buffer.h"
+#include "header.h"
+#include "inflate.h"
+#include "parser.h"
+#include "slab.h"
 #include "url.h"
 
+/* Body framing, see https://tools.ietf.org/html/rfc7230#section-3.3.3 */
+#define HTTP_BODY_UNKNOWN	0	/* the header is not received yet */
+#define HTTP_BODY_NONE		1
+#define HTTP_BODY_LENGTH	2	/* Content-Length */
+#define HTTP_BODY_CHUNKED	3	/* Transfer-Encoding: chunked */
+#define HTTP_BODY_CLOSE		4	/* the body ends when the server closes the connection */
+
+/* Content-Encoding decoded by the body readers, see https://tools.ietf.org/html/rfc7231#section-3.1.2.1 */
+#define HTTP_CODING_IDENTITY	0	/* the body is passed as received */
+#define HTTP_CODING_GZIP		1
+#define HTTP_CODING_DEFLATE		2
+
+/* The receive buffer of a response starts at HTTP_RECV_BUF_INITIAL bytes and grows while
+   the data comes faster than it is read, up to buf_size, 1 MiB by default. A response on
+   a kept alive connection starts with the buffer shrunk back. */
+#define HTTP_RECV_BUF_INITIAL		(16 << 10)
+#define HTTP_RECV_BUDGET_WAIT_MS	200
+
 struct http_response {
 	unsigned char	http_version_major;
 	unsigned char	http_version_minor;
@@ -13,33 +39,154 @@ struct http_response {
 	/* Internally used fields */
 	int		socket;
 	char	*buf;
-	size_t	buf_size;
+	size_t	buf_size;	/* the largest size buf grows to */
+	size_t	buf_capacity;
+	bool	buf_ring;	/* buf is mapped twice in a row, see ring.h */
+	bool	buf_filled;	/* the last recv() filled buf */
 	char	*data;
 	size_t	data_size;
 	int		recv_errno;
 	char	*header_buf;
+	struct header_index	header_index;	/* of the fields in header_buf */
+	char	*trailer_buf;	/* fields of the chunked trailer part */
+	struct header_index	trailer_index;
+
+	int			body_type;
+	uint64_t	body_left;	/* bytes left in the body or in the current chunk */
+	size_t		body_chunks;
+	bool		body_done;
+	size_t		body_run;	/* decoded body bytes at data, the parser is past them */
+	int			body_err;	/* found in the framing after body_run */
+	bool		accept_encoding;	/* the request has Accept-Encoding */
+	int			coding;		/* HTTP_CODING_* of the body */
+	struct inflate	*inflate;	/* allocated with the first encoded body, kept for the connection */
+	int			pipe[2];	/* used by http_response_splice() */
+	bool		splice_unsupported;
+	char		*origin;	/* the connection returns to the pool under this name */
+	struct parser	parser;
 };
 
-/* Returns value of the HTTP header if found. Otherwise returns NULL. */
+/* Returns value of the HTTP header if found. Otherwise returns NULL.
+   Once a chunked body is read, the fields of its trailer part are found as well,
+   the header fields take precedence. */
 const char *http_response_get_header(struct http_response *response, const char *name);
 
+/* Returns value of the well-known header, id is one of HTTP_HDR_*, or NULL if the response
+   has none. It is the fastest lookup: the slot of every well-known field is filled in while
+   the header is parsed. Trailer fields are found as by http_response_get_header(). */
+const char *http_response_header(struct http_response *response, int id);
+
 int http_response_readline(struct http_response *response, const char **line);
 
 int http_response_get_chunk_size(struct http_response *response, size_t *chunk_size);
 
+/* Returns a view of the next body bytes right in the receive buffer, receiving more if it
+   is empty. The view ends at the end of the received data. Chunked encoding is decoded in
+   place: the data of the chunks received together is moved over their framing, so the view
+   spans all of them. *size == 0 means the end of the body. The view stays valid until
+   the next call on the response.
+   If the request has Accept-Encoding and the body is encoded with gzip or deflate, the view
+   is of the decoded data, and ERR_INFLATE_* are returned for a broken encoding. Other
+   codings are passed as received. */
+int http_response_peek(struct http_response *response, const char **data, size_t *size);
+
+/* Marks size bytes of the last view returned by http_response_peek() as consumed */
+void http_response_consume(struct http_response *response, size_t size);
+
+/* Returns nonzero to stop, the value is returned by http_response_on_data() */
+typedef int (*http_data_callback)(void *arg, const char *data, size_t size);
+
+/* Passes the rest of the body to the callback piece by piece without copying it */
+int http_response_on_data(struct http_response *response, http_data_callback callback, void *arg);
+
+/* Copies up to buf_len bytes of the body to buf, *data_size < buf_len means the end of the body */
 int http_response_read(struct http_response *response, void *buf, size_t buf_len, size_t *data_size);
 
+/* Writes up to size bytes of the response body to the file descriptor. The data goes
+   from the socket to the file with splice() bypassing user space when both descriptors
+   support it and through the receive buffer otherwise. The body is written at *offset
+   which is advanced, or at the current file position if offset is NULL.
+   Chunked encoding is decoded. *written < size means the end of the body.
+   A body decoded as by http_response_peek() is written through the receive buffer. */
+int http_response_splice(struct http_response *response, int fd, off_t *offset, size_t size, size_t *written);
+
+/* Returns the connection to the pool if the body has been read completely
+   and the server allows to keep the connection alive. Otherwise closes it. */
 void http_response_close(struct http_response *response);
 
+/* Sets the allocator of the receive buffers and the header storage, NULL restores malloc().
+   It must be called before the first request. The buffers are pooled either way, the pool
+   statistics are returned by slab_get_stats(). */
+void http_set_allocator(const struct slab_allocator *allocator);
+
+/* Limits the bytes of the receive buffers of all responses, 0 (the default) means no limit.
+   Over the budget the buffers do not grow, and a response is not received until others
+   release their buffers, letting TCP flow control hold the servers back. It is a soft limit:
+   a response waits for HTTP_RECV_BUDGET_WAIT_MS at most and is received over the budget
+   then, as the buffers may be held by the same thread, and a buffer full of a header or
+   a line grows over the budget to take the rest of it. The buffers of loop.h are charged
+   as well but never wait, the loop would hold all of its requests. */
+void http_set_recv_budget(size_t bytes);
+
+/* Returns the bytes of the receive buffers in use */
+size_t http_recv_budget_used(void);
+
+#define ERR_HTTP_NOT_SAME_ORIGIN	-10 /* pipelined urls have different scheme, host or port */
 #define ERR_HTTP_URL_HAS_NO_HOST	-11
 #define ERR_HTTP_SEND_FAILED		-12
 #define ERR_HTTP_RECV_FAILED		-13
 #define ERR_HTTP_BUFFER_TOO_SMALL	-14	/* buffer is not enough to obtain all HTTP headers */
 #define ERR_HTTP_INVALID_RESPONSE	-15 /* Response header is not compliant to HTTP standard */
+#define ERR_HTTP_BODY_TRUNCATED		-16 /* Connection closed before the end of the body */
+#define ERR_HTTP_WRITE_FAILED		-17
+#define ERR_HTTP_CONNECT_FAILED		-18
+#define ERR_HTTP_CONNECTION_CLOSED	-20 /* the server closed the connection without a response */
+#define ERR_HTTP_INVALID_HEADER		-25 /* a request header is not "Name: value" on one line */
 
 int http_get(const char *url, const char **headers, struct http_response *response);
 int http_post(const char *url, const char **headers, const char *body, struct http_response *response);
 
+/* Method, origin and the fixed headers of the requests to one endpoint, with the Host and
+   the fixed header lines serialized once. A request made of the template only appends its
+   varying headers to them. The template is not changed by the requests, so threads may share it. */
+struct http_template {
+	char		*method;
+	char		*url;
+	struct url	parsed_url;	/* points into url */
+	char		*origin;	/* name of the connections in the pool */
+	struct buffer	head;	/* "Name: value\r\n" lines */
+	bool		content_length;	/* the fixed headers have Content-Length */
+	bool		accept_encoding;
+};
+
+int http_template_init(struct http_template *template, const char *method, const char *url,
+					   const char **headers);
+void http_template_term(struct http_template *template);
+
+/* Sends the request to the url of the template or to the path at its origin, e.g. "/a?b",
+   if path is not NULL. The headers are added to the fixed ones, body may be NULL. */
+int http_template_request(struct http_template *template, const char *path, const char **headers,
+						  const char *body, struct http_response *response);
+
+/* Called for every pipelined request in order. On success the response header is parsed
+   and the body may be read with http_response_peek(), http_response_read() and others, the rest
+   of it is skipped after the call. On error the response is NULL. */
+typedef void (*http_pipeline_callback)(void *arg, size_t index, int err, struct http_response *response);
+
+/* Sends GET requests to urls of the same origin over one keep-alive connection with up
+   to depth of them in flight. If the server closes the connection, the requests left
+   unanswered are sent again over a new one. */
+int http_pipeline(const char **urls, size_t nr_urls, const char **headers, size_t depth,
+				  http_pipeline_callback callback, void *arg);
+
 #ifdef UNIT_TEST
 void test_http(void);
 #endif
+
+#ifdef FUZZ
+void fuzz_http(const unsigned char *data, size_t size);
+#endif
+
+#ifdef BENCH
+void bench_http(void);
+#endif
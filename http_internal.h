@@ -0,0 +1,29 @@
+#pragma once
+#include "buffer.h"
+#include "dns.h"
+#include "http.h"
+#include "url.h"
+
+/* Parts of http.c shared with the other request engines of the library */
+
+/* Resolves the url host through the DNS cache. The caller must dns_release() the entry
+   whether the call has succeeded or not. */
+int url_resolve(const struct url *url, struct dns_entry **entry);
+
+/* Returns the "scheme://host:port" name of the connection pool entry. The caller must free() it. */
+char *http_origin(const struct url *url);
+
+/* Appends the request line and the header to the buffer. Adds Host and Content-Length
+   headers if they are missing. The parsed url points into the url string. */
+int http_request_format(const char *method, const char *url, const char **headers,
+						const char *body, struct url *parsed_url, struct buffer *buf);
+
+void http_response_init(struct http_response *response);
+
+/* Charges the receive budget without waiting, see http_set_recv_budget() */
+void http_recv_budget_take(size_t size);
+void http_recv_budget_release(size_t size);
+
+/* Writes all the data at *offset, which is advanced, or at the current position if offset
+   is NULL, resuming after partial writes */
+int write_all(int fd, off_t *offset, const char *data, size_t size);
@@ -0,0 +1,1125 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "inflate.h"
+#include "log.h"
+
+#define INFLATE_WINDOW_MASK	(INFLATE_WINDOW_SIZE - 1)
+#define INFLATE_MAX_MATCH	258
+#define INFLATE_CODE_BITS	7	/* of the code length code */
+
+/* A table entry: bits of the code, operation and its arguments */
+#define INFLATE_OP_LITERAL	0	/* the literal in bits 8-15 */
+#define INFLATE_OP_LITERALS	1	/* two literals in bits 8-15 and 16-23, bits of the first one in 24-27 */
+#define INFLATE_OP_LENGTH	2	/* a length or a distance: extra bits in 8-11, the base in 16-31 */
+#define INFLATE_OP_END		3	/* end of the block */
+#define INFLATE_OP_SUBTABLE	4	/* index bits in 8-11, offset in 16-31 */
+#define INFLATE_OP_INVALID	5
+
+#define INFLATE_ENTRY_BITS(entry)	((entry) & 0x1f)
+#define INFLATE_ENTRY_OP(entry)		(((entry) >> 5) & 7)
+#define INFLATE_ENTRY(op, arg)		((uint32_t)(op) << 5 | (uint32_t)(arg) << 8)
+#define INFLATE_LENGTH(extra, base)	(INFLATE_ENTRY(INFLATE_OP_LENGTH, extra) | (uint32_t)(base) << 16)
+
+static const unsigned short length_base[29] = {
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+	35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const unsigned char length_extra[29] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const unsigned short dist_base[30] = {
+	1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+	257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+static const unsigned char dist_extra[30] = {
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+/* Order of the code length code lengths */
+static const unsigned char code_order[19] = {
+	16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+/* Entries of the symbols without the code bits */
+static uint32_t lit_symbols[288];
+static uint32_t dist_symbols[32];
+static uint32_t code_symbols[19];
+
+static uint32_t fixed_lit[INFLATE_LIT_TABLE_SIZE];
+static uint32_t fixed_dist[INFLATE_DIST_TABLE_SIZE];
+static uint32_t crc_tables[8][256];
+static pthread_once_t inflate_once = PTHREAD_ONCE_INIT;
+
+static unsigned int inflate_reverse(unsigned int code, unsigned int len)
+{
+	unsigned int reversed = 0;
+	for (unsigned int i = 0; i < len; i++, code >>= 1)
+		reversed = (reversed << 1) | (code & 1);
+	return reversed;
+}
+
+/* Builds the lookup table of the canonical Huffman code, see
+   https://tools.ietf.org/html/rfc1951#section-3.2.2 Codes longer than table_bits are in
+   the second level tables following the first one. Incomplete codes are allowed, their
+   missing codes are invalid. If pairs is true, an entry decodes two literals if both fit. */
+static int inflate_build(uint32_t *table, size_t capacity, unsigned int table_bits,
+						 const unsigned char *lengths, unsigned int nr_symbols,
+						 const uint32_t *symbols, bool pairs)
+{
+	unsigned int count[16] = {0};
+	for (unsigned int i = 0; i < nr_symbols; i++)
+		count[lengths[i]]++;
+	count[0] = 0;
+	int left = 1;
+	for (unsigned int len = 1; len < 16; len++) {
+		left = (left << 1) - count[len];
+		if (left < 0)
+			return ERR_INFLATE_INVALID_DATA;	/* over-subscribed */
+	}
+	unsigned int next[16];
+	unsigned int code = 0;
+	for (unsigned int len = 1; len < 16; len++) {
+		code = (code + count[len - 1]) << 1;
+		next[len] = code;
+	}
+
+	/* Codes are read starting from their first bit, which is the lowest one of the index */
+	size_t size = (size_t)1 << table_bits;
+	unsigned short codes[288];
+	unsigned char longest[1 << INFLATE_LIT_BITS] = {0};	/* of the codes with the index */
+	for (unsigned int i = 0; i < nr_symbols; i++) {
+		unsigned int len = lengths[i];
+		if (len == 0)
+			continue;
+		codes[i] = inflate_reverse(next[len]++, len);
+		size_t index = codes[i] & (size - 1);
+		if (len > table_bits && len > longest[index])
+			longest[index] = len;
+	}
+
+	for (size_t i = 0; i < size; i++)
+		table[i] = INFLATE_ENTRY(INFLATE_OP_INVALID, 0) | 15;
+	size_t used = size;
+	for (unsigned int i = 0; i < nr_symbols; i++) {
+		unsigned int len = lengths[i];
+		if (len == 0)
+			continue;
+		if (len <= table_bits) {
+			for (size_t j = codes[i]; j < size; j += (size_t)1 << len)
+				table[j] = symbols[i] | len;
+			continue;
+		}
+		size_t index = codes[i] & (size - 1);
+		unsigned int sub_bits = longest[index] - table_bits;
+		if (INFLATE_ENTRY_OP(table[index]) != INFLATE_OP_SUBTABLE) {
+			if (used + ((size_t)1 << sub_bits) > capacity)
+				return ERR_INFLATE_INVALID_DATA;
+			table[index] = INFLATE_ENTRY(INFLATE_OP_SUBTABLE, sub_bits) | (uint32_t)used << 16 | table_bits;
+			for (size_t j = 0; j < ((size_t)1 << sub_bits); j++)
+				table[used + j] = INFLATE_ENTRY(INFLATE_OP_INVALID, 0) | (15 - table_bits);
+			used += (size_t)1 << sub_bits;
+		}
+		uint32_t *sub = table + (table[index] >> 16);
+		for (size_t j = codes[i] >> table_bits; j < ((size_t)1 << sub_bits); j += (size_t)1 << (len - table_bits))
+			sub[j] = symbols[i] | (len - table_bits);
+	}
+
+	if (pairs) {
+		uint32_t single[1 << INFLATE_LIT_BITS];
+		assert(size <= sizeof(single) / sizeof(single[0]));
+		memcpy(single, table, size * sizeof(*table));
+		for (size_t i = 0; i < size; i++) {
+			uint32_t first = single[i];
+			unsigned int len = INFLATE_ENTRY_BITS(first);
+			if (INFLATE_ENTRY_OP(first) != INFLATE_OP_LITERAL || len >= table_bits)
+				continue;
+			/* The rest of the index is the beginning of the next code */
+			uint32_t second = single[i >> len];
+			if (INFLATE_ENTRY_OP(second) != INFLATE_OP_LITERAL || INFLATE_ENTRY_BITS(second) > table_bits - len)
+				continue;
+			table[i] = INFLATE_ENTRY(INFLATE_OP_LITERALS, (first >> 8) & 0xff) | (second & 0xff00) << 8 |
+				(uint32_t)len << 24 | (len + INFLATE_ENTRY_BITS(second));
+		}
+	}
+	return 0;
+}
+
+static void inflate_init_tables(void)
+{
+	for (unsigned int i = 0; i < 256; i++)
+		lit_symbols[i] = INFLATE_ENTRY(INFLATE_OP_LITERAL, i);
+	lit_symbols[256] = INFLATE_ENTRY(INFLATE_OP_END, 0);
+	for (unsigned int i = 0; i < 29; i++)
+		lit_symbols[257 + i] = INFLATE_LENGTH(length_extra[i], length_base[i]);
+	lit_symbols[286] = lit_symbols[287] = INFLATE_ENTRY(INFLATE_OP_INVALID, 0);
+	for (unsigned int i = 0; i < 30; i++)
+		dist_symbols[i] = INFLATE_LENGTH(dist_extra[i], dist_base[i]);
+	dist_symbols[30] = dist_symbols[31] = INFLATE_ENTRY(INFLATE_OP_INVALID, 0);
+	for (unsigned int i = 0; i < 19; i++)
+		code_symbols[i] = INFLATE_ENTRY(INFLATE_OP_LITERAL, i);
+
+	/* https://tools.ietf.org/html/rfc1951#section-3.2.6 */
+	unsigned char lengths[288];
+	memset(lengths, 8, 144);
+	memset(lengths + 144, 9, 112);
+	memset(lengths + 256, 7, 24);
+	memset(lengths + 280, 8, 8);
+	int err = inflate_build(fixed_lit, INFLATE_LIT_TABLE_SIZE, INFLATE_LIT_BITS, lengths, 288, lit_symbols, true);
+	memset(lengths, 5, 32);
+	err |= inflate_build(fixed_dist, INFLATE_DIST_TABLE_SIZE, INFLATE_DIST_BITS, lengths, 32, dist_symbols, false);
+	assert(!err);
+	(void)err;
+
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t crc = i;
+		for (int j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ (crc & 1 ? 0xedb88320 : 0);
+		crc_tables[0][i] = crc;
+	}
+	for (int k = 1; k < 8; k++) {
+		for (int i = 0; i < 256; i++)
+			crc_tables[k][i] = (crc_tables[k - 1][i] >> 8) ^ crc_tables[0][crc_tables[k - 1][i] & 0xff];
+	}
+}
+
+/* CRC-32 of gzip with 8 bytes a step */
+static uint32_t inflate_crc32(uint32_t crc, const unsigned char *data, size_t size)
+{
+	crc = ~crc;
+	for (; size >= 8; data += 8, size -= 8) {
+		uint32_t low = crc ^ (data[0] | data[1] << 8 | data[2] << 16 | (uint32_t)data[3] << 24);
+		uint32_t high = data[4] | data[5] << 8 | data[6] << 16 | (uint32_t)data[7] << 24;
+		crc = crc_tables[7][low & 0xff] ^ crc_tables[6][(low >> 8) & 0xff] ^
+			crc_tables[5][(low >> 16) & 0xff] ^ crc_tables[4][low >> 24] ^
+			crc_tables[3][high & 0xff] ^ crc_tables[2][(high >> 8) & 0xff] ^
+			crc_tables[1][(high >> 16) & 0xff] ^ crc_tables[0][high >> 24];
+	}
+	for (; size; data++, size--)
+		crc = crc_tables[0][(crc ^ *data) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+/* Adler-32 of zlib, the sums are reduced before they may overflow */
+static uint32_t inflate_adler32(uint32_t adler, const unsigned char *data, size_t size)
+{
+	uint32_t a = adler & 0xffff;
+	uint32_t b = adler >> 16;
+	while (size) {
+		size_t block = size < 5552 ? size : 5552;
+		size -= block;
+		for (; block; block--) {
+			a += *data++;
+			b += a;
+		}
+		a %= 65521;
+		b %= 65521;
+	}
+	return b << 16 | a;
+}
+
+void inflate_init(struct inflate *inflate, int format)
+{
+	pthread_once(&inflate_once, inflate_init_tables);
+	memset(inflate, 0, sizeof(*inflate));
+	inflate->window = malloc(INFLATE_WINDOW_SIZE);
+	assert(inflate->window);
+	inflate_reset(inflate, format);
+}
+
+void inflate_term(struct inflate *inflate)
+{
+	free(inflate->window);
+	inflate->window = NULL;
+}
+
+void inflate_reset(struct inflate *inflate, int format)
+{
+	inflate->state = INFLATE_HEADER;
+	inflate->format = format;
+	inflate->bits = 0;
+	inflate->nr_bits = 0;
+	inflate->last_block = false;
+	inflate->written = inflate->read = inflate->checked = 0;
+	inflate->checksum = format == INFLATE_ZLIB || format == INFLATE_DEFLATE ? 1 : 0;
+	inflate->total_in = 0;
+}
+
+static void inflate_update_checksum(struct inflate *inflate)
+{
+	while (inflate->checked < inflate->written) {
+		size_t offset = inflate->checked & INFLATE_WINDOW_MASK;
+		size_t size = inflate->written - inflate->checked;
+		if (size > INFLATE_WINDOW_SIZE - offset)
+			size = INFLATE_WINDOW_SIZE - offset;
+		const unsigned char *data = inflate->window + offset;
+		if (inflate->format == INFLATE_GZIP)
+			inflate->checksum = inflate_crc32(inflate->checksum, data, size);
+		else if (inflate->format == INFLATE_ZLIB)
+			inflate->checksum = inflate_adler32(inflate->checksum, data, size);
+		inflate->checked += size;
+	}
+}
+
+/* The bit buffer takes whole bytes while it has room for them */
+static inline void inflate_fill(struct inflate *inflate, const unsigned char **in, const unsigned char *end)
+{
+	while (inflate->nr_bits <= 56 && *in < end) {
+		inflate->bits |= (uint64_t)*(*in)++ << inflate->nr_bits;
+		inflate->nr_bits += 8;
+	}
+}
+
+static inline bool inflate_need(struct inflate *inflate, const unsigned char **in, const unsigned char *end,
+								unsigned int nr_bits)
+{
+	inflate_fill(inflate, in, end);
+	return inflate->nr_bits >= nr_bits;
+}
+
+static inline uint32_t inflate_bits(struct inflate *inflate, unsigned int nr_bits)
+{
+	return inflate->bits & (((uint64_t)1 << nr_bits) - 1);
+}
+
+static inline void inflate_drop(struct inflate *inflate, unsigned int nr_bits)
+{
+	inflate->bits >>= nr_bits;
+	inflate->nr_bits -= nr_bits;
+}
+
+/* Takes the next byte of the byte aligned input */
+static bool inflate_byte(struct inflate *inflate, const unsigned char **in, const unsigned char *end,
+						 unsigned int *byte)
+{
+	if (!inflate_need(inflate, in, end, 8))
+		return false;
+	*byte = inflate_bits(inflate, 8);
+	inflate_drop(inflate, 8);
+	return true;
+}
+
+static inline uint32_t inflate_lookup(const uint32_t *table, unsigned int table_bits, uint64_t bits,
+									  unsigned int *len)
+{
+	uint32_t entry = table[bits & ((1u << table_bits) - 1)];
+	if (INFLATE_ENTRY_OP(entry) != INFLATE_OP_SUBTABLE) {
+		*len = INFLATE_ENTRY_BITS(entry);
+		return entry;
+	}
+	uint32_t sub_bits = (entry >> 8) & 0xf;
+	uint32_t sub = table[(entry >> 16) + ((bits >> table_bits) & ((1u << sub_bits) - 1))];
+	*len = table_bits + INFLATE_ENTRY_BITS(sub);
+	return sub;
+}
+
+static inline void inflate_copy(unsigned char *window, size_t written, size_t dist, size_t length)
+{
+	size_t to = written & INFLATE_WINDOW_MASK;
+	size_t from = (written - dist) & INFLATE_WINDOW_MASK;
+	if (to + length <= INFLATE_WINDOW_SIZE && from + length <= INFLATE_WINDOW_SIZE) {
+		if (dist >= length && dist < INFLATE_WINDOW_SIZE) {
+			memcpy(window + to, window + from, length);
+		} else {
+			/* The match repeats the bytes it is copying */
+			for (size_t i = 0; i < length; i++)
+				window[to + i] = window[from + i];
+		}
+		return;
+	}
+	for (size_t i = 0; i < length; i++)
+		window[(written + i) & INFLATE_WINDOW_MASK] = window[(written - dist + i) & INFLATE_WINDOW_MASK];
+}
+
+/* Decodes literals and matches of the block. A symbol is decoded only when all its bits
+   are received, so the state is just the bit buffer. With 8 input bytes left the buffer
+   is refilled to at least 56 bits, more than the 48 of the longest length and distance. */
+static int inflate_codes(struct inflate *inflate, const unsigned char **in, const unsigned char *end)
+{
+	const unsigned char *p = *in;
+	uint64_t bits = inflate->bits;
+	unsigned int nr_bits = inflate->nr_bits;
+	unsigned char *window = inflate->window;
+	size_t written = inflate->written;
+	/* The output must not overwrite the bytes not read yet */
+	size_t limit = inflate->read + INFLATE_WINDOW_SIZE - INFLATE_MAX_MATCH;
+	const uint32_t *lit = inflate->lit;
+	const uint32_t *dist = inflate->dist;
+	int err = 0;
+
+	while (written <= limit) {
+		if (end - p >= 8) {
+			while (nr_bits <= 56) {
+				bits |= (uint64_t)*p++ << nr_bits;
+				nr_bits += 8;
+			}
+		} else {
+			while (nr_bits <= 56 && p < end) {
+				bits |= (uint64_t)*p++ << nr_bits;
+				nr_bits += 8;
+			}
+		}
+
+		unsigned int len = 0;
+		uint32_t entry = inflate_lookup(lit, INFLATE_LIT_BITS, bits, &len);
+		unsigned int op = INFLATE_ENTRY_OP(entry);
+		if (op == INFLATE_OP_LITERALS) {
+			if (len <= nr_bits) {
+				window[written++ & INFLATE_WINDOW_MASK] = entry >> 8;
+				window[written++ & INFLATE_WINDOW_MASK] = entry >> 16;
+				bits >>= len;
+				nr_bits -= len;
+				continue;
+			}
+			/* The second code may not be received yet */
+			op = INFLATE_OP_LITERAL;
+			len = (entry >> 24) & 0xf;
+		}
+		if (len > nr_bits)
+			break;
+		if (op == INFLATE_OP_LITERAL) {
+			window[written++ & INFLATE_WINDOW_MASK] = entry >> 8;
+			bits >>= len;
+			nr_bits -= len;
+			continue;
+		}
+		if (op == INFLATE_OP_END) {
+			bits >>= len;
+			nr_bits -= len;
+			inflate->state = inflate->last_block ? INFLATE_TRAILER : INFLATE_BLOCK;
+			break;
+		}
+		if (op != INFLATE_OP_LENGTH) {
+			error("Invalid deflate literal/length code");
+			err = ERR_INFLATE_INVALID_DATA;
+			break;
+		}
+
+		unsigned int extra = (entry >> 8) & 0xf;
+		unsigned int used = len + extra;
+		size_t length = (entry >> 16) + ((bits >> len) & ((1u << extra) - 1));
+		unsigned int dist_len = 0;
+		uint32_t dist_entry = inflate_lookup(dist, INFLATE_DIST_BITS, bits >> used, &dist_len);
+		unsigned int dist_extra = (dist_entry >> 8) & 0xf;
+		if (used + dist_len + dist_extra > nr_bits)
+			break;
+		if (INFLATE_ENTRY_OP(dist_entry) != INFLATE_OP_LENGTH) {
+			error("Invalid deflate distance code");
+			err = ERR_INFLATE_INVALID_DATA;
+			break;
+		}
+		size_t distance = (dist_entry >> 16) + ((bits >> (used + dist_len)) & ((1u << dist_extra) - 1));
+		if (distance > written) {
+			error("Deflate distance %zu is beyond the start of the data", distance);
+			err = ERR_INFLATE_INVALID_DATA;
+			break;
+		}
+		used += dist_len + dist_extra;
+		bits >>= used;
+		nr_bits -= used;
+		inflate_copy(window, written, distance, length);
+		written += length;
+	}
+
+	*in = p;
+	inflate->bits = bits;
+	inflate->nr_bits = nr_bits;
+	inflate->written = written;
+	return err;
+}
+
+/* Reads the code lengths of the dynamic block, see https://tools.ietf.org/html/rfc1951#section-3.2.7 */
+static int inflate_lengths(struct inflate *inflate, const unsigned char **in, const unsigned char *end)
+{
+	unsigned int total = inflate->nr_lit + inflate->nr_dist;
+	while (inflate->nr_lengths < total) {
+		inflate_fill(inflate, in, end);
+		unsigned int len = 0;
+		uint32_t entry = inflate_lookup(inflate->code_table, INFLATE_CODE_BITS, inflate->bits, &len);
+		if (INFLATE_ENTRY_OP(entry) != INFLATE_OP_LITERAL) {
+			if (inflate->nr_bits < len)
+				return 0;
+			error("Invalid deflate code length code");
+			return ERR_INFLATE_INVALID_DATA;
+		}
+		unsigned int symbol = (entry >> 8) & 0xff;
+		static const unsigned char repeat_bits[3] = {2, 3, 7};
+		unsigned int extra = symbol < 16 ? 0 : repeat_bits[symbol - 16];
+		if (inflate->nr_bits < len + extra)
+			return 0;
+		inflate_drop(inflate, len);
+		if (symbol < 16) {
+			inflate->lengths[inflate->nr_lengths++] = symbol;
+			continue;
+		}
+		static const unsigned char repeat_base[3] = {3, 3, 11};
+		unsigned int repeat = repeat_base[symbol - 16] + inflate_bits(inflate, extra);
+		inflate_drop(inflate, extra);
+		unsigned char value = 0;
+		if (symbol == 16) {
+			if (inflate->nr_lengths == 0) {
+				error("Deflate code length repeated before the first one");
+				return ERR_INFLATE_INVALID_DATA;
+			}
+			value = inflate->lengths[inflate->nr_lengths - 1];
+		}
+		if (inflate->nr_lengths + repeat > total) {
+			error("Deflate code lengths exceed the number of codes");
+			return ERR_INFLATE_INVALID_DATA;
+		}
+		memset(inflate->lengths + inflate->nr_lengths, value, repeat);
+		inflate->nr_lengths += repeat;
+	}
+
+	if (inflate->lengths[256] == 0) {
+		error("Deflate block has no end code");
+		return ERR_INFLATE_INVALID_DATA;
+	}
+	if (inflate_build(inflate->lit_table, INFLATE_LIT_TABLE_SIZE, INFLATE_LIT_BITS, inflate->lengths,
+					  inflate->nr_lit, lit_symbols, true) ||
+		inflate_build(inflate->dist_table, INFLATE_DIST_TABLE_SIZE, INFLATE_DIST_BITS,
+					  inflate->lengths + inflate->nr_lit, inflate->nr_dist, dist_symbols, false)) {
+		error("Invalid deflate Huffman code");
+		return ERR_INFLATE_INVALID_DATA;
+	}
+	inflate->lit = inflate->lit_table;
+	inflate->dist = inflate->dist_table;
+	inflate->state = INFLATE_CODES;
+	return 0;
+}
+
+/* Copies the stored block to the window, see https://tools.ietf.org/html/rfc1951#section-3.2.4 */
+static void inflate_stored(struct inflate *inflate, const unsigned char **in, const unsigned char *end)
+{
+	while (inflate->left) {
+		size_t space = inflate->read + INFLATE_WINDOW_SIZE - inflate->written;
+		if (space == 0)
+			return;
+		unsigned char *to = inflate->window + (inflate->written & INFLATE_WINDOW_MASK);
+		if (inflate->nr_bits) {
+			*to = inflate_bits(inflate, 8);
+			inflate_drop(inflate, 8);
+			inflate->written++;
+			inflate->left--;
+			continue;
+		}
+		size_t size = end - *in;
+		if (size == 0)
+			return;
+		size_t contiguous = INFLATE_WINDOW_SIZE - (inflate->written & INFLATE_WINDOW_MASK);
+		if (size > inflate->left)
+			size = inflate->left;
+		if (size > space)
+			size = space;
+		if (size > contiguous)
+			size = contiguous;
+		memcpy(to, *in, size);
+		*in += size;
+		inflate->written += size;
+		inflate->left -= size;
+	}
+	inflate->state = inflate->last_block ? INFLATE_TRAILER : INFLATE_BLOCK;
+}
+
+/* The gzip header, see https://tools.ietf.org/html/rfc1952#section-2.3 */
+#define GZIP_FHCRC		0x02
+#define GZIP_FEXTRA		0x04
+#define GZIP_FNAME		0x08
+#define GZIP_FCOMMENT	0x10
+#define GZIP_RESERVED	0xe0
+
+/* Returns the state of the first gzip header field present after the state */
+static int inflate_gzip_next(struct inflate *inflate, int state)
+{
+	static const struct {
+		int				state;
+		unsigned int	flag;
+	} fields[] = {
+		{INFLATE_GZIP_EXTRA_LEN, GZIP_FEXTRA},
+		{INFLATE_GZIP_NAME, GZIP_FNAME},
+		{INFLATE_GZIP_COMMENT, GZIP_FCOMMENT},
+		{INFLATE_GZIP_HCRC, GZIP_FHCRC},
+	};
+	for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+		if (fields[i].state > state && (inflate->header_flags & fields[i].flag))
+			return fields[i].state;
+	}
+	return INFLATE_BLOCK;
+}
+
+static int inflate_header(struct inflate *inflate, const unsigned char **in, const unsigned char *end)
+{
+	if (!inflate_need(inflate, in, end, inflate->format == INFLATE_GZIP ? 32 : 16))
+		return 0;
+	unsigned int first = inflate_bits(inflate, 8);
+	unsigned int second = (inflate->bits >> 8) & 0xff;
+	/* https://tools.ietf.org/html/rfc1950#section-2.2 */
+	bool zlib = (first & 0xf) == 8 && (first >> 4) <= 7 && (first << 8 | second) % 31 == 0;
+
+	switch (inflate->format) {
+	case INFLATE_DEFLATE:
+		inflate->format = zlib ? INFLATE_ZLIB : INFLATE_RAW;
+		return 0;
+	case INFLATE_RAW:
+		inflate->state = INFLATE_BLOCK;
+		return 0;
+	case INFLATE_ZLIB:
+		if (!zlib || (second & 0x20)) {
+			error("Invalid zlib header 0x%02x%02x", first, second);
+			return ERR_INFLATE_INVALID_DATA;
+		}
+		inflate_drop(inflate, 16);
+		inflate->state = INFLATE_BLOCK;
+		return 0;
+	}
+
+	unsigned int method = (inflate->bits >> 16) & 0xff;
+	inflate->header_flags = (inflate->bits >> 24) & 0xff;
+	if (first != 0x1f || second != 0x8b || method != 8 || (inflate->header_flags & GZIP_RESERVED)) {
+		error("Invalid gzip header");
+		return ERR_INFLATE_INVALID_DATA;
+	}
+	inflate_drop(inflate, 32);
+	inflate->state = INFLATE_GZIP_MTIME;
+	return 0;
+}
+
+/* Skips the gzip header fields after its fixed part */
+static void inflate_gzip_fields(struct inflate *inflate, const unsigned char **in, const unsigned char *end)
+{
+	unsigned int byte = 0;
+	switch (inflate->state) {
+	case INFLATE_GZIP_MTIME:
+		if (!inflate_need(inflate, in, end, 48))
+			return;
+		inflate_drop(inflate, 48);
+		break;
+	case INFLATE_GZIP_EXTRA_LEN:
+		if (!inflate_need(inflate, in, end, 16))
+			return;
+		inflate->left = inflate_bits(inflate, 16);
+		inflate_drop(inflate, 16);
+		inflate->state = INFLATE_GZIP_EXTRA;
+		return;
+	case INFLATE_GZIP_EXTRA:
+		for (; inflate->left; inflate->left--) {
+			if (!inflate_byte(inflate, in, end, &byte))
+				return;
+		}
+		break;
+	case INFLATE_GZIP_NAME:
+	case INFLATE_GZIP_COMMENT:
+		do {
+			if (!inflate_byte(inflate, in, end, &byte))
+				return;
+		} while (byte);
+		break;
+	case INFLATE_GZIP_HCRC:
+		if (!inflate_need(inflate, in, end, 16))
+			return;
+		inflate_drop(inflate, 16);
+		break;
+	}
+	inflate->state = inflate_gzip_next(inflate, inflate->state);
+}
+
+static int inflate_trailer(struct inflate *inflate, const unsigned char **in, const unsigned char *end)
+{
+	inflate_drop(inflate, inflate->nr_bits % 8);
+	if (inflate->format == INFLATE_ZLIB) {
+		/* Adler-32 in network byte order */
+		if (!inflate_need(inflate, in, end, 32))
+			return 0;
+		uint32_t value = inflate_bits(inflate, 32);
+		uint32_t adler = (value & 0xff) << 24 | (value & 0xff00) << 8 | (value >> 8 & 0xff00) | value >> 24;
+		inflate_drop(inflate, 32);
+		inflate_update_checksum(inflate);
+		if (adler != inflate->checksum) {
+			error("Adler-32 mismatch: 0x%08x instead of 0x%08x", inflate->checksum, adler);
+			return ERR_INFLATE_CHECKSUM;
+		}
+	} else if (inflate->format == INFLATE_GZIP) {
+		/* CRC-32 and the size modulo 2^32 */
+		if (!inflate_need(inflate, in, end, 64))
+			return 0;
+		uint32_t crc = inflate_bits(inflate, 32);
+		uint32_t size = inflate->bits >> 32;
+		inflate_drop(inflate, 32);
+		inflate_drop(inflate, 32);
+		inflate_update_checksum(inflate);
+		if (crc != inflate->checksum || size != (uint32_t)inflate->written) {
+			error("gzip CRC-32 or size mismatch: 0x%08x %u instead of 0x%08x %u",
+				inflate->checksum, (uint32_t)inflate->written, crc, size);
+			return ERR_INFLATE_CHECKSUM;
+		}
+	}
+	inflate->state = INFLATE_DONE;
+	return 0;
+}
+
+static int inflate_block(struct inflate *inflate, const unsigned char **in, const unsigned char *end)
+{
+	switch (inflate->state) {
+	case INFLATE_BLOCK: {
+		if (!inflate_need(inflate, in, end, 3))
+			return 0;
+		unsigned int header = inflate_bits(inflate, 3);
+		inflate_drop(inflate, 3);
+		inflate->last_block = header & 1;
+		switch (header >> 1) {
+		case 0:
+			inflate->state = INFLATE_STORED_LEN;
+			break;
+		case 1:
+			inflate->lit = fixed_lit;
+			inflate->dist = fixed_dist;
+			inflate->state = INFLATE_CODES;
+			break;
+		case 2:
+			inflate->state = INFLATE_TABLE_COUNTS;
+			break;
+		default:
+			error("Invalid deflate block type");
+			return ERR_INFLATE_INVALID_DATA;
+		}
+		return 0;
+	}
+	case INFLATE_STORED_LEN: {
+		inflate_drop(inflate, inflate->nr_bits % 8);
+		if (!inflate_need(inflate, in, end, 32))
+			return 0;
+		uint32_t len = inflate_bits(inflate, 16);
+		uint32_t nlen = (inflate->bits >> 16) & 0xffff;
+		inflate_drop(inflate, 32);
+		if (len != (~nlen & 0xffff)) {
+			error("Deflate stored block length is not confirmed");
+			return ERR_INFLATE_INVALID_DATA;
+		}
+		inflate->left = len;
+		inflate->state = INFLATE_STORED;
+		return 0;
+	}
+	case INFLATE_TABLE_COUNTS:
+		if (!inflate_need(inflate, in, end, 14))
+			return 0;
+		inflate->nr_lit = 257 + inflate_bits(inflate, 5);
+		inflate->nr_dist = 1 + ((inflate->bits >> 5) & 0x1f);
+		inflate->nr_code = 4 + ((inflate->bits >> 10) & 0xf);
+		inflate_drop(inflate, 14);
+		if (inflate->nr_lit > 286 || inflate->nr_dist > 30) {
+			error("Invalid number of deflate codes");
+			return ERR_INFLATE_INVALID_DATA;
+		}
+		memset(inflate->lengths, 0, 19);
+		inflate->nr_lengths = 0;
+		inflate->state = INFLATE_TABLE_CODE_LENGTHS;
+		return 0;
+	case INFLATE_TABLE_CODE_LENGTHS:
+		for (; inflate->nr_lengths < inflate->nr_code; inflate->nr_lengths++) {
+			if (!inflate_need(inflate, in, end, 3))
+				return 0;
+			inflate->lengths[code_order[inflate->nr_lengths]] = inflate_bits(inflate, 3);
+			inflate_drop(inflate, 3);
+		}
+		if (inflate_build(inflate->code_table, 1 << INFLATE_CODE_BITS, INFLATE_CODE_BITS,
+						  inflate->lengths, 19, code_symbols, false)) {
+			error("Invalid deflate code length code");
+			return ERR_INFLATE_INVALID_DATA;
+		}
+		inflate->nr_lengths = 0;
+		inflate->state = INFLATE_TABLE_LENGTHS;
+		return 0;
+	case INFLATE_TABLE_LENGTHS:
+		return inflate_lengths(inflate, in, end);
+	case INFLATE_STORED:
+		inflate_stored(inflate, in, end);
+		return 0;
+	case INFLATE_CODES:
+		return inflate_codes(inflate, in, end);
+	}
+	assert(0);
+	return ERR_INFLATE_INVALID_DATA;
+}
+
+int inflate_decode(struct inflate *inflate, const void *data, size_t size, size_t *consumed)
+{
+	const unsigned char *in = data;
+	const unsigned char *end = in + size;
+	int err = 0;
+	while (!err) {
+		int state = inflate->state;
+		int format = inflate->format;
+		size_t written = inflate->written;
+		const unsigned char *start = in;
+		switch (state) {
+		case INFLATE_HEADER:
+			err = inflate_header(inflate, &in, end);
+			break;
+		case INFLATE_GZIP_MTIME:
+		case INFLATE_GZIP_EXTRA_LEN:
+		case INFLATE_GZIP_EXTRA:
+		case INFLATE_GZIP_NAME:
+		case INFLATE_GZIP_COMMENT:
+		case INFLATE_GZIP_HCRC:
+			inflate_gzip_fields(inflate, &in, end);
+			break;
+		case INFLATE_TRAILER:
+			err = inflate_trailer(inflate, &in, end);
+			break;
+		case INFLATE_DONE:
+			if (in < end || inflate->nr_bits >= 8) {
+				error("Data after the end of the deflate stream");
+				err = ERR_INFLATE_INVALID_DATA;
+			}
+			break;
+		default:
+			err = inflate_block(inflate, &in, end);
+			break;
+		}
+		/* Stops when there is no input or no room for the output */
+		if (inflate->state == state && inflate->format == format && inflate->written == written && in == start)
+			break;
+	}
+	inflate_update_checksum(inflate);
+	*consumed = in - (const unsigned char*)data;
+	inflate->total_in += *consumed;
+	return err;
+}
+
+size_t inflate_peek(struct inflate *inflate, const char **data)
+{
+	size_t offset = inflate->read & INFLATE_WINDOW_MASK;
+	size_t size = inflate->written - inflate->read;
+	if (size > INFLATE_WINDOW_SIZE - offset)
+		size = INFLATE_WINDOW_SIZE - offset;
+	*data = (const char*)inflate->window + offset;
+	return size;
+}
+
+void inflate_consume(struct inflate *inflate, size_t size)
+{
+	assert(size <= inflate->written - inflate->read);
+	inflate->read += size;
+}
+
+int inflate_eof(struct inflate *inflate)
+{
+	if (inflate->state == INFLATE_DONE)
+		return 0;
+	error("The deflate stream is truncated");
+	return ERR_INFLATE_TRUNCATED;
+}
+
+#ifdef UNIT_TEST
+static const char test_json[] =
+	"{\"id\": 1, \"name\": \"alpha\", \"tags\": [\"a\", \"b\"]},\n"
+	"{\"id\": 2, \"name\": \"beta\", \"tags\": [\"b\", \"c\"]},\n"
+	"{\"id\": 3, \"name\": \"gamma\", \"tags\": [\"c\", \"a\"]},\n"
+	"{\"id\": 4, \"name\": \"delta\", \"tags\": []}\n";
+
+/* gzip -9 of test_json, fixed Huffman codes */
+static const unsigned char test_gzip[] = {
+	0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x03, 0xab, 0x56, 0xca, 0x4c, 0x51, 0xb2,
+	0x52, 0x30, 0xd4, 0x51, 0x50, 0xca, 0x4b, 0xcc, 0x4d, 0x05, 0x32, 0x95, 0x12, 0x73, 0x0a, 0x32,
+	0x12, 0x95, 0x80, 0x02, 0x25, 0x89, 0xe9, 0xc5, 0x40, 0x81, 0x68, 0x25, 0x30, 0x2f, 0x49, 0x29,
+	0xb6, 0x56, 0x87, 0xab, 0x1a, 0xa2, 0xde, 0x08, 0x49, 0x7d, 0x52, 0x6a, 0x09, 0xaa, 0xf2, 0x24,
+	0x10, 0x2f, 0x19, 0x59, 0xb9, 0x31, 0x92, 0xf2, 0xf4, 0xc4, 0xdc, 0x5c, 0x54, 0xf5, 0xc9, 0x20,
+	0x5e, 0x22, 0xb2, 0x7a, 0x13, 0x24, 0xf5, 0x29, 0xa9, 0x39, 0xa8, 0xe6, 0xc7, 0xd6, 0x72, 0x01,
+	0x00, 0x56, 0x2b, 0x67, 0xd4, 0xb6, 0x00, 0x00, 0x00,
+};
+/* zlib of "Hello, Hello, Hello!", fixed Huffman codes */
+static const unsigned char test_zlib[] = {
+	0x78, 0x01, 0xf3, 0x48, 0xcd, 0xc9, 0xc9, 0xd7, 0x51, 0xf0, 0x40, 0xa2, 0x14, 0x01, 0x46, 0x3e,
+	0x06, 0x96,
+};
+/* A stored block of "stored bytes" */
+static const unsigned char test_stored[] = {
+	0x01, 0x0c, 0x00, 0xf3, 0xff, 0x73, 0x74, 0x6f, 0x72, 0x65, 0x64, 0x20, 0x62, 0x79, 0x74, 0x65,
+	0x73,
+};
+/* Bare deflate of test_long_data(), a match at the distance of 32668 and dynamic codes */
+static const unsigned char test_long[] = {
+	0xed, 0xc1, 0xd1, 0x66, 0x02, 0x00, 0x00, 0x40, 0x51, 0x11, 0x51, 0x4a, 0x11, 0x23, 0x22, 0x22,
+	0x22, 0x4a, 0x29, 0x22, 0x46, 0x44, 0x44, 0x44, 0xd9, 0x14, 0x11, 0x11, 0x11, 0x11, 0x51, 0x8a,
+	0x88, 0x88, 0x11, 0x23, 0x22, 0x4a, 0x11, 0x11, 0x31, 0x22, 0x22, 0xa2, 0x14, 0x11, 0x11, 0x31,
+	0x22, 0x62, 0x94, 0x45, 0x44, 0x44, 0x64, 0x1f, 0xb1, 0xd7, 0x7b, 0x8e, 0xc4, 0x14, 0xc8, 0x36,
+	0x67, 0x27, 0x99, 0xe5, 0x3d, 0xdf, 0x5e, 0x9c, 0x15, 0xb6, 0x50, 0xa1, 0xb3, 0xbc, 0x28, 0xed,
+	0xe1, 0x62, 0x77, 0x75, 0x7d, 0x71, 0x44, 0x4a, 0xbd, 0xf5, 0x4d, 0xf5, 0x1a, 0x2d, 0xf7, 0x37,
+	0x77, 0xb5, 0x33, 0xf6, 0xf1, 0xb5, 0x7d, 0x68, 0x5c, 0xf1, 0xca, 0xe0, 0xfb, 0xa9, 0x75, 0x27,
+	0x3e, 0x87, 0x3b, 0x81, 0xce, 0x93, 0xac, 0x8e, 0xf6, 0x42, 0xbd, 0x37, 0x55, 0x1b, 0x1f, 0x44,
+	0x06, 0x5f, 0xba, 0x3e, 0xf9, 0x11, 0x1b, 0xfd, 0x99, 0xc6, 0xf4, 0x28, 0x35, 0xbf, 0xe5, 0x5a,
+	0xf3, 0x5f, 0xb9, 0x35, 0x98, 0x05, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0xe0, 0x1f, 0x24, 0xa6, 0x40, 0xb6, 0x39, 0x3b, 0xc9, 0x2c, 0xef, 0xf9,
+	0xf6, 0xe2, 0xac, 0xb0, 0x85, 0x0a, 0x9d, 0xe5, 0x45, 0x69, 0x0f, 0x17, 0xbb, 0xab, 0xeb, 0x8b,
+	0x23, 0x52, 0xea, 0xad, 0x6f, 0xaa, 0xd7, 0x68, 0xb9, 0xbf, 0xb9, 0xab, 0x9d, 0xb1, 0x8f, 0xaf,
+	0xed, 0x43, 0xe3, 0x8a, 0x57, 0x06, 0xdf, 0x4f, 0xad, 0x3b, 0xf1, 0x39, 0xdc, 0x09, 0x74, 0x9e,
+	0x64, 0x75, 0xb4, 0x17, 0xea, 0xbd, 0xa9, 0xda, 0xf8, 0x20, 0x32, 0xf8, 0xd2, 0xf5, 0xc9, 0x8f,
+	0xd8, 0xe8, 0xcf, 0x34, 0xa6, 0x47, 0xa9, 0xf9, 0x2d, 0xd7, 0x9a, 0xff, 0xca, 0xad, 0xc1, 0x3f,
+};
+/* gzip -9 of 100000 'a', the output wraps the window */
+static const unsigned char test_repeated[] = {
+	0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x03, 0xed, 0xc1, 0x31, 0x01, 0x00, 0x00,
+	0x00, 0xc2, 0xa0, 0xac, 0xeb, 0x5f, 0xc2, 0x1a, 0x1e, 0x40, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xaf, 0x06, 0x87, 0xfa, 0xe2,
+	0x1b, 0xa0, 0x86, 0x01, 0x00,
+};
+
+static unsigned char *test_long_data(size_t *size)
+{
+	*size = 100 + 32568 + 100;
+	unsigned char *data = malloc(*size);
+	assert(data);
+	for (size_t i = 0; i < 100; i++)
+		data[i] = data[*size - 100 + i] = (i * 37 + 11) & 0xff;
+	memset(data + 100, 'z', 32568);
+	return data;
+}
+
+/* Decodes the input given in slices of slice bytes and takes the output in pieces of up to
+   piece bytes. Returns the error of the decoder or of the end of input. */
+static int test_decode(int format, const unsigned char *data, size_t size, size_t slice, size_t piece,
+					   unsigned char *out, size_t *out_size)
+{
+	struct inflate inflate;
+	inflate_init(&inflate, format);
+	size_t pos = 0;
+	*out_size = 0;
+	int err = 0;
+	while (!err) {
+		size_t consumed = 0;
+		size_t len = size - pos < slice ? size - pos : slice;
+		err = inflate_decode(&inflate, data + pos, len, &consumed);
+		assert(consumed <= len);
+		pos += consumed;
+		const char *output = NULL;
+		size_t output_size = inflate_peek(&inflate, &output);
+		if (output_size > piece)
+			output_size = piece;
+		memcpy(out + *out_size, output, output_size);
+		*out_size += output_size;
+		inflate_consume(&inflate, output_size);
+		if (!err && pos == size && consumed == 0 && output_size == 0)
+			err = inflate_eof(&inflate);
+		if (pos == size && inflate_done(&inflate) && inflate_peek(&inflate, &output) == 0)
+			break;
+	}
+	inflate_term(&inflate);
+	return err;
+}
+
+static void test_decode_all(int format, const unsigned char *data, size_t size,
+							const void *expected, size_t expected_size)
+{
+	unsigned char *out = malloc(expected_size + 1);
+	assert(out);
+	static const size_t pieces[] = {1, 1000, SIZE_MAX};
+	for (size_t slice = 1; slice <= size; slice++) {
+		for (size_t i = 0; i < sizeof(pieces) / sizeof(pieces[0]); i++) {
+			/* Small pieces of large outputs take long */
+			if (pieces[i] == 1 && expected_size > 1000 && slice > 3)
+				continue;
+			size_t out_size = 0;
+			assert(!test_decode(format, data, size, slice, pieces[i], out, &out_size));
+			assert(out_size == expected_size && !memcmp(out, expected, out_size));
+		}
+	}
+	free(out);
+}
+
+void test_inflate(void)
+{
+	test_decode_all(INFLATE_GZIP, test_gzip, sizeof(test_gzip), test_json, strlen(test_json));
+	test_decode_all(INFLATE_ZLIB, test_zlib, sizeof(test_zlib), "Hello, Hello, Hello!", 20);
+	test_decode_all(INFLATE_DEFLATE, test_zlib, sizeof(test_zlib), "Hello, Hello, Hello!", 20);
+	test_decode_all(INFLATE_RAW, test_stored, sizeof(test_stored), "stored bytes", 12);
+	test_decode_all(INFLATE_DEFLATE, test_stored, sizeof(test_stored), "stored bytes", 12);
+	size_t long_size = 0;
+	unsigned char *long_data = test_long_data(&long_size);
+	test_decode_all(INFLATE_RAW, test_long, sizeof(test_long), long_data, long_size);
+	free(long_data);
+	unsigned char *repeated = malloc(100000);
+	memset(repeated, 'a', 100000);
+	test_decode_all(INFLATE_GZIP, test_repeated, sizeof(test_repeated), repeated, 100000);
+
+	/* Broken streams */
+	unsigned char broken[sizeof(test_gzip) + 1];
+	size_t size = 0;
+	memcpy(broken, test_gzip, sizeof(test_gzip));
+	broken[sizeof(test_gzip) - 8] ^= 1;	/* CRC-32 */
+	assert(test_decode(INFLATE_GZIP, broken, sizeof(test_gzip), 7, SIZE_MAX, repeated, &size) ==
+		ERR_INFLATE_CHECKSUM);
+	memcpy(broken, test_gzip, sizeof(test_gzip));
+	broken[sizeof(test_gzip) - 1] ^= 1;	/* ISIZE */
+	assert(test_decode(INFLATE_GZIP, broken, sizeof(test_gzip), 7, SIZE_MAX, repeated, &size) ==
+		ERR_INFLATE_CHECKSUM);
+	memcpy(broken, test_zlib, sizeof(test_zlib));
+	broken[sizeof(test_zlib) - 1] ^= 1;	/* Adler-32 */
+	assert(test_decode(INFLATE_ZLIB, broken, sizeof(test_zlib), 7, SIZE_MAX, repeated, &size) ==
+		ERR_INFLATE_CHECKSUM);
+	for (size_t len = 0; len < sizeof(test_gzip); len++) {
+		assert(test_decode(INFLATE_GZIP, test_gzip, len, 7, SIZE_MAX, repeated, &size) ==
+			ERR_INFLATE_TRUNCATED);
+	}
+	memcpy(broken, test_gzip, sizeof(test_gzip));
+	broken[sizeof(test_gzip)] = 0;
+	assert(test_decode(INFLATE_GZIP, broken, sizeof(broken), 7, SIZE_MAX, repeated, &size) ==
+		ERR_INFLATE_INVALID_DATA);
+	assert(test_decode(INFLATE_ZLIB, test_gzip, sizeof(test_gzip), 7, SIZE_MAX, repeated, &size) ==
+		ERR_INFLATE_INVALID_DATA);
+	assert(test_decode(INFLATE_GZIP, test_zlib, sizeof(test_zlib), 7, SIZE_MAX, repeated, &size) ==
+		ERR_INFLATE_INVALID_DATA);
+	memcpy(broken, test_stored, sizeof(test_stored));
+	broken[3] ^= 1;	/* NLEN */
+	assert(test_decode(INFLATE_RAW, broken, sizeof(test_stored), 7, SIZE_MAX, repeated, &size) ==
+		ERR_INFLATE_INVALID_DATA);
+	broken[0] = 0x07;	/* the reserved block type */
+	assert(test_decode(INFLATE_RAW, broken, sizeof(test_stored), 7, SIZE_MAX, repeated, &size) ==
+		ERR_INFLATE_INVALID_DATA);
+	/* A fixed block with a match at the distance of 1 before any output */
+	broken[0] = 0x03;
+	broken[1] = 0x02;
+	broken[2] = 0x00;
+	assert(test_decode(INFLATE_RAW, broken, 3, 7, SIZE_MAX, repeated, &size) == ERR_INFLATE_INVALID_DATA);
+	free(repeated);
+}
+#endif
+
+#ifdef FUZZ
+/* Decodes up to 16 MiB of output, summing it up in the hash */
+static int fuzz_decode(int format, const unsigned char *data, size_t size, size_t slice,
+					   size_t *out_size, uint32_t *hash)
+{
+	struct inflate inflate;
+	inflate_init(&inflate, format);
+	size_t pos = 0;
+	*out_size = 0;
+	*hash = 2166136261u;
+	int err = 0;
+	while (!err && *out_size < (1 << 24)) {
+		size_t consumed = 0;
+		size_t len = size - pos < slice ? size - pos : slice;
+		err = inflate_decode(&inflate, data + pos, len, &consumed);
+		assert(consumed <= len);
+		pos += consumed;
+		const char *output = NULL;
+		size_t output_size = inflate_peek(&inflate, &output);
+		for (size_t i = 0; i < output_size; i++)
+			*hash = (*hash ^ (unsigned char)output[i]) * 16777619u;
+		*out_size += output_size;
+		inflate_consume(&inflate, output_size);
+		if (!err && pos == size && consumed == 0 && output_size == 0)
+			err = inflate_eof(&inflate);
+		if (pos == size && inflate_done(&inflate) && inflate_peek(&inflate, &output) == 0)
+			break;
+	}
+	inflate_term(&inflate);
+	return err;
+}
+
+/* The first byte is the format, the second one is the slice size and the rest is the
+   stream. Decoding it in slices must give the same result as at once. */
+void fuzz_inflate(const unsigned char *data, size_t size)
+{
+	if (size < 2)
+		return;
+	int format = data[0] % 4;
+	size_t slice = data[1] + 1;
+	size_t out_size, whole_size;
+	uint32_t hash, whole_hash;
+	int err = fuzz_decode(format, data + 2, size - 2, slice, &out_size, &hash);
+	int whole_err = fuzz_decode(format, data + 2, size - 2, size, &whole_size, &whole_hash);
+	if (out_size < (1 << 24) && whole_size < (1 << 24))
+		assert(err == whole_err && out_size == whole_size && hash == whole_hash);
+}
+#endif
+
+#ifdef BENCH
+#include <stdio.h>
+#include <unistd.h>
+
+/* Writes a JSON-like corpus of about size bytes to the file */
+static size_t bench_corpus(FILE *file, size_t size)
+{
+	static const char *names[] = {"alpha", "beta", "gamma", "delta", "epsilon", "zeta"};
+	size_t written = 0;
+	unsigned int seed = 1;
+	for (size_t id = 0; written < size; id++) {
+		seed = seed * 1103515245 + 12345;
+		written += fprintf(file, "{\"id\": %zu, \"name\": \"%s-%u\", \"score\": %u.%02u, \"active\": %s},\n",
+			id, names[seed % 6], (seed >> 8) % 1000, (seed >> 12) % 100, (seed >> 20) % 100,
+			seed & 0x100 ? "true" : "false");
+	}
+	return written;
+}
+
+/* Reads the gzip compressed file into memory */
+static unsigned char *bench_gzip(const char *path, size_t *size)
+{
+	char command[64];
+	snprintf(command, sizeof(command), "gzip -c %s", path);
+	FILE *pipe = popen(command, "r");
+	assert(pipe);
+	size_t capacity = 1 << 20;
+	unsigned char *data = malloc(capacity);
+	*size = 0;
+	size_t len = 0;
+	while ((len = fread(data + *size, 1, capacity - *size, pipe)) > 0) {
+		*size += len;
+		if (*size == capacity)
+			data = realloc(data, capacity *= 2);
+		assert(data);
+	}
+	int status = pclose(pipe);
+	assert(status == 0);
+	(void)status;
+	return data;
+}
+
+void bench_inflate(void)
+{
+	char path[] = "/tmp/http_client_bench_XXXXXX";
+	int fd = mkstemp(path);
+	assert(fd != -1);
+	FILE *file = fdopen(fd, "w");
+	size_t corpus_size = bench_corpus(file, 32 << 20);
+	fclose(file);
+	size_t size = 0;
+	unsigned char *data = bench_gzip(path, &size);
+	unlink(path);
+
+	struct inflate inflate;
+	inflate_init(&inflate, INFLATE_GZIP);
+	for (size_t slice = 1 << 12; slice <= 1 << 20; slice <<= 4) {
+		double start = bench_now();
+		size_t iterations = 8;
+		for (size_t n = 0; n < iterations; n++) {
+			inflate_reset(&inflate, INFLATE_GZIP);
+			size_t pos = 0;
+			while (!inflate_done(&inflate)) {
+				size_t consumed = 0;
+				int err = inflate_decode(&inflate, data + pos, size - pos < slice ? size - pos : slice, &consumed);
+				assert(!err);
+				(void)err;
+				pos += consumed;
+				const char *output = NULL;
+				size_t output_size;
+				while ((output_size = inflate_peek(&inflate, &output)))
+					inflate_consume(&inflate, output_size);
+			}
+			assert(pos == size && inflate.written == corpus_size);
+		}
+		double seconds = bench_now() - start;
+		printf("inflate corpus=%zu gzip=%zu slice=%zu MB/s=%.0f\n", corpus_size, size, slice,
+			iterations * corpus_size / seconds / 1e6);
+	}
+	inflate_term(&inflate);
+	free(data);
+}
+#endif
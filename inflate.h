@@ -0,0 +1,114 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Streaming decoder of deflate data, see https://tools.ietf.org/html/rfc1951, bare or in
+   the zlib (RFC 1950) or gzip (RFC 1952) format. The input is pushed in slices of any size.
+   The output goes to the 32 KiB sliding window, which the caller reads in place, so the
+   decoder never copies it. Huffman codes are decoded with lookup tables, a table entry
+   decodes two short literal codes at once. */
+
+/* Formats */
+#define INFLATE_RAW		0
+#define INFLATE_ZLIB	1
+#define INFLATE_GZIP	2
+#define INFLATE_DEFLATE	3	/* HTTP "deflate": zlib, or raw deflate sent by some servers */
+
+/* States */
+#define INFLATE_HEADER				0
+#define INFLATE_GZIP_MTIME			1	/* MTIME, XFL and OS of the gzip header */
+#define INFLATE_GZIP_EXTRA_LEN		2
+#define INFLATE_GZIP_EXTRA			3
+#define INFLATE_GZIP_NAME			4
+#define INFLATE_GZIP_COMMENT		5
+#define INFLATE_GZIP_HCRC			6
+#define INFLATE_BLOCK				7
+#define INFLATE_STORED_LEN			8
+#define INFLATE_STORED				9
+#define INFLATE_TABLE_COUNTS		10
+#define INFLATE_TABLE_CODE_LENGTHS	11
+#define INFLATE_TABLE_LENGTHS		12
+#define INFLATE_CODES				13
+#define INFLATE_TRAILER				14
+#define INFLATE_DONE				15
+
+#define INFLATE_WINDOW_SIZE	(1 << 15)
+
+/* Bits of the first level of the tables, longer codes are looked up in second level ones */
+#define INFLATE_LIT_BITS	10
+#define INFLATE_DIST_BITS	8
+/* The first level and the largest second levels a code may need: each table of 2^n entries
+   takes at least n + 1 symbols out of 286 literal/length and 30 distance ones */
+#define INFLATE_LIT_TABLE_SIZE	((1 << INFLATE_LIT_BITS) + 286 / 6 * 32)
+#define INFLATE_DIST_TABLE_SIZE	((1 << INFLATE_DIST_BITS) + 30 / 8 * 128)
+
+#define ERR_INFLATE_INVALID_DATA	-31
+#define ERR_INFLATE_CHECKSUM		-32	/* the data is corrupted */
+#define ERR_INFLATE_TRUNCATED		-33	/* the input has ended before the end of the stream */
+
+struct inflate {
+	int				state;
+	int				format;
+	uint64_t		bits;	/* input bits not decoded yet, the first one is the lowest */
+	unsigned int	nr_bits;
+	bool			last_block;
+
+	unsigned char	*window;
+	size_t			written;	/* output since the stream start, the window has the last 32 KiB */
+	size_t			read;		/* output taken by the caller */
+	size_t			checked;	/* output in the checksum */
+	uint32_t		checksum;	/* CRC-32 for gzip, Adler-32 for zlib */
+	size_t			total_in;
+
+	unsigned int	header_flags;	/* of the gzip header */
+	size_t			left;	/* bytes of the gzip header field or of the stored block */
+
+	/* Code lengths of the dynamic block being read */
+	unsigned int	nr_lit;
+	unsigned int	nr_dist;
+	unsigned int	nr_code;
+	unsigned int	nr_lengths;
+	unsigned char	lengths[286 + 30];
+
+	const uint32_t	*lit;	/* tables of the current block */
+	const uint32_t	*dist;
+	uint32_t		code_table[1 << 7];
+	uint32_t		lit_table[INFLATE_LIT_TABLE_SIZE];
+	uint32_t		dist_table[INFLATE_DIST_TABLE_SIZE];
+};
+
+/* Allocates the window */
+void inflate_init(struct inflate *inflate, int format);
+void inflate_term(struct inflate *inflate);
+
+/* Starts the next stream keeping the window */
+void inflate_reset(struct inflate *inflate, int format);
+
+/* Decodes the input until it runs out, the end of the stream or the window fills with
+   output not read yet. The unconsumed bytes must be passed again. */
+int inflate_decode(struct inflate *inflate, const void *data, size_t size, size_t *consumed);
+
+/* Returns the size of the next output bytes at *data, contiguous in the window */
+size_t inflate_peek(struct inflate *inflate, const char **data);
+void inflate_consume(struct inflate *inflate, size_t size);
+
+/* The input has ended. Returns an error unless the stream is complete. */
+int inflate_eof(struct inflate *inflate);
+
+static inline bool inflate_done(const struct inflate *inflate)
+{
+	return inflate->state == INFLATE_DONE;
+}
+
+#ifdef UNIT_TEST
+void test_inflate(void);
+#endif
+
+#ifdef FUZZ
+void fuzz_inflate(const unsigned char *data, size_t size);
+#endif
+
+#ifdef BENCH
+void bench_inflate(void);
+#endif
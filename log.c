@@ -2,6 +2,7 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 #include "log.h"
 
 void error(const char *format, ...)
@@ -24,17 +25,28 @@ void info(const char *format, ...)
 
 char *aprintf(const char *format, ...)
 {
-	va_list ap;
+	va_list ap, ap2;
 	va_start(ap, format);
+	va_copy(ap2, ap);
 	int size = vsnprintf(NULL, 0, format, ap);
 	char *buffer = NULL;
 	if (size <= 0)
 		goto out;
 	size_t bsize = size + 1;
 	buffer = malloc(bsize);
-	size = vsnprintf(buffer, bsize, format, ap);
+	size = vsnprintf(buffer, bsize, format, ap2);
 	assert(size < bsize);
 out:
+	va_end(ap2);
 	va_end(ap);
 	return buffer;
 }
+
+#ifdef BENCH
+double bench_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+#endif
@@ -20,3 +20,8 @@ char *aprintf(const char *format, ...)
 #else
 	 	 ;
 #endif
+
+#ifdef BENCH
+/* Monotonic time in seconds, for the benchmarks to time their runs */
+double bench_now(void);
+#endif
@@ -0,0 +1,1181 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "buffer.h"
+#include "connect.h"
+#include "dns.h"
+#include "http.h"
+#include "http_internal.h"
+#include "log.h"
+#include "loop.h"
+#include "pool.h"
+#include "uring.h"
+#include "url.h"
+
+#define LOOP_MAX_EVENTS			256
+#define LOOP_MAX_HEADER_SIZE	(64 << 10)
+/* Free space in the receive buffer for every recv() */
+#define LOOP_RECV_SIZE			(16 << 10)
+/* Threads resolving the host names of a loop, a slow lookup does not hold the others */
+#define LOOP_RESOLVERS			4
+
+/* Request states */
+#define STATE_RESOLVING		1
+#define STATE_CONNECTING	2
+#define STATE_SENDING		3
+#define STATE_RECEIVING		4
+
+/* user_data of the io_uring operations which are not of a request */
+#define LOOP_DATA_RESOLVED	0
+#define LOOP_DATA_TIMEOUT	1
+
+struct loop_request {
+	struct loop_request	*next;	/* in the queue */
+	char				*url;
+	struct url			parsed_url;
+	char				*origin;
+	loop_callback		callback;
+	void				*arg;
+
+	int					state;
+	int					socket;
+	bool				reused;	/* the connection is taken from the pool */
+	bool				eof;
+	struct dns_entry	*dns;
+	int					resolve_err;
+	struct addrinfo		*addr;	/* the address being connected */
+	/* With epoll, in the list of the connecting requests while connect_deadline is set */
+	uint64_t			connect_deadline;	/* ms */
+	struct loop_request	*connecting_prev;
+	struct loop_request	*connecting_next;
+	struct __kernel_timespec	connect_timeout;	/* of IORING_OP_LINK_TIMEOUT */
+
+	struct buffer		out;
+	size_t				sent;
+
+	/* Header, then the body. The parser consumes the framing, a chunked body is decoded
+	   in place: in[body_start, body_end) is the body, in[parsed, end) is not parsed yet. */
+	struct buffer		in;
+	size_t				in_charged;	/* to the receive budget of http.h */
+	size_t				body_start;
+	size_t				body_end;
+	size_t				parsed;
+	size_t				max_body_size;
+
+	struct http_response	response;
+};
+
+/* A completion taken off the io_uring queue to make room, handled with the next ones */
+struct loop_completion {
+	uint64_t	user_data;
+	int			res;
+};
+
+struct loop {
+	int					epoll;	/* -1 with io_uring */
+	struct uring		*uring;	/* every active request has one operation in flight */
+	struct loop_completion	*backlog;
+	size_t				nr_backlog;
+	size_t				backlog_capacity;
+	size_t				max_connections;
+	size_t				nr_active;
+	struct loop_request	*queue_head;
+	struct loop_request	*queue_tail;
+	unsigned int		connect_timeout_ms;
+	size_t				max_body_size;
+	/* With epoll, the earliest deadline first as they all have the same timeout */
+	struct loop_request	*connecting_head;
+	struct loop_request	*connecting_tail;
+
+	/* getaddrinfo() blocks, the resolvers call it and signal the event when done.
+	   They are started with the first request which is not in the DNS cache. */
+	pthread_t			resolvers[LOOP_RESOLVERS];
+	size_t				nr_resolvers;
+	int					resolved_event;	/* eventfd */
+	bool				resolved_polled;	/* io_uring has a poll of it in flight */
+	size_t				nr_resolving;
+	pthread_mutex_t		lock;	/* of the fields below */
+	pthread_cond_t		cond;
+	bool				stop;
+	struct loop_request	*resolve_head;
+	struct loop_request	*resolve_tail;
+	struct loop_request	*resolved;
+};
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+struct loop *loop_create(size_t max_connections)
+{
+	return loop_create_backend(max_connections, LOOP_BACKEND_EPOLL);
+}
+
+struct loop *loop_create_backend(size_t max_connections, int backend)
+{
+	assert(max_connections > 0);
+	struct loop *loop = calloc(1, sizeof(*loop));
+	assert(loop);
+	loop->max_connections = max_connections;
+	loop->connect_timeout_ms = CONNECT_DEFAULT_TIMEOUT_MS;
+	loop->max_body_size = LOOP_DEFAULT_MAX_BODY_SIZE;
+	loop->resolved_event = -1;
+	pthread_mutex_init(&loop->lock, NULL);
+	pthread_cond_init(&loop->cond, NULL);
+	if (backend == LOOP_BACKEND_URING) {
+		loop->uring = malloc(sizeof(*loop->uring));
+		assert(loop->uring);
+		/* A connect takes two entries with its timeout, the resolvers take one */
+		unsigned entries = max_connections < LOOP_MAX_EVENTS / 2 ? 2 * max_connections + 1 :
+			LOOP_MAX_EVENTS;
+		if (!uring_init(loop->uring, entries)) {
+			loop->epoll = -1;
+			return loop;
+		}
+		info("io_uring is not available, using epoll");
+		free(loop->uring);
+		loop->uring = NULL;
+	}
+	loop->epoll = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epoll == -1) {
+		error("epoll_create1() failed: %s errno=%d", strerror(errno), errno);
+		pthread_cond_destroy(&loop->cond);
+		pthread_mutex_destroy(&loop->lock);
+		free(loop);
+		return NULL;
+	}
+	return loop;
+}
+
+static void request_free(struct loop_request *request)
+{
+	if (request->dns)
+		dns_release(request->dns);
+	buffer_term(&request->out);
+	if (request->in.data) {
+		http_recv_budget_release(request->in_charged);
+		buffer_term(&request->in);
+	}
+	free(request->origin);
+	free(request->url);
+	free(request);
+}
+
+void loop_destroy(struct loop *loop)
+{
+	assert(loop->nr_active == 0);
+	while (loop->queue_head) {
+		struct loop_request *request = loop->queue_head;
+		loop->queue_head = request->next;
+		request_free(request);
+	}
+	pthread_mutex_lock(&loop->lock);
+	loop->stop = true;
+	pthread_cond_broadcast(&loop->cond);
+	pthread_mutex_unlock(&loop->lock);
+	for (size_t i = 0; i < loop->nr_resolvers; i++)
+		pthread_join(loop->resolvers[i], NULL);
+	if (loop->resolved_event != -1)
+		close(loop->resolved_event);
+	pthread_cond_destroy(&loop->cond);
+	pthread_mutex_destroy(&loop->lock);
+	if (loop->uring) {
+		uring_term(loop->uring);
+		free(loop->uring);
+		free(loop->backlog);
+	} else {
+		close(loop->epoll);
+	}
+	free(loop);
+}
+
+int loop_backend(const struct loop *loop)
+{
+	return loop->uring ? LOOP_BACKEND_URING : LOOP_BACKEND_EPOLL;
+}
+
+void loop_set_connect_timeout(struct loop *loop, unsigned int timeout_ms)
+{
+	loop->connect_timeout_ms = timeout_ms;
+}
+
+void loop_set_max_body_size(struct loop *loop, size_t max_body_size)
+{
+	loop->max_body_size = max_body_size;
+}
+
+/* Moves the completions to the backlog, the kernel does not take more entries while
+   the completion queue is full */
+static void loop_stash_completions(struct loop *loop)
+{
+	struct io_uring_cqe *cqe;
+	while ((cqe = uring_cqe(loop->uring))) {
+		if (loop->nr_backlog == loop->backlog_capacity) {
+			loop->backlog_capacity = loop->backlog_capacity ? 2 * loop->backlog_capacity : 64;
+			loop->backlog = realloc(loop->backlog, loop->backlog_capacity * sizeof(*loop->backlog));
+			assert(loop->backlog);
+		}
+		loop->backlog[loop->nr_backlog].user_data = cqe->user_data;
+		loop->backlog[loop->nr_backlog].res = cqe->res;
+		loop->nr_backlog++;
+		uring_cqe_seen(loop->uring);
+	}
+}
+
+/* Makes room for nr entries in the submission queue, submitting the prepared ones.
+   Returns nonzero if io_uring has failed. */
+static int loop_reserve(struct loop *loop, unsigned nr)
+{
+	while (uring_sq_space(loop->uring) < nr) {
+		int submitted = uring_submit(loop->uring, 0);
+		if (submitted < 0)
+			return ERR_LOOP_URING_FAILED;
+		if (submitted == 0)
+			loop_stash_completions(loop);
+	}
+	return 0;
+}
+
+/* Returns an entry of the submission queue or NULL if io_uring has failed */
+static struct io_uring_sqe *loop_sqe(struct loop *loop, struct loop_request *request)
+{
+	if (loop_reserve(loop, 1))
+		return NULL;
+	struct io_uring_sqe *sqe = uring_sqe(loop->uring);
+	sqe->user_data = (uintptr_t)request;
+	return sqe;
+}
+
+static int loop_submit(struct loop *loop, const char *method, const char *url, const char **headers,
+					   const char *body, loop_callback callback, void *arg)
+{
+	struct loop_request *request = calloc(1, sizeof(*request));
+	assert(request);
+	request->url = strdup(url);
+	request->callback = callback;
+	request->arg = arg;
+	request->socket = -1;
+	buffer_init(&request->out, 1 << 10);
+	int err = http_request_format(method, request->url, headers, body,
+								  &request->parsed_url, &request->out);
+	if (err) {
+		request_free(request);
+		return err;
+	}
+	if (body) {
+		size_t body_len = strlen(body);
+		buffer_reserve(&request->out, body_len);
+		memcpy(request->out.space, body, body_len);
+		request->out.space += body_len;
+	}
+
+	if (loop->queue_tail)
+		loop->queue_tail->next = request;
+	else
+		loop->queue_head = request;
+	loop->queue_tail = request;
+	return 0;
+}
+
+int loop_get(struct loop *loop, const char *url, const char **headers,
+			 loop_callback callback, void *arg)
+{
+	return loop_submit(loop, "GET", url, headers, NULL, callback, arg);
+}
+
+int loop_post(struct loop *loop, const char *url, const char **headers, const char *body,
+			  loop_callback callback, void *arg)
+{
+	return loop_submit(loop, "POST", url, headers, body, callback, arg);
+}
+
+static int set_blocking(int socket, bool blocking)
+{
+	int flags = fcntl(socket, F_GETFL);
+	if (flags == -1)
+		return -1;
+	flags = blocking ? flags & ~O_NONBLOCK : flags | O_NONBLOCK;
+	return fcntl(socket, F_SETFL, flags);
+}
+
+static void loop_connecting_add(struct loop *loop, struct loop_request *request)
+{
+	request->connect_deadline = now_ms() + loop->connect_timeout_ms;
+	request->connecting_prev = loop->connecting_tail;
+	request->connecting_next = NULL;
+	if (loop->connecting_tail)
+		loop->connecting_tail->connecting_next = request;
+	else
+		loop->connecting_head = request;
+	loop->connecting_tail = request;
+}
+
+static void loop_connecting_remove(struct loop *loop, struct loop_request *request)
+{
+	if (request->connect_deadline == 0)
+		return;
+	if (request->connecting_prev)
+		request->connecting_prev->connecting_next = request->connecting_next;
+	else
+		loop->connecting_head = request->connecting_next;
+	if (request->connecting_next)
+		request->connecting_next->connecting_prev = request->connecting_prev;
+	else
+		loop->connecting_tail = request->connecting_prev;
+	request->connect_deadline = 0;
+}
+
+/* The receive buffer counts against the budget of the blocking API */
+static void request_charge_in(struct loop_request *request)
+{
+	if (request->in.capacity > request->in_charged) {
+		http_recv_budget_take(request->in.capacity - request->in_charged);
+		request->in_charged = request->in.capacity;
+	}
+}
+
+static void request_complete(struct loop *loop, struct loop_request *request, int err)
+{
+	struct http_response *response = &request->response;
+	loop_connecting_remove(loop, request);
+	if (request->socket != -1) {
+		/* Pooled connections are used by the blocking API as well, io_uring uses them as they are */
+		if (!loop->uring)
+			epoll_ctl(loop->epoll, EPOLL_CTL_DEL, request->socket, NULL);
+		if (!err && !request->eof && (loop->uring || !set_blocking(request->socket, true))) {
+			response->socket = request->socket;
+			response->origin = request->origin;
+			request->origin = NULL;
+		} else {
+			close(request->socket);
+		}
+		request->socket = -1;
+	}
+
+	const char *body = err ? NULL : request->in.data + request->body_start;
+	size_t body_len = err ? 0 : request->body_end - request->body_start;
+	request->callback(request->arg, err, response, body, body_len);
+
+	http_response_close(response);
+	request_free(request);
+	loop->nr_active--;
+}
+
+static void request_watch(struct loop *loop, struct loop_request *request, int op,
+						  int state, uint32_t events)
+{
+	struct epoll_event event = {
+		.events = events,
+		.data.ptr = request,
+	};
+	request->state = state;
+	if (epoll_ctl(loop->epoll, op, request->socket, &event)) {
+		error("epoll_ctl() failed: %s errno=%d", strerror(errno), errno);
+		request_complete(loop, request, ERR_LOOP_EPOLL_FAILED);
+	}
+}
+
+static void *loop_resolver(void *arg)
+{
+	struct loop *loop = arg;
+	pthread_mutex_lock(&loop->lock);
+	while (1) {
+		while (!loop->stop && loop->resolve_head == NULL)
+			pthread_cond_wait(&loop->cond, &loop->lock);
+		if (loop->stop)
+			break;
+		struct loop_request *request = loop->resolve_head;
+		loop->resolve_head = request->next;
+		if (loop->resolve_head == NULL)
+			loop->resolve_tail = NULL;
+		pthread_mutex_unlock(&loop->lock);
+
+		request->resolve_err = url_resolve(&request->parsed_url, &request->dns);
+
+		pthread_mutex_lock(&loop->lock);
+		request->next = loop->resolved;
+		loop->resolved = request;
+		uint64_t one = 1;
+		if (write(loop->resolved_event, &one, sizeof(one)) != sizeof(one))
+			error("write() to eventfd failed: %s errno=%d", strerror(errno), errno);
+	}
+	pthread_mutex_unlock(&loop->lock);
+	return NULL;
+}
+
+/* Returns nonzero if there is no resolver */
+static int loop_start_resolvers(struct loop *loop)
+{
+	if (loop->resolved_event == -1) {
+		loop->resolved_event = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		if (loop->resolved_event == -1) {
+			error("eventfd() failed: %s errno=%d", strerror(errno), errno);
+			return -1;
+		}
+		struct epoll_event event = {
+			.events = EPOLLIN,
+			.data.ptr = NULL,
+		};
+		if (!loop->uring && epoll_ctl(loop->epoll, EPOLL_CTL_ADD, loop->resolved_event, &event)) {
+			error("epoll_ctl() failed: %s errno=%d", strerror(errno), errno);
+			close(loop->resolved_event);
+			loop->resolved_event = -1;
+			return -1;
+		}
+	}
+	for (; loop->nr_resolvers < LOOP_RESOLVERS; loop->nr_resolvers++) {
+		int err = pthread_create(&loop->resolvers[loop->nr_resolvers], NULL, loop_resolver, loop);
+		if (err) {
+			error("pthread_create() failed: %s err=%d", strerror(err), err);
+			break;
+		}
+	}
+	return loop->nr_resolvers == 0;
+}
+
+static void loop_poll_resolved(struct loop *loop)
+{
+	if (!loop->uring || loop->resolved_polled || loop->nr_resolving == 0)
+		return;
+	struct io_uring_sqe *sqe = loop_sqe(loop, NULL);
+	if (sqe == NULL)
+		return;
+	sqe->user_data = LOOP_DATA_RESOLVED;
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = loop->resolved_event;
+	sqe->poll_events = POLLIN;
+	loop->resolved_polled = true;
+}
+
+static void request_connect(struct loop *loop, struct loop_request *request);
+
+/* Gives the host to the resolvers, the loop goes on with the other requests */
+static void request_resolve(struct loop *loop, struct loop_request *request)
+{
+	if (loop->nr_resolvers == 0 && loop_start_resolvers(loop)) {
+		request->resolve_err = url_resolve(&request->parsed_url, &request->dns);
+		if (request->resolve_err) {
+			request_complete(loop, request, request->resolve_err);
+			return;
+		}
+		request->addr = request->dns->addrinfo;
+		request_connect(loop, request);
+		return;
+	}
+	request->state = STATE_RESOLVING;
+	pthread_mutex_lock(&loop->lock);
+	if (loop->resolve_tail)
+		loop->resolve_tail->next = request;
+	else
+		loop->resolve_head = request;
+	loop->resolve_tail = request;
+	pthread_cond_signal(&loop->cond);
+	pthread_mutex_unlock(&loop->lock);
+	loop->nr_resolving++;
+	loop_poll_resolved(loop);
+}
+
+/* Connects the requests the resolvers are done with */
+static void loop_resolved(struct loop *loop)
+{
+	uint64_t count;
+	if (read(loop->resolved_event, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		error("read() from eventfd failed: %s errno=%d", strerror(errno), errno);
+	pthread_mutex_lock(&loop->lock);
+	struct loop_request *resolved = loop->resolved;
+	loop->resolved = NULL;
+	pthread_mutex_unlock(&loop->lock);
+
+	while (resolved) {
+		struct loop_request *request = resolved;
+		resolved = request->next;
+		request->next = NULL;
+		loop->nr_resolving--;
+		if (request->resolve_err) {
+			request_complete(loop, request, request->resolve_err);
+			continue;
+		}
+		request->addr = request->dns->addrinfo;
+		request_connect(loop, request);
+	}
+	loop_poll_resolved(loop);
+}
+
+/* Connects to the next address of the host */
+static void request_connect(struct loop *loop, struct loop_request *request)
+{
+	if (request->dns == NULL) {
+		request_resolve(loop, request);
+		return;
+	}
+
+	for (; request->addr; request->addr = request->addr->ai_next) {
+		struct addrinfo *addr = request->addr;
+		int s = socket(addr->ai_family, addr->ai_socktype | SOCK_CLOEXEC |
+					   (loop->uring ? 0 : SOCK_NONBLOCK), addr->ai_protocol);
+		if (s == -1) {
+			error("socket() failed: %s, err=%d", strerror(errno), errno);
+			continue;
+		}
+		if (loop->uring) {
+			request->socket = s;
+			request->state = STATE_CONNECTING;
+			/* The timeout is linked to the connect, they go to the kernel together */
+			if (loop_reserve(loop, 2)) {
+				request_complete(loop, request, ERR_LOOP_URING_FAILED);
+				return;
+			}
+			struct io_uring_sqe *sqe = loop_sqe(loop, request);
+			sqe->opcode = IORING_OP_CONNECT;
+			sqe->fd = s;
+			sqe->addr = (uintptr_t)addr->ai_addr;
+			sqe->off = addr->ai_addrlen;
+			if (loop->connect_timeout_ms) {
+				sqe->flags |= IOSQE_IO_LINK;
+				request->connect_timeout.tv_sec = loop->connect_timeout_ms / 1000;
+				request->connect_timeout.tv_nsec = loop->connect_timeout_ms % 1000 * 1000000;
+				sqe = loop_sqe(loop, NULL);
+				sqe->user_data = LOOP_DATA_TIMEOUT;
+				sqe->opcode = IORING_OP_LINK_TIMEOUT;
+				sqe->addr = (uintptr_t)&request->connect_timeout;
+				sqe->len = 1;
+			}
+			return;
+		}
+		if (connect(s, addr->ai_addr, addr->ai_addrlen) && errno != EINPROGRESS) {
+			error("connect() failed: %s, err=%d", strerror(errno), errno);
+			close(s);
+			continue;
+		}
+		request->socket = s;
+		if (loop->connect_timeout_ms)
+			loop_connecting_add(loop, request);
+		request_watch(loop, request, EPOLL_CTL_ADD, STATE_CONNECTING, EPOLLOUT);
+		return;
+	}
+	request_complete(loop, request, ERR_HTTP_CONNECT_FAILED);
+}
+
+static void request_send(struct loop *loop, struct loop_request *request);
+static void request_recv(struct loop *loop, struct loop_request *request);
+
+static void request_start(struct loop *loop, struct loop_request *request)
+{
+	loop->nr_active++;
+	http_response_init(&request->response);
+	request->response.parser.max_header_size = LOOP_MAX_HEADER_SIZE;
+	request->max_body_size = loop->max_body_size;
+	buffer_init(&request->in, LOOP_RECV_SIZE);
+	request_charge_in(request);
+	request->origin = http_origin(&request->parsed_url);
+	request->socket = pool_get(request->origin);
+	if (request->socket == -1 || (!loop->uring && set_blocking(request->socket, false))) {
+		if (request->socket != -1)
+			close(request->socket);
+		request->socket = -1;
+		request_connect(loop, request);
+		return;
+	}
+	request->reused = true;
+	if (loop->uring)
+		request_send(loop, request);
+	else
+		request_watch(loop, request, EPOLL_CTL_ADD, STATE_SENDING, EPOLLOUT);
+}
+
+/* A pooled connection may have been closed by the server while the request was on its way */
+static void request_failed(struct loop *loop, struct loop_request *request, int err)
+{
+	bool retry = request->reused && buffer_data_len(&request->in) == 0 &&
+		(err == ERR_HTTP_SEND_FAILED || err == ERR_HTTP_CONNECTION_CLOSED);
+	if (!retry) {
+		request_complete(loop, request, err);
+		return;
+	}
+	info("Retrying the request on a new connection");
+	close(request->socket);
+	request->socket = -1;
+	request->reused = false;
+	request->eof = false;
+	request->sent = 0;
+	request_connect(loop, request);
+}
+
+static void request_send(struct loop *loop, struct loop_request *request)
+{
+	size_t len = buffer_data_len(&request->out);
+	if (loop->uring) {
+		if (request->sent == len) {
+			request_recv(loop, request);
+			return;
+		}
+		request->state = STATE_SENDING;
+		struct io_uring_sqe *sqe = loop_sqe(loop, request);
+		if (sqe == NULL) {
+			request_complete(loop, request, ERR_LOOP_URING_FAILED);
+			return;
+		}
+		sqe->opcode = IORING_OP_SEND;
+		sqe->fd = request->socket;
+		sqe->addr = (uintptr_t)(request->out.data + request->sent);
+		sqe->len = len - request->sent;
+		sqe->msg_flags = MSG_NOSIGNAL;
+		return;
+	}
+	while (request->sent < len) {
+		ssize_t sent = send(request->socket, request->out.data + request->sent,
+							len - request->sent, MSG_NOSIGNAL);
+		if (sent < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return;
+			error("send() failed: %s errno=%d", strerror(errno), errno);
+			request_failed(loop, request, ERR_HTTP_SEND_FAILED);
+			return;
+		}
+		request->sent += sent;
+	}
+	request_watch(loop, request, EPOLL_CTL_MOD, STATE_RECEIVING, EPOLLIN);
+}
+
+/* Returns true when the whole response has been received */
+static bool request_parse(struct loop_request *request, int *err)
+{
+	struct http_response *response = &request->response;
+	struct buffer *in = &request->in;
+	size_t len = buffer_data_len(in);
+	*err = 0;
+
+	while (response->parser.state != PARSER_DONE) {
+		uint64_t available = parser_body_available(response);
+		if (available) {
+			size_t size = len - request->parsed;
+			if (size > available)
+				size = available;
+			if (size == 0)
+				break;
+			if (request->body_end - request->body_start + size > request->max_body_size) {
+				*err = ERR_LOOP_BODY_TOO_LARGE;
+				return true;
+			}
+			if (request->body_end != request->parsed)
+				memmove(in->data + request->body_end, in->data + request->parsed, size);
+			request->body_end += size;
+			request->parsed += size;
+			parser_body_consumed(response, size);
+			continue;
+		}
+		if (request->parsed == len)
+			break;
+
+		bool header = parser_header_received(&response->parser);
+		size_t consumed = 0;
+		*err = parser_parse(response, in->data + request->parsed, len - request->parsed, &consumed);
+		if (*err == ERR_HTTP_BUFFER_TOO_SMALL)
+			*err = ERR_LOOP_HEADER_TOO_LARGE;
+		if (*err)
+			return true;
+		request->parsed += consumed;
+		/* The body data of a Content-Length response stays where it has been received */
+		if (!header && parser_header_received(&response->parser)) {
+			request->body_start = request->body_end = request->parsed;
+			/* Known before any of it is received */
+			if (response->body_type == HTTP_BODY_LENGTH && response->body_left > request->max_body_size) {
+				*err = ERR_LOOP_BODY_TOO_LARGE;
+				return true;
+			}
+		}
+	}
+
+	if (response->parser.state != PARSER_DONE) {
+		if (!request->eof)
+			return false;
+		if ((*err = parser_eof(response)))
+			return true;
+	}
+	/* The bytes of the next response, which nobody asked for, keep the connection out of the pool */
+	response->data_size = len - request->parsed;
+	return true;
+}
+
+/* Handles the result of recv(), the error is -errno */
+static void request_received(struct loop *loop, struct loop_request *request, ssize_t received)
+{
+	struct buffer *in = &request->in;
+	if (received < 0) {
+		if (received == -EINTR || received == -EAGAIN || received == -EWOULDBLOCK) {
+			if (loop->uring)
+				request_recv(loop, request);
+			return;
+		}
+		request->response.recv_errno = -received;
+		error("recv() failed: %s errno=%d", strerror(-received), (int)-received);
+		request_failed(loop, request, received == -ECONNRESET && buffer_data_len(in) == 0 ?
+			ERR_HTTP_CONNECTION_CLOSED : ERR_HTTP_RECV_FAILED);
+		return;
+	}
+	in->space += received;
+	if (received == 0) {
+		request->eof = true;
+		if (buffer_data_len(in) == 0) {
+			request_failed(loop, request, ERR_HTTP_CONNECTION_CLOSED);
+			return;
+		}
+	}
+
+	int err = 0;
+	if (request_parse(request, &err))
+		request_complete(loop, request, err);
+	else if (loop->uring)
+		request_recv(loop, request);
+}
+
+static void request_recv(struct loop *loop, struct loop_request *request)
+{
+	struct buffer *in = &request->in;
+	if (request->parsed > request->body_end) {
+		/* Drop the chunk framing decoded already */
+		size_t size = buffer_data_len(in) - request->parsed;
+		memmove(in->data + request->body_end, in->data + request->parsed, size);
+		in->space = in->data + request->body_end + size;
+		request->parsed = request->body_end;
+	}
+	buffer_reserve(in, LOOP_RECV_SIZE);
+	request_charge_in(request);
+
+	if (loop->uring) {
+		request->state = STATE_RECEIVING;
+		struct io_uring_sqe *sqe = loop_sqe(loop, request);
+		if (sqe == NULL) {
+			request_complete(loop, request, ERR_LOOP_URING_FAILED);
+			return;
+		}
+		sqe->opcode = IORING_OP_RECV;
+		sqe->fd = request->socket;
+		sqe->addr = (uintptr_t)in->space;
+		sqe->len = buffer_space_len(in);
+		return;
+	}
+	ssize_t received = recv(request->socket, in->space, buffer_space_len(in), 0);
+	request_received(loop, request, received < 0 ? -errno : received);
+}
+
+static void request_handle(struct loop *loop, struct loop_request *request, uint32_t events)
+{
+	switch (request->state) {
+	case STATE_CONNECTING: {
+		loop_connecting_remove(loop, request);
+		int so_error = 0;
+		socklen_t len = sizeof(so_error);
+		if (getsockopt(request->socket, SOL_SOCKET, SO_ERROR, &so_error, &len) || so_error) {
+			error("connect() failed: %s, err=%d", strerror(so_error), so_error);
+			close(request->socket);
+			request->socket = -1;
+			request->addr = request->addr->ai_next;
+			request_connect(loop, request);
+			return;
+		}
+		request->state = STATE_SENDING;
+	}
+		/* fall through */
+	case STATE_SENDING:
+		request_send(loop, request);
+		return;
+	default:
+		request_recv(loop, request);
+		return;
+	}
+}
+
+/* Handles the completion of the operation of the request, res is its result or -errno */
+static void request_handle_uring(struct loop *loop, struct loop_request *request, int res)
+{
+	switch (request->state) {
+	case STATE_CONNECTING:
+		if (res < 0) {
+			/* Canceled by the linked timeout */
+			if (res == -ECANCELED)
+				error("connect() timed out after %u ms", loop->connect_timeout_ms);
+			else
+				error("connect() failed: %s, err=%d", strerror(-res), -res);
+			close(request->socket);
+			request->socket = -1;
+			request->addr = request->addr->ai_next;
+			request_connect(loop, request);
+			return;
+		}
+		request_send(loop, request);
+		return;
+	case STATE_SENDING:
+		if (res < 0) {
+			if (res == -EINTR || res == -EAGAIN) {
+				request_send(loop, request);
+				return;
+			}
+			error("send() failed: %s errno=%d", strerror(-res), -res);
+			request_failed(loop, request, ERR_HTTP_SEND_FAILED);
+			return;
+		}
+		request->sent += res;
+		request_send(loop, request);
+		return;
+	default:
+		request_received(loop, request, res);
+		return;
+	}
+}
+
+static void loop_complete(struct loop *loop, uint64_t user_data, int res)
+{
+	if (user_data == LOOP_DATA_RESOLVED) {
+		loop->resolved_polled = false;
+		loop_resolved(loop);
+	} else if (user_data != LOOP_DATA_TIMEOUT) {
+		request_handle_uring(loop, (struct loop_request*)(uintptr_t)user_data, res);
+	}
+}
+
+/* Every round submits the operations of all the requests at once and takes all the
+   completions ready, so the requests share the system calls */
+static int loop_run_uring(struct loop *loop)
+{
+	while (1) {
+		while (loop->queue_head && loop->nr_active < loop->max_connections) {
+			struct loop_request *request = loop->queue_head;
+			loop->queue_head = request->next;
+			if (loop->queue_head == NULL)
+				loop->queue_tail = NULL;
+			request->next = NULL;
+			request_start(loop, request);
+		}
+		if (loop->nr_active == 0) {
+			if (loop->queue_head == NULL)
+				return 0;
+			continue;
+		}
+
+		/* The completions in the backlog are ready, nothing to wait for */
+		if (uring_submit(loop->uring, loop->nr_backlog ? 0 : 1) < 0)
+			return ERR_LOOP_URING_FAILED;
+		/* Handling a completion may add to the backlog */
+		for (size_t i = 0; i < loop->nr_backlog; i++) {
+			struct loop_completion completion = loop->backlog[i];
+			loop_complete(loop, completion.user_data, completion.res);
+		}
+		loop->nr_backlog = 0;
+		struct io_uring_cqe *cqe;
+		while ((cqe = uring_cqe(loop->uring))) {
+			uint64_t user_data = cqe->user_data;
+			int res = cqe->res;
+			uring_cqe_seen(loop->uring);
+			loop_complete(loop, user_data, res);
+		}
+	}
+}
+
+/* Moves the connects past their deadline to the next address */
+static void loop_expire(struct loop *loop)
+{
+	uint64_t now = now_ms();
+	while (loop->connecting_head && loop->connecting_head->connect_deadline <= now) {
+		struct loop_request *request = loop->connecting_head;
+		loop_connecting_remove(loop, request);
+		error("connect() timed out after %u ms", loop->connect_timeout_ms);
+		close(request->socket);
+		request->socket = -1;
+		request->addr = request->addr->ai_next;
+		request_connect(loop, request);
+	}
+}
+
+/* Returns the epoll_wait() timeout until the earliest connect deadline */
+static int loop_timeout(struct loop *loop)
+{
+	if (loop->connecting_head == NULL)
+		return -1;
+	uint64_t now = now_ms();
+	uint64_t deadline = loop->connecting_head->connect_deadline;
+	return deadline > now ? (int)(deadline - now) : 0;
+}
+
+int loop_run(struct loop *loop)
+{
+	if (loop->uring)
+		return loop_run_uring(loop);
+	struct epoll_event events[LOOP_MAX_EVENTS];
+	while (1) {
+		while (loop->queue_head && loop->nr_active < loop->max_connections) {
+			struct loop_request *request = loop->queue_head;
+			loop->queue_head = request->next;
+			if (loop->queue_head == NULL)
+				loop->queue_tail = NULL;
+			request->next = NULL;
+			request_start(loop, request);
+		}
+		if (loop->nr_active == 0) {
+			if (loop->queue_head == NULL)
+				return 0;
+			continue;
+		}
+
+		int nr_events = epoll_wait(loop->epoll, events, LOOP_MAX_EVENTS, loop_timeout(loop));
+		if (nr_events < 0) {
+			if (errno == EINTR)
+				continue;
+			error("epoll_wait() failed: %s errno=%d", strerror(errno), errno);
+			return ERR_LOOP_EPOLL_FAILED;
+		}
+		for (int i = 0; i < nr_events; i++) {
+			if (events[i].data.ptr)
+				request_handle(loop, events[i].data.ptr, events[i].events);
+			else
+				loop_resolved(loop);
+		}
+		loop_expire(loop);
+	}
+}
+
+#ifdef UNIT_TEST
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include "server.h"
+
+struct test_result {
+	int		err;
+	int		status_code;
+	char	body[64];
+	size_t	budget_used;
+};
+
+static void test_callback(void *arg, int err, struct http_response *response,
+						  const char *body, size_t body_len)
+{
+	struct test_result *result = arg;
+	result->err = err;
+	result->status_code = response->status_code;
+	result->budget_used = http_recv_budget_used();
+	assert(body_len < sizeof(result->body));
+	if (body_len)
+		memcpy(result->body, body, body_len);
+	result->body[body_len] = 0;
+}
+
+static void test_requests(int backend)
+{
+	struct server server;
+	assert(!server_start(&server));
+
+	static const char *paths[] = { "length/12", "chunked/12?chunk=5", "close/12", "length/12" };
+	struct test_result results[4];
+	memset(results, 0, sizeof(results));
+	struct loop *loop = loop_create_backend(2, backend);
+	assert(loop && loop_backend(loop) == backend);
+	for (int i = 0; i < 4; i++) {
+		char url[64];
+		snprintf(url, sizeof(url), "http://127.0.0.1:%d/%s", server.port, paths[i]);
+		if (i < 3)
+			assert(!loop_get(loop, url, NULL, test_callback, &results[i]));
+		else
+			assert(!loop_post(loop, url, NULL, "body", test_callback, &results[i]));
+	}
+	assert(!loop_run(loop));
+	loop_destroy(loop);
+	assert(server_requests(&server) == 4);
+	pool_clear();
+	server_stop(&server);
+
+	for (int i = 0; i < 4; i++) {
+		assert(results[i].err == 0);
+		assert(results[i].status_code == 200);
+		assert(strlen(results[i].body) == 12);
+		for (size_t j = 0; j < 12; j++)
+			assert(results[i].body[j] == server_body_byte(j));
+	}
+}
+
+static void test_connect_failed(int backend)
+{
+	struct test_result result;
+	memset(&result, 0, sizeof(result));
+	struct loop *loop = loop_create_backend(1, backend);
+	/* Nobody listens on port 1 */
+	assert(!loop_get(loop, "http://127.0.0.1:1/", NULL, test_callback, &result));
+	assert(!loop_run(loop));
+	loop_destroy(loop);
+	assert(result.err == ERR_HTTP_CONNECT_FAILED);
+}
+
+static void test_max_body_size(int backend)
+{
+	struct server server;
+	assert(!server_start(&server));
+	static const char *paths[] = { "length", "chunked", "close" };
+	size_t used = http_recv_budget_used();
+	for (size_t max = 49; max <= 50; max++) {
+		struct test_result results[3];
+		memset(results, 0, sizeof(results));
+		struct loop *loop = loop_create_backend(3, backend);
+		loop_set_max_body_size(loop, max);
+		for (int i = 0; i < 3; i++) {
+			char url[64];
+			snprintf(url, sizeof(url), "http://127.0.0.1:%d/%s/50", server.port, paths[i]);
+			assert(!loop_get(loop, url, NULL, test_callback, &results[i]));
+		}
+		assert(!loop_run(loop));
+		loop_destroy(loop);
+		assert(http_recv_budget_used() == used);
+		for (int i = 0; i < 3; i++) {
+			assert(results[i].budget_used >= used + LOOP_RECV_SIZE);
+			if (max < 50) {
+				assert(results[i].err == ERR_LOOP_BODY_TOO_LARGE);
+				continue;
+			}
+			assert(results[i].err == 0 && strlen(results[i].body) == 50);
+			for (size_t j = 0; j < 50; j++)
+				assert(results[i].body[j] == server_body_byte(j));
+		}
+	}
+	pool_clear();
+	server_stop(&server);
+}
+
+/* More connections than the submission queue has entries, it fills up while the
+   completions are handled */
+static void test_many_connections(int backend)
+{
+	enum { NR_CONNECTIONS = 200, NR_REQUESTS = 600 };
+	struct server server;
+	assert(!server_start(&server));
+	char url[64];
+	snprintf(url, sizeof(url), "http://127.0.0.1:%d/length/12", server.port);
+	static struct test_result results[NR_REQUESTS];
+	memset(results, 0, sizeof(results));
+	struct loop *loop = loop_create_backend(NR_CONNECTIONS, backend);
+	for (int i = 0; i < NR_REQUESTS; i++)
+		assert(!loop_get(loop, url, NULL, test_callback, &results[i]));
+	assert(!loop_run(loop));
+	loop_destroy(loop);
+	for (int i = 0; i < NR_REQUESTS; i++)
+		assert(results[i].err == 0 && results[i].status_code == 200 && strlen(results[i].body) == 12);
+	pool_clear();
+	server_stop(&server);
+}
+
+/* The listen queue is full, the SYN of the request is dropped */
+static void test_connect_timeout(int backend)
+{
+	int s = socket(AF_INET, SOCK_STREAM, 0);
+	assert(s != -1);
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	socklen_t addr_len = sizeof(addr);
+	assert(!bind(s, (struct sockaddr*)&addr, addr_len));
+	assert(!listen(s, 0));
+	assert(!getsockname(s, (struct sockaddr*)&addr, &addr_len));
+	int fillers[4];
+	for (int i = 0; i < 4; i++) {
+		fillers[i] = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+		assert(fillers[i] != -1);
+		connect(fillers[i], (struct sockaddr*)&addr, addr_len);
+	}
+
+	struct test_result result;
+	memset(&result, 0, sizeof(result));
+	struct loop *loop = loop_create_backend(1, backend);
+	loop_set_connect_timeout(loop, 100);
+	char url[64];
+	snprintf(url, sizeof(url), "http://127.0.0.1:%d/", ntohs(addr.sin_port));
+	assert(!loop_get(loop, url, NULL, test_callback, &result));
+	uint64_t start = now_ms();
+	assert(!loop_run(loop));
+	assert(now_ms() - start < 1000);
+	loop_destroy(loop);
+	assert(result.err == ERR_HTTP_CONNECT_FAILED);
+	for (int i = 0; i < 4; i++)
+		close(fillers[i]);
+	close(s);
+}
+
+void test_loop(void)
+{
+	test_requests(LOOP_BACKEND_EPOLL);
+	test_connect_failed(LOOP_BACKEND_EPOLL);
+	test_connect_timeout(LOOP_BACKEND_EPOLL);
+	test_max_body_size(LOOP_BACKEND_EPOLL);
+	test_many_connections(LOOP_BACKEND_EPOLL);
+	if (!uring_supported()) {
+		info("io_uring is not supported, skipping its loop test");
+		return;
+	}
+	test_requests(LOOP_BACKEND_URING);
+	test_connect_failed(LOOP_BACKEND_URING);
+	test_connect_timeout(LOOP_BACKEND_URING);
+	test_max_body_size(LOOP_BACKEND_URING);
+	test_many_connections(LOOP_BACKEND_URING);
+}
+#endif
+
+#ifdef BENCH
+#include <stdio.h>
+#include "server.h"
+
+static void bench_callback(void *arg, int err, struct http_response *response,
+						   const char *body, size_t body_len)
+{
+	assert(!err && body_len == 64);
+	(*(size_t*)arg)++;
+}
+
+/* Small requests over many keep-alive connections, where the system calls dominate */
+void bench_loop(void)
+{
+	struct server server;
+	int err = server_start(&server);
+	assert(!err);
+	(void)err;
+	char url[64];
+	snprintf(url, sizeof(url), "http://127.0.0.1:%d/length/64", server.port);
+
+	static const char *names[] = {"epoll", "io_uring"};
+	size_t iterations = 20000;
+	for (int backend = LOOP_BACKEND_EPOLL; backend <= LOOP_BACKEND_URING; backend++) {
+		struct loop *loop = loop_create_backend(64, backend);
+		if (loop_backend(loop) != backend) {
+			loop_destroy(loop);
+			continue;
+		}
+		size_t completed = 0;
+		double start = bench_now();
+		for (size_t i = 0; i < iterations; i++) {
+			err = loop_get(loop, url, NULL, bench_callback, &completed);
+			assert(!err);
+		}
+		err = loop_run(loop);
+		assert(!err && completed == iterations);
+		double seconds = bench_now() - start;
+		loop_destroy(loop);
+		pool_clear();
+		printf("loop backend=%s connections=64 req/s=%.0f\n", names[backend], iterations / seconds);
+	}
+	server_stop(&server);
+}
+#endif
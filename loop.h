@@ -0,0 +1,60 @@
+#pragma once
+#include <stddef.h>
+#include "http.h"
+
+/* Runs many HTTP requests concurrently in a single thread with non-blocking
+   sockets and epoll. Response bodies are collected in memory, which suits
+   fetching many small objects. Host names are resolved by a few helper threads
+   of the loop, getaddrinfo() does not block the other requests. */
+
+struct loop;
+
+/* err is 0 on success. The response and the body are only valid during the call.
+   The callback may submit new requests to the loop. */
+typedef void (*loop_callback)(void *arg, int err, struct http_response *response,
+							  const char *body, size_t body_len);
+
+/* At most max_connections requests are in flight, the rest wait in a queue */
+struct loop *loop_create(size_t max_connections);
+
+/* With LOOP_BACKEND_URING connect(), send() and recv() of all the requests are submitted
+   to io_uring together, a round of them costs one system call. The loop uses epoll if
+   the kernel does not support io_uring, loop_backend() tells which one it has. */
+#define LOOP_BACKEND_EPOLL	0
+#define LOOP_BACKEND_URING	1
+
+struct loop *loop_create_backend(size_t max_connections, int backend);
+int loop_backend(const struct loop *loop);
+void loop_destroy(struct loop *loop);
+
+/* Limit for connecting to every address of a host, the next one is tried when it
+   expires. 0 waits as long as the kernel does, the default is CONNECT_DEFAULT_TIMEOUT_MS. */
+void loop_set_connect_timeout(struct loop *loop, unsigned int timeout_ms);
+
+/* Requests with a larger response body fail with ERR_LOOP_BODY_TOO_LARGE, the body is
+   kept in memory until the callback */
+#define LOOP_DEFAULT_MAX_BODY_SIZE	(16 << 20)
+
+void loop_set_max_body_size(struct loop *loop, size_t max_body_size);
+
+/* The requests start when loop_run() is called */
+int loop_get(struct loop *loop, const char *url, const char **headers,
+			 loop_callback callback, void *arg);
+int loop_post(struct loop *loop, const char *url, const char **headers, const char *body,
+			  loop_callback callback, void *arg);
+
+/* Runs until every submitted request has completed */
+int loop_run(struct loop *loop);
+
+#define ERR_LOOP_EPOLL_FAILED		-41
+#define ERR_LOOP_HEADER_TOO_LARGE	-42
+#define ERR_LOOP_URING_FAILED		-43
+#define ERR_LOOP_BODY_TOO_LARGE		-44
+
+#ifdef UNIT_TEST
+void test_loop(void);
+#endif
+
+#ifdef BENCH
+void bench_loop(void);
+#endif
@@ -1,15 +1,161 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "connect.h"
+#include "dns.h"
+#include "download.h"
+#include "header.h"
 #include "http.h"
+#include "inflate.h"
+#include "loop.h"
+#include "parser.h"
+#include "pool.h"
+#include "progress.h"
+#include "punycode.h"
+#include "ring.h"
+#include "scan.h"
+#include "slab.h"
+#include "uring.h"
+#include "url.h"
 
 #ifdef UNIT_TEST
 int main()
 {
-	//test_url_parse();
+	test_url_parse();
+	test_ring();
+	test_slab();
+	test_uring();
+	test_scan();
+	test_punycode();
+	test_header();
+	test_inflate();
+	test_parser();
+	test_connect();
+	test_dns();
+	test_pool();
+	test_loop();
+	test_progress();
+	test_download();
 	test_http();
 	return 0;
 }
-#else
+#elif defined(BENCH)
+static const struct {
+	const char	*name;
+	void		(*run)(void);
+} benches[] = {
+	{"scan", bench_scan},
+	{"parser", bench_parser},
+	{"url", bench_url},
+	{"punycode", bench_punycode},
+	{"inflate", bench_inflate},
+	{"http", bench_http},
+	{"loop", bench_loop},
+	{"download", bench_download},
+};
+
+/* Runs the benchmarks named in the arguments or all of them. Every result is a line of
+   "name key=value ... metric=value" with the metric last. */
 int main(int argc, char *argv[])
 {
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	for (size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+		int selected = argc == 1;
+		for (int j = 1; j < argc; j++)
+			selected |= !strcmp(argv[j], benches[i].name);
+		if (selected)
+			benches[i].run();
+	}
+	return 0;
+}
+#elif defined(FUZZ)
+#include <stdint.h>
+
+/* FUZZ is the fuzz_* function of the target, e.g. -DFUZZ=fuzz_parser */
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	FUZZ(data, size);
 	return 0;
 }
+
+#ifndef FUZZ_LIBFUZZER
+static void run_file(FILE *file)
+{
+	size_t size = 0, capacity = 1 << 12;
+	unsigned char *data = malloc(capacity);
+	size_t len;
+	while ((len = fread(data + size, 1, capacity - size, file)) > 0) {
+		size += len;
+		if (size == capacity)
+			data = realloc(data, capacity *= 2);
+	}
+	LLVMFuzzerTestOneInput(data, size);
+	free(data);
+}
+
+/* Runs the target on the files in the arguments or on the standard input, for AFL and
+   for replaying a corpus without libFuzzer */
+int main(int argc, char *argv[])
+{
+	if (argc == 1)
+		run_file(stdin);
+	for (int i = 1; i < argc; i++) {
+		FILE *file = fopen(argv[i], "rb");
+		if (file == NULL) {
+			perror(argv[i]);
+			return EXIT_FAILURE;
+		}
+		run_file(file);
+		fclose(file);
+	}
+	return 0;
+}
+#endif
+#else
+static int usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-c] [-m | -u] [-n CONNECTIONS] URL [FILE]\n"
+		"Downloads the URL to the FILE, by default named after the URL path.\n"
+		"FILE '-' means the standard output.\n"
+		"  -c              resume the download to the FILE, its progress is kept in FILE.progress\n"
+		"  -m              receive the data right into the memory-mapped FILE\n"
+		"  -u              receive and write the data with io_uring if available\n"
+		"  -n CONNECTIONS  download segments of the file in parallel\n", name);
+	return EXIT_FAILURE;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int connections = 1;
+	int opt;
+	while ((opt = getopt(argc, argv, "cmun:")) != -1) {
+		switch (opt) {
+		case 'c':
+			download_set_resume(true);
+			break;
+		case 'm':
+			download_set_writer(DOWNLOAD_WRITER_MMAP);
+			break;
+		case 'u':
+			download_set_writer(DOWNLOAD_WRITER_URING);
+			break;
+		case 'n':
+			connections = strtoul(optarg, NULL, 10);
+			if (connections == 0 || connections > 256)
+				return usage(argv[0]);
+			break;
+		default:
+			return usage(argv[0]);
+		}
+	}
+	if (argc - optind < 1 || argc - optind > 2)
+		return usage(argv[0]);
+
+	const char *url = argv[optind];
+	char *path = argc - optind == 2 ? NULL : download_file_name(url);
+	int err = download(url, path ? path : argv[optind + 1], connections);
+	free(path);
+	return err ? EXIT_FAILURE : EXIT_SUCCESS;
+}
 #endif
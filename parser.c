@@ -0,0 +1,862 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "http.h"
+#include "log.h"
+#include "parser.h"
+#include "scan.h"
+#include "slab.h"
+
+void parser_init(struct parser *parser, size_t max_header_size)
+{
+	/* The header index keeps 32-bit offsets */
+	assert(max_header_size <= UINT32_MAX);
+	memset(parser, 0, sizeof(*parser));
+	parser->max_header_size = max_header_size;
+}
+
+void parser_term(struct parser *parser)
+{
+	if (parser->header.data)
+		buffer_term(&parser->header);
+	if (parser->lines.data)
+		buffer_term(&parser->lines);
+	if (parser->other.data)
+		buffer_term(&parser->other);
+	parser_init(parser, parser->max_header_size);
+}
+
+void parser_reset(struct parser *parser)
+{
+	parser->state = PARSER_STATUS_LINE;
+	parser->header.space = parser->header.data;
+	parser->lines.space = parser->lines.data;
+	parser->other.space = parser->other.data;
+	parser->line_start = 0;
+	parser->status_line = 0;
+	parser->chunk_digits = 0;
+	parser->framing_size = 0;
+	parser->trailer_line = 0;
+}
+
+static int parser_append(struct parser *parser, const char *data, size_t size)
+{
+	if (parser->header.data == NULL)
+		buffer_init_slab(&parser->header, 1 << 10);
+	if (buffer_data_len(&parser->header) + size > parser->max_header_size) {
+		error("The response header exceeds %zu bytes", parser->max_header_size);
+		return ERR_HTTP_BUFFER_TOO_SMALL;
+	}
+	buffer_append(&parser->header, data, size);
+	return 0;
+}
+
+static inline bool parser_is_digit(char ch)
+{
+	return ch >= '0' && ch <= '9';
+}
+
+/* HTTP-version SP status-code SP reason-phrase, see https://tools.ietf.org/html/rfc7230#section-3.1.2 */
+static int parse_status_line(struct http_response *response, const char *line)
+{
+	if (strncmp(line, "HTTP/", 5) || !parser_is_digit(line[5]) || line[6] != '.' ||
+		!parser_is_digit(line[7]) || line[8] != ' ') {
+		error("Invalid HTTP version: '%s'", line);
+		return ERR_HTTP_INVALID_RESPONSE;
+	}
+	response->http_version_major = line[5] - '0';
+	response->http_version_minor = line[7] - '0';
+
+	const char *code = line + 9;
+	if (!parser_is_digit(code[0]) || !parser_is_digit(code[1]) || !parser_is_digit(code[2]) ||
+		(code[3] && code[3] != ' ')) {
+		error("Invalid status code: Status line: '%s'", code);
+		return ERR_HTTP_INVALID_RESPONSE;
+	}
+	response->status_code = (code[0] - '0') * 100 + (code[1] - '0') * 10 + (code[2] - '0');
+	return 0;
+}
+
+/* Parses a decimal number, rejecting anything but digits and values over UINT64_MAX */
+static bool parse_uint64(const char *str, uint64_t *value)
+{
+	uint64_t result = 0;
+	const char *ch = str;
+	for (; parser_is_digit(*ch); ch++) {
+		unsigned int digit = *ch - '0';
+		if (result > (UINT64_MAX - digit) / 10)
+			return false;
+		result = result * 10 + digit;
+	}
+	if (ch == str || *ch)
+		return false;
+	*value = result;
+	return true;
+}
+
+/* Determines how the end of the body is detected according to
+   https://tools.ietf.org/html/rfc7230#section-3.3.3 */
+static int parser_body_init(struct http_response *response)
+{
+	struct parser *parser = &response->parser;
+	unsigned int status = response->status_code;
+	if ((status >= 100 && status < 200) || status == 204 || status == 304) {
+		response->body_type = HTTP_BODY_NONE;
+		parser->state = PARSER_DONE;
+		response->body_done = true;
+		return 0;
+	}
+
+	const char *encoding = http_response_header(response, HTTP_HDR_TRANSFER_ENCODING);
+	if (encoding) {
+		size_t len = strlen(encoding);
+		if (len < 7 || strcasecmp(encoding + len - 7, "chunked")) {
+			error("Unsupported Transfer-Encoding: '%s'", encoding);
+			return ERR_HTTP_INVALID_RESPONSE;
+		}
+		response->body_type = HTTP_BODY_CHUNKED;
+		parser->state = PARSER_CHUNK_SIZE;
+		return 0;
+	}
+
+	const char *length = http_response_header(response, HTTP_HDR_CONTENT_LENGTH);
+	if (length) {
+		if (!parse_uint64(length, &response->body_left)) {
+			error("Invalid Content-Length: '%s'", length);
+			return ERR_HTTP_INVALID_RESPONSE;
+		}
+		response->body_type = HTTP_BODY_LENGTH;
+		parser->state = response->body_left ? PARSER_BODY : PARSER_DONE;
+		response->body_done = response->body_left == 0;
+		return 0;
+	}
+
+	response->body_type = HTTP_BODY_CLOSE;
+	parser->state = PARSER_BODY;
+	return 0;
+}
+
+/* Puts the field at line_start of the header buffer to the index, the line is trimmed
+   and terminated by zero already */
+static int parser_field(struct parser *parser, struct header_index *index, size_t len)
+{
+	struct buffer *header = &parser->header;
+	struct header_slot slot;
+	int id = header_field(header->data, parser->line_start, len, &slot);
+	if (id == -2) {
+		error("Invalid header field: '%s'", header->data + parser->line_start);
+		return ERR_HTTP_INVALID_RESPONSE;
+	}
+	if (id >= 0) {
+		if (index->known[id].name == 0)
+			index->known[id] = slot;
+	} else {
+		if (parser->other.data == NULL)
+			buffer_init_slab(&parser->other, 16 * sizeof(slot));
+		buffer_append(&parser->other, &slot, sizeof(slot));
+	}
+	return 0;
+}
+
+static size_t parser_other_capacity(struct parser *parser)
+{
+	return header_other_capacity(buffer_data_len(&parser->other) / sizeof(struct header_slot));
+}
+
+/* Fills the table of the other fields, which has parser_other_capacity() slots */
+static void parser_index_other(struct parser *parser, struct header_index *index, struct header_slot *table)
+{
+	memset(table, 0, parser_other_capacity(parser) * sizeof(*table));
+	header_index_other(index, parser->header.data, table, (const struct header_slot*)parser->other.data,
+					   buffer_data_len(&parser->other) / sizeof(struct header_slot));
+}
+
+static size_t parser_padding(size_t size)
+{
+	return (sizeof(char*) - size % sizeof(char*)) % sizeof(char*);
+}
+
+/* Hands the collected lines over to the response as its header. The array of the lines
+   and the table of the other fields follow them in the same block. */
+static int parser_header_complete(struct http_response *response)
+{
+	struct parser *parser = &response->parser;
+	size_t nr_headers = buffer_data_len(&parser->lines) / sizeof(size_t);
+	size_t size = buffer_data_len(&parser->header);
+	size_t padding = parser_padding(size);
+	buffer_reserve(&parser->header, padding + (nr_headers + 1) * sizeof(char*) +
+				   parser_other_capacity(parser) * sizeof(struct header_slot));
+
+	char *header = parser->header.data;
+	const char **headers = (const char**)(header + size + padding);
+	const size_t *offsets = (const size_t*)parser->lines.data;
+	for (size_t i = 0; i < nr_headers; i++)
+		headers[i] = header + offsets[i];
+	headers[nr_headers] = NULL;
+	parser_index_other(parser, &response->header_index, (struct header_slot*)(headers + nr_headers + 1));
+
+	assert(response->header_buf == NULL);
+	response->header_buf = header;
+	response->headers = headers;
+	response->status_line = header + parser->status_line;
+	memset(&parser->header, 0, sizeof(parser->header));
+	return parser_body_init(response);
+}
+
+/* Remove optional trailing whitespace according to
+   https://tools.ietf.org/html/rfc7230#section-3.2 */
+static size_t parser_trim(struct parser *parser, size_t len)
+{
+	struct buffer *header = &parser->header;
+	while (len && (header->space[-1] == ' ' || header->space[-1] == '\t')) {
+		header->space--;
+		len--;
+	}
+	buffer_append(header, "", 1);
+	return len;
+}
+
+/* The line at line_start is complete, its CRLF is dropped already */
+static int parser_line(struct http_response *response)
+{
+	struct parser *parser = &response->parser;
+	struct buffer *header = &parser->header;
+	size_t len = buffer_data_len(header) - parser->line_start;
+
+	if (parser->state == PARSER_STATUS_LINE) {
+		buffer_append(header, "", 1);
+		const char *line = header->data + parser->line_start;
+		int err = parse_status_line(response, line);
+		if (err)
+			return err;
+		parser->status_line = parser->line_start + 9;
+		parser->line_start = buffer_data_len(header);
+		parser->state = PARSER_HEADER;
+		return 0;
+	}
+
+	if (len == 0)
+		return parser_header_complete(response);
+
+	len = parser_trim(parser, len);
+	int err = parser_field(parser, &response->header_index, len);
+	if (err)
+		return err;
+	if (parser->lines.data == NULL)
+		buffer_init_slab(&parser->lines, 32 * sizeof(size_t));
+	buffer_append(&parser->lines, &parser->line_start, sizeof(parser->line_start));
+	parser->line_start = buffer_data_len(header);
+	return 0;
+}
+
+static int parser_header(struct http_response *response, const char *data, size_t size, size_t *consumed)
+{
+	struct parser *parser = &response->parser;
+	const char *p = data;
+	const char *end = data + size;
+	int err = 0;
+
+	/* The CR of the line is the last byte of the previous slice */
+	struct buffer *header = &parser->header;
+	if (header->data && buffer_data_len(header) > parser->line_start &&
+		header->space[-1] == '\r' && *p == '\n') {
+		header->space--;
+		p++;
+		if ((err = parser_line(response)) || parser_header_received(parser))
+			goto out;
+	}
+
+	struct scan_lines lines;
+	scan_lines_init(&lines);
+	scan_header(p, end - p, &lines);
+	const char *start = p;
+	for (size_t i = 0; i < lines.nr; i++) {
+		const char *eol = start + lines.ends[i];
+		if ((err = parser_append(parser, p, eol - p)))
+			break;
+		p = eol + 2;
+		if ((err = parser_line(response)) || parser_header_received(parser))
+			break;
+	}
+	scan_lines_term(&lines);
+	if (!err && !parser_header_received(parser)) {
+		/* The beginning of the next line */
+		err = parser_append(parser, p, end - p);
+		p = end;
+	}
+out:
+	*consumed = p - data;
+	return err;
+}
+
+static int parser_trailer_line(struct http_response *response)
+{
+	struct parser *parser = &response->parser;
+	size_t len = parser_trim(parser, parser->trailer_line);
+	return parser_field(parser, &response->trailer_index, len);
+}
+
+/* Hands the trailer fields over to the response with the table of the other fields */
+static void parser_trailer_complete(struct http_response *response)
+{
+	struct parser *parser = &response->parser;
+	if (parser->header.data == NULL || buffer_data_len(&parser->header) == 0)
+		return;
+	size_t size = buffer_data_len(&parser->header);
+	size_t padding = parser_padding(size);
+	buffer_reserve(&parser->header, padding + parser_other_capacity(parser) * sizeof(struct header_slot));
+	parser_index_other(parser, &response->trailer_index,
+					   (struct header_slot*)(parser->header.data + size + padding));
+
+	assert(response->trailer_buf == NULL);
+	response->trailer_buf = parser->header.data;
+	memset(&parser->header, 0, sizeof(parser->header));
+}
+
+static int parser_framing_byte(struct parser *parser)
+{
+	if (++parser->framing_size > parser->max_header_size) {
+		error("Chunk framing exceeds %zu bytes", parser->max_header_size);
+		return ERR_HTTP_BUFFER_TOO_SMALL;
+	}
+	return 0;
+}
+
+/* Decodes chunk size lines, CRLFs after the chunk data and the trailer part,
+   see https://tools.ietf.org/html/rfc7230#section-4.1 */
+static int parser_chunk(struct http_response *response, const char *data, size_t size, size_t *consumed)
+{
+	struct parser *parser = &response->parser;
+	const char *p = data;
+	const char *end = data + size;
+	int err = 0;
+	while (p < end && parser->state != PARSER_BODY && parser->state != PARSER_DONE) {
+		char ch = *p++;
+		switch (parser->state) {
+		case PARSER_CHUNK_SIZE: {
+			int digit = -1;
+			if (parser_is_digit(ch))
+				digit = ch - '0';
+			else if (ch >= 'a' && ch <= 'f')
+				digit = ch - 'a' + 10;
+			else if (ch >= 'A' && ch <= 'F')
+				digit = ch - 'A' + 10;
+			if (digit >= 0) {
+				if (response->body_left >> 60) {
+					error("Chunk size is too large");
+					return ERR_HTTP_INVALID_RESPONSE;
+				}
+				response->body_left = (response->body_left << 4) | digit;
+				parser->chunk_digits++;
+				break;
+			}
+			if (parser->chunk_digits == 0) {
+				error("Invalid chunk size: unexpected character 0x%02x", (unsigned char)ch);
+				return ERR_HTTP_INVALID_RESPONSE;
+			}
+			/* Chunk extensions are ignored */
+			if (ch == ';' || ch == ' ' || ch == '\t') {
+				parser->state = PARSER_CHUNK_EXTENSION;
+				parser->framing_size = 0;
+			} else if (ch == '\r') {
+				parser->state = PARSER_CHUNK_SIZE_LF;
+			} else if (ch == '\n') {
+				goto chunk_size;
+			} else {
+				error("Invalid chunk size: unexpected character 0x%02x", (unsigned char)ch);
+				return ERR_HTTP_INVALID_RESPONSE;
+			}
+			break;
+		}
+		case PARSER_CHUNK_EXTENSION:
+			if (ch == '\r')
+				parser->state = PARSER_CHUNK_SIZE_LF;
+			else if (ch == '\n')
+				goto chunk_size;
+			else if ((err = parser_framing_byte(parser)))
+				return err;
+			break;
+		case PARSER_CHUNK_SIZE_LF:
+			if (ch != '\n') {
+				error("Chunk size is not terminated by CRLF");
+				return ERR_HTTP_INVALID_RESPONSE;
+			}
+chunk_size:
+			parser->chunk_digits = 0;
+			response->body_chunks++;
+			if (response->body_left) {
+				parser->state = PARSER_BODY;
+			} else {
+				parser->state = PARSER_TRAILER;
+				parser->framing_size = 0;
+				parser->trailer_line = 0;
+				parser->header.space = parser->header.data;
+				parser->other.space = parser->other.data;
+			}
+			break;
+		case PARSER_CHUNK_DATA_CR:
+		case PARSER_CHUNK_DATA_LF:
+			if (ch != (parser->state == PARSER_CHUNK_DATA_CR ? '\r' : '\n')) {
+				error("Chunk data is not terminated by CRLF");
+				return ERR_HTTP_INVALID_RESPONSE;
+			}
+			parser->state = parser->state == PARSER_CHUNK_DATA_CR ? PARSER_CHUNK_DATA_LF : PARSER_CHUNK_SIZE;
+			break;
+		case PARSER_TRAILER:
+			if ((err = parser_framing_byte(parser)))
+				return err;
+			if (ch == '\n') {
+				if (parser->trailer_line == 0) {
+					parser_trailer_complete(response);
+					parser->state = PARSER_DONE;
+					response->body_done = true;
+				} else if ((err = parser_trailer_line(response))) {
+					return err;
+				}
+				parser->trailer_line = 0;
+			} else if (ch != '\r') {
+				if (parser->header.data == NULL)
+					buffer_init_slab(&parser->header, 1 << 8);
+				/* Offset 0 means an empty slot of the index */
+				if (buffer_data_len(&parser->header) == 0)
+					buffer_append(&parser->header, "", 1);
+				if (parser->trailer_line++ == 0)
+					parser->line_start = buffer_data_len(&parser->header);
+				buffer_append(&parser->header, &ch, 1);
+			}
+			break;
+		}
+	}
+	*consumed = p - data;
+	return 0;
+}
+
+int parser_parse(struct http_response *response, const char *data, size_t size, size_t *consumed)
+{
+	*consumed = 0;
+	if (size == 0)
+		return 0;
+	switch (response->parser.state) {
+	case PARSER_STATUS_LINE:
+	case PARSER_HEADER:
+		return parser_header(response, data, size, consumed);
+	case PARSER_BODY:
+	case PARSER_DONE:
+		return 0;
+	default:
+		return parser_chunk(response, data, size, consumed);
+	}
+}
+
+uint64_t parser_body_available(struct http_response *response)
+{
+	if (response->parser.state != PARSER_BODY)
+		return 0;
+	return response->body_type == HTTP_BODY_CLOSE ? UINT64_MAX : response->body_left;
+}
+
+void parser_body_consumed(struct http_response *response, size_t size)
+{
+	assert(response->parser.state == PARSER_BODY || size == 0);
+	if (response->body_type == HTTP_BODY_CLOSE)
+		return;
+	assert(size <= response->body_left);
+	response->body_left -= size;
+	if (response->body_left)
+		return;
+	if (response->body_type == HTTP_BODY_CHUNKED) {
+		response->parser.state = PARSER_CHUNK_DATA_CR;
+	} else {
+		response->parser.state = PARSER_DONE;
+		response->body_done = true;
+	}
+}
+
+int parser_eof(struct http_response *response)
+{
+	struct parser *parser = &response->parser;
+	switch (parser->state) {
+	case PARSER_STATUS_LINE:
+	case PARSER_HEADER:
+		if (parser_empty(parser)) {
+			error("The server closed the connection without response");
+			return ERR_HTTP_CONNECTION_CLOSED;
+		}
+		error("Connection closed in the middle of the response header");
+		return ERR_HTTP_INVALID_RESPONSE;
+	case PARSER_DONE:
+		return 0;
+	case PARSER_BODY:
+		if (response->body_type == HTTP_BODY_CLOSE) {
+			parser->state = PARSER_DONE;
+			response->body_done = true;
+			return 0;
+		}
+		/* fall through */
+	default:
+		error("Connection closed before the end of the response body");
+		return ERR_HTTP_BODY_TRUNCATED;
+	}
+}
+
+#ifdef UNIT_TEST
+#include <stdio.h>
+#include "http_internal.h"
+
+/* Feeds the text in slices of the size and collects the body */
+static int test_parse(const char *text, size_t slice, struct http_response *response, struct buffer *body)
+{
+	http_response_init(response);
+	buffer_init(body, 64);
+	const char *data = text;
+	const char *end = text + strlen(text);
+	size_t size = 0;
+	while (response->parser.state != PARSER_DONE) {
+		if (size == 0) {
+			if (data == end)
+				return parser_eof(response);
+			size = (size_t)(end - data) < slice ? (size_t)(end - data) : slice;
+		}
+		uint64_t available = parser_body_available(response);
+		if (available) {
+			size_t body_size = available < size ? available : size;
+			buffer_append(body, data, body_size);
+			parser_body_consumed(response, body_size);
+			data += body_size;
+			size -= body_size;
+			continue;
+		}
+		size_t consumed = 0;
+		int err = parser_parse(response, data, size, &consumed);
+		if (err)
+			return err;
+		data += consumed;
+		size -= consumed;
+	}
+	/* The bytes after the response belong to the next one */
+	return data + size == end ? 0 : -1;
+}
+
+static void test_response(const char *text, int expected_err, const char *expected_body)
+{
+	for (size_t slice = 1; slice == 1 || slice <= strlen(text); slice++) {
+		struct http_response response;
+		struct buffer body;
+		int err = test_parse(text, slice, &response, &body);
+		assert(err == expected_err);
+		if (!err) {
+			assert(buffer_data_len(&body) == strlen(expected_body));
+			assert(!memcmp(body.data, expected_body, buffer_data_len(&body)));
+		}
+		buffer_term(&body);
+		http_response_close(&response);
+	}
+}
+
+static void test_header_fields(void)
+{
+	static const char text[] =
+		"HTTP/1.1 200 OK\r\n"
+		"Server: nginx\r\n"
+		"Date: Sun, 03 Feb 2019 09:35:44 GMT\r\n"
+		"Header-With-Trailing-Whitespace: \tsome value \t\r\n"
+		"Content-Length: 14\r\n"
+		"\r\n"
+		"blah blah blah";
+	for (size_t slice = 1; slice <= sizeof(text) - 1; slice++) {
+		struct http_response response;
+		struct buffer body;
+		assert(!test_parse(text, slice, &response, &body));
+		assert(response.http_version_major == 1);
+		assert(response.http_version_minor == 1);
+		assert(response.status_code == 200);
+		assert(!strcmp(response.status_line, "200 OK"));
+		assert(!strcmp(response.headers[0], "Server: nginx"));
+		assert(!strcmp(response.headers[1], "Date: Sun, 03 Feb 2019 09:35:44 GMT"));
+		assert(!strcmp(response.headers[2], "Header-With-Trailing-Whitespace: \tsome value"));
+		assert(!strcmp(response.headers[3], "Content-Length: 14"));
+		assert(response.headers[4] == NULL);
+
+		assert(!strcmp(http_response_get_header(&response, "Server"), "nginx"));
+		assert(!strcmp(http_response_get_header(&response, "Date"), "Sun, 03 Feb 2019 09:35:44 GMT"));
+		assert(!strcmp(http_response_get_header(&response, "Header-With-Trailing-Whitespace"), "some value"));
+		assert(http_response_get_header(&response, "Unknown-header") == NULL);
+		assert(!strcmp(http_response_header(&response, HTTP_HDR_CONTENT_LENGTH), "14"));
+		assert(http_response_header(&response, HTTP_HDR_ETAG) == NULL);
+		assert(buffer_data_len(&body) == 14 && !memcmp(body.data, "blah blah blah", 14));
+		buffer_term(&body);
+		http_response_close(&response);
+	}
+}
+
+static void test_header_index(void)
+{
+	char text[4096] = "HTTP/1.1 200 OK\r\n"
+		"content-length: 0\r\n"
+		"X-Request-Id: 1\r\n"
+		"ETag: \"a\"\r\n"
+		"x-request-id: 2\r\n"
+		"etag: \"b\"\r\n";
+	/* More other fields than the table has slots for a few of them */
+	for (int i = 0; i < 100; i++)
+		sprintf(text + strlen(text), "X-Field-%d: %d\r\n", i, i);
+	strcat(text, "\r\n");
+
+	struct http_response response;
+	struct buffer body;
+	assert(!test_parse(text, sizeof(text), &response, &body));
+	assert(!strcmp(http_response_header(&response, HTTP_HDR_CONTENT_LENGTH), "0"));
+	assert(!strcmp(http_response_header(&response, HTTP_HDR_ETAG), "\"a\""));
+	assert(!strcmp(http_response_get_header(&response, "etag"), "\"a\""));
+	assert(!strcmp(http_response_get_header(&response, "X-REQUEST-ID"), "1"));
+	for (int i = 0; i < 100; i++) {
+		char name[32], value[32];
+		sprintf(name, "x-field-%d", i);
+		sprintf(value, "%d", i);
+		assert(!strcmp(http_response_get_header(&response, name), value));
+	}
+	assert(http_response_get_header(&response, "X-Field-100") == NULL);
+	assert(http_response_header(&response, HTTP_HDR_SERVER) == NULL);
+	buffer_term(&body);
+	http_response_close(&response);
+	assert(http_response_header(&response, HTTP_HDR_ETAG) == NULL);
+
+	test_response("HTTP/1.1 200 OK\r\nServer nginx\r\n\r\n", ERR_HTTP_INVALID_RESPONSE, NULL);
+	test_response("HTTP/1.1 200 OK\r\n: nginx\r\n\r\n", ERR_HTTP_INVALID_RESPONSE, NULL);
+	test_response("HTTP/1.1 200 OK\r\nContent-Length : 0\r\n\r\n", ERR_HTTP_INVALID_RESPONSE, NULL);
+
+	/* A zero byte in a name, which test_response() can not pass */
+	static const char nul[] = "HTTP/1.1 200 OK\r\nVia\0;: x\r\nContent-Length: 0\r\n\r\n";
+	http_response_init(&response);
+	size_t consumed = 0;
+	assert(parser_parse(&response, nul, sizeof(nul) - 1, &consumed) == ERR_HTTP_INVALID_RESPONSE);
+	http_response_close(&response);
+}
+
+static int test_status_line(const char *status_line, int major_version, int minor_version)
+{
+	char text[256];
+	snprintf(text, sizeof(text), "%s\r\nContent-Length: 0\r\n\r\n", status_line);
+	struct http_response response;
+	struct buffer body;
+	int err = test_parse(text, sizeof(text), &response, &body);
+	if (!err) {
+		assert(response.http_version_major == major_version);
+		assert(response.http_version_minor == minor_version);
+	}
+	buffer_term(&body);
+	http_response_close(&response);
+	return err;
+}
+
+static void test_status_lines(void)
+{
+	assert(!test_status_line("HTTP/1.1 200 OK", 1, 1));
+	assert(!test_status_line("HTTP/0.9 200 OK", 0, 9));
+	assert(!test_status_line("HTTP/1.0 200 OK", 1, 0));
+	assert(!test_status_line("HTTP/1.1 200", 1, 1));
+	assert(ERR_HTTP_INVALID_RESPONSE == test_status_line("HTTP/2 200 OK", 2, 0));
+	assert(ERR_HTTP_INVALID_RESPONSE == test_status_line("HTTP/xx 200 OK", 0, 0));
+	assert(ERR_HTTP_INVALID_RESPONSE == test_status_line("HTTP/1.1 2000 OK", 1, 1));
+	assert(ERR_HTTP_INVALID_RESPONSE == test_status_line("HTTP/1.1 20 OK", 1, 1));
+	assert(ERR_HTTP_INVALID_RESPONSE == test_status_line("HTTP/1.1 -200 OK", 1, 1));
+}
+
+static void test_bodies(void)
+{
+	test_response("HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nhello", 0, "hello");
+	test_response("HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n", 0, "");
+	test_response("HTTP/1.1 204 No Content\r\n\r\n", 0, "");
+	test_response("HTTP/1.0 200 OK\r\n\r\nuntil close", 0, "until close");
+	test_response("HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+		"5\r\nhello\r\n7;ext=\"a b\"\r\n, world\r\nA \r\n0123456789\r\n0\r\nTrailer: x\r\n\r\n",
+		0, "hello, world0123456789");
+	test_response("HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n0\r\n\r\n", 0, "");
+
+	test_response("", ERR_HTTP_CONNECTION_CLOSED, NULL);
+	test_response("HTTP/1.1 200 OK\r\nServer: x", ERR_HTTP_INVALID_RESPONSE, NULL);
+	test_response("HTTP/1.1 200 OK\r\nContent-Length: 10\r\n\r\nshort", ERR_HTTP_BODY_TRUNCATED, NULL);
+	test_response("HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n5\r\nhello\r\n",
+		ERR_HTTP_BODY_TRUNCATED, NULL);
+	test_response("HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n5\r\nhelloXX0\r\n\r\n",
+		ERR_HTTP_INVALID_RESPONSE, NULL);
+	test_response("HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\nx\r\n",
+		ERR_HTTP_INVALID_RESPONSE, NULL);
+	test_response("HTTP/1.1 200 OK\r\nTransfer-Encoding: gzip\r\n\r\n", ERR_HTTP_INVALID_RESPONSE, NULL);
+	test_response("HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n0\r\nNo colon\r\n\r\n",
+		ERR_HTTP_INVALID_RESPONSE, NULL);
+}
+
+static void test_trailers(void)
+{
+	static const char text[] =
+		"HTTP/1.1 200 OK\r\n"
+		"Transfer-Encoding: chunked\r\n"
+		"Server: nginx\r\n"
+		"\r\n"
+		"3\r\nabc\r\n"
+		"0\r\n"
+		"X-Checksum: 1234 \r\n"
+		"Server: other\r\n"
+		"Expires: 0\r\n"
+		"\r\n";
+	for (size_t slice = 1; slice <= sizeof(text) - 1; slice++) {
+		struct http_response response;
+		struct buffer body;
+		assert(!test_parse(text, slice, &response, &body));
+		assert(!strcmp(http_response_get_header(&response, "X-Checksum"), "1234"));
+		assert(!strcmp(http_response_header(&response, HTTP_HDR_EXPIRES), "0"));
+		/* The header field takes precedence */
+		assert(!strcmp(http_response_header(&response, HTTP_HDR_SERVER), "nginx"));
+		assert(http_response_get_header(&response, "Trailer") == NULL);
+		buffer_term(&body);
+		http_response_close(&response);
+	}
+}
+
+static void test_overflow(void)
+{
+	test_response("HTTP/1.1 200 OK\r\nContent-Length: 18446744073709551615\r\n\r\n",
+		ERR_HTTP_BODY_TRUNCATED, NULL);
+	test_response("HTTP/1.1 200 OK\r\nContent-Length: 18446744073709551616\r\n\r\n",
+		ERR_HTTP_INVALID_RESPONSE, NULL);
+	test_response("HTTP/1.1 200 OK\r\nContent-Length: 1x\r\n\r\n", ERR_HTTP_INVALID_RESPONSE, NULL);
+	test_response("HTTP/1.1 200 OK\r\nContent-Length: \r\n\r\n", ERR_HTTP_INVALID_RESPONSE, NULL);
+	test_response("HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\nfffffffffffffffff\r\n",
+		ERR_HTTP_INVALID_RESPONSE, NULL);
+
+	struct http_response response;
+	http_response_init(&response);
+	response.parser.max_header_size = 16;
+	size_t consumed = 0;
+	assert(parser_parse(&response, "HTTP/1.1 200 OK\r\nServer: nginx\r\n", 32, &consumed) ==
+		ERR_HTTP_BUFFER_TOO_SMALL);
+	http_response_close(&response);
+}
+
+void test_parser(void)
+{
+	test_header_fields();
+	test_header_index();
+	test_status_lines();
+	test_bodies();
+	test_trailers();
+	test_overflow();
+}
+#endif
+
+#ifdef FUZZ
+#include "http_internal.h"
+
+/* The first byte is the slice size, the rest is a response. Every header field must be
+   found by its name once the header is parsed. */
+void fuzz_parser(const unsigned char *data, size_t size)
+{
+	if (size == 0)
+		return;
+	size_t slice = data[0] + 1;
+	const char *text = (const char*)data + 1;
+	const char *end = text + size - 1;
+
+	struct http_response response;
+	http_response_init(&response);
+	response.parser.max_header_size = 1 << 12;
+	size_t left = 0;
+	int err = 0;
+	while (!err && response.parser.state != PARSER_DONE) {
+		if (left == 0) {
+			if (text == end) {
+				err = parser_eof(&response);
+				break;
+			}
+			left = (size_t)(end - text) < slice ? (size_t)(end - text) : slice;
+		}
+		uint64_t available = parser_body_available(&response);
+		if (available) {
+			size_t body_size = available < left ? available : left;
+			parser_body_consumed(&response, body_size);
+			text += body_size;
+			left -= body_size;
+			continue;
+		}
+		size_t consumed = 0;
+		bool header_received = parser_header_received(&response.parser);
+		err = parser_parse(&response, text, left, &consumed);
+		assert(consumed <= left);
+		text += consumed;
+		left -= consumed;
+		if (err || header_received || !parser_header_received(&response.parser))
+			continue;
+		for (const char **line = response.headers; *line; line++) {
+			char name[256];
+			size_t name_len = strcspn(*line, ":");
+			/* A name with a zero byte cannot be looked up */
+			if ((*line)[name_len] != ':' || name_len >= sizeof(name))
+				continue;
+			assert(name_len > 0);
+			memcpy(name, *line, name_len);
+			name[name_len] = 0;
+			assert(http_response_get_header(&response, name));
+		}
+	}
+	http_response_close(&response);
+}
+#endif
+
+#ifdef BENCH
+#include <stdio.h>
+#include "http_internal.h"
+
+/* Parses a typical response header at once and looks up its fields */
+void bench_parser(void)
+{
+	static const char header[] =
+		"HTTP/1.1 200 OK\r\n"
+		"Server: nginx/1.18.0\r\n"
+		"Date: Sun, 03 Feb 2019 09:35:44 GMT\r\n"
+		"Content-Type: text/html; charset=utf-8\r\n"
+		"Content-Length: 153428\r\n"
+		"Connection: keep-alive\r\n"
+		"Cache-Control: private, max-age=0, must-revalidate\r\n"
+		"Set-Cookie: session=5f2b1c0e8a3d4f6b9c7e1a2d3f4b5c6d; Path=/; HttpOnly; Secure; SameSite=Lax\r\n"
+		"ETag: \"5c56b6a0-25754\"\r\n"
+		"Vary: Accept-Encoding, Cookie\r\n"
+		"Strict-Transport-Security: max-age=31536000; includeSubDomains\r\n"
+		"X-Frame-Options: SAMEORIGIN\r\n"
+		"X-Request-Id: 7b1f0c2e\r\n"
+		"\r\n";
+	size_t nr_fields = 12;
+	size_t iterations = 1 << 20;
+	struct http_response response;
+	http_response_init(&response);
+	double start = bench_now();
+	for (size_t n = 0; n < iterations; n++) {
+		size_t consumed = 0;
+		int err = parser_parse(&response, header, sizeof(header) - 1, &consumed);
+		assert(!err && consumed == sizeof(header) - 1);
+		(void)err;
+		slab_free(response.header_buf);
+		response.header_buf = NULL;
+		header_index_init(&response.header_index);
+		parser_reset(&response.parser);
+	}
+	double seconds = bench_now() - start;
+	printf("parser header=%zu fields=%zu ns/header=%.1f\n", sizeof(header) - 1, nr_fields,
+		seconds / iterations * 1e9);
+
+	size_t consumed = 0;
+	parser_parse(&response, header, sizeof(header) - 1, &consumed);
+	static const char *names[] = {"Content-Length", "ETag", "X-Request-Id", "X-Missing"};
+	for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+		const char *volatile value;
+		start = bench_now();
+		for (size_t n = 0; n < iterations; n++)
+			value = http_response_get_header(&response, names[i]);
+		(void)value;
+		seconds = bench_now() - start;
+		printf("parser lookup=%s ns/lookup=%.1f\n", names[i], seconds / iterations * 1e9);
+	}
+	http_response_close(&response);
+}
+#endif
@@ -0,0 +1,85 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "buffer.h"
+
+/* Push parser of HTTP/1.x responses. It takes the bytes in slices of any size as they
+   arrive and keeps its state between the calls, so a byte is never looked at twice.
+   Header lines are split by the vectorized scanner and copied once to their final place,
+   chunk framing is decoded byte by byte. Body data is left to the caller, in place.
+   The blocking API and the event loop both run on it. */
+
+#define PARSER_STATUS_LINE		0
+#define PARSER_HEADER			1
+#define PARSER_BODY				2	/* data of the body or of the current chunk */
+#define PARSER_CHUNK_SIZE		3
+#define PARSER_CHUNK_EXTENSION	4
+#define PARSER_CHUNK_SIZE_LF	5
+#define PARSER_CHUNK_DATA_CR	6	/* CRLF after the chunk data */
+#define PARSER_CHUNK_DATA_LF	7
+#define PARSER_TRAILER			8
+#define PARSER_DONE				9
+
+#define PARSER_DEFAULT_MAX_HEADER_SIZE	(1 << 20)
+
+struct http_response;
+
+struct parser {
+	int				state;
+	size_t			max_header_size;	/* limits chunk extensions and trailers as well */
+	struct buffer	header;		/* lines received so far, each terminated by zero */
+	struct buffer	lines;		/* offsets of the header fields in the header */
+	struct buffer	other;		/* slots of the fields missing from the well-known ones */
+	size_t			line_start;	/* offset of the incomplete line */
+	size_t			status_line;	/* offset of the status code in the header */
+	size_t			chunk_digits;
+	size_t			framing_size;	/* of the chunk extension or of the trailer part */
+	size_t			trailer_line;	/* length of the current trailer line */
+};
+
+void parser_init(struct parser *parser, size_t max_header_size);
+void parser_term(struct parser *parser);
+
+/* Prepares the parser for the next response on the connection */
+void parser_reset(struct parser *parser);
+
+/* Parses bytes of the response up to the end of the header, to body data or to the end
+   of the response, whichever comes first. The consumed bytes may be dropped by the caller.
+   Once the header is received, the response fields and headers are set. */
+int parser_parse(struct http_response *response, const char *data, size_t size, size_t *consumed);
+
+/* Returns the number of body bytes starting at the current position, UINT64_MAX if
+   the body ends with the connection. Zero means the parser needs framing bytes or
+   the response is complete. */
+uint64_t parser_body_available(struct http_response *response);
+
+/* Marks size bytes of body data, at most parser_body_available(), as consumed */
+void parser_body_consumed(struct http_response *response, size_t size);
+
+/* The server has closed the connection. Completes a body delimited by the close,
+   otherwise returns the error describing the incomplete response. */
+int parser_eof(struct http_response *response);
+
+static inline bool parser_header_received(const struct parser *parser)
+{
+	return parser->state >= PARSER_BODY;
+}
+
+/* Returns true if no byte of the response has arrived yet */
+static inline bool parser_empty(const struct parser *parser)
+{
+	return parser->state == PARSER_STATUS_LINE && parser->header.space == parser->header.data;
+}
+
+#ifdef UNIT_TEST
+void test_parser(void);
+#endif
+
+#ifdef FUZZ
+void fuzz_parser(const unsigned char *data, size_t size);
+#endif
+
+#ifdef BENCH
+void bench_parser(void);
+#endif
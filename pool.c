@@ -0,0 +1,334 @@
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "log.h"
+#include "pool.h"
+
+/* Smallest hash table of the origins, it doubles when the origins outnumber the buckets */
+#define POOL_MIN_BUCKETS	16
+
+struct pool_connection {
+	/* Of the origin, most recently used first: it is the least likely to be closed by the server */
+	struct pool_connection	*prev;
+	struct pool_connection	*next;
+	/* Of all idle connections in the order of idle_since, the oldest is evicted first */
+	struct pool_connection	*older;
+	struct pool_connection	*newer;
+	struct pool_origin		*origin;
+	int						socket;
+	uint64_t				idle_since;	/* ms */
+};
+
+/* An origin is kept while it has idle connections */
+struct pool_origin {
+	struct pool_origin		*next;	/* in the bucket */
+	char					*origin;
+	uint32_t				hash;
+	struct pool_connection	*idle;
+};
+
+static struct {
+	pthread_mutex_t		lock;
+	struct pool_origin	**buckets;
+	size_t				nr_buckets;
+	size_t				nr_origins;
+	struct pool_connection	*oldest;
+	struct pool_connection	*newest;
+	size_t				nr_idle;
+	size_t				max_idle;
+	unsigned int		idle_timeout_ms;
+} pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.max_idle = POOL_DEFAULT_MAX_IDLE,
+	.idle_timeout_ms = POOL_DEFAULT_IDLE_TIMEOUT_MS,
+};
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* An idle HTTP connection must have nothing to read. Readable data means either
+   the server has closed the connection or has sent something unexpected. */
+static bool is_alive(int socket)
+{
+	char byte;
+	ssize_t result = recv(socket, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+	return result == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/* FNV-1a */
+static uint32_t pool_hash(const char *name)
+{
+	uint32_t hash = 2166136261u;
+	for (; *name; name++) {
+		hash ^= (unsigned char)*name;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/* Called under the lock, as all the functions below */
+static struct pool_origin *pool_find(const char *name, uint32_t hash)
+{
+	if (pool.nr_buckets == 0)
+		return NULL;
+	for (struct pool_origin *origin = pool.buckets[hash & (pool.nr_buckets - 1)]; origin;
+		 origin = origin->next) {
+		if (origin->hash == hash && !strcmp(origin->origin, name))
+			return origin;
+	}
+	return NULL;
+}
+
+static void pool_resize(size_t nr_buckets)
+{
+	struct pool_origin **buckets = calloc(nr_buckets, sizeof(*buckets));
+	assert(buckets);
+	for (size_t i = 0; i < pool.nr_buckets; i++) {
+		while (pool.buckets[i]) {
+			struct pool_origin *origin = pool.buckets[i];
+			pool.buckets[i] = origin->next;
+			origin->next = buckets[origin->hash & (nr_buckets - 1)];
+			buckets[origin->hash & (nr_buckets - 1)] = origin;
+		}
+	}
+	free(pool.buckets);
+	pool.buckets = buckets;
+	pool.nr_buckets = nr_buckets;
+}
+
+static struct pool_origin *pool_add_origin(const char *name, uint32_t hash)
+{
+	if (pool.nr_origins == pool.nr_buckets)
+		pool_resize(pool.nr_buckets ? 2 * pool.nr_buckets : POOL_MIN_BUCKETS);
+	struct pool_origin *origin = calloc(1, sizeof(*origin));
+	assert(origin);
+	origin->origin = strdup(name);
+	assert(origin->origin);
+	origin->hash = hash;
+	struct pool_origin **bucket = &pool.buckets[hash & (pool.nr_buckets - 1)];
+	origin->next = *bucket;
+	*bucket = origin;
+	pool.nr_origins++;
+	return origin;
+}
+
+static void pool_remove_origin(struct pool_origin *origin)
+{
+	struct pool_origin **link = &pool.buckets[origin->hash & (pool.nr_buckets - 1)];
+	while (*link != origin)
+		link = &(*link)->next;
+	*link = origin->next;
+	pool.nr_origins--;
+	free(origin->origin);
+	free(origin);
+}
+
+/* Takes the connection out of the pool, the origin goes with its last connection */
+static void pool_remove(struct pool_connection *connection)
+{
+	struct pool_origin *origin = connection->origin;
+	if (connection->prev)
+		connection->prev->next = connection->next;
+	else
+		origin->idle = connection->next;
+	if (connection->next)
+		connection->next->prev = connection->prev;
+	if (connection->older)
+		connection->older->newer = connection->newer;
+	else
+		pool.oldest = connection->newer;
+	if (connection->newer)
+		connection->newer->older = connection->older;
+	else
+		pool.newest = connection->older;
+	pool.nr_idle--;
+	if (origin->idle == NULL)
+		pool_remove_origin(origin);
+}
+
+static void connection_close(struct pool_connection *connection)
+{
+	pool_remove(connection);
+	close(connection->socket);
+	free(connection);
+}
+
+/* Closes connections idle for too long, they are the oldest ones */
+static void pool_evict_expired(uint64_t now)
+{
+	while (pool.oldest && now - pool.oldest->idle_since >= pool.idle_timeout_ms)
+		connection_close(pool.oldest);
+}
+
+int pool_get(const char *name)
+{
+	int socket = -1;
+	uint32_t hash = pool_hash(name);
+	pthread_mutex_lock(&pool.lock);
+	pool_evict_expired(now_ms());
+	struct pool_origin *origin = pool_find(name, hash);
+	while (origin && socket == -1) {
+		struct pool_connection *connection = origin->idle;
+		if (connection->next == NULL)
+			origin = NULL;	/* freed with its last connection */
+		pool_remove(connection);
+		if (is_alive(connection->socket))
+			socket = connection->socket;
+		else
+			close(connection->socket);
+		free(connection);
+	}
+	pthread_mutex_unlock(&pool.lock);
+	return socket;
+}
+
+void pool_put(const char *name, int socket)
+{
+	struct pool_connection *connection = calloc(1, sizeof(*connection));
+	assert(connection);
+	connection->socket = socket;
+	uint32_t hash = pool_hash(name);
+
+	pthread_mutex_lock(&pool.lock);
+	/* Taken under the lock, so the list of all connections stays in the order of it */
+	connection->idle_since = now_ms();
+	pool_evict_expired(connection->idle_since);
+	if (pool.max_idle == 0) {
+		pthread_mutex_unlock(&pool.lock);
+		close(socket);
+		free(connection);
+		return;
+	}
+	if (pool.nr_idle == pool.max_idle)
+		connection_close(pool.oldest);
+
+	struct pool_origin *origin = pool_find(name, hash);
+	if (origin == NULL)
+		origin = pool_add_origin(name, hash);
+	connection->origin = origin;
+	connection->next = origin->idle;
+	if (origin->idle)
+		origin->idle->prev = connection;
+	origin->idle = connection;
+	connection->older = pool.newest;
+	if (pool.newest)
+		pool.newest->newer = connection;
+	else
+		pool.oldest = connection;
+	pool.newest = connection;
+	pool.nr_idle++;
+	pthread_mutex_unlock(&pool.lock);
+}
+
+void pool_set_limits(size_t max_idle, unsigned int idle_timeout_ms)
+{
+	pthread_mutex_lock(&pool.lock);
+	pool.max_idle = max_idle;
+	pool.idle_timeout_ms = idle_timeout_ms;
+	while (pool.nr_idle > pool.max_idle)
+		connection_close(pool.oldest);
+	pthread_mutex_unlock(&pool.lock);
+}
+
+void pool_clear(void)
+{
+	pthread_mutex_lock(&pool.lock);
+	while (pool.oldest)
+		connection_close(pool.oldest);
+	assert(pool.nr_idle == 0 && pool.nr_origins == 0);
+	free(pool.buckets);
+	pool.buckets = NULL;
+	pool.nr_buckets = 0;
+	pthread_mutex_unlock(&pool.lock);
+}
+
+#ifdef UNIT_TEST
+#include <stdio.h>
+
+static void test_reuse(void)
+{
+	int sv[2];
+	assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+	pool_put("http://a:80", sv[0]);
+	assert(pool_get("http://b:80") == -1);
+	assert(pool_get("http://a:80") == sv[0]);
+	assert(pool_get("http://a:80") == -1);
+
+	/* The server has closed the idle connection */
+	pool_put("http://a:80", sv[0]);
+	close(sv[1]);
+	assert(pool_get("http://a:80") == -1);
+	assert(pool.nr_idle == 0 && pool.nr_origins == 0);
+}
+
+static void test_limits(void)
+{
+	int sv1[2], sv2[2];
+	assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, sv1));
+	assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, sv2));
+	pool_set_limits(1, POOL_DEFAULT_IDLE_TIMEOUT_MS);
+	pool_put("http://a:80", sv1[0]);
+	pool_put("http://b:80", sv2[0]);
+	assert(pool.nr_idle == 1);
+	assert(pool_get("http://a:80") == -1);
+	assert(pool_get("http://b:80") == sv2[0]);
+
+	pool_set_limits(POOL_DEFAULT_MAX_IDLE, 0);
+	pool_put("http://b:80", sv2[0]);
+	assert(pool_get("http://b:80") == -1);
+	assert(pool.nr_idle == 0);
+
+	pool_set_limits(POOL_DEFAULT_MAX_IDLE, POOL_DEFAULT_IDLE_TIMEOUT_MS);
+	pool_clear();
+	close(sv1[1]);
+	close(sv2[1]);
+}
+
+/* Origins are freed with their last idle connection, the oldest connection is evicted first */
+static void test_origins(void)
+{
+	enum { NR_ORIGINS = 100 };
+	int sockets[NR_ORIGINS][2];
+	pool_set_limits(NR_ORIGINS - 1, POOL_DEFAULT_IDLE_TIMEOUT_MS);
+	for (int i = 0; i < NR_ORIGINS; i++) {
+		assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, sockets[i]));
+		char name[32];
+		snprintf(name, sizeof(name), "http://host%d:80", i);
+		pool_put(name, sockets[i][0]);
+	}
+	assert(pool.nr_idle == NR_ORIGINS - 1 && pool.nr_origins == NR_ORIGINS - 1);
+	assert(pool.nr_buckets >= pool.nr_origins);
+	assert(pool_get("http://host0:80") == -1);
+	for (int i = NR_ORIGINS - 1; i > 0; i--) {
+		char name[32];
+		snprintf(name, sizeof(name), "http://host%d:80", i);
+		assert(pool_get(name) == sockets[i][0]);
+		assert(pool.nr_origins == (size_t)i - 1);
+	}
+	for (int i = 0; i < NR_ORIGINS; i++) {
+		if (i)
+			close(sockets[i][0]);
+		close(sockets[i][1]);
+	}
+	pool_set_limits(POOL_DEFAULT_MAX_IDLE, POOL_DEFAULT_IDLE_TIMEOUT_MS);
+	pool_clear();
+}
+
+void test_pool(void)
+{
+	test_reuse();
+	test_limits();
+	test_origins();
+}
+#endif
@@ -0,0 +1,25 @@
+#pragma once
+#include <stddef.h>
+
+/* Pool of idle keep-alive connections shared by all threads.
+   Connections are looked up by origin, a "scheme://host:port" string. */
+
+#define POOL_DEFAULT_MAX_IDLE			32
+#define POOL_DEFAULT_IDLE_TIMEOUT_MS	10000
+
+/* Returns an idle connection to the origin which the server has not closed yet,
+   or -1 if there is none. */
+int pool_get(const char *origin);
+
+/* Keeps the connection for reuse. The oldest idle connection is closed if the pool is full. */
+void pool_put(const char *origin, int socket);
+
+/* max_idle = 0 disables the pool */
+void pool_set_limits(size_t max_idle, unsigned int idle_timeout_ms);
+
+/* Closes all idle connections */
+void pool_clear(void);
+
+#ifdef UNIT_TEST
+void test_pool(void);
+#endif
@@ -0,0 +1,224 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "log.h"
+#include "progress.h"
+
+#define PROGRESS_SUFFIX		".progress"
+#define PROGRESS_VERSION	1
+/* Longest line of the file, the validator is a header field value */
+#define PROGRESS_MAX_LINE	1024
+
+/* Reads the line without its LF, returns nonzero if there is none or it is too long */
+static int progress_line(FILE *file, char *line)
+{
+	if (fgets(line, PROGRESS_MAX_LINE, file) == NULL)
+		return -1;
+	size_t len = strlen(line);
+	if (len == 0 || line[len - 1] != '\n')
+		return -1;
+	line[len - 1] = 0;
+	return 0;
+}
+
+static int progress_parse(FILE *file, struct progress *progress)
+{
+	char line[PROGRESS_MAX_LINE];
+	int version = 0;
+	long long length = 0, written = 0;
+	if (progress_line(file, line) || sscanf(line, "progress %d", &version) != 1 ||
+		version != PROGRESS_VERSION)
+		return ERR_PROGRESS_INVALID;
+	if (progress_line(file, line) || sscanf(line, "length %lld", &length) != 1 || length <= 0)
+		return ERR_PROGRESS_INVALID;
+	progress->length = length;
+	if (progress_line(file, line) || strncmp(line, "validator ", 10) || line[10] == 0 ||
+		strchr(line, '\r'))
+		return ERR_PROGRESS_INVALID;
+	progress->validator = strdup(line + 10);
+	assert(progress->validator);
+	if (progress_line(file, line) || sscanf(line, "written %lld", &written) != 1)
+		return ERR_PROGRESS_INVALID;
+
+	size_t capacity = 0;
+	while (!progress_line(file, line)) {
+		long long start = 0, end = 0;
+		if (sscanf(line, "range %lld %lld", &start, &end) != 2 || start < 0 || start >= end ||
+			end > length || progress->nr_ranges == PROGRESS_MAX_RANGES)
+			return ERR_PROGRESS_INVALID;
+		if (progress->nr_ranges == capacity) {
+			capacity = capacity ? capacity * 2 : 4;
+			progress->ranges = realloc(progress->ranges, capacity * sizeof(*progress->ranges));
+			assert(progress->ranges);
+		}
+		progress->ranges[progress->nr_ranges].start = start;
+		progress->ranges[progress->nr_ranges].end = end;
+		progress->nr_ranges++;
+	}
+	/* The count is redundant, a file cut short or edited does not add up */
+	if (!feof(file) || progress->nr_ranges == 0 || progress_written(progress) != written)
+		return ERR_PROGRESS_INVALID;
+	return 0;
+}
+
+int progress_load(const char *path, struct progress *progress)
+{
+	memset(progress, 0, sizeof(*progress));
+	char *name = aprintf("%s" PROGRESS_SUFFIX, path);
+	FILE *file = fopen(name, "r");
+	if (file == NULL) {
+		int err = errno;
+		if (err != ENOENT)
+			error("fopen(path='%s') failed: %s errno=%d", name, strerror(err), err);
+		free(name);
+		return ERR_PROGRESS_NOT_FOUND;
+	}
+	int err = progress_parse(file, progress);
+	fclose(file);
+	if (err) {
+		error("'%s' is not a valid progress file", name);
+		progress_term(progress);
+	}
+	free(name);
+	return err;
+}
+
+/* Makes the rename of a file in the directory of path durable */
+static void progress_sync_dir(const char *path)
+{
+	char *copy = strdup(path);
+	assert(copy);
+	int fd = open(dirname(copy), O_RDONLY | O_CLOEXEC);
+	if (fd != -1) {
+		fsync(fd);
+		close(fd);
+	}
+	free(copy);
+}
+
+int progress_save(const char *path, const struct progress *progress)
+{
+	char *name = aprintf("%s" PROGRESS_SUFFIX, path);
+	char *tmp_name = aprintf("%s.tmp", name);
+	int err = 0;
+	FILE *file = fopen(tmp_name, "w");
+	if (file == NULL) {
+		error("fopen(path='%s') failed: %s errno=%d", tmp_name, strerror(errno), errno);
+		err = ERR_PROGRESS_WRITE_FAILED;
+		goto out;
+	}
+	fprintf(file, "progress %d\nlength %lld\nvalidator %s\nwritten %lld\n", PROGRESS_VERSION,
+		(long long)progress->length, progress->validator, (long long)progress_written(progress));
+	for (size_t i = 0; i < progress->nr_ranges; i++) {
+		fprintf(file, "range %lld %lld\n", (long long)progress->ranges[i].start,
+			(long long)progress->ranges[i].end);
+	}
+	bool failed = fflush(file) || fsync(fileno(file));
+	if (fclose(file) || failed || rename(tmp_name, name)) {
+		error("Could not save the progress to '%s': %s errno=%d", name, strerror(errno), errno);
+		unlink(tmp_name);
+		err = ERR_PROGRESS_WRITE_FAILED;
+		goto out;
+	}
+	progress_sync_dir(name);
+out:
+	free(tmp_name);
+	free(name);
+	return err;
+}
+
+void progress_remove(const char *path)
+{
+	char *name = aprintf("%s" PROGRESS_SUFFIX, path);
+	if (unlink(name) && errno != ENOENT)
+		error("unlink(path='%s') failed: %s errno=%d", name, strerror(errno), errno);
+	free(name);
+}
+
+void progress_term(struct progress *progress)
+{
+	free(progress->validator);
+	free(progress->ranges);
+	memset(progress, 0, sizeof(*progress));
+}
+
+off_t progress_written(const struct progress *progress)
+{
+	off_t left = 0;
+	for (size_t i = 0; i < progress->nr_ranges; i++)
+		left += progress->ranges[i].end - progress->ranges[i].start;
+	return progress->length - left;
+}
+
+#ifdef UNIT_TEST
+static void test_progress_write(const char *path, const char *content)
+{
+	char *name = aprintf("%s" PROGRESS_SUFFIX, path);
+	FILE *file = fopen(name, "w");
+	assert(file);
+	fputs(content, file);
+	fclose(file);
+	free(name);
+}
+
+void test_progress(void)
+{
+	char path[] = "/tmp/http_client_test_XXXXXX";
+	int fd = mkstemp(path);
+	assert(fd != -1);
+	close(fd);
+	struct progress progress;
+	assert(progress_load(path, &progress) == ERR_PROGRESS_NOT_FOUND);
+
+	struct progress_range ranges[] = { {100, 200}, {500, 1000} };
+	struct progress saved = {
+		.length = 1000,
+		.validator = "\"5f3a-1c2b\"",
+		.ranges = ranges,
+		.nr_ranges = 2,
+	};
+	assert(progress_written(&saved) == 400);
+	assert(!progress_save(path, &saved));
+	assert(!progress_load(path, &progress));
+	assert(progress.length == 1000 && !strcmp(progress.validator, saved.validator));
+	assert(progress.nr_ranges == 2 && !memcmp(progress.ranges, ranges, sizeof(ranges)));
+	progress_term(&progress);
+
+	/* Dates have spaces */
+	saved.validator = "Wed, 21 Oct 2015 07:28:00 GMT";
+	saved.nr_ranges = 1;
+	assert(!progress_save(path, &saved));
+	assert(!progress_load(path, &progress));
+	assert(!strcmp(progress.validator, saved.validator) && progress.nr_ranges == 1);
+	progress_term(&progress);
+
+	test_progress_write(path, "progress 1\nlength 1000\nvalidator \"a\"\nwritten 900\nrange 100 200\n");
+	assert(!progress_load(path, &progress));
+	progress_term(&progress);
+	/* The count does not match the ranges */
+	test_progress_write(path, "progress 1\nlength 1000\nvalidator \"a\"\nwritten 800\nrange 100 200\n");
+	assert(progress_load(path, &progress) == ERR_PROGRESS_INVALID);
+	/* Cut short */
+	test_progress_write(path, "progress 1\nlength 1000\nvalidator \"a\"\nwritten 900\nrange 100 2");
+	assert(progress_load(path, &progress) == ERR_PROGRESS_INVALID);
+	test_progress_write(path, "progress 1\nlength 1000\nvalidator \"a\"\nwritten 0\nrange 0 1001\n");
+	assert(progress_load(path, &progress) == ERR_PROGRESS_INVALID);
+	test_progress_write(path, "progress 1\nlength 1000\nvalidator \nwritten 900\nrange 100 200\n");
+	assert(progress_load(path, &progress) == ERR_PROGRESS_INVALID);
+	test_progress_write(path, "progress 2\nlength 1000\nvalidator \"a\"\nwritten 900\nrange 100 200\n");
+	assert(progress_load(path, &progress) == ERR_PROGRESS_INVALID);
+	/* Nothing is left to download */
+	test_progress_write(path, "progress 1\nlength 1000\nvalidator \"a\"\nwritten 1000\n");
+	assert(progress_load(path, &progress) == ERR_PROGRESS_INVALID);
+
+	progress_remove(path);
+	assert(progress_load(path, &progress) == ERR_PROGRESS_NOT_FOUND);
+	unlink(path);
+}
+#endif
@@ -0,0 +1,51 @@
+#pragma once
+#include <stddef.h>
+#include <sys/types.h>
+
+/* Progress of a download kept next to the file in "<path>.progress", so a download which
+   has died continues where it stopped. It is a few lines of text:
+     progress 1
+     length 21474836480
+     validator "5f3a-1c2b"
+     written 20401094656
+     range 20401094656 21474836480
+   The validator is the ETag or Last-Modified of the file, sent back in If-Range. Every range
+   line is a part of the file not downloaded yet, from its first byte to its end, one per
+   segment of a parallel download. The data the file is saved for must be on the disk
+   already: it is replaced atomically by renaming a temporary file written and fsync()ed. */
+
+#define ERR_PROGRESS_NOT_FOUND		-71
+#define ERR_PROGRESS_INVALID		-72
+#define ERR_PROGRESS_WRITE_FAILED	-73
+
+/* Saved progress with more ranges is taken for a broken file */
+#define PROGRESS_MAX_RANGES		4096
+
+struct progress_range {
+	off_t	start;
+	off_t	end;	/* exclusive */
+};
+
+struct progress {
+	off_t	length;		/* of the file */
+	char	*validator;
+	struct progress_range	*ranges;	/* left to download */
+	size_t	nr_ranges;
+};
+
+/* Reads the progress saved for the file at path */
+int progress_load(const char *path, struct progress *progress);
+
+int progress_save(const char *path, const struct progress *progress);
+
+/* Called when the download has finished */
+void progress_remove(const char *path);
+
+void progress_term(struct progress *progress);
+
+/* Returns the number of bytes downloaded */
+off_t progress_written(const struct progress *progress);
+
+#ifdef UNIT_TEST
+void test_progress(void);
+#endif
@@ -1,76 +1,274 @@
 #include <assert.h>
-#include <ctype.h>
-#include <errno.h>
-#include <netdb.h>
-#include <stdarg.h>
 #include <stdbool.h>
-#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <strings.h>
-#include <sys/socket.h>
-#include <unistd.h>
 #include "buffer.h"
-#include "http.h"
 #include "log.h"
-#include "url.h"
+#include "punycode.h"
+#include "scan.h"
+
+/* Parameters of Punycode, see https://tools.ietf.org/html/rfc3492#section-5 */
+#define PUNYCODE_BASE			36
+#define PUNYCODE_TMIN			1
+#define PUNYCODE_TMAX			26
+#define PUNYCODE_SKEW			38
+#define PUNYCODE_DAMP			700
+#define PUNYCODE_INITIAL_BIAS	72
+#define PUNYCODE_INITIAL_N		0x80
+
+/* Code points of a label before the encoding, more never fit PUNYCODE_MAX_LABEL bytes */
+#define PUNYCODE_MAX_INPUT		PUNYCODE_MAX_LABEL
 
-/* Convert hostname from UTF-8 to Punycode according to https://tools.ietf.org/html/rfc3492 */
-int punycode(char **host)
+static uint32_t punycode_adapt(uint32_t delta, uint32_t nr_points, bool first)
 {
-	char *idna = *host; /* Internationalized Domain Name in Applications */
-	size_t idna_len = strlen(idna);
-
-	char *ascii = malloc(idna_len * 3);
-	char *end_ascii = ascii + idna_len * 3;
-
-	/* First, all basic ASCII characters in the string are copied from input to output,
-	   skipping over any other characters. */
-	char *dest = ascii;
-	size_t non_ascii_cnt = 0;
-	for (const char *src = idna; *src; src++) {
-		if (((signed char)*src) > 0)
-			*dest++ = *src;
-		else
-			non_ascii_cnt++;
+	delta = first ? delta / PUNYCODE_DAMP : delta / 2;
+	delta += delta / nr_points;
+	uint32_t k = 0;
+	while (delta > ((PUNYCODE_BASE - PUNYCODE_TMIN) * PUNYCODE_TMAX) / 2) {
+		delta /= PUNYCODE_BASE - PUNYCODE_TMIN;
+		k += PUNYCODE_BASE;
 	}
+	return k + (PUNYCODE_BASE - PUNYCODE_TMIN + 1) * delta / (delta + PUNYCODE_SKEW);
+}
 
-	if (non_ascii_cnt == 0) {
-		free(ascii);
-		return 0;
+static char punycode_digit(uint32_t digit)
+{
+	return digit < 26 ? 'a' + digit : '0' + digit - 26;
+}
+
+int punycode_encode(const uint32_t *input, size_t input_len, char *output, size_t size)
+{
+	size_t len = 0;
+	/* First, all basic code points are copied from input to output */
+	for (size_t i = 0; i < input_len; i++) {
+		if (input[i] >= PUNYCODE_INITIAL_N)
+			continue;
+		if (len == size)
+			return ERR_PUNYCODE_LABEL_TOO_LONG;
+		output[len++] = input[i];
+	}
+	size_t nr_basic = len;
+	/* If any were copied, an ASCII hyphen is added to the output next */
+	if (nr_basic) {
+		if (len == size)
+			return ERR_PUNYCODE_LABEL_TOO_LONG;
+		output[len++] = '-';
+	}
+
+	/* The other code points are inserted in the order of their values, every insertion
+	   is a delta of the code point and its position encoded as a variable-length integer */
+	uint32_t n = PUNYCODE_INITIAL_N;
+	uint32_t delta = 0;
+	uint32_t bias = PUNYCODE_INITIAL_BIAS;
+	for (size_t handled = nr_basic; handled < input_len; n++, delta++) {
+		uint32_t m = UINT32_MAX;
+		for (size_t i = 0; i < input_len; i++) {
+			if (input[i] >= n && input[i] < m)
+				m = input[i];
+		}
+		if ((m - n) > (UINT32_MAX - delta) / (handled + 1))
+			return ERR_PUNYCODE_LABEL_TOO_LONG;
+		delta += (m - n) * (handled + 1);
+		n = m;
+		for (size_t i = 0; i < input_len; i++) {
+			if (input[i] < n && ++delta == 0)
+				return ERR_PUNYCODE_LABEL_TOO_LONG;
+			if (input[i] != n)
+				continue;
+			uint32_t q = delta;
+			for (uint32_t k = PUNYCODE_BASE; ; k += PUNYCODE_BASE) {
+				uint32_t t = k <= bias ? PUNYCODE_TMIN :
+					k >= bias + PUNYCODE_TMAX ? PUNYCODE_TMAX : k - bias;
+				if (q < t)
+					break;
+				if (len == size)
+					return ERR_PUNYCODE_LABEL_TOO_LONG;
+				output[len++] = punycode_digit(t + (q - t) % (PUNYCODE_BASE - t));
+				q = (q - t) / (PUNYCODE_BASE - t);
+			}
+			if (len == size)
+				return ERR_PUNYCODE_LABEL_TOO_LONG;
+			output[len++] = punycode_digit(q);
+			bias = punycode_adapt(delta, handled + 1, handled == nr_basic);
+			delta = 0;
+			handled++;
+		}
 	}
+	return len;
+}
 
-	/* If any characters were copied an ASCII hyphen is added to the output next. */
-	if (dest > ascii) {
-			assert(dest < end_ascii);
-			*dest++ = '-';
+/* Decodes the UTF-8 character at *str, rejecting overlong forms and surrogates */
+static int punycode_utf8(const unsigned char **str, const unsigned char *end, uint32_t *cp)
+{
+	const unsigned char *s = *str;
+	size_t len = s[0] < 0x80 ? 1 : s[0] < 0xc2 ? 0 : s[0] < 0xe0 ? 2 : s[0] < 0xf0 ? 3 : s[0] < 0xf5 ? 4 : 0;
+	if (len == 0 || (size_t)(end - s) < len)
+		return ERR_PUNYCODE_INVALID_UTF8;
+	static const uint32_t first_mask[] = {0, 0x7f, 0x1f, 0x0f, 0x07};
+	uint32_t value = s[0] & first_mask[len];
+	for (size_t i = 1; i < len; i++) {
+		if ((s[i] & 0xc0) != 0x80)
+			return ERR_PUNYCODE_INVALID_UTF8;
+		value = (value << 6) | (s[i] & 0x3f);
 	}
+	static const uint32_t min_value[] = {0, 0, 0x80, 0x800, 0x10000};
+	if (value < min_value[len] || value > 0x10ffff || (value >= 0xd800 && value <= 0xdfff))
+		return ERR_PUNYCODE_INVALID_UTF8;
+	*cp = value;
+	*str = s + len;
+	return 0;
+}
 
-	/* Not implemented yet */
-	assert(0);
+/* Lowers the capital letters of the scripts with a simple case mapping */
+static uint32_t punycode_lower(uint32_t cp)
+{
+	if ((cp >= 'A' && cp <= 'Z') || (cp >= 0xc0 && cp <= 0xde && cp != 0xd7) ||
+		(cp >= 0x391 && cp <= 0x3a9 && cp != 0x3a2) || (cp >= 0x410 && cp <= 0x42f))
+		return cp + 0x20;
+	if (cp >= 0x400 && cp <= 0x40f)
+		return cp + 0x50;
+	return cp;
+}
 
-	free(idna);
-	*host = ascii;
+/* Full stops of RFC 3490 section 3.1: ideographic, fullwidth and halfwidth ideographic */
+static bool punycode_is_dot(uint32_t cp)
+{
+	return cp == '.' || cp == 0x3002 || cp == 0xff0e || cp == 0xff61;
+}
+
+/* Appends the label of the code points, encoded if it has non-ASCII ones */
+static int punycode_label(const uint32_t *label, size_t len, struct buffer *out)
+{
+	bool ascii = true;
+	for (size_t i = 0; i < len; i++)
+		ascii &= label[i] < 0x80;
+	buffer_reserve(out, PUNYCODE_MAX_LABEL + 1);
+	if (ascii) {
+		for (size_t i = 0; i < len; i++)
+			*out->space++ = label[i];
+		return 0;
+	}
+	memcpy(out->space, "xn--", 4);
+	int encoded = punycode_encode(label, len, out->space + 4, PUNYCODE_MAX_LABEL - 4);
+	if (encoded < 0)
+		return encoded;
+	out->space += 4 + encoded;
+	return 0;
+}
+
+int punycode_host(const char *host, size_t host_len, char **ascii)
+{
+	*ascii = NULL;
+	if (scan_ascii(host, host_len) == host_len)
+		return 0;
+
+	struct buffer out;
+	buffer_init(&out, host_len + PUNYCODE_MAX_LABEL + 1);
+	uint32_t label[PUNYCODE_MAX_INPUT];
+	size_t label_len = 0;
+	int err = 0;
+	const unsigned char *str = (const unsigned char*)host;
+	const unsigned char *end = str + host_len;
+	while (!err) {
+		/* The end of the host ends the last label as a dot would */
+		bool last = str == end;
+		uint32_t cp = '.';
+		if (!last && (err = punycode_utf8(&str, end, &cp)))
+			break;
+		if (punycode_is_dot(cp)) {
+			if ((err = punycode_label(label, label_len, &out)) || last)
+				break;
+			label_len = 0;
+			*out.space++ = '.';
+		} else if (label_len == PUNYCODE_MAX_INPUT) {
+			err = ERR_PUNYCODE_LABEL_TOO_LONG;
+		} else {
+			label[label_len++] = punycode_lower(cp);
+		}
+	}
+	if (err) {
+		error("Could not convert the host '%.*s' to ASCII: %s", (int)host_len, host,
+			err == ERR_PUNYCODE_INVALID_UTF8 ? "invalid UTF-8" : "a label is too long");
+		buffer_term(&out);
+		return err;
+	}
+	*out.space = 0;
+	*ascii = out.data;
 	return 0;
 }
 
 #ifdef UNIT_TEST
-static int test_punycode_one(const char *idna, const char *result)
+static void test_encode(const char *utf8, const char *expected)
 {
-	char *host = strdup(idna);
-	int err = punycode(&host);
+	const unsigned char *str = (const unsigned char*)utf8;
+	const unsigned char *end = str + strlen(utf8);
+	uint32_t input[PUNYCODE_MAX_INPUT];
+	size_t input_len = 0;
+	while (str < end)
+		assert(!punycode_utf8(&str, end, &input[input_len++]));
+	char output[PUNYCODE_MAX_LABEL];
+	int len = punycode_encode(input, input_len, output, sizeof(output));
+	assert(len == (int)strlen(expected) && !memcmp(output, expected, len));
+}
+
+static int test_host(const char *host, const char *expected)
+{
+	char *ascii = NULL;
+	int err = punycode_host(host, strlen(host), &ascii);
 	if (!err)
-		assert(!strcmp(host, result));
-	free(host);
+		assert(expected ? ascii && !strcmp(ascii, expected) : ascii == NULL);
+	free(ascii);
 	return err;
 }
 
 void test_punycode(void)
 {
-	/* Punycode is not implemented yet */
-	return;
-	assert(!test_punycode_one("bücher", "bcher-kva"));
-	assert(!test_punycode_one("München", "Mnchen-3ya"));
-	assert(!test_punycode_one("кто-звонит.рф", "xn----dtbofgvdd5ah.xn--p1ai"));
+	test_encode("bücher", "bcher-kva");
+	test_encode("München", "Mnchen-3ya");
+	/* Samples of https://tools.ietf.org/html/rfc3492#section-7.1 */
+	test_encode("\xd9\x84\xd9\x8a\xd9\x87\xd9\x85\xd8\xa7\xd8\xa8\xd8\xaa\xd9\x83\xd9\x84\xd9\x85"
+		"\xd9\x88\xd8\xb4\xd8\xb9\xd8\xb1\xd8\xa8\xd9\x8a\xd8\x9f", "egbpdaj6bu4bxfgehfvwxn");
+	test_encode("3年B組金八先生", "3B-ww4c5e180e575a65lsy2b");
+	test_encode("Pročprostěnemluvíčesky", "Proprostnemluvesky-uyb24dma41a");
+	test_encode("-> $1.00 <-", "-> $1.00 <--");
+
+	assert(!test_host("example.com", NULL));
+	assert(!test_host("кто-звонит.рф", "xn----dtbofgvdd5ah.xn--p1ai"));
+	assert(!test_host("КТО-ЗВОНИТ.РФ", "xn----dtbofgvdd5ah.xn--p1ai"));
+	assert(!test_host("www.München.de", "www.xn--mnchen-3ya.de"));
+	assert(!test_host("bücher.example.", "xn--bcher-kva.example."));
+	assert(!test_host("例え。テスト", "xn--r8jz45g.xn--zckzah"));
+	assert(test_host("b\xfc" "cher.de", NULL) == ERR_PUNYCODE_INVALID_UTF8);
+	assert(test_host("\xc0\xae.de", NULL) == ERR_PUNYCODE_INVALID_UTF8);
+	assert(test_host("\xed\xa0\x80.de", NULL) == ERR_PUNYCODE_INVALID_UTF8);
+	assert(test_host("b\xc3", NULL) == ERR_PUNYCODE_INVALID_UTF8);
+	char host[256] = "ü";
+	for (int i = 0; i < 60; i++)
+		strcat(host, "a");
+	assert(test_host(host, NULL) == ERR_PUNYCODE_LABEL_TOO_LONG);
+}
+#endif
+
+#ifdef BENCH
+#include <stdio.h>
+
+void bench_punycode(void)
+{
+	static const char *hosts[] = {"example.com", "static.cdn.example-content-delivery.net",
+		"кто-звонит.рф", "www.München.de"};
+	size_t iterations = 1 << 20;
+	for (size_t i = 0; i < sizeof(hosts) / sizeof(hosts[0]); i++) {
+		size_t len = strlen(hosts[i]);
+		double start = bench_now();
+		for (size_t n = 0; n < iterations; n++) {
+			char *ascii;
+			int err = punycode_host(hosts[i], len, &ascii);
+			assert(!err);
+			(void)err;
+			free(ascii);
+		}
+		double seconds = bench_now() - start;
+		printf("punycode host=%s ns/host=%.1f\n", hosts[i], seconds / iterations * 1e9);
+	}
 }
 #endif
@@ -0,0 +1,30 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/* Internationalized host names, see https://tools.ietf.org/html/rfc3490. A label with
+   characters out of ASCII is resolved and sent in Host as "xn--" followed by its Punycode,
+   see https://tools.ietf.org/html/rfc3492. Capital letters of ASCII, Latin-1, Greek and
+   Cyrillic are lowered before the encoding, the rest of nameprep is not done.
+   An ASCII host is only scanned, 16 or 32 bytes at once, and is never copied. */
+
+#define PUNYCODE_MAX_LABEL	63	/* bytes of an encoded label with the "xn--" prefix */
+
+#define ERR_PUNYCODE_INVALID_UTF8		-51
+#define ERR_PUNYCODE_LABEL_TOO_LONG		-52
+
+/* Encodes the code points without the "xn--" prefix. Returns the length of the output
+   or ERR_PUNYCODE_LABEL_TOO_LONG if it does not fit size bytes. */
+int punycode_encode(const uint32_t *input, size_t input_len, char *output, size_t size);
+
+/* Converts the UTF-8 host to ASCII. Sets *ascii to NULL if the host is ASCII already,
+   otherwise to the converted zero-terminated name which the caller must free(). */
+int punycode_host(const char *host, size_t host_len, char **ascii);
+
+#ifdef UNIT_TEST
+void test_punycode(void);
+#endif
+
+#ifdef BENCH
+void bench_punycode(void);
+#endif
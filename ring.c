@@ -0,0 +1,68 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "log.h"
+#include "ring.h"
+
+void *ring_alloc(size_t size)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+	if (size == 0 || page_size <= 0 || size % page_size)
+		return NULL;
+
+	int fd = memfd_create("http_client_ring", MFD_CLOEXEC);
+	if (fd == -1)
+		return NULL;
+	char *ring = MAP_FAILED;
+	if (ftruncate(fd, size)) {
+		error("ftruncate() failed: %s errno=%d", strerror(errno), errno);
+		goto out;
+	}
+
+	/* Reserve the address space for both halves, then map the file over it */
+	ring = mmap(NULL, 2 * size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ring == MAP_FAILED) {
+		error("mmap() failed: %s errno=%d", strerror(errno), errno);
+		goto out;
+	}
+	for (int i = 0; i < 2; i++) {
+		void *half = mmap(ring + i * size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0);
+		if (half == MAP_FAILED) {
+			error("mmap() failed: %s errno=%d", strerror(errno), errno);
+			munmap(ring, 2 * size);
+			ring = MAP_FAILED;
+			break;
+		}
+	}
+out:
+	close(fd);
+	return ring == MAP_FAILED ? NULL : ring;
+}
+
+void ring_free(void *ring, size_t size)
+{
+	if (ring)
+		munmap(ring, 2 * size);
+}
+
+#ifdef UNIT_TEST
+void test_ring(void)
+{
+	size_t size = 1 << 16;
+	char *ring = ring_alloc(size);
+	if (ring == NULL)
+		return; /* memfd_create() is not supported */
+
+	memcpy(ring + size - 3, "abcdef", 6);
+	assert(!memcmp(ring, "def", 3));
+	assert(!memcmp(ring + 2 * size - 3, "abc", 3));
+	ring[1] = 'x';
+	assert(ring[size + 1] == 'x');
+	ring_free(ring, size);
+
+	assert(ring_alloc(size + 1) == NULL);
+}
+#endif
@@ -0,0 +1,15 @@
+#pragma once
+#include <stddef.h>
+
+/* Ring buffer mapped twice in a row ("magic ring"): the byte at ring + size + i is the
+   byte at ring + i, so data wrapping around the end of the ring is contiguous in memory
+   and neither parsers nor recv() have to care about the wrap. */
+
+/* size must be a multiple of the page size. Returns NULL if the kernel does not
+   support memfd_create() or the mapping fails, the caller falls back to malloc(). */
+void *ring_alloc(size_t size);
+void ring_free(void *ring, size_t size);
+
+#ifdef UNIT_TEST
+void test_ring(void);
+#endif
@@ -0,0 +1,417 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "scan.h"
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define SCAN_X86
+#include <immintrin.h>
+#endif
+
+void scan_lines_init(struct scan_lines *lines)
+{
+	lines->ends = lines->inline_ends;
+	lines->nr = 0;
+	lines->capacity = SCAN_INLINE_LINES;
+}
+
+void scan_lines_term(struct scan_lines *lines)
+{
+	if (lines->ends != lines->inline_ends)
+		free(lines->ends);
+	scan_lines_init(lines);
+}
+
+static void scan_lines_grow(struct scan_lines *lines)
+{
+	size_t capacity = lines->capacity * 2;
+	size_t *ends = malloc(capacity * sizeof(*ends));
+	assert(ends);
+	memcpy(ends, lines->ends, lines->nr * sizeof(*ends));
+	if (lines->ends != lines->inline_ends)
+		free(lines->ends);
+	lines->ends = ends;
+	lines->capacity = capacity;
+}
+
+/* Adds the line end. Returns true if it ends the empty line. */
+static inline bool scan_line_end(struct scan_lines *lines, size_t end)
+{
+	if (lines->nr == lines->capacity)
+		scan_lines_grow(lines);
+	lines->ends[lines->nr++] = end;
+	return lines->nr >= 2 && lines->ends[lines->nr - 2] + 2 == end;
+}
+
+/* The scanners return the offset of the first CRLF if lines is NULL, otherwise of the
+   CRLF ending the empty line. They return size if there is none. */
+
+static size_t scan_scalar(const char *data, size_t size, struct scan_lines *lines)
+{
+	const char *end = data + size;
+	const char *cr = data;
+	while ((cr = memchr(cr, '\r', end - cr)) && cr + 1 < end) {
+		if (cr[1] == '\n' && (!lines || scan_line_end(lines, cr - data)))
+			return cr - data;
+		cr++;
+	}
+	return size;
+}
+
+/* The ASCII scanners return the offset of the first byte >= 0x80 or size */
+static size_t scan_ascii_scalar(const char *data, size_t size)
+{
+	size_t i = 0;
+	for (; i + 8 <= size; i += 8) {
+		uint64_t word;
+		memcpy(&word, data + i, 8);
+		if (word & 0x8080808080808080ull)
+			break;
+	}
+	for (; i < size && !(data[i] & 0x80); i++)
+		;
+	return i;
+}
+
+#ifdef SCAN_X86
+/* mask() returns the bitmap of the CRLFs starting in the block,
+   reading one byte past it for the LF of the last position */
+static inline size_t scan_blocks(const char *data, size_t size, struct scan_lines *lines,
+								 size_t block_size, uint32_t (*mask)(const char *block))
+{
+	size_t i = 0;
+	for (; i + block_size < size; i += block_size) {
+		for (uint32_t bits = mask(data + i); bits; bits &= bits - 1) {
+			size_t end = i + __builtin_ctz(bits);
+			if (!lines || scan_line_end(lines, end))
+				return end;
+		}
+	}
+	for (; i + 1 < size; i++) {
+		if (data[i] == '\r' && data[i + 1] == '\n' && (!lines || scan_line_end(lines, i)))
+			return i;
+	}
+	return size;
+}
+
+static inline uint32_t scan_mask_sse2(const char *block)
+{
+	__m128i cr = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)block), _mm_set1_epi8('\r'));
+	__m128i lf = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(block + 1)), _mm_set1_epi8('\n'));
+	return (uint32_t)_mm_movemask_epi8(_mm_and_si128(cr, lf));
+}
+
+static size_t scan_sse2(const char *data, size_t size, struct scan_lines *lines)
+{
+	return scan_blocks(data, size, lines, 16, scan_mask_sse2);
+}
+
+__attribute__((target("avx2")))
+static inline uint32_t scan_mask_avx2(const char *block)
+{
+	__m256i cr = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)block), _mm256_set1_epi8('\r'));
+	__m256i lf = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(block + 1)), _mm256_set1_epi8('\n'));
+	return (uint32_t)_mm256_movemask_epi8(_mm256_and_si256(cr, lf));
+}
+
+__attribute__((target("avx2")))
+static size_t scan_avx2(const char *data, size_t size, struct scan_lines *lines)
+{
+	return scan_blocks(data, size, lines, 32, scan_mask_avx2);
+}
+
+/* The sign bits of the bytes are the bitmap of the non-ASCII ones */
+static size_t scan_ascii_sse2(const char *data, size_t size)
+{
+	size_t i = 0;
+	for (; i + 16 <= size; i += 16) {
+		uint32_t bits = _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)(data + i)));
+		if (bits)
+			return i + __builtin_ctz(bits);
+	}
+	return i + scan_ascii_scalar(data + i, size - i);
+}
+
+__attribute__((target("avx2")))
+static size_t scan_ascii_avx2(const char *data, size_t size)
+{
+	size_t i = 0;
+	for (; i + 32 <= size; i += 32) {
+		uint32_t bits = _mm256_movemask_epi8(_mm256_loadu_si256((const __m256i*)(data + i)));
+		if (bits)
+			return i + __builtin_ctz(bits);
+	}
+	return i + scan_ascii_sse2(data + i, size - i);
+}
+#endif
+
+static pthread_once_t scan_once = PTHREAD_ONCE_INIT;
+static int scan_impl = SCAN_SCALAR;
+static size_t (*scan)(const char *data, size_t size, struct scan_lines *lines) = scan_scalar;
+static size_t (*scan_ascii_impl)(const char *data, size_t size) = scan_ascii_scalar;
+
+static bool scan_select(int impl)
+{
+	switch (impl) {
+	case SCAN_SCALAR:
+		scan = scan_scalar;
+		scan_ascii_impl = scan_ascii_scalar;
+		break;
+#ifdef SCAN_X86
+	case SCAN_SSE2:
+		scan = scan_sse2;
+		scan_ascii_impl = scan_ascii_sse2;
+		break;
+	case SCAN_AVX2:
+		__builtin_cpu_init();
+		if (!__builtin_cpu_supports("avx2"))
+			return false;
+		scan = scan_avx2;
+		scan_ascii_impl = scan_ascii_avx2;
+		break;
+#endif
+	default:
+		return false;
+	}
+	scan_impl = impl;
+	return true;
+}
+
+static void scan_init(void)
+{
+	if (!scan_select(SCAN_AVX2))
+		scan_select(SCAN_SSE2);
+}
+
+int scan_get_impl(void)
+{
+	pthread_once(&scan_once, scan_init);
+	return scan_impl;
+}
+
+bool scan_set_impl(int impl)
+{
+	/* The default is chosen first, so it does not replace the implementation set */
+	pthread_once(&scan_once, scan_init);
+	return scan_select(impl);
+}
+
+const char *scan_crlf(const char *data, size_t size)
+{
+	pthread_once(&scan_once, scan_init);
+	size_t offset = scan(data, size, NULL);
+	return offset < size ? data + offset : NULL;
+}
+
+bool scan_header(const char *data, size_t size, struct scan_lines *lines)
+{
+	pthread_once(&scan_once, scan_init);
+	lines->nr = 0;
+	return scan(data, size, lines) < size;
+}
+
+size_t scan_ascii(const char *data, size_t size)
+{
+	pthread_once(&scan_once, scan_init);
+	return scan_ascii_impl(data, size);
+}
+
+#if defined(UNIT_TEST) || defined(BENCH)
+static const int test_impls[] = {SCAN_SCALAR, SCAN_SSE2, SCAN_AVX2};
+#define NR_TEST_IMPLS	(sizeof(test_impls) / sizeof(test_impls[0]))
+#endif
+
+#ifdef UNIT_TEST
+static void test_header(const char *header, bool complete, size_t nr_lines)
+{
+	struct scan_lines lines;
+	scan_lines_init(&lines);
+	assert(scan_header(header, strlen(header), &lines) == complete);
+	assert(lines.nr == nr_lines);
+	for (size_t i = 0; i < lines.nr; i++)
+		assert(header[lines.ends[i]] == '\r' && header[lines.ends[i] + 1] == '\n');
+	scan_lines_term(&lines);
+}
+
+static void test_headers(void)
+{
+	test_header("HTTP/1.1 200 OK", false, 0);
+	test_header("HTTP/1.1 200 OK\r\n\r\n", true, 2);
+	test_header("HTTP/1.1 200 OK\r\nServer: nginx\r\n\r\nbody\r\n\r\n", true, 3);
+	test_header("HTTP/1.1 200 OK\r\nServer: nginx\r\nDate: Sun, 03 Feb 2019 09:35:44 GMT\r\n", false, 3);
+	test_header("HTTP/1.1 200 OK\r\n\r\r\n\n\r\n", false, 3);
+
+	/* More lines than fit the inline array */
+	char header[1024] = "HTTP/1.1 200 OK\r\n";
+	for (int i = 0; i < 100; i++)
+		strcat(header, "A: b\r\n");
+	strcat(header, "\r\n");
+	test_header(header, true, 102);
+}
+
+/* Compares every implementation with the scalar one at every alignment and length */
+static void test_random(void)
+{
+	char data[300];
+	unsigned int seed = 1;
+	for (size_t i = 0; i < sizeof(data); i++) {
+		seed = seed * 1103515245 + 12345;
+		const char alphabet[] = "\r\n\r\nab";
+		data[i] = alphabet[(seed >> 16) % (sizeof(alphabet) - 1)];
+	}
+	for (size_t start = 0; start < 40; start++) {
+		for (size_t size = 0; start + size <= sizeof(data); size++) {
+			const char *expected = NULL;
+			for (size_t i = 0; i < NR_TEST_IMPLS; i++) {
+				if (!scan_set_impl(test_impls[i]))
+					continue;
+				const char *crlf = scan_crlf(data + start, size);
+				if (i == 0)
+					expected = crlf;
+				assert(crlf == expected);
+			}
+		}
+	}
+	scan_init();
+}
+
+static void test_ascii(void)
+{
+	char data[100];
+	for (size_t i = 0; i < sizeof(data); i++)
+		data[i] = 'a' + i % 26;
+	for (size_t impl = 0; impl < NR_TEST_IMPLS; impl++) {
+		if (!scan_set_impl(test_impls[impl]))
+			continue;
+		for (size_t start = 0; start < 40; start++) {
+			for (size_t size = 0; start + size <= sizeof(data); size++) {
+				assert(scan_ascii(data + start, size) == size);
+				for (size_t pos = 0; pos < size; pos++) {
+					data[start + pos] = (char)(pos % 2 ? 0x80 : 0xff);
+					assert(scan_ascii(data + start, size) == pos);
+					data[start + pos] = 'a';
+				}
+			}
+		}
+	}
+	scan_init();
+}
+
+void test_scan(void)
+{
+	for (size_t i = 0; i < NR_TEST_IMPLS; i++) {
+		if (!scan_set_impl(test_impls[i]))
+			continue;
+		test_headers();
+		/* The first scan does not choose the default over the one set */
+		assert(scan_get_impl() == test_impls[i]);
+	}
+	scan_init();
+	test_random();
+	test_ascii();
+}
+#endif
+
+#ifdef BENCH
+#include <stdio.h>
+#include "log.h"
+
+/* The header splitting before the vectorized scanner: memchr() and strlen() for the block
+   end, then strstr() for counting and for splitting the lines */
+static size_t bench_strstr(char *data, size_t size)
+{
+	const char *end = data + size;
+	const char *mem = data;
+	const char *block_end = NULL;
+	while (mem < end) {
+		const char *ptr = memchr(mem, '\r', end - mem);
+		if (ptr == NULL || end < ptr + strlen("\r\n\r\n"))
+			break;
+		if (!memcmp(ptr, "\r\n\r\n", 4)) {
+			block_end = ptr;
+			break;
+		}
+		mem = ptr + 1;
+	}
+	assert(block_end);
+	size_t nr_lines = 0;
+	for (const char *line = data; (line = strstr(line, "\r\n")) && line < block_end; line += 2)
+		nr_lines++;
+	for (const char *line = data; (line = strstr(line, "\r\n")) && line < block_end; line += 2)
+		nr_lines--;
+	return nr_lines + (block_end - data);
+}
+
+static size_t bench_scan_header(char *data, size_t size)
+{
+	static struct scan_lines lines;
+	if (lines.ends == NULL)
+		scan_lines_init(&lines);
+	bool complete = scan_header(data, size, &lines);
+	assert(complete);
+	return lines.ends[lines.nr - 2];
+}
+
+/* Builds a header block of about size bytes out of typical response headers */
+static char *bench_header(size_t size)
+{
+	static const char *headers[] = {
+		"Server: nginx/1.18.0",
+		"Date: Sun, 03 Feb 2019 09:35:44 GMT",
+		"Content-Type: text/html; charset=utf-8",
+		"Content-Length: 153428",
+		"Connection: keep-alive",
+		"Cache-Control: private, max-age=0, must-revalidate",
+		"Set-Cookie: session=5f2b1c0e8a3d4f6b9c7e1a2d3f4b5c6d; Path=/; HttpOnly; Secure; SameSite=Lax",
+		"ETag: \"5c56b6a0-25754\"",
+		"Vary: Accept-Encoding, Cookie",
+		"Strict-Transport-Security: max-age=31536000; includeSubDomains",
+		"X-Frame-Options: SAMEORIGIN",
+		"Content-Security-Policy: default-src 'self'; script-src 'self' https://cdn.example.com",
+	};
+	size_t nr_headers = sizeof(headers) / sizeof(headers[0]);
+	char *header = malloc(size + 256);
+	strcpy(header, "HTTP/1.1 200 OK\r\n");
+	for (size_t i = 0; strlen(header) < size; i++) {
+		strcat(header, headers[i % nr_headers]);
+		strcat(header, "\r\n");
+	}
+	strcat(header, "\r\n");
+	return header;
+}
+
+void bench_scan(void)
+{
+	static const char *names[] = {"scalar", "sse2", "avx2"};
+	static const size_t sizes[] = {512, 1024, 2048, 4096, 8192};
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		char *header = bench_header(sizes[i]);
+		size_t size = strlen(header);
+		size_t iterations = (256 << 20) / size;
+
+		double start = bench_now();
+		size_t check = 0;
+		for (size_t n = 0; n < iterations; n++)
+			check += bench_strstr(header, size);
+		double seconds = bench_now() - start;
+		printf("scan header=%zu impl=strstr MB/s=%.0f\n", size, iterations * size / seconds / 1e6);
+
+		for (size_t j = 0; j < NR_TEST_IMPLS; j++) {
+			if (!scan_set_impl(test_impls[j]))
+				continue;
+			start = bench_now();
+			size_t check2 = 0;
+			for (size_t n = 0; n < iterations; n++)
+				check2 += bench_scan_header(header, size);
+			seconds = bench_now() - start;
+			assert(check2 == check);
+			printf("scan header=%zu impl=%s MB/s=%.0f\n", size, names[test_impls[j]],
+				iterations * size / seconds / 1e6);
+		}
+		free(header);
+	}
+	scan_init();
+}
+#endif
@@ -0,0 +1,48 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Vectorized search for CRLF line ends and for non-ASCII bytes. SSE2 or AVX2 compare 16
+   or 32 bytes at once producing a bitmap of the positions, the implementation is selected
+   at run time by the CPU features. Other CPUs use the scalar code. */
+
+#define SCAN_SCALAR	0
+#define SCAN_SSE2	1
+#define SCAN_AVX2	2
+
+#define SCAN_INLINE_LINES	64
+
+/* Line ends of a header block */
+struct scan_lines {
+	size_t	*ends;	/* offsets of the CR of every CRLF */
+	size_t	nr;
+	size_t	capacity;
+	size_t	inline_ends[SCAN_INLINE_LINES];
+};
+
+void scan_lines_init(struct scan_lines *lines);
+void scan_lines_term(struct scan_lines *lines);
+
+/* Returns the first CRLF in data or NULL */
+const char *scan_crlf(const char *data, size_t size);
+
+/* Collects the line ends in one pass up to the empty line ending the header block.
+   The last two ends are the CRLFCRLF. Returns false if there is no empty line yet. */
+bool scan_header(const char *data, size_t size, struct scan_lines *lines);
+
+/* Returns the offset of the first byte >= 0x80, i.e. not ASCII, or size if there is none */
+size_t scan_ascii(const char *data, size_t size);
+
+/* Returns the implementation in use */
+int scan_get_impl(void);
+
+/* Returns false if the CPU does not support the implementation */
+bool scan_set_impl(int impl);
+
+#ifdef UNIT_TEST
+void test_scan(void);
+#endif
+
+#ifdef BENCH
+void bench_scan(void);
+#endif
@@ -0,0 +1,488 @@
+#include <arpa/inet.h>
+#include <assert.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+#include "log.h"
+#include "server.h"
+
+#if defined(UNIT_TEST) || defined(BENCH)
+
+#define SERVER_REQUEST_SIZE	(1 << 13)
+#define SERVER_PATTERN_SIZE	(1 << 16)
+#define SERVER_DEFAULT_CHUNK	(1 << 14)
+
+/* Body framing of the response */
+#define SERVER_LENGTH	0
+#define SERVER_CHUNKED	1
+#define SERVER_CLOSE	2
+
+struct server_connection {
+	struct server				*server;
+	int							socket;
+	struct server_connection	*prev;
+	struct server_connection	*next;
+	char						request[SERVER_REQUEST_SIZE];
+	size_t						request_len;
+};
+
+struct server_response {
+	int				status_code;
+	int				type;
+	size_t			size;
+	size_t			chunk;
+	size_t			drip;
+	unsigned int	latency_ms;
+	unsigned int	interval_ms;
+	bool			close;
+	unsigned long	etag;	/* 0 if none */
+	size_t			abort;	/* 0 if the body is sent whole */
+	bool			partial;	/* the range from first to last is sent */
+	size_t			first;
+	size_t			last;
+};
+
+/* The body bytes from every offset modulo 64 on */
+static char server_pattern[SERVER_PATTERN_SIZE + 64];
+static pthread_once_t server_once = PTHREAD_ONCE_INIT;
+
+static void server_init_pattern(void)
+{
+	for (size_t i = 0; i < sizeof(server_pattern); i++)
+		server_pattern[i] = server_body_byte(i);
+}
+
+static void server_sleep(unsigned int ms)
+{
+	struct timespec ts = {
+		.tv_sec = ms / 1000,
+		.tv_nsec = (ms % 1000) * 1000000L,
+	};
+	while (nanosleep(&ts, &ts) && errno == EINTR)
+		;
+}
+
+static int server_sendv(int s, struct iovec *iov, size_t iovcnt)
+{
+	while (iovcnt) {
+		struct msghdr msg = {
+			.msg_iov = iov,
+			.msg_iovlen = iovcnt,
+		};
+		ssize_t sent = sendmsg(s, &msg, MSG_NOSIGNAL);
+		if (sent < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;	/* the client has gone */
+		}
+		for (; iovcnt && (size_t)sent >= iov->iov_len; iov++, iovcnt--)
+			sent -= iov->iov_len;
+		if (iovcnt) {
+			iov->iov_base = (char*)iov->iov_base + sent;
+			iov->iov_len -= sent;
+		}
+	}
+	return 0;
+}
+
+static int server_send(int s, const char *data, size_t size)
+{
+	struct iovec iov = { .iov_base = (void*)data, .iov_len = size };
+	return server_sendv(s, &iov, 1);
+}
+
+/* Parses the path and the query, e.g. "/chunked/100?chunk=10&latency=5" */
+static void server_route(const char *target, size_t target_len, struct server_response *response)
+{
+	static const struct {
+		const char	*prefix;
+		int			type;
+	} routes[] = {
+		{"/length/", SERVER_LENGTH},
+		{"/chunked/", SERVER_CHUNKED},
+		{"/close/", SERVER_CLOSE},
+	};
+	memset(response, 0, sizeof(*response));
+	response->status_code = 404;
+	response->chunk = SERVER_DEFAULT_CHUNK;
+	response->interval_ms = 1;
+
+	char path[256];
+	if (target_len >= sizeof(path))
+		return;
+	memcpy(path, target, target_len);
+	path[target_len] = 0;
+	for (size_t i = 0; i < sizeof(routes) / sizeof(routes[0]); i++) {
+		size_t prefix_len = strlen(routes[i].prefix);
+		if (strncmp(path, routes[i].prefix, prefix_len))
+			continue;
+		char *end = NULL;
+		response->size = strtoull(path + prefix_len, &end, 10);
+		if (end == path + prefix_len || (*end && *end != '?'))
+			return;
+		response->type = routes[i].type;
+		response->status_code = 200;
+		for (char *option = *end ? end + 1 : end; *option; ) {
+			size_t len = strcspn(option, "&");
+			char *value = memchr(option, '=', len);
+			if (value) {
+				unsigned long number = strtoul(value + 1, NULL, 10);
+				size_t name_len = value - option;
+				if (name_len == 5 && !strncmp(option, "chunk", 5) && number)
+					response->chunk = number;
+				else if (name_len == 4 && !strncmp(option, "drip", 4))
+					response->drip = number;
+				else if (name_len == 7 && !strncmp(option, "latency", 7))
+					response->latency_ms = number;
+				else if (name_len == 8 && !strncmp(option, "interval", 8))
+					response->interval_ms = number;
+				else if (name_len == 5 && !strncmp(option, "close", 5))
+					response->close = number != 0;
+				else if (name_len == 4 && !strncmp(option, "etag", 4))
+					response->etag = number;
+				else if (name_len == 5 && !strncmp(option, "abort", 5))
+					response->abort = number;
+			}
+			option += len + (option[len] == '&');
+		}
+		return;
+	}
+}
+
+/* Sends size body bytes starting at offset in pieces of up to the drip size. The connection
+   breaks at the abort offset. */
+static int server_send_body(int s, const struct server_response *response, size_t offset, size_t size)
+{
+	bool broken = response->abort && offset + size > response->abort;
+	if (broken)
+		size = offset < response->abort ? response->abort - offset : 0;
+	while (size) {
+		size_t piece = size < SERVER_PATTERN_SIZE ? size : SERVER_PATTERN_SIZE;
+		if (response->drip && piece > response->drip)
+			piece = response->drip;
+		if (server_send(s, server_pattern + offset % 64, piece))
+			return -1;
+		offset += piece;
+		size -= piece;
+		if (response->drip && size)
+			server_sleep(response->interval_ms);
+	}
+	return broken ? -1 : 0;
+}
+
+static int server_respond(int s, const struct server_response *response, bool head)
+{
+	if (response->latency_ms)
+		server_sleep(response->latency_ms);
+	char header[512];
+	int header_len = 0;
+	if (response->status_code != 200) {
+		header_len = snprintf(header, sizeof(header),
+			"HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n%s\r\n",
+			response->close ? "Connection: close\r\n" : "");
+		return server_send(s, header, header_len);
+	}
+	const char *connection = response->close || response->type == SERVER_CLOSE ? "Connection: close\r\n" : "";
+	char etag[48] = "";
+	if (response->etag)
+		snprintf(etag, sizeof(etag), "ETag: \"%lu\"\r\n", response->etag);
+	if (response->partial && response->type == SERVER_CHUNKED) {
+		header_len = snprintf(header, sizeof(header), "HTTP/1.1 206 Partial Content\r\n"
+			"Content-Range: bytes %zu-%zu/%zu\r\nTransfer-Encoding: chunked\r\n%s%s\r\n",
+			response->first, response->last, response->size, etag, connection);
+	} else if (response->partial) {
+		header_len = snprintf(header, sizeof(header), "HTTP/1.1 206 Partial Content\r\n"
+			"Content-Range: bytes %zu-%zu/%zu\r\nContent-Length: %zu\r\n%s%s\r\n",
+			response->first, response->last, response->size, response->last - response->first + 1,
+			etag, connection);
+	} else if (response->type == SERVER_LENGTH) {
+		header_len = snprintf(header, sizeof(header), "HTTP/1.1 200 OK\r\nContent-Length: %zu\r\n%s%s\r\n",
+			response->size, etag, connection);
+	} else if (response->type == SERVER_CHUNKED) {
+		header_len = snprintf(header, sizeof(header),
+			"HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n%s%s\r\n", etag, connection);
+	} else {
+		header_len = snprintf(header, sizeof(header), "HTTP/1.1 200 OK\r\n%s%s\r\n", etag, connection);
+	}
+	if (server_send(s, header, header_len))
+		return -1;
+	if (head)
+		return 0;
+	if (response->type != SERVER_CHUNKED && response->partial)
+		return server_send_body(s, response, response->first, response->last - response->first + 1);
+	if (response->type != SERVER_CHUNKED)
+		return server_send_body(s, response, 0, response->size);
+
+	size_t begin = response->partial ? response->first : 0;
+	size_t end = response->partial ? response->last + 1 : response->size;
+	for (size_t offset = begin; offset < end; offset += response->chunk) {
+		size_t size = end - offset < response->chunk ? end - offset : response->chunk;
+		char line[32];
+		int line_len = snprintf(line, sizeof(line), "%zx\r\n", size);
+		if (!response->drip && size <= SERVER_PATTERN_SIZE) {
+			/* The whole chunk in one call */
+			struct iovec iov[3] = {
+				{ .iov_base = line, .iov_len = line_len },
+				{ .iov_base = server_pattern + offset % 64, .iov_len = size },
+				{ .iov_base = "\r\n", .iov_len = 2 },
+			};
+			if (server_sendv(s, iov, 3))
+				return -1;
+			continue;
+		}
+		if (server_send(s, line, line_len) || server_send_body(s, response, offset, size) ||
+			server_send(s, "\r\n", 2))
+			return -1;
+	}
+	return server_send(s, "0\r\n\r\n", 5);
+}
+
+/* Receives the next request header, returns its length with the final CRLF or 0 */
+static size_t server_recv_header(struct server_connection *connection)
+{
+	while (1) {
+		connection->request[connection->request_len] = 0;
+		char *end = strstr(connection->request, "\r\n\r\n");
+		if (end)
+			return end + 4 - connection->request;
+		if (connection->request_len == SERVER_REQUEST_SIZE - 1)
+			return 0;
+		ssize_t received = recv(connection->socket, connection->request + connection->request_len,
+			SERVER_REQUEST_SIZE - 1 - connection->request_len, 0);
+		if (received <= 0)
+			return 0;
+		connection->request_len += received;
+	}
+}
+
+/* Drops the request header and the body of the given size from the buffer */
+static int server_skip(struct server_connection *connection, size_t header_len, size_t body_len)
+{
+	size_t size = header_len + body_len;
+	while (connection->request_len < size) {
+		size -= connection->request_len;
+		ssize_t received = recv(connection->socket, connection->request,
+			size < SERVER_REQUEST_SIZE ? size : SERVER_REQUEST_SIZE, 0);
+		if (received <= 0)
+			return -1;
+		connection->request_len = received;
+	}
+	connection->request_len -= size;
+	memmove(connection->request, connection->request + size, connection->request_len);
+	return 0;
+}
+
+/* Returns the value of the request header field or NULL */
+static const char *server_field(const char *header, const char *name)
+{
+	size_t name_len = strlen(name);
+	for (const char *line = strstr(header, "\r\n"); line; line = strstr(line, "\r\n")) {
+		line += 2;
+		if (!strncasecmp(line, name, name_len) && line[name_len] == ':')
+			return line + name_len + 1 + strspn(line + name_len + 1, " \t");
+	}
+	return NULL;
+}
+
+/* A body with Content-Length or chunked is served in part for "Range: bytes=FIRST-[LAST]",
+   unless If-Range names another ETag. Other ranges get the whole body. */
+static void server_range(const char *header, struct server_response *response)
+{
+	const char *range = server_field(header, "Range");
+	if (range == NULL || response->status_code != 200 || response->type == SERVER_CLOSE)
+		return;
+	const char *if_range = server_field(header, "If-Range");
+	if (if_range) {
+		char etag[32];
+		int etag_len = snprintf(etag, sizeof(etag), "\"%lu\"", response->etag);
+		if (!response->etag || strncmp(if_range, etag, etag_len) || if_range[etag_len] != '\r')
+			return;
+	}
+	unsigned long long first = 0;
+	int pos = 0;
+	if (sscanf(range, "bytes=%llu-%n", &first, &pos) != 1 || pos == 0)
+		return;
+	unsigned long long last = response->size - 1;
+	if (range[pos] != '\r') {
+		char *end = NULL;
+		last = strtoull(range + pos, &end, 10);
+		if (end == range + pos || *end != '\r')
+			return;
+		if (last >= response->size)
+			last = response->size - 1;
+	}
+	if (response->size == 0 || first > last)
+		return;
+	response->partial = true;
+	response->first = first;
+	response->last = last;
+}
+
+static void server_serve(struct server_connection *connection)
+{
+	size_t header_len = 0;
+	while ((header_len = server_recv_header(connection))) {
+		const char *header = connection->request;
+		const char *target = strchr(header, ' ');
+		if (target == NULL)
+			return;
+		target++;
+		size_t target_len = strcspn(target, " \r");
+		const char *version = target + target_len;
+		const char *length = server_field(header, "Content-Length");
+		const char *connection_field = server_field(header, "Connection");
+		struct server_response response;
+		server_route(target, target_len, &response);
+		server_range(header, &response);
+		if ((connection_field && !strncasecmp(connection_field, "close", 5)) || !strncmp(version, " HTTP/1.0", 9))
+			response.close = true;
+		bool head = !strncmp(header, "HEAD ", 5);
+		if (server_skip(connection, header_len, length ? strtoull(length, NULL, 10) : 0))
+			return;
+
+		pthread_mutex_lock(&connection->server->lock);
+		connection->server->nr_requests++;
+		pthread_mutex_unlock(&connection->server->lock);
+		if (server_respond(connection->socket, &response, head) || response.close ||
+			response.type == SERVER_CLOSE)
+			return;
+	}
+}
+
+static void *server_connection_run(void *arg)
+{
+	struct server_connection *connection = arg;
+	struct server *server = connection->server;
+	server_serve(connection);
+
+	pthread_mutex_lock(&server->lock);
+	if (connection->prev)
+		connection->prev->next = connection->next;
+	else
+		server->connections = connection->next;
+	if (connection->next)
+		connection->next->prev = connection->prev;
+	close(connection->socket);
+	if (server->connections == NULL)
+		pthread_cond_signal(&server->idle);
+	pthread_mutex_unlock(&server->lock);
+	free(connection);
+	return NULL;
+}
+
+static void *server_run(void *arg)
+{
+	struct server *server = arg;
+	while (1) {
+		int s = accept(server->socket, NULL, NULL);
+		if (s == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			return NULL;	/* stopped */
+		}
+		/* The header and the body go in separate writes, which must not wait for delayed ACKs */
+		int on = 1;
+		setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+		struct server_connection *connection = malloc(sizeof(*connection));
+		assert(connection);
+		connection->server = server;
+		connection->socket = s;
+		connection->request_len = 0;
+
+		pthread_mutex_lock(&server->lock);
+		connection->prev = NULL;
+		connection->next = server->connections;
+		if (server->connections)
+			server->connections->prev = connection;
+		server->connections = connection;
+		server->nr_accepted++;
+		pthread_mutex_unlock(&server->lock);
+
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		pthread_t thread;
+		int err = pthread_create(&thread, &attr, server_connection_run, connection);
+		pthread_attr_destroy(&attr);
+		if (err) {
+			error("pthread_create() failed: %s err=%d", strerror(err), err);
+			shutdown(s, SHUT_RDWR);
+			server_connection_run(connection);
+		}
+	}
+}
+
+int server_start(struct server *server)
+{
+	pthread_once(&server_once, server_init_pattern);
+	memset(server, 0, sizeof(*server));
+	server->socket = socket(AF_INET, SOCK_STREAM, 0);
+	if (server->socket == -1) {
+		error("socket() failed: %s errno=%d", strerror(errno), errno);
+		return -1;
+	}
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	socklen_t addr_len = sizeof(addr);
+	if (bind(server->socket, (struct sockaddr*)&addr, addr_len) || listen(server->socket, 1024) ||
+		getsockname(server->socket, (struct sockaddr*)&addr, &addr_len)) {
+		error("Could not listen on the loopback: %s errno=%d", strerror(errno), errno);
+		close(server->socket);
+		return -1;
+	}
+	server->port = ntohs(addr.sin_port);
+	pthread_mutex_init(&server->lock, NULL);
+	pthread_cond_init(&server->idle, NULL);
+	int err = pthread_create(&server->thread, NULL, server_run, server);
+	if (err) {
+		error("pthread_create() failed: %s err=%d", strerror(err), err);
+		close(server->socket);
+		return -1;
+	}
+	return 0;
+}
+
+void server_stop(struct server *server)
+{
+	/* Makes accept() fail */
+	shutdown(server->socket, SHUT_RDWR);
+	pthread_join(server->thread, NULL);
+	close(server->socket);
+
+	pthread_mutex_lock(&server->lock);
+	for (struct server_connection *connection = server->connections; connection; connection = connection->next)
+		shutdown(connection->socket, SHUT_RDWR);
+	while (server->connections)
+		pthread_cond_wait(&server->idle, &server->lock);
+	pthread_mutex_unlock(&server->lock);
+	pthread_cond_destroy(&server->idle);
+	pthread_mutex_destroy(&server->lock);
+}
+
+size_t server_accepted(struct server *server)
+{
+	pthread_mutex_lock(&server->lock);
+	size_t nr_accepted = server->nr_accepted;
+	pthread_mutex_unlock(&server->lock);
+	return nr_accepted;
+}
+
+size_t server_requests(struct server *server)
+{
+	pthread_mutex_lock(&server->lock);
+	size_t nr_requests = server->nr_requests;
+	pthread_mutex_unlock(&server->lock);
+	return nr_requests;
+}
+
+#endif
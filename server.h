@@ -0,0 +1,55 @@
+#pragma once
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Local HTTP/1.1 server for the tests and benchmarks, so they need no network. It listens
+   on a free loopback port and serves every connection in its own thread. The response
+   is chosen by the request path:
+     /length/N   N body bytes with Content-Length
+     /chunked/N  N body bytes in chunks, of 16 KiB unless chunk=BYTES is given
+     /close/N    N body bytes ended by closing the connection
+   /length and /chunked bodies are served in part for "Range: bytes=FIRST-[LAST]" with
+   206 Partial Content, unless If-Range names another ETag. The response is chosen further by the
+   query options:
+     latency=MS  waits before the response header
+     drip=BYTES  sends the body in pieces of BYTES, waiting interval=MS (1 by default)
+                 after each one
+     close=1     closes the connection after the response
+     etag=N      sends ETag: "N"
+     abort=OFFSET  breaks the connection before the body byte at OFFSET
+   Connections are kept alive unless the request or the options ask to close them.
+   The body byte at offset i is server_body_byte(i), so the client may check the data.
+   Other paths get 404 Not Found. */
+
+#if defined(UNIT_TEST) || defined(BENCH)
+
+struct server_connection;
+
+struct server {
+	int					socket;
+	int					port;
+	pthread_t			thread;	/* accepting the connections */
+	pthread_mutex_t		lock;
+	pthread_cond_t		idle;	/* signaled when the last connection ends */
+	struct server_connection	*connections;	/* open ones */
+	size_t				nr_accepted;
+	size_t				nr_requests;
+};
+
+static inline char server_body_byte(size_t offset)
+{
+	return "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ\r\n"[offset % 64];
+}
+
+/* Returns nonzero if the server could not listen */
+int server_start(struct server *server);
+
+/* Closes the listening socket and the connections, and waits for their threads */
+void server_stop(struct server *server);
+
+/* Returns the number of connections accepted and requests served so far */
+size_t server_accepted(struct server *server);
+size_t server_requests(struct server *server);
+
+#endif
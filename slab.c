@@ -0,0 +1,322 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ring.h"
+#include "slab.h"
+
+/* Precedes every buffer, 16 bytes keep the buffer aligned as malloc() does */
+struct slab_header {
+	size_t	capacity;
+	size_t	reserved;
+};
+
+/* Free lists of the thread */
+struct slab_cache {
+	void	*free[SLAB_NR_CLASSES][SLAB_MAX_FREE];	/* of struct slab_header */
+	size_t	nr_free[SLAB_NR_CLASSES];
+	void	*rings[SLAB_NR_CLASSES][SLAB_MAX_FREE];
+	size_t	nr_rings[SLAB_NR_CLASSES];
+};
+
+static void *slab_malloc(void *arg, size_t size)
+{
+	return malloc(size);
+}
+
+static void slab_malloc_free(void *arg, void *ptr, size_t size)
+{
+	free(ptr);
+}
+
+static struct {
+	pthread_once_t	once;
+	pthread_key_t	key;
+	struct slab_allocator	allocator;
+	bool	custom;		/* the allocator is not malloc(), rings are not used then */
+	struct slab_stats	stats;
+} slab = {
+	.once = PTHREAD_ONCE_INIT,
+	.allocator = { .alloc = slab_malloc, .free = slab_malloc_free },
+};
+
+static void counter_add(uint64_t *counter, uint64_t value)
+{
+	__atomic_add_fetch(counter, value, __ATOMIC_RELAXED);
+}
+
+static void counter_sub(uint64_t *counter, uint64_t value)
+{
+	__atomic_sub_fetch(counter, value, __ATOMIC_RELAXED);
+}
+
+/* Returns the class of the buffers of size bytes or -1 if they are not pooled */
+static int slab_class(size_t size)
+{
+	for (int i = 0; i < SLAB_NR_CLASSES; i++) {
+		if (size <= (size_t)1 << (SLAB_MIN_SHIFT + i))
+			return i;
+	}
+	return -1;
+}
+
+static void slab_release(struct slab_header *header)
+{
+	size_t size = sizeof(*header) + header->capacity;
+	counter_sub(&slab.stats.resident, size);
+	slab.allocator.free(slab.allocator.arg, header, size);
+}
+
+static void slab_release_ring(void *ring, size_t size)
+{
+	counter_sub(&slab.stats.resident, size);
+	ring_free(ring, size);
+}
+
+static void slab_cache_clear(struct slab_cache *cache)
+{
+	for (int i = 0; i < SLAB_NR_CLASSES; i++) {
+		size_t size = (size_t)1 << (SLAB_MIN_SHIFT + i);
+		for (; cache->nr_free[i]; cache->nr_free[i]--) {
+			counter_sub(&slab.stats.cached, sizeof(struct slab_header) + size);
+			slab_release(cache->free[i][cache->nr_free[i] - 1]);
+		}
+		for (; cache->nr_rings[i]; cache->nr_rings[i]--) {
+			counter_sub(&slab.stats.cached, size);
+			slab_release_ring(cache->rings[i][cache->nr_rings[i] - 1], size);
+		}
+	}
+}
+
+/* Called when the thread exits */
+static void slab_cache_destroy(void *arg)
+{
+	slab_cache_clear(arg);
+	free(arg);
+}
+
+static void slab_key_create(void)
+{
+	int err = pthread_key_create(&slab.key, slab_cache_destroy);
+	assert(!err);
+	(void)err;
+}
+
+/* Returns the free lists of the thread, NULL if they can not be allocated */
+static struct slab_cache *slab_cache(void)
+{
+	pthread_once(&slab.once, slab_key_create);
+	struct slab_cache *cache = pthread_getspecific(slab.key);
+	if (cache == NULL && (cache = calloc(1, sizeof(*cache)))) {
+		if (pthread_setspecific(slab.key, cache)) {
+			free(cache);
+			cache = NULL;
+		}
+	}
+	return cache;
+}
+
+void *slab_alloc(size_t size)
+{
+	int class = slab_class(size);
+	struct slab_cache *cache = class >= 0 ? slab_cache() : NULL;
+	struct slab_header *header;
+	if (cache && cache->nr_free[class]) {
+		header = cache->free[class][--cache->nr_free[class]];
+		counter_add(&slab.stats.hits, 1);
+		counter_sub(&slab.stats.cached, sizeof(*header) + header->capacity);
+		return header + 1;
+	}
+	size_t capacity = class >= 0 ? (size_t)1 << (SLAB_MIN_SHIFT + class) : size;
+	header = slab.allocator.alloc(slab.allocator.arg, sizeof(*header) + capacity);
+	assert(header);
+	header->capacity = capacity;
+	counter_add(&slab.stats.misses, 1);
+	counter_add(&slab.stats.resident, sizeof(*header) + capacity);
+	return header + 1;
+}
+
+void slab_free(void *ptr)
+{
+	if (ptr == NULL)
+		return;
+	struct slab_header *header = (struct slab_header*)ptr - 1;
+	int class = slab_class(header->capacity);
+	struct slab_cache *cache = class >= 0 ? slab_cache() : NULL;
+	if (cache && cache->nr_free[class] < SLAB_MAX_FREE) {
+		cache->free[class][cache->nr_free[class]++] = header;
+		counter_add(&slab.stats.cached, sizeof(*header) + header->capacity);
+		return;
+	}
+	slab_release(header);
+}
+
+size_t slab_capacity(const void *ptr)
+{
+	return ((const struct slab_header*)ptr - 1)->capacity;
+}
+
+/* Rings are pooled if their size is one of the classes */
+static int slab_ring_class(size_t size)
+{
+	int class = slab_class(size);
+	return class >= 0 && size == (size_t)1 << (SLAB_MIN_SHIFT + class) ? class : -1;
+}
+
+void *slab_alloc_ring(size_t size)
+{
+	if (slab.custom)
+		return NULL;
+	int class = slab_ring_class(size);
+	struct slab_cache *cache = class >= 0 ? slab_cache() : NULL;
+	if (cache && cache->nr_rings[class]) {
+		counter_add(&slab.stats.hits, 1);
+		counter_sub(&slab.stats.cached, size);
+		return cache->rings[class][--cache->nr_rings[class]];
+	}
+	void *ring = ring_alloc(size);
+	if (ring) {
+		counter_add(&slab.stats.misses, 1);
+		counter_add(&slab.stats.resident, size);
+	}
+	return ring;
+}
+
+void slab_free_ring(void *ring, size_t size)
+{
+	int class = slab_ring_class(size);
+	struct slab_cache *cache = class >= 0 ? slab_cache() : NULL;
+	if (cache && cache->nr_rings[class] < SLAB_MAX_FREE) {
+		cache->rings[class][cache->nr_rings[class]++] = ring;
+		counter_add(&slab.stats.cached, size);
+		return;
+	}
+	slab_release_ring(ring, size);
+}
+
+void slab_set_allocator(const struct slab_allocator *allocator)
+{
+	slab_trim();
+	slab.custom = allocator != NULL;
+	if (allocator)
+		slab.allocator = *allocator;
+	else
+		slab.allocator = (struct slab_allocator){ .alloc = slab_malloc, .free = slab_malloc_free };
+}
+
+void slab_get_stats(struct slab_stats *stats)
+{
+	stats->hits = __atomic_load_n(&slab.stats.hits, __ATOMIC_RELAXED);
+	stats->misses = __atomic_load_n(&slab.stats.misses, __ATOMIC_RELAXED);
+	stats->resident = __atomic_load_n(&slab.stats.resident, __ATOMIC_RELAXED);
+	stats->cached = __atomic_load_n(&slab.stats.cached, __ATOMIC_RELAXED);
+}
+
+void slab_trim(void)
+{
+	struct slab_cache *cache = slab_cache();
+	if (cache)
+		slab_cache_clear(cache);
+}
+
+#ifdef UNIT_TEST
+#include <unistd.h>
+
+struct test_arena {
+	size_t	nr_allocs;
+	size_t	nr_frees;
+	size_t	allocated;
+};
+
+static void *test_arena_alloc(void *arg, size_t size)
+{
+	struct test_arena *arena = arg;
+	arena->nr_allocs++;
+	arena->allocated += size;
+	return malloc(size);
+}
+
+static void test_arena_free(void *arg, void *ptr, size_t size)
+{
+	struct test_arena *arena = arg;
+	arena->nr_frees++;
+	arena->allocated -= size;
+	free(ptr);
+}
+
+static void *test_thread(void *arg)
+{
+	/* The buffers cached by the thread are freed when it exits */
+	slab_free(slab_alloc(1 << 12));
+	return NULL;
+}
+
+void test_slab(void)
+{
+	slab_trim();
+	struct slab_stats base, stats;
+	slab_get_stats(&base);
+
+	/* A buffer freed to the cache is reused by the next allocation of the class */
+	char *buf = slab_alloc(1000);
+	assert(slab_capacity(buf) == 1 << 10);
+	memset(buf, 1, slab_capacity(buf));
+	slab_free(buf);
+	char *again = slab_alloc(1 << 10);
+	assert(again == buf);
+	slab_free(again);
+	assert(slab_capacity(slab_alloc(1)) == 1 << 10);
+	slab_get_stats(&stats);
+	assert(stats.misses - base.misses == 1 && stats.hits - base.hits == 2);
+	assert(stats.cached - base.cached == 0 && stats.resident - base.resident == (1 << 10) + 16);
+	slab_free(again);
+
+	/* Up to SLAB_MAX_FREE buffers of a class are kept */
+	void *bufs[SLAB_MAX_FREE + 1];
+	for (int i = 0; i <= SLAB_MAX_FREE; i++)
+		bufs[i] = slab_alloc(1 << 16);
+	for (int i = 0; i <= SLAB_MAX_FREE; i++)
+		slab_free(bufs[i]);
+	slab_get_stats(&stats);
+	assert(stats.cached - base.cached == SLAB_MAX_FREE * ((1 << 16) + 16) + (1 << 10) + 16);
+
+	/* Larger buffers are not pooled */
+	buf = slab_alloc((1 << SLAB_MAX_SHIFT) + 1);
+	assert(slab_capacity(buf) == (1 << SLAB_MAX_SHIFT) + 1);
+	slab_free(buf);
+	slab_get_stats(&stats);
+	assert(stats.resident - stats.cached == base.resident - base.cached);
+
+	/* Rings come back mapped */
+	size_t size = sysconf(_SC_PAGESIZE) * 4;
+	char *ring = slab_alloc_ring(size);
+	if (ring) {
+		ring[0] = 'a';
+		assert(ring[size] == 'a');
+		slab_free_ring(ring, size);
+		assert(slab_alloc_ring(size) == ring);
+		slab_free_ring(ring, size);
+	}
+
+	pthread_t thread;
+	assert(!pthread_create(&thread, NULL, test_thread, NULL));
+	assert(!pthread_join(thread, NULL));
+	slab_trim();
+	slab_get_stats(&stats);
+	assert(stats.cached == 0 && stats.resident == base.resident - base.cached);
+
+	/* The buffers come from the custom allocator, rings are not used with it */
+	struct test_arena arena = {0};
+	struct slab_allocator allocator = { test_arena_alloc, test_arena_free, &arena };
+	slab_set_allocator(&allocator);
+	assert(slab_alloc_ring(size) == NULL);
+	buf = slab_alloc(100);
+	slab_free(buf);
+	assert(slab_alloc(100) == buf);
+	slab_free(buf);
+	assert(arena.nr_allocs == 1 && arena.allocated == (1 << 10) + 16);
+	slab_set_allocator(NULL);
+	assert(arena.nr_frees == 1 && arena.allocated == 0);
+}
+#endif
@@ -0,0 +1,53 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/* Pool of the buffers of requests and responses: receive buffers and header storage.
+   A freed buffer goes to the free list of its size class kept by the thread, and the next
+   allocation of the class takes it back without calling the allocator, with its pages
+   resident already. The classes are powers of two from 1 KiB to 1 MiB, larger buffers are
+   not pooled. Receive buffers mapped as rings (see ring.h) have lists of their own, as
+   a mapping costs several system calls. A thread keeps up to SLAB_MAX_FREE buffers of
+   a class, the lists are freed when the thread exits. */
+
+#define SLAB_MIN_SHIFT	10
+#define SLAB_MAX_SHIFT	20
+#define SLAB_NR_CLASSES	(SLAB_MAX_SHIFT - SLAB_MIN_SHIFT + 1)
+#define SLAB_MAX_FREE	4
+
+/* Allocator of the memory the pool hands out, e.g. an arena */
+struct slab_allocator {
+	void	*(*alloc)(void *arg, size_t size);
+	void	(*free)(void *arg, void *ptr, size_t size);
+	void	*arg;
+};
+
+struct slab_stats {
+	uint64_t	hits;		/* allocations served from the free lists */
+	uint64_t	misses;		/* allocations passed to the allocator */
+	uint64_t	resident;	/* bytes of the buffers in use and in the free lists */
+	uint64_t	cached;		/* bytes in the free lists */
+};
+
+/* Returns a buffer of at least size bytes, slab_capacity() returns its usable size */
+void *slab_alloc(size_t size);
+void slab_free(void *ptr);
+size_t slab_capacity(const void *ptr);
+
+/* Returns a ring of size bytes, a multiple of the page size, or NULL if rings are not
+   supported or a custom allocator is set */
+void *slab_alloc_ring(size_t size);
+void slab_free_ring(void *ring, size_t size);
+
+/* Sets the allocator, NULL restores malloc(). It must be set before the first buffer is
+   allocated, as the buffers are returned to the allocator they came from. */
+void slab_set_allocator(const struct slab_allocator *allocator);
+
+void slab_get_stats(struct slab_stats *stats);
+
+/* Returns the free buffers of the calling thread to the allocator */
+void slab_trim(void);
+
+#ifdef UNIT_TEST
+void test_slab(void);
+#endif
@@ -0,0 +1,272 @@
+#define _GNU_SOURCE /* syscall(), MAP_POPULATE */
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "log.h"
+#include "uring.h"
+
+static int uring_setup(unsigned entries, struct io_uring_params *params)
+{
+	return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int uring_register(int fd, unsigned opcode, const void *arg, unsigned nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/* Checks that the kernel knows the operations of the library */
+static bool uring_probe(int fd)
+{
+	static const unsigned char ops[] = {IORING_OP_CONNECT, IORING_OP_SEND, IORING_OP_RECV,
+		IORING_OP_WRITE_FIXED, IORING_OP_READ_FIXED, IORING_OP_POLL_ADD, IORING_OP_LINK_TIMEOUT};
+	size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe = calloc(1, size);
+	assert(probe);
+	bool supported = !uring_register(fd, IORING_REGISTER_PROBE, probe, 256);
+	for (size_t i = 0; supported && i < sizeof(ops); i++)
+		supported = ops[i] <= probe->last_op && (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+	free(probe);
+	return supported;
+}
+
+int uring_init(struct uring *uring, unsigned entries)
+{
+	memset(uring, 0, sizeof(*uring));
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	/* The completions are run when the thread enters the kernel, not by interrupting it */
+	params.flags = IORING_SETUP_COOP_TASKRUN;
+	uring->fd = uring_setup(entries, &params);
+	if (uring->fd == -1 && errno == EINVAL) {
+		memset(&params, 0, sizeof(params));
+		uring->fd = uring_setup(entries, &params);
+	}
+	if (uring->fd == -1)
+		return ERR_URING_UNSUPPORTED;
+	if (!(params.features & IORING_FEAT_NODROP) || !uring_probe(uring->fd)) {
+		close(uring->fd);
+		return ERR_URING_UNSUPPORTED;
+	}
+
+	uring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	uring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+	if (single_mmap && uring->cq_ring_size > uring->sq_ring_size)
+		uring->sq_ring_size = uring->cq_ring_size;
+	uring->sq_ring = mmap(NULL, uring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+						  uring->fd, IORING_OFF_SQ_RING);
+	if (uring->sq_ring == MAP_FAILED)
+		goto failed;
+	uring->cq_ring = single_mmap ? uring->sq_ring :
+		mmap(NULL, uring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			 uring->fd, IORING_OFF_CQ_RING);
+	if (uring->cq_ring == MAP_FAILED)
+		goto failed;
+	uring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	uring->sqes = mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+					   uring->fd, IORING_OFF_SQES);
+	if (uring->sqes == MAP_FAILED)
+		goto failed;
+
+	char *sq = uring->sq_ring;
+	uring->sq_head = (unsigned*)(sq + params.sq_off.head);
+	uring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+	uring->sq_mask = *(unsigned*)(sq + params.sq_off.ring_mask);
+	uring->sq_local_tail = *uring->sq_tail;
+	/* The entries are used in the order of the ring, so the array maps every slot to itself */
+	unsigned *array = (unsigned*)(sq + params.sq_off.array);
+	for (unsigned i = 0; i < params.sq_entries; i++)
+		array[i] = i;
+	char *cq = uring->cq_ring;
+	uring->cq_head = (unsigned*)(cq + params.cq_off.head);
+	uring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+	uring->cq_mask = *(unsigned*)(cq + params.cq_off.ring_mask);
+	uring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+	return 0;
+
+failed:
+	error("mmap() of io_uring failed: %s errno=%d", strerror(errno), errno);
+	if (uring->sq_ring == MAP_FAILED)
+		uring->sq_ring = NULL;
+	if (uring->cq_ring == MAP_FAILED)
+		uring->cq_ring = NULL;
+	if (uring->sqes == MAP_FAILED)
+		uring->sqes = NULL;
+	uring_term(uring);
+	return ERR_URING_FAILED;
+}
+
+void uring_term(struct uring *uring)
+{
+	if (uring->sqes)
+		munmap(uring->sqes, uring->sqes_size);
+	if (uring->cq_ring && uring->cq_ring != uring->sq_ring)
+		munmap(uring->cq_ring, uring->cq_ring_size);
+	if (uring->sq_ring)
+		munmap(uring->sq_ring, uring->sq_ring_size);
+	close(uring->fd);
+	memset(uring, 0, sizeof(*uring));
+	uring->fd = -1;
+}
+
+bool uring_supported(void)
+{
+	/* 0 is not probed yet, 1 supported, -1 not */
+	static int supported;
+	int value = __atomic_load_n(&supported, __ATOMIC_RELAXED);
+	if (value == 0) {
+		struct uring uring;
+		value = uring_init(&uring, 4) ? -1 : 1;
+		if (value == 1)
+			uring_term(&uring);
+		__atomic_store_n(&supported, value, __ATOMIC_RELAXED);
+	}
+	return value == 1;
+}
+
+struct io_uring_sqe *uring_sqe(struct uring *uring)
+{
+	unsigned head = __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE);
+	if (uring->sq_local_tail - head > uring->sq_mask)
+		return NULL;
+	struct io_uring_sqe *sqe = &uring->sqes[uring->sq_local_tail++ & uring->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+unsigned uring_sq_space(struct uring *uring)
+{
+	unsigned head = __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE);
+	return uring->sq_mask + 1 - (uring->sq_local_tail - head);
+}
+
+int uring_submit(struct uring *uring, unsigned wait_nr)
+{
+	unsigned tail = *uring->sq_tail;
+	uring->nr_pending += uring->sq_local_tail - tail;
+	__atomic_store_n(uring->sq_tail, uring->sq_local_tail, __ATOMIC_RELEASE);
+	while (1) {
+		int result = uring_enter(uring->fd, uring->nr_pending, wait_nr,
+								 wait_nr ? IORING_ENTER_GETEVENTS : 0);
+		if (result >= 0) {
+			uring->nr_pending -= result;
+			return result;
+		}
+		if (errno == EINTR)
+			continue;
+		/* The completion queue is full, the caller has to take some of it first */
+		if (errno == EBUSY || errno == EAGAIN)
+			return 0;
+		error("io_uring_enter() failed: %s errno=%d", strerror(errno), errno);
+		return ERR_URING_FAILED;
+	}
+}
+
+struct io_uring_cqe *uring_cqe(struct uring *uring)
+{
+	unsigned head = *uring->cq_head;
+	if (head == __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+	return &uring->cqes[head & uring->cq_mask];
+}
+
+void uring_cqe_seen(struct uring *uring)
+{
+	__atomic_store_n(uring->cq_head, *uring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+int uring_register_buffers(struct uring *uring, const struct iovec *iov, unsigned nr)
+{
+	if (uring_register(uring->fd, IORING_REGISTER_BUFFERS, iov, nr)) {
+		error("Registering io_uring buffers failed: %s errno=%d", strerror(errno), errno);
+		return ERR_URING_FAILED;
+	}
+	return 0;
+}
+
+#ifdef UNIT_TEST
+#include <sys/socket.h>
+
+/* Returns the result of the next completion */
+static int test_complete(struct uring *uring, uint64_t user_data)
+{
+	assert(uring_submit(uring, 1) >= 0);
+	struct io_uring_cqe *cqe = uring_cqe(uring);
+	assert(cqe && cqe->user_data == user_data);
+	int res = cqe->res;
+	uring_cqe_seen(uring);
+	return res;
+}
+
+void test_uring(void)
+{
+	if (!uring_supported()) {
+		info("io_uring is not supported, skipping its test");
+		return;
+	}
+	struct uring uring;
+	assert(!uring_init(&uring, 4));
+
+	struct io_uring_sqe *sqe = uring_sqe(&uring);
+	sqe->opcode = IORING_OP_NOP;
+	sqe->user_data = 1;
+	assert(test_complete(&uring, 1) == 0);
+
+	/* The queue takes as many entries as it has */
+	size_t nr = 0;
+	while ((sqe = uring_sqe(&uring))) {
+		sqe->opcode = IORING_OP_NOP;
+		sqe->user_data = 2;
+		nr++;
+	}
+	assert(nr == 4 && uring_submit(&uring, 4) == 4);
+	for (; nr; nr--) {
+		struct io_uring_cqe *cqe = uring_cqe(&uring);
+		assert(cqe && cqe->user_data == 2);
+		uring_cqe_seen(&uring);
+	}
+
+	/* A receive linked to a write of the registered buffer */
+	int sv[2];
+	assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+	char buf[64] = "";
+	struct iovec iov = { buf, sizeof(buf) };
+	assert(!uring_register_buffers(&uring, &iov, 1));
+	sqe = uring_sqe(&uring);
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = sv[0];
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = 5;
+	sqe->msg_flags = MSG_WAITALL;
+	sqe->flags = IOSQE_IO_LINK;
+	sqe->user_data = 3;
+	sqe = uring_sqe(&uring);
+	sqe->opcode = IORING_OP_WRITE_FIXED;
+	sqe->fd = sv[0];
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = 5;
+	sqe->buf_index = 0;
+	sqe->user_data = 4;
+	assert(uring_submit(&uring, 0) == 2);
+	assert(write(sv[1], "hel", 3) == 3);
+	assert(write(sv[1], "lo", 2) == 2);
+	assert(test_complete(&uring, 3) == 5);
+	assert(test_complete(&uring, 4) == 5);
+	char echo[8] = "";
+	assert(read(sv[1], echo, sizeof(echo)) == 5 && !memcmp(echo, "hello", 5));
+	close(sv[0]);
+	close(sv[1]);
+	uring_term(&uring);
+}
+#endif
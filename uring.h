@@ -0,0 +1,63 @@
+#pragma once
+#include <linux/io_uring.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+/* io_uring over the bare system calls, see https://kernel.dk/io_uring.pdf. Requests are
+   prepared in the submission queue and go to the kernel together with one io_uring_enter(),
+   which also waits for the completions. It is optional: the callers check uring_supported()
+   or the result of uring_init() and fall back to the plain system calls. */
+
+#define ERR_URING_UNSUPPORTED	-61	/* no io_uring or some of the operations used here */
+#define ERR_URING_FAILED		-62
+
+struct uring {
+	int		fd;
+	/* Submission queue, shared with the kernel */
+	unsigned	*sq_head;
+	unsigned	*sq_tail;
+	unsigned	sq_mask;
+	struct io_uring_sqe	*sqes;
+	unsigned	sq_local_tail;	/* of the entries prepared, not yet given to the kernel */
+	unsigned	nr_pending;		/* entries given to the kernel, not yet submitted */
+	/* Completion queue */
+	unsigned	*cq_head;
+	unsigned	*cq_tail;
+	unsigned	cq_mask;
+	struct io_uring_cqe	*cqes;
+
+	void	*sq_ring;
+	size_t	sq_ring_size;
+	void	*cq_ring;	/* the same mapping as sq_ring with IORING_FEAT_SINGLE_MMAP */
+	size_t	cq_ring_size;
+	size_t	sqes_size;
+};
+
+/* Checks once if the kernel allows io_uring with the operations used by the library */
+bool uring_supported(void);
+
+/* entries is rounded up to a power of two by the kernel, the completion queue is twice larger */
+int uring_init(struct uring *uring, unsigned entries);
+void uring_term(struct uring *uring);
+
+/* Returns a cleared entry of the submission queue or NULL if it is full */
+struct io_uring_sqe *uring_sqe(struct uring *uring);
+
+/* Returns the number of free entries, linked entries must be submitted together */
+unsigned uring_sq_space(struct uring *uring);
+
+/* Submits the prepared entries and waits for wait_nr completions */
+int uring_submit(struct uring *uring, unsigned wait_nr);
+
+/* Returns the next completion or NULL, uring_cqe_seen() releases it */
+struct io_uring_cqe *uring_cqe(struct uring *uring);
+void uring_cqe_seen(struct uring *uring);
+
+/* Pins the buffers for IORING_OP_READ_FIXED and IORING_OP_WRITE_FIXED, buf_index is
+   the index in iov */
+int uring_register_buffers(struct uring *uring, const struct iovec *iov, unsigned nr);
+
+#ifdef UNIT_TEST
+void test_uring(void);
+#endif
@@ -1,4 +1,5 @@
 #pragma once
+#include <stdbool.h>
 #include <stddef.h>
 
 /* 
@@ -7,8 +8,9 @@
 	URI = scheme:[//authority]path[?query][#fragment]
 	authority = [userinfo@]host[:port]
 
-	TODO: Add internationalzed URL support
-		  https://en.wikipedia.org/wiki/URL#Internationalized_URL
+	The url is parsed in one pass classifying every character by a table. The parts
+	point into the url string, nothing is allocated.
+	Internationalized hosts are converted to ASCII by punycode_host().
 */
 
 struct url {
@@ -18,19 +20,39 @@ struct url {
 	size_t username_len;
 	const char *password;
 	size_t password_len;
-	const char *host;
+	const char *host;	/* without the brackets of an IPv6 literal */
 	size_t host_len;
 	const char *port;
 	size_t port_len;
 	const char *path;
 	size_t path_len;
+	const char *query;	/* after "?" */
+	size_t query_len;
+	const char *fragment;	/* after "#" */
+	size_t fragment_len;
+	unsigned int port_number;	/* the port or the default one of the scheme, 0 if unknown */
+	bool ipv6;	/* the host is an IPv6 address */
 };
 
 #define ERR_URL_NO_SCHEME		-1
 #define ERR_URL_INVALID_PORT	-2
+#define ERR_URL_INVALID_CHARACTER	-3	/* a space or a control character, e.g. CRLF splitting the request */
+#define ERR_URL_INVALID_HOST		-4	/* misplaced brackets or colons */
 
 int url_parse(const char *url,  struct url *parsed);
 
+/* Returns the length of the request target at *target: the path with the query, e.g.
+   "/a?b". It starts with the "?" if the path is empty. */
+size_t url_target(const struct url *url, const char **target);
+
 #ifdef UNIT_TEST
 void test_url_parse();
 #endif
+
+#ifdef FUZZ
+void fuzz_url(const unsigned char *data, size_t size);
+#endif
+
+#ifdef BENCH
+void bench_url(void);
+#endif